@@ -0,0 +1,69 @@
+#pragma once
+
+// The binary trace shared by the tracer (memstatlib.cpp) and the analyser
+// (memstat_analyze.cpp). A trace is a |TraceHeader| followed by |TraceRecord|s
+// in the order their per-thread buffers were flushed, i.e., not in time order;
+// |seq| gives the global order. The trace of a process is <prefix>.<pid>.bin;
+// the call sites in it are symbolized at exit into <prefix>.<pid>.sym, one
+// "address<TAB>module+offset<TAB>symbol" per line.
+
+#include <stdint.h>
+
+#define MEMSTAT_MAGIC "RTNNMEM1"
+#define MEMSTAT_MAX_DEPTH 8
+
+// what kind of memory an allocation is.
+enum MemstatKind
+{
+    MEMSTAT_HOST = 0,   // malloc and friends, operator new
+    MEMSTAT_PINNED = 1, // cudaMallocHost, cudaHostAlloc
+    MEMSTAT_DEVICE = 2, // cudaMalloc, cudaMallocManaged
+    MEMSTAT_KIND_COUNT
+};
+
+enum MemstatOp
+{
+    MEMSTAT_ALLOC = 0,
+    MEMSTAT_FREE = 1
+};
+
+enum MemstatApi
+{
+    MEMSTAT_MALLOC = 0,
+    MEMSTAT_CALLOC,
+    MEMSTAT_REALLOC,
+    MEMSTAT_MEMALIGN, // memalign, posix_memalign, aligned_alloc, valloc
+    MEMSTAT_FREE_API,
+    MEMSTAT_CUDA_MALLOC,
+    MEMSTAT_CUDA_MALLOC_MANAGED,
+    MEMSTAT_CUDA_FREE,
+    MEMSTAT_CUDA_MALLOC_HOST, // cudaMallocHost, cudaHostAlloc
+    MEMSTAT_CUDA_FREE_HOST,
+    MEMSTAT_API_COUNT
+};
+
+struct TraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pid;
+    uint32_t recordSize; // sizeof(TraceRecord)
+    uint32_t depth;      // frames recorded per event, <= MEMSTAT_MAX_DEPTH
+};
+
+// the size of a free is that of the allocation it frees.
+struct TraceRecord
+{
+    uint64_t seq;
+    uint64_t timeNs; // CLOCK_MONOTONIC
+    uint64_t ptr;
+    uint64_t size;
+    uint32_t tid;
+    uint8_t op;
+    uint8_t kind;
+    uint8_t api;
+    uint8_t depth; // valid entries of |frames|
+    // return addresses, innermost first, starting at the caller of the
+    // allocator.
+    uint64_t frames[MEMSTAT_MAX_DEPTH];
+};
@@ -0,0 +1,344 @@
+// Reads a trace of memstatlib and reports, for host, pinned and device memory,
+// the peak and what was live at the peak by call site, the allocations of
+// every call site and what was still live at exit, and optionally writes the
+// memory in use over time as CSV.
+//
+//   memstat_analyze [-n sites] [-d frames] [-a] [-t timeline.csv] [-i ms] memstat.<pid>.bin
+
+#include <cxxabi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "memstat.h"
+
+namespace {
+
+const double kMB = 1024 * 1024;
+const char* kKindNames[MEMSTAT_KIND_COUNT] = {"host", "pinned", "device"};
+
+struct Symbol
+{
+    std::string module; // module+offset, for addr2line
+    std::string name;
+};
+
+struct Site
+{
+    std::vector<uint64_t> frames;
+    uint64_t allocs[MEMSTAT_KIND_COUNT];
+    uint64_t bytes[MEMSTAT_KIND_COUNT];
+    uint64_t liveAtExit[MEMSTAT_KIND_COUNT];
+};
+
+struct Live
+{
+    uint64_t size;
+    uint32_t site;
+};
+
+struct Options
+{
+    int topSites = 10;
+    int siteDepth = 2;        // frames that tell call sites apart
+    bool allFrames = false;   // don't skip the frames of the allocators
+    std::string timeline;
+    double intervalMs = 0;    // of the timeline, 0 for a 1000th of the run
+};
+
+std::map<uint64_t, Symbol> g_symbols;
+
+void printUsageAndExit(const char* argv0) {
+    fprintf(stderr, "Usage  : %s [options] <memstat.pid.bin>\n", argv0);
+    fprintf(stderr, "Options: --sites | -n <int>         Call sites listed per table (default 10)\n");
+    fprintf(stderr, "         --depth | -d <int>         Frames that make a call site (default 2)\n");
+    fprintf(stderr, "         --all | -a                 Don't skip frames in libc, libstdc++, libcudart and the tracer\n");
+    fprintf(stderr, "         --timeline | -t <file>     Write the memory in use over time as CSV\n");
+    fprintf(stderr, "         --interval | -i <ms>       Interval of the timeline (default a 1000th of the run)\n");
+    exit(1);
+}
+
+std::string demangle(const std::string& name) {
+    // "symbol+0xoffset"
+    size_t plus = name.rfind('+');
+    std::string mangled = name.substr(0, plus);
+    int status = 0;
+    char* s = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr, &status);
+    if (status != 0 || !s) return name;
+    std::string demangled = s;
+    free(s);
+    return plus == std::string::npos ? demangled : demangled + name.substr(plus);
+}
+
+void readSymbols(const std::string& tracePath) {
+    std::string path = tracePath;
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".bin") == 0) path.resize(path.size() - 4);
+    path += ".sym";
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        fprintf(stderr, "No symbols in %s, call sites are shown as addresses.\n", path.c_str());
+        return;
+    }
+    char line[8192];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* module = strchr(line, '\t');
+        if (!module) continue;
+        *module++ = '\0';
+        char* name = strchr(module, '\t');
+        if (!name) continue;
+        *name++ = '\0';
+        Symbol& sym = g_symbols[strtoull(line, nullptr, 16)];
+        sym.module = module;
+        sym.name = demangle(name);
+    }
+    fclose(fp);
+}
+
+// the frames of the allocators themselves (operator new, thrust's allocator
+// calling cudaMalloc, ...) say little about who allocated.
+bool isAllocatorFrame(uint64_t addr) {
+    static const char* modules[] = {"libmemstatlib", "libc.so", "libc-", "libstdc++", "libcudart", "libgcc_s"};
+    std::map<uint64_t, Symbol>::const_iterator it = g_symbols.find(addr);
+    if (it == g_symbols.end()) return false;
+    for (size_t i = 0; i < sizeof(modules) / sizeof(modules[0]); i++)
+        if (it->second.module.find(modules[i]) != std::string::npos) return true;
+    return false;
+}
+
+std::string frameName(uint64_t addr) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)addr);
+    std::map<uint64_t, Symbol>::const_iterator it = g_symbols.find(addr);
+    if (it == g_symbols.end()) return buf;
+    if (it->second.name != "??") return it->second.name;
+    return it->second.module;
+}
+
+void printSite(const Site& site) {
+    if (site.frames.empty()) {
+        printf("  (no frames)\n");
+        return;
+    }
+    for (size_t i = 0; i < site.frames.size(); i++)
+        printf("  %s%s\n", i ? "  from " : "", frameName(site.frames[i]).c_str());
+}
+
+std::string siteNameOrNone(const std::vector<Site>& sites, uint32_t s) {
+    return sites[s].frames.empty() ? "(no frames)" : frameName(sites[s].frames[0]);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    std::string tracePath;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--sites" || arg == "-n") {
+            if (i >= argc - 1) printUsageAndExit(argv[0]);
+            opt.topSites = atoi(argv[++i]);
+        } else if (arg == "--depth" || arg == "-d") {
+            if (i >= argc - 1) printUsageAndExit(argv[0]);
+            opt.siteDepth = std::min(std::max(atoi(argv[++i]), 1), MEMSTAT_MAX_DEPTH);
+        } else if (arg == "--all" || arg == "-a") {
+            opt.allFrames = true;
+        } else if (arg == "--timeline" || arg == "-t") {
+            if (i >= argc - 1) printUsageAndExit(argv[0]);
+            opt.timeline = argv[++i];
+        } else if (arg == "--interval" || arg == "-i") {
+            if (i >= argc - 1) printUsageAndExit(argv[0]);
+            opt.intervalMs = atof(argv[++i]);
+        } else if (arg[0] == '-' || !tracePath.empty()) {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            printUsageAndExit(argv[0]);
+        } else {
+            tracePath = arg;
+        }
+    }
+    if (tracePath.empty()) printUsageAndExit(argv[0]);
+
+    FILE* fp = fopen(tracePath.c_str(), "rb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s.\n", tracePath.c_str());
+        exit(1);
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, MEMSTAT_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not a memstat trace.\n", tracePath.c_str());
+        exit(1);
+    }
+    if (header.recordSize != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s has records of %u bytes, expected %zu.\n", tracePath.c_str(), header.recordSize,
+                sizeof(TraceRecord));
+        exit(1);
+    }
+    std::vector<TraceRecord> records;
+    TraceRecord r;
+    while (fread(&r, sizeof(r), 1, fp) == 1) records.push_back(r);
+    fclose(fp);
+    // the logs of threads are flushed in any order.
+    std::sort(records.begin(), records.end(),
+              [](const TraceRecord& a, const TraceRecord& b) { return a.seq < b.seq; });
+    if (header.depth > 0) readSymbols(tracePath);
+
+    // call sites by their first frames outside the allocators.
+    std::vector<Site> sites;
+    std::map<std::vector<uint64_t>, uint32_t> siteIds;
+    std::vector<uint32_t> siteOf(records.size(), 0);
+    std::set<uint32_t> tids;
+    for (size_t i = 0; i < records.size(); i++) {
+        const TraceRecord& e = records[i];
+        tids.insert(e.tid);
+        if (e.op != MEMSTAT_ALLOC) continue;
+        int first = 0;
+        if (!opt.allFrames)
+            while (first < e.depth - 1 && isAllocatorFrame(e.frames[first])) first++;
+        std::vector<uint64_t> key(e.frames + first, e.frames + std::min((int)e.depth, first + opt.siteDepth));
+        std::map<std::vector<uint64_t>, uint32_t>::iterator it = siteIds.find(key);
+        if (it == siteIds.end()) {
+            Site site;
+            site.frames = key;
+            memset(site.allocs, 0, sizeof(site.allocs));
+            memset(site.bytes, 0, sizeof(site.bytes));
+            memset(site.liveAtExit, 0, sizeof(site.liveAtExit));
+            it = siteIds.insert(std::make_pair(key, (uint32_t)sites.size())).first;
+            sites.push_back(site);
+        }
+        siteOf[i] = it->second;
+    }
+
+    uint64_t t0 = records.empty() ? 0 : records.front().timeNs;
+    double spanMs = records.empty() ? 0 : (records.back().timeNs - t0) / 1e6;
+    double intervalMs = opt.intervalMs > 0 ? opt.intervalMs : std::max(spanMs / 1000, 1e-3);
+    FILE* tfp = nullptr;
+    if (!opt.timeline.empty()) {
+        tfp = fopen(opt.timeline.c_str(), "w");
+        if (!tfp) {
+            fprintf(stderr, "Cannot write the timeline to %s.\n", opt.timeline.c_str());
+            exit(1);
+        }
+        fprintf(tfp, "time_ms,host_mb,pinned_mb,device_mb\n");
+    }
+
+    // replays the trace; a free of an address that isn't live was allocated
+    // before tracing started and is ignored.
+    std::unordered_map<uint64_t, Live> live;
+    int64_t current[MEMSTAT_KIND_COUNT] = {};
+    int64_t peak[MEMSTAT_KIND_COUNT] = {};
+    size_t peakAt[MEMSTAT_KIND_COUNT] = {};
+    int64_t bucketMax[MEMSTAT_KIND_COUNT] = {};
+    int64_t bucket = -1;
+    uint64_t unmatchedFrees = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        const TraceRecord& e = records[i];
+        uint64_t key = e.ptr ^ ((uint64_t)e.kind << 60);
+        if (e.op == MEMSTAT_ALLOC) {
+            Live l = {e.size, siteOf[i]};
+            live[key] = l;
+            current[e.kind] += e.size;
+            sites[siteOf[i]].allocs[e.kind]++;
+            sites[siteOf[i]].bytes[e.kind] += e.size;
+            if (current[e.kind] > peak[e.kind]) {
+                peak[e.kind] = current[e.kind];
+                peakAt[e.kind] = i;
+            }
+        } else {
+            std::unordered_map<uint64_t, Live>::iterator it = live.find(key);
+            if (it == live.end()) {
+                unmatchedFrees++;
+                continue;
+            }
+            current[e.kind] -= it->second.size;
+            live.erase(it);
+        }
+        if (!tfp) continue;
+        // a row per interval with events, with the most in use during it.
+        int64_t b = (int64_t)((e.timeNs - t0) / 1e6 / intervalMs);
+        if (b != bucket) {
+            if (bucket >= 0)
+                fprintf(tfp, "%.3f,%.3f,%.3f,%.3f\n", bucket * intervalMs, bucketMax[MEMSTAT_HOST] / kMB,
+                        bucketMax[MEMSTAT_PINNED] / kMB, bucketMax[MEMSTAT_DEVICE] / kMB);
+            bucket = b;
+            std::fill(bucketMax, bucketMax + MEMSTAT_KIND_COUNT, 0);
+        }
+        for (int k = 0; k < MEMSTAT_KIND_COUNT; k++) bucketMax[k] = std::max(bucketMax[k], current[k]);
+    }
+    if (tfp) {
+        if (bucket >= 0)
+            fprintf(tfp, "%.3f,%.3f,%.3f,%.3f\n", bucket * intervalMs, bucketMax[MEMSTAT_HOST] / kMB,
+                    bucketMax[MEMSTAT_PINNED] / kMB, bucketMax[MEMSTAT_DEVICE] / kMB);
+        fclose(tfp);
+    }
+    for (std::unordered_map<uint64_t, Live>::const_iterator it = live.begin(); it != live.end(); ++it)
+        sites[it->second.site].liveAtExit[it->first >> 60] += it->second.size;
+
+    printf("%s: pid %u, %zu events over %.3f ms from %zu threads, %u frames per allocation\n", tracePath.c_str(),
+           header.pid, records.size(), spanMs, tids.size(), header.depth);
+    if (unmatchedFrees) printf("%llu frees of memory allocated before tracing\n", (unsigned long long)unmatchedFrees);
+    printf("\n%-8s %12s %12s %12s %12s\n", "memory", "peak MB", "at ms", "allocations", "live at exit MB");
+    for (int k = 0; k < MEMSTAT_KIND_COUNT; k++) {
+        uint64_t allocs = 0;
+        for (size_t s = 0; s < sites.size(); s++) allocs += sites[s].allocs[k];
+        if (!allocs) continue;
+        printf("%-8s %12.3f %12.3f %12llu %12.3f\n", kKindNames[k], peak[k] / kMB,
+               (records[peakAt[k]].timeNs - t0) / 1e6, (unsigned long long)allocs, current[k] / kMB);
+    }
+
+    // what was live at every peak, by replaying up to it.
+    for (int k = 0; k < MEMSTAT_KIND_COUNT; k++) {
+        if (peak[k] == 0) continue;
+        std::unordered_map<uint64_t, Live> liveAtPeak;
+        for (size_t i = 0; i <= peakAt[k]; i++) {
+            const TraceRecord& e = records[i];
+            if (e.kind != k) continue;
+            if (e.op == MEMSTAT_ALLOC) {
+                Live l = {e.size, siteOf[i]};
+                liveAtPeak[e.ptr] = l;
+            } else {
+                liveAtPeak.erase(e.ptr);
+            }
+        }
+        std::map<uint32_t, std::pair<uint64_t, uint64_t> > bySite; // bytes, allocations
+        for (std::unordered_map<uint64_t, Live>::const_iterator it = liveAtPeak.begin(); it != liveAtPeak.end(); ++it) {
+            bySite[it->second.site].first += it->second.size;
+            bySite[it->second.site].second++;
+        }
+        std::vector<std::pair<uint64_t, uint32_t> > order;
+        for (std::map<uint32_t, std::pair<uint64_t, uint64_t> >::const_iterator it = bySite.begin(); it != bySite.end(); ++it)
+            order.push_back(std::make_pair(it->second.first, it->first));
+        std::sort(order.rbegin(), order.rend());
+
+        printf("\n%s memory live at its peak of %.3f MB, by call site:\n", kKindNames[k], peak[k] / kMB);
+        for (size_t i = 0; i < order.size() && (int)i < opt.topSites; i++) {
+            printf("%12.3f MB %6.1f%% in %llu allocations\n", order[i].first / kMB, 100.0 * order[i].first / peak[k],
+                   (unsigned long long)bySite[order[i].second].second);
+            printSite(sites[order[i].second]);
+        }
+    }
+
+    // the busiest call sites and those that never freed.
+    for (int k = 0; k < MEMSTAT_KIND_COUNT; k++) {
+        std::vector<std::pair<uint64_t, uint32_t> > order;
+        for (size_t s = 0; s < sites.size(); s++)
+            if (sites[s].allocs[k]) order.push_back(std::make_pair(sites[s].bytes[k], (uint32_t)s));
+        if (order.empty()) continue;
+        std::sort(order.rbegin(), order.rend());
+        printf("\n%s memory allocated by call site:\n", kKindNames[k]);
+        printf("%12s %12s %15s  %s\n", "MB", "allocations", "live at exit MB", "site");
+        for (size_t i = 0; i < order.size() && (int)i < opt.topSites; i++) {
+            const Site& site = sites[order[i].second];
+            printf("%12.3f %12llu %15.3f  %s\n", site.bytes[k] / kMB, (unsigned long long)site.allocs[k],
+                   site.liveAtExit[k] / kMB, siteNameOrNone(sites, order[i].second).c_str());
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+// A program for memstat_test.sh to trace: four threads each allocate 16 MB at
+// one call site, all live at the same time and then freed, and then leak 3 MB
+// each at another. The call sites are exported (-rdynamic) so the analyser
+// names them.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+const int kThreads = 4;
+
+extern "C" __attribute__((noinline)) void* allocPeak(size_t n) {
+    void* p = malloc(n);
+    memset(p, 1, n);
+    return p;
+}
+
+extern "C" __attribute__((noinline)) void* leakAtExit(size_t n) {
+    void* p = malloc(n);
+    memset(p, 1, n);
+    return p;
+}
+
+int main() {
+    std::vector<void*> peak(kThreads);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; i++) threads.emplace_back([&peak, i]() { peak[i] = allocPeak(16 << 20); });
+    for (auto& t : threads) t.join();
+
+    threads.clear();
+    for (int i = 0; i < kThreads; i++) threads.emplace_back([&peak, i]() {
+        free(peak[i]);
+        leakAtExit(3 << 20);
+    });
+    for (auto& t : threads) t.join();
+    return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Preloads the host variant of the tracer into memstat_test and checks what
+# memstat_analyze makes of its trace: the host peak is the 64 MB of the four
+# threads, all of it from allocPeak, and the 12 MB live at exit are attributed
+# to leakAtExit. Run by `make test`.
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+MEMSTAT_TRACE="$dir/trace" LD_PRELOAD=./libmemstatlib_host.so ./memstat_test > /dev/null || exit 1
+./memstat_analyze "$dir"/trace.*.bin > "$dir/report" || exit 1
+
+fail() {
+    echo "memstat_test: $1" >&2
+    cat "$dir/report" >&2
+    exit 1
+}
+
+# "host <peak MB> <at ms> <allocations> <live at exit MB>" in the summary.
+awk '/^host +[0-9]/ { ok = ($2 >= 64 && $2 < 65 && $5 >= 12 && $5 < 13) } END { exit !ok }' "$dir/report" ||
+    fail "host peak or live at exit"
+# "<MB> <allocations> <live at exit MB> <site>" by call site.
+awk '$4 ~ /^allocPeak\+/ { ok = ($1 == 64 && $2 == 4 && $3 == 0) } END { exit !ok }' "$dir/report" ||
+    fail "allocPeak"
+awk '$4 ~ /^leakAtExit\+/ { ok = ($1 == 12 && $2 == 4 && $3 == 12) } END { exit !ok }' "$dir/report" ||
+    fail "leakAtExit"
+grep -Eq "from ([5-9]|[1-9][0-9]+) threads" "$dir/report" || fail "threads"
+echo "memstat_test passed"
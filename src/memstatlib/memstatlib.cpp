@@ -1,44 +1,612 @@
+// An allocation tracer to be LD_PRELOADed (or linked) into RTNN, useful to
+// track OOM issues and the memory footprint of a run. It interposes the host
+// allocators and, unless built with MEMSTAT_NO_CUDA, cudaMalloc and friends,
+// and writes every allocation and free, with the call stack of allocations,
+// to a binary trace (see memstat.h) that memstat_analyze reads.
+//
+// Every thread logs into a buffer of its own that is written to the trace with
+// a single write() when full, so threads don't share a lock; the only shared
+// state on the hot path is the event counter, the per-kind byte counters and
+// the table of live allocations, all updated with atomics.
+//
+// Environment:
+//   MEMSTAT_TRACE    prefix of the trace, "memstat" by default
+//   MEMSTAT_DEPTH    frames recorded per allocation, 0 to 8 (default 8)
+//   MEMSTAT_HOST     0 to trace device and pinned memory only
+//   MEMSTAT_TABLE    log2 of the slots of the live allocation table (default 22)
+//   MEMSTAT_VERBOSE  1 to print every device and pinned allocation and free
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
-#include <dlfcn.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#ifndef MEMSTAT_NO_CUDA
 #include <cuda_runtime.h>
-#include <map>
+#endif
 
-std::map<void*, double> memmap;
-double tot_alloc_size = 0;
+#include "memstat.h"
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void __libc_free(void* ptr);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void* __libc_pvalloc(size_t size);
+}
+
+#define MEMSTAT_INLINE inline __attribute__((always_inline))
+
+namespace {
+
+const uint32_t kVersion = 1;
+const int kLogRecords = 4096;
+const uintptr_t kEmpty = 0;
+const uintptr_t kTombstone = 1;
+const int kMaxProbes = 1024;
+const double kMB = 1024 * 1024;
+
+struct ThreadLog
+{
+    ThreadLog* next;
+    std::atomic<int> owned; // a live thread logs here
+    std::atomic<int> busy;  // being appended to or flushed
+    uint32_t tid;
+    uint32_t count;
+    TraceRecord records[kLogRecords];
+};
 
-cudaError_t cudaMalloc ( void** dst, size_t count )
+// a slot of the open addressing table of live allocations.
+struct Slot
 {
-    cudaError_t (*lcudaMalloc) ( void**, size_t ) = (cudaError_t (*) ( void**, size_t ))dlsym(RTLD_NEXT, "cudaMalloc");
-    cudaError_t msg = lcudaMalloc( dst, count );
-    double size = (double)count/1024/1024;
-    printf("[MEM_STATS] cudaMalloc (%p): %lf MB\n", *dst, size);
-    memmap[*dst] = size;
-    tot_alloc_size += size;
-    printf("[MEM_STATS] %lf MB\n", tot_alloc_size);
-    return msg;
+    std::atomic<uintptr_t> key;
+    std::atomic<uint64_t> val; // size << 2 | kind
+};
+
+std::atomic<ThreadLog*> g_logs(nullptr);
+std::atomic<uint64_t> g_seq(0);
+std::atomic<uint64_t> g_dropped(0);   // events that didn't make it to the trace
+std::atomic<uint64_t> g_untracked(0); // allocations the table had no room for
+std::atomic<int64_t> g_current[MEMSTAT_KIND_COUNT];
+std::atomic<int64_t> g_peak[MEMSTAT_KIND_COUNT];
+std::atomic<uint64_t> g_allocs[MEMSTAT_KIND_COUNT];
+std::atomic<bool> g_ready(false);
+
+Slot* g_table = nullptr;
+int g_tableBits = 22;
+size_t g_tableMask = 0;
+int g_fd = -1;
+char g_prefix[2048] = "memstat";
+char g_path[4096];
+int g_depth = MEMSTAT_MAX_DEPTH;
+bool g_host = true;
+bool g_verbose = false;
+pthread_key_t g_key;
+
+// set while a thread is inside the tracer, so that the allocations of the
+// tracer itself (backtrace, dlsym, stdio) aren't traced. initial-exec, since
+// the first access of a dynamic TLS variable may allocate.
+__thread int t_inHook __attribute__((tls_model("initial-exec")));
+__thread ThreadLog* t_log __attribute__((tls_model("initial-exec")));
+
+const char* kindName(int kind) {
+    static const char* names[MEMSTAT_KIND_COUNT] = {"host", "pinned", "device"};
+    return names[kind];
 }
 
-cudaError_t cudaFree ( void* dst )
+struct Reentry
 {
-    cudaError_t (*lcudaFree) ( void* ) = (cudaError_t (*) ( void* ))dlsym(RTLD_NEXT, "cudaFree");
-    cudaError_t msg = lcudaFree( dst );
-    printf("[MEM_STATS] cudaFree (%p): %lf MB\n", dst, memmap[dst]);
-    tot_alloc_size -= memmap[dst];
-    printf("[MEM_STATS] %lf MB\n", tot_alloc_size);
-    return msg;
-}
-
-//cudaError_t cudaMemcpy ( void* dst, const void* src, size_t count, cudaMemcpyKind kind )
-//{
-//    cudaError_t (*lcudaMemcpy) ( void*, const void*, size_t, cudaMemcpyKind) = (cudaError_t (*) ( void* , const void* , size_t , cudaMemcpyKind  ))dlsym(RTLD_NEXT, "cudaMemcpy");
-//    printf("cudaMemcpy: %lf MB\n", (double)count/1024/1024);
-//    return lcudaMemcpy( dst, src, count, kind );
-//}
-//
-//cudaError_t cudaMemcpyAsync ( void* dst, const void* src, size_t count, cudaMemcpyKind kind, cudaStream_t str )
-//{
-//    cudaError_t (*lcudaMemcpyAsync) ( void*, const void*, size_t, cudaMemcpyKind, cudaStream_t) = (cudaError_t (*) ( void* , const void* , size_t , cudaMemcpyKind, cudaStream_t   ))dlsym(RTLD_NEXT, "cudaMemcpyAsync");
-//    printf("cudaMemcpyAsync: %lf MB\n", (double)count/1024/1024);
-//    return lcudaMemcpyAsync( dst, src, count, kind, str );
-//}
+    int saved;
+    Reentry() : saved(t_inHook) { t_inHook = 1; }
+    ~Reentry() { t_inHook = saved; }
+};
+
+uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+size_t slotOf(uintptr_t key) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - g_tableBits));
+}
+
+// an address is live at most once, so a key is never inserted twice and a
+// tombstone can be reused without looking further.
+bool insertLive(const void* ptr, uint64_t size, int kind) {
+    uintptr_t key = (uintptr_t)ptr;
+    size_t i = slotOf(key);
+    for (int n = 0; n < kMaxProbes; n++, i = (i + 1) & g_tableMask) {
+        uintptr_t k = g_table[i].key.load(std::memory_order_acquire);
+        if ((k == kEmpty || k == kTombstone) &&
+            g_table[i].key.compare_exchange_strong(k, key, std::memory_order_acq_rel)) {
+            g_table[i].val.store(size << 2 | kind, std::memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+// only the owner of an allocation frees it, so nobody else removes its key.
+bool removeLive(const void* ptr, uint64_t& size, int& kind) {
+    uintptr_t key = (uintptr_t)ptr;
+    size_t i = slotOf(key);
+    for (int n = 0; n < kMaxProbes; n++, i = (i + 1) & g_tableMask) {
+        uintptr_t k = g_table[i].key.load(std::memory_order_acquire);
+        if (k == kEmpty) return false;
+        if (k == key) {
+            uint64_t v = g_table[i].val.load(std::memory_order_acquire);
+            g_table[i].key.store(kTombstone, std::memory_order_release);
+            size = v >> 2;
+            kind = (int)(v & 3);
+            return true;
+        }
+    }
+    return false;
+}
+
+void account(int kind, int64_t delta) {
+    int64_t cur = g_current[kind].fetch_add(delta, std::memory_order_relaxed) + delta;
+    int64_t peak = g_peak[kind].load(std::memory_order_relaxed);
+    while (cur > peak && !g_peak[kind].compare_exchange_weak(peak, cur, std::memory_order_relaxed)) {}
+}
+
+void flushLog(ThreadLog* log) {
+    const char* p = (const char*)log->records;
+    size_t bytes = log->count * sizeof(TraceRecord);
+    while (bytes > 0) {
+        ssize_t written = write(g_fd, p, bytes);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            g_dropped.fetch_add((bytes + sizeof(TraceRecord) - 1) / sizeof(TraceRecord));
+            break;
+        }
+        p += written;
+        bytes -= written;
+    }
+    log->count = 0;
+}
+
+// logs of exited threads are reused before new ones are mapped; they are
+// never unmapped, since the exit flush walks them without a lock.
+ThreadLog* claimLog() {
+    for (ThreadLog* log = g_logs.load(std::memory_order_acquire); log; log = log->next) {
+        int expected = 0;
+        if (log->owned.load(std::memory_order_relaxed) == 0 &&
+            log->owned.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+            return log;
+    }
+    void* p = mmap(nullptr, sizeof(ThreadLog), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    ThreadLog* log = (ThreadLog*)p;
+    log->owned.store(1, std::memory_order_relaxed);
+    ThreadLog* head = g_logs.load(std::memory_order_relaxed);
+    do {
+        log->next = head;
+    } while (!g_logs.compare_exchange_weak(head, log, std::memory_order_release, std::memory_order_relaxed));
+    return log;
+}
+
+ThreadLog* threadLog() {
+    if (t_log) return t_log;
+    ThreadLog* log = claimLog();
+    if (!log) return nullptr;
+    log->tid = (uint32_t)syscall(SYS_gettid);
+    log->count = 0;
+    t_log = log;
+    // so that the log is written and released when the thread exits.
+    pthread_setspecific(g_key, log);
+    return log;
+}
+
+void releaseLog(void* p) {
+    ThreadLog* log = (ThreadLog*)p;
+    Reentry reentry;
+    int expected = 0;
+    // a busy log is being flushed at exit.
+    if (log->busy.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+        flushLog(log);
+        log->busy.store(0, std::memory_order_release);
+    }
+    t_log = nullptr;
+    log->owned.store(0, std::memory_order_release);
+}
+
+void logEvent(int op, int kind, int api, const void* ptr, uint64_t size, void** frames, int depth) {
+    ThreadLog* log = threadLog();
+    int expected = 0;
+    if (!log || !log->busy.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+        g_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    TraceRecord& r = log->records[log->count];
+    r.seq = g_seq.fetch_add(1, std::memory_order_relaxed);
+    r.timeNs = nowNs();
+    r.ptr = (uint64_t)(uintptr_t)ptr;
+    r.size = size;
+    r.tid = log->tid;
+    r.op = (uint8_t)op;
+    r.kind = (uint8_t)kind;
+    r.api = (uint8_t)api;
+    r.depth = (uint8_t)depth;
+    for (int i = 0; i < MEMSTAT_MAX_DEPTH; i++)
+        r.frames[i] = i < depth ? (uint64_t)(uintptr_t)frames[i] : 0;
+    if (++log->count == kLogRecords) flushLog(log);
+    log->busy.store(0, std::memory_order_release);
+}
+
+const char* apiName(int api) {
+    static const char* names[MEMSTAT_API_COUNT] = {
+        "malloc", "calloc", "realloc", "memalign", "free", "cudaMalloc",
+        "cudaMallocManaged", "cudaFree", "cudaMallocHost", "cudaFreeHost"
+    };
+    return names[api];
+}
+
+void onAlloc(int kind, int api, const void* ptr, uint64_t size, void** frames, int depth) {
+    if (insertLive(ptr, size, kind)) account(kind, (int64_t)size);
+    else g_untracked.fetch_add(1, std::memory_order_relaxed);
+    g_allocs[kind].fetch_add(1, std::memory_order_relaxed);
+    logEvent(MEMSTAT_ALLOC, kind, api, ptr, size, frames, depth);
+    if (g_verbose && kind != MEMSTAT_HOST)
+        fprintf(stderr, "[MEM_STATS] %s (%p): %lf MB, %lf MB in use\n", apiName(api), ptr, size / kMB,
+                g_current[kind].load(std::memory_order_relaxed) / kMB);
+}
+
+bool onFree(int kind, int api, const void* ptr, uint64_t* freed) {
+    uint64_t size;
+    int liveKind;
+    if (!removeLive(ptr, size, liveKind)) {
+        // could be one the table had no room for, which the trace does have.
+        if (g_untracked.load(std::memory_order_relaxed))
+            logEvent(MEMSTAT_FREE, kind, api, ptr, 0, nullptr, 0);
+        return false;
+    }
+    account(liveKind, -(int64_t)size);
+    logEvent(MEMSTAT_FREE, liveKind, api, ptr, size, nullptr, 0);
+    if (freed) *freed = size;
+    if (g_verbose && liveKind != MEMSTAT_HOST)
+        fprintf(stderr, "[MEM_STATS] %s (%p): %lf MB, %lf MB in use\n", apiName(api), ptr, size / kMB,
+                g_current[liveKind].load(std::memory_order_relaxed) / kMB);
+    return true;
+}
+
+bool tracing(int kind) {
+    return !t_inHook && g_ready.load(std::memory_order_acquire) && (kind != MEMSTAT_HOST || g_host);
+}
+
+// inlined into the hooks, so that the first frame of the backtrace is the
+// hook and the second its caller.
+MEMSTAT_INLINE void traceAlloc(int kind, int api, const void* ptr, uint64_t size) {
+    if (!ptr || !tracing(kind)) return;
+    t_inHook = 1;
+    int savedErrno = errno;
+    void* frames[MEMSTAT_MAX_DEPTH + 1];
+    int depth = g_depth > 0 ? backtrace(frames, g_depth + 1) - 1 : 0;
+    onAlloc(kind, api, ptr, size, frames + 1, std::max(depth, 0));
+    errno = savedErrno;
+    t_inHook = 0;
+}
+
+// called before the memory is actually freed, so that its free is ordered
+// before whatever allocation gets the address next.
+MEMSTAT_INLINE bool traceFree(int kind, int api, const void* ptr, uint64_t* freed) {
+    if (!ptr || !tracing(kind)) return false;
+    t_inHook = 1;
+    int savedErrno = errno;
+    bool traced = onFree(kind, api, ptr, freed);
+    errno = savedErrno;
+    t_inHook = 0;
+    return traced;
+}
+
+int envInt(const char* name, int def, int lo, int hi) {
+    const char* s = getenv(name);
+    if (!s || !*s) return def;
+    return std::min(std::max(atoi(s), lo), hi);
+}
+
+bool openTrace() {
+    snprintf(g_path, sizeof(g_path), "%s.%d.bin", g_prefix, (int)getpid());
+    g_fd = open(g_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (g_fd < 0) {
+        fprintf(stderr, "[MEM_STATS] Cannot write the trace to %s, not tracing.\n", g_path);
+        return false;
+    }
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MEMSTAT_MAGIC, sizeof(header.magic));
+    header.version = kVersion;
+    header.pid = (uint32_t)getpid();
+    header.recordSize = sizeof(TraceRecord);
+    header.depth = (uint32_t)g_depth;
+    return write(g_fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+}
+
+// the child gets a trace of its own; what the parent's threads logged is the
+// parent's to write.
+void afterFork() {
+    for (ThreadLog* log = g_logs.load(std::memory_order_acquire); log; log = log->next) {
+        log->count = 0;
+        log->busy.store(0, std::memory_order_relaxed);
+        if (log != t_log) log->owned.store(0, std::memory_order_relaxed);
+    }
+    if (t_log) t_log->tid = (uint32_t)syscall(SYS_gettid);
+    close(g_fd);
+    if (!openTrace()) g_ready.store(false, std::memory_order_release);
+}
+
+__attribute__((constructor)) void memstatInit() {
+    Reentry reentry;
+    const char* prefix = getenv("MEMSTAT_TRACE");
+    if (prefix && *prefix) snprintf(g_prefix, sizeof(g_prefix), "%s", prefix);
+    g_depth = envInt("MEMSTAT_DEPTH", MEMSTAT_MAX_DEPTH, 0, MEMSTAT_MAX_DEPTH);
+    g_host = envInt("MEMSTAT_HOST", 1, 0, 1) != 0;
+    g_verbose = envInt("MEMSTAT_VERBOSE", 0, 0, 1) != 0;
+    g_tableBits = envInt("MEMSTAT_TABLE", 22, 10, 32);
+    g_tableMask = ((size_t)1 << g_tableBits) - 1;
+
+    // touched only where used.
+    void* table = mmap(nullptr, sizeof(Slot) << g_tableBits, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+        fprintf(stderr, "[MEM_STATS] Cannot map the allocation table, not tracing.\n");
+        return;
+    }
+    g_table = (Slot*)table;
+    if (!openTrace()) return;
+    pthread_key_create(&g_key, releaseLog);
+    pthread_atfork(nullptr, nullptr, afterFork);
+    // the first backtrace loads the unwinder, which is better done here than
+    // in the middle of someone's malloc.
+    if (g_depth > 0) {
+        void* frames[2];
+        backtrace(frames, 2);
+    }
+    g_ready.store(true, std::memory_order_release);
+}
+
+// return addresses point past the call; the call itself is a byte earlier.
+void writeSymbol(FILE* fp, uint64_t addr) {
+    Dl_info info;
+    void* call = (void*)(uintptr_t)(addr - 1);
+    if (!dladdr(call, &info) || !info.dli_fbase) {
+        fprintf(fp, "0x%llx\t??\t??\n", (unsigned long long)addr);
+        return;
+    }
+    // executables that aren't position independent are symbolized by their
+    // addresses, everything else by the offset into the module.
+    const Elf64_Ehdr* elf = (const Elf64_Ehdr*)info.dli_fbase;
+    uintptr_t base = elf->e_type == ET_EXEC ? 0 : (uintptr_t)info.dli_fbase;
+    char exe[4096] = "";
+    const char* module = info.dli_fname;
+    if (!module || !*module) {
+        ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (n > 0) exe[n] = '\0';
+        module = exe;
+    }
+    fprintf(fp, "0x%llx\t%s+0x%llx\t", (unsigned long long)addr, module,
+            (unsigned long long)((uintptr_t)call - base));
+    if (info.dli_sname)
+        fprintf(fp, "%s+0x%llx\n", info.dli_sname, (unsigned long long)((uintptr_t)call - (uintptr_t)info.dli_saddr));
+    else
+        fprintf(fp, "??\n");
+}
+
+// symbolizes the call sites in the trace, which has to be done by the
+// process, since modules are mapped at different addresses in every process.
+void writeSymbols() {
+    if (g_depth == 0) return;
+    int fd = open(g_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    std::vector<uint64_t> addrs;
+    std::vector<TraceRecord> records(kLogRecords);
+    TraceHeader header;
+    if (read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header)) {
+        ssize_t n;
+        while ((n = read(fd, records.data(), records.size() * sizeof(TraceRecord))) > 0) {
+            for (size_t i = 0; i < n / sizeof(TraceRecord); i++)
+                addrs.insert(addrs.end(), records[i].frames, records[i].frames + records[i].depth);
+        }
+    }
+    close(fd);
+    std::sort(addrs.begin(), addrs.end());
+    addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d.sym", g_prefix, (int)getpid());
+    FILE* fp = fopen(path, "w");
+    if (!fp) return;
+    for (size_t i = 0; i < addrs.size(); i++) writeSymbol(fp, addrs[i]);
+    fclose(fp);
+}
+
+__attribute__((destructor)) void memstatFini() {
+    // allocations from here on aren't traced.
+    if (!g_ready.exchange(false)) return;
+    Reentry reentry;
+    // a log is busy only for the append in flight; it stays busy afterwards,
+    // so threads still running log nothing more.
+    for (ThreadLog* log = g_logs.load(std::memory_order_acquire); log; log = log->next) {
+        int expected = 0;
+        while (!log->busy.compare_exchange_weak(expected, 1, std::memory_order_acquire)) {
+            expected = 0;
+            sched_yield();
+        }
+        flushLog(log);
+    }
+    close(g_fd);
+    writeSymbols();
+
+    for (int k = 0; k < MEMSTAT_KIND_COUNT; k++) {
+        if (g_allocs[k].load() == 0) continue;
+        fprintf(stderr, "[MEM_STATS] %-6s peak %12.3f MB, %12.3f MB live at exit, %llu allocations\n", kindName(k),
+                g_peak[k].load() / kMB, g_current[k].load() / kMB, (unsigned long long)g_allocs[k].load());
+    }
+    fprintf(stderr, "[MEM_STATS] %llu events in %s", (unsigned long long)g_seq.load(), g_path);
+    if (g_dropped.load() || g_untracked.load())
+        fprintf(stderr, " (%llu dropped, %llu untracked)", (unsigned long long)g_dropped.load(),
+                (unsigned long long)g_untracked.load());
+    fprintf(stderr, "\n");
+}
+
+#ifndef MEMSTAT_NO_CUDA
+template <typename F> F realFunction(std::atomic<void*>& cache, const char* name) {
+    void* f = cache.load(std::memory_order_acquire);
+    if (!f) {
+        Reentry reentry;
+        f = dlsym(RTLD_NEXT, name);
+        cache.store(f, std::memory_order_release);
+    }
+    return (F)f;
+}
+#endif
+
+} // namespace
+
+extern "C" {
+
+void* malloc(size_t size) {
+    void* ptr = __libc_malloc(size);
+    traceAlloc(MEMSTAT_HOST, MEMSTAT_MALLOC, ptr, size);
+    return ptr;
+}
+
+void* calloc(size_t n, size_t size) {
+    void* ptr = __libc_calloc(n, size);
+    traceAlloc(MEMSTAT_HOST, MEMSTAT_CALLOC, ptr, (uint64_t)n * size);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    uint64_t oldSize = 0;
+    bool traced = traceFree(MEMSTAT_HOST, MEMSTAT_REALLOC, ptr, &oldSize);
+    void* newPtr = __libc_realloc(ptr, size);
+    if (newPtr) traceAlloc(MEMSTAT_HOST, MEMSTAT_REALLOC, newPtr, size);
+    // a failed realloc leaves the block alone.
+    else if (size && traced) traceAlloc(MEMSTAT_HOST, MEMSTAT_REALLOC, ptr, oldSize);
+    return newPtr;
+}
+
+void* reallocarray(void* ptr, size_t n, size_t size) {
+    if (size && n > (size_t)-1 / size) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(ptr, n * size);
+}
+
+void free(void* ptr) {
+    traceFree(MEMSTAT_HOST, MEMSTAT_FREE_API, ptr, nullptr);
+    __libc_free(ptr);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    void* ptr = __libc_memalign(alignment, size);
+    traceAlloc(MEMSTAT_HOST, MEMSTAT_MEMALIGN, ptr, size);
+    return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    void* ptr = __libc_memalign(alignment, size);
+    traceAlloc(MEMSTAT_HOST, MEMSTAT_MEMALIGN, ptr, size);
+    return ptr;
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) {
+    if (alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    int savedErrno = errno;
+    void* ptr = __libc_memalign(alignment, size);
+    errno = savedErrno;
+    if (!ptr) return ENOMEM;
+    *out = ptr;
+    traceAlloc(MEMSTAT_HOST, MEMSTAT_MEMALIGN, ptr, size);
+    return 0;
+}
+
+void* valloc(size_t size) {
+    void* ptr = __libc_valloc(size);
+    traceAlloc(MEMSTAT_HOST, MEMSTAT_MEMALIGN, ptr, size);
+    return ptr;
+}
+
+void* pvalloc(size_t size) {
+    void* ptr = __libc_pvalloc(size);
+    traceAlloc(MEMSTAT_HOST, MEMSTAT_MEMALIGN, ptr, size);
+    return ptr;
+}
+
+#ifndef MEMSTAT_NO_CUDA
+cudaError_t cudaMalloc(void** devPtr, size_t size) {
+    static std::atomic<void*> real(nullptr);
+    cudaError_t (*f)(void**, size_t) = realFunction<cudaError_t (*)(void**, size_t)>(real, "cudaMalloc");
+    if (!f) return cudaErrorInitializationError;
+    cudaError_t err = f(devPtr, size);
+    if (err == cudaSuccess) traceAlloc(MEMSTAT_DEVICE, MEMSTAT_CUDA_MALLOC, *devPtr, size);
+    return err;
+}
+
+cudaError_t cudaMallocManaged(void** devPtr, size_t size, unsigned int flags) {
+    static std::atomic<void*> real(nullptr);
+    cudaError_t (*f)(void**, size_t, unsigned int) =
+        realFunction<cudaError_t (*)(void**, size_t, unsigned int)>(real, "cudaMallocManaged");
+    if (!f) return cudaErrorInitializationError;
+    cudaError_t err = f(devPtr, size, flags);
+    if (err == cudaSuccess) traceAlloc(MEMSTAT_DEVICE, MEMSTAT_CUDA_MALLOC_MANAGED, *devPtr, size);
+    return err;
+}
+
+cudaError_t cudaFree(void* devPtr) {
+    static std::atomic<void*> real(nullptr);
+    cudaError_t (*f)(void*) = realFunction<cudaError_t (*)(void*)>(real, "cudaFree");
+    if (!f) return cudaErrorInitializationError;
+    traceFree(MEMSTAT_DEVICE, MEMSTAT_CUDA_FREE, devPtr, nullptr);
+    return f(devPtr);
+}
+
+cudaError_t cudaMallocHost(void** ptr, size_t size) {
+    static std::atomic<void*> real(nullptr);
+    cudaError_t (*f)(void**, size_t) = realFunction<cudaError_t (*)(void**, size_t)>(real, "cudaMallocHost");
+    if (!f) return cudaErrorInitializationError;
+    cudaError_t err = f(ptr, size);
+    if (err == cudaSuccess) traceAlloc(MEMSTAT_PINNED, MEMSTAT_CUDA_MALLOC_HOST, *ptr, size);
+    return err;
+}
+
+cudaError_t cudaHostAlloc(void** pHost, size_t size, unsigned int flags) {
+    static std::atomic<void*> real(nullptr);
+    cudaError_t (*f)(void**, size_t, unsigned int) =
+        realFunction<cudaError_t (*)(void**, size_t, unsigned int)>(real, "cudaHostAlloc");
+    if (!f) return cudaErrorInitializationError;
+    cudaError_t err = f(pHost, size, flags);
+    if (err == cudaSuccess) traceAlloc(MEMSTAT_PINNED, MEMSTAT_CUDA_MALLOC_HOST, *pHost, size);
+    return err;
+}
+
+cudaError_t cudaFreeHost(void* ptr) {
+    static std::atomic<void*> real(nullptr);
+    cudaError_t (*f)(void*) = realFunction<cudaError_t (*)(void*)>(real, "cudaFreeHost");
+    if (!f) return cudaErrorInitializationError;
+    traceFree(MEMSTAT_PINNED, MEMSTAT_CUDA_FREE_HOST, ptr, nullptr);
+    return f(ptr);
+}
+#endif
+
+} // extern "C"
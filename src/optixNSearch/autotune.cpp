@@ -0,0 +1,490 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "grid.h"
+#include "hostgrid.h"
+#include "scheduler.h"
+
+// picks the sort modes, crRatio, mcScale and gsrRatio from a host-side model
+// of the search cost instead of running the search. the model works on the
+// same uniform grids as the device (|genGridInfo|): the number of candidate
+// tests of a query is estimated from the point counts of the cells that its
+// launch AABB overlaps (the launch radius coming from the same
+// |calcSearchSize| as query partitioning), and an ordering from how much the
+// lanes of warps of consecutive queries diverge.
+
+namespace {
+
+// rough costs in ms; only their ratios matter for the ranking. the device
+// ones are the empirical fits of |autoBatchingRange| and |autoBatchingKNN|;
+// memory traffic and the sorts have no fit there and are left out, so the
+// device model ranks orderings by divergence alone.
+const float kBuildGas_PerAABB = 3.8e-6;
+const float kBuildGas_Intercept = 20;
+const float kSphereTest_PerIS = 1e-4/50;
+const float kAABBTest_PerIS = 1e-5/50;
+
+const float kHostTest = 2e-6; // a distance test
+const float kHostCell = 2e-5; // visiting a cell
+const float kHostLine = 1e-5; // a cache line of points
+const float kHostBuild_PerPoint = 2e-5;
+const float kHostBuild_PerCell = 2e-6;
+
+const unsigned int kWarpSize = 32;
+const unsigned int kNumWarps = 128;
+const float kPointsPerLine = 128.0f / sizeof(float3);
+// the tables of a tuning grid take about 20 bytes per cell.
+const size_t kMaxTuneCells = 1 << 23;
+
+// the points and queries binned into the cells of one cell size.
+struct TuneGrid {
+  float cellSize;
+  // |GridDimension| is |dim|, i.e., not padded to whole meta grids, so that
+  // raster indices are dense.
+  GridInfo gridInfo;
+  uint3 dim;
+  std::vector<unsigned int> pointCounts;
+  // summed-volume table of |pointCounts|, (dim + 1)^3 entries; unsigned
+  // wraparound cancels out in box sums.
+  std::vector<unsigned int> pointSAT;
+  // counting sort of points and queries by raster cell.
+  std::vector<unsigned int> pointOffsets;
+  std::vector<unsigned int> pointIds;
+  std::vector<unsigned int> queryOffsets;
+  std::vector<unsigned int> queryIds;
+  // |calcSearchSize| of a cell, -1 until it's needed.
+  std::vector<int> cellMask;
+};
+
+// the non-empty cells in the order of a sort mode, and how many points (or
+// queries) come before each.
+struct CellOrder {
+  std::vector<unsigned int> cells;
+  std::vector<unsigned int> start;
+  // fraction of consecutive points that are not in the same or adjacent
+  // cells; one minus that is the chance that the next point is close by.
+  float jumpRate;
+};
+
+struct TuneConfig {
+  int pointSortMode;
+  int querySortMode;
+  float crRatio;
+  int mcScale;
+  float gsrRatio;
+  double cost;
+};
+
+int3 cellOf(const TuneGrid& g, float3 p) {
+  int3 c = hostGridCell(g.gridInfo, p);
+  return make_int3(std::min(std::max(c.x, 0), (int)g.dim.x - 1),
+                   std::min(std::max(c.y, 0), (int)g.dim.y - 1),
+                   std::min(std::max(c.z, 0), (int)g.dim.z - 1));
+}
+
+unsigned int rasterIdx(const TuneGrid& g, int3 c) {
+  return (c.x * g.dim.y + c.y) * g.dim.z + c.z;
+}
+
+int3 rasterCell(const TuneGrid& g, unsigned int idx) {
+  return make_int3(idx / (g.dim.y * g.dim.z), (idx / g.dim.z) % g.dim.y, idx % g.dim.z);
+}
+
+bool adjacent(int3 a, int3 b) {
+  return std::abs(a.x - b.x) <= 1 && std::abs(a.y - b.y) <= 1 && std::abs(a.z - b.z) <= 1;
+}
+
+size_t satIdx(const TuneGrid& g, int x, int y, int z) {
+  return ((size_t)x * (g.dim.y + 1) + y) * (g.dim.z + 1) + z;
+}
+
+// points in the cells [lo, hi].
+unsigned int boxCount(const TuneGrid& g, int3 lo, int3 hi) {
+  const std::vector<unsigned int>& s = g.pointSAT;
+  int x0 = lo.x, y0 = lo.y, z0 = lo.z, x1 = hi.x + 1, y1 = hi.y + 1, z1 = hi.z + 1;
+  return s[satIdx(g, x1, y1, z1)] - s[satIdx(g, x0, y1, z1)] - s[satIdx(g, x1, y0, z1)] - s[satIdx(g, x1, y1, z0)]
+       + s[satIdx(g, x0, y0, z1)] + s[satIdx(g, x0, y1, z0)] + s[satIdx(g, x1, y0, z0)] - s[satIdx(g, x0, y0, z0)];
+}
+
+// expected points in the cube |q| +- |h|: the counts of the cells it overlaps,
+// scaled by the fraction of their volume that the cube covers.
+float cubeCount(const TuneGrid& g, float3 q, float h) {
+  int3 lo = cellOf(g, q - h);
+  int3 hi = cellOf(g, q + h);
+  float3 boxLo, boxHi, t;
+  hostCellBounds(g.gridInfo, lo.x, lo.y, lo.z, boxLo, t);
+  hostCellBounds(g.gridInfo, hi.x, hi.y, hi.z, t, boxHi);
+  float3 overlap = fmaxf(fminf(q + h, boxHi) - fmaxf(q - h, boxLo), make_float3(0, 0, 0));
+  float3 box = boxHi - boxLo;
+  return boxCount(g, lo, hi) * (overlap.x * overlap.y * overlap.z) / (box.x * box.y * box.z);
+}
+
+void countingSort(const TuneGrid& g, const float3* p, unsigned int N, std::vector<unsigned int>& offsets, std::vector<unsigned int>& ids) {
+  unsigned int numCells = g.dim.x * g.dim.y * g.dim.z;
+  std::vector<unsigned int> cells(N);
+  offsets.assign(numCells + 1, 0);
+  for (unsigned int i = 0; i < N; i++) {
+    cells[i] = rasterIdx(g, cellOf(g, p[i]));
+    offsets[cells[i] + 1]++;
+  }
+  for (unsigned int c = 0; c < numCells; c++) offsets[c + 1] += offsets[c];
+  std::vector<unsigned int> pos(offsets.begin(), offsets.end() - 1);
+  ids.resize(N);
+  for (unsigned int i = 0; i < N; i++) ids[pos[cells[i]]++] = i;
+}
+
+// the queries are only sorted into the cells if |queries|.
+bool buildTuneGrid(RTNNState& tune, float cellSize, bool queries, TuneGrid& g) {
+  g.cellSize = cellSize;
+  genGridInfo(tune, tune.numPoints, cellSize, g.gridInfo, false);
+  // the dimensions before |genGridInfo| pads them to whole meta grids.
+  if (tune.periodic) g.dim = g.gridInfo.PeriodicDimension;
+  else {
+    float3 size = tune.Max - tune.Min;
+    g.dim = make_uint3(std::max(1.0f, ceilf(size.x / cellSize)), std::max(1.0f, ceilf(size.y / cellSize)), std::max(1.0f, ceilf(size.z / cellSize)));
+  }
+  if ((double)g.dim.x * g.dim.y * g.dim.z > kMaxTuneCells) return false;
+  g.gridInfo.GridDimension = g.dim;
+  unsigned int numCells = g.dim.x * g.dim.y * g.dim.z;
+
+  countingSort(g, tune.h_points, tune.numPoints, g.pointOffsets, g.pointIds);
+  if (queries && tune.samepq) {
+    g.queryOffsets = g.pointOffsets;
+    g.queryIds = g.pointIds;
+  } else if (queries)
+    countingSort(g, tune.h_queries, tune.numQueries, g.queryOffsets, g.queryIds);
+
+  g.pointCounts.resize(numCells);
+  for (unsigned int c = 0; c < numCells; c++) g.pointCounts[c] = g.pointOffsets[c + 1] - g.pointOffsets[c];
+
+  g.pointSAT.assign((size_t)(g.dim.x + 1) * (g.dim.y + 1) * (g.dim.z + 1), 0);
+  for (int x = 1; x <= (int)g.dim.x; x++)
+    for (int y = 1; y <= (int)g.dim.y; y++)
+      for (int z = 1; z <= (int)g.dim.z; z++)
+        g.pointSAT[satIdx(g, x, y, z)] = g.pointCounts[rasterIdx(g, make_int3(x - 1, y - 1, z - 1))]
+          + g.pointSAT[satIdx(g, x - 1, y, z)] + g.pointSAT[satIdx(g, x, y - 1, z)] + g.pointSAT[satIdx(g, x, y, z - 1)]
+          - g.pointSAT[satIdx(g, x - 1, y - 1, z)] - g.pointSAT[satIdx(g, x - 1, y, z - 1)] - g.pointSAT[satIdx(g, x, y - 1, z - 1)]
+          + g.pointSAT[satIdx(g, x - 1, y - 1, z - 1)];
+
+  g.cellMask.assign(numCells, -1);
+  return true;
+}
+
+// |keyInfo| is the padded grid of the meta grid scale being tuned.
+void buildOrder(const TuneGrid& g, const GridInfo& keyInfo, bool morton, const std::vector<unsigned int>& offsets, CellOrder& o) {
+  std::vector<std::pair<unsigned int, unsigned int>> keyed;
+  for (unsigned int c = 0; c + 1 < offsets.size(); c++) {
+    if (offsets[c + 1] == offsets[c]) continue;
+    // raster indices of the unpadded grid are in the same order as the
+    // padded ones.
+    keyed.push_back(std::make_pair(morton ? ToCellIndex_MortonMetaGrid(keyInfo, rasterCell(g, c)) : c, c));
+  }
+  std::sort(keyed.begin(), keyed.end());
+
+  o.cells.resize(keyed.size());
+  o.start.resize(keyed.size() + 1);
+  o.start[0] = 0;
+  unsigned int jumps = 0;
+  for (size_t i = 0; i < keyed.size(); i++) {
+    unsigned int c = keyed[i].second;
+    o.cells[i] = c;
+    o.start[i + 1] = o.start[i] + offsets[c + 1] - offsets[c];
+    if (i && !adjacent(rasterCell(g, c), rasterCell(g, o.cells[i - 1]))) jumps++;
+  }
+  o.jumpRate = o.start.back() ? (float)jumps / o.start.back() : 0;
+}
+
+float fileJumpRate(const TuneGrid& g, const float3* p, unsigned int N) {
+  if (N < 2) return 0;
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<unsigned int> dist(0, N - 2);
+  unsigned int samples = std::min(N - 1, 1u << 16), jumps = 0;
+  for (unsigned int s = 0; s < samples; s++) {
+    unsigned int i = dist(gen);
+    if (!adjacent(cellOf(g, p[i]), cellOf(g, p[i + 1]))) jumps++;
+  }
+  return (float)jumps / samples;
+}
+
+// every |stride|-th of |span| consecutive elements in an order, starting at
+// the fraction |u| of it; |order| is nullptr for the order of the file.
+void sampleWarp(const CellOrder* order, const std::vector<unsigned int>& offsets, const std::vector<unsigned int>& ids,
+                const float3* data, unsigned int N, double u, unsigned int span, unsigned int stride, std::vector<float3>& lanes) {
+  lanes.clear();
+  unsigned int pos = (unsigned int)(u * (N - std::min(N, span)));
+  if (!order) {
+    for (unsigned int k = 0; k < span && pos + k < N; k += stride) lanes.push_back(data[pos + k]);
+    return;
+  }
+
+  size_t i = std::upper_bound(order->start.begin(), order->start.end(), pos) - order->start.begin() - 1;
+  unsigned int j = pos - order->start[i];
+  for (unsigned int k = 0; k < span && i < order->cells.size(); k++) {
+    unsigned int c = order->cells[i];
+    if (k % stride == 0) lanes.push_back(data[ids[offsets[c] + j]]);
+    if (++j == offsets[c + 1] - offsets[c]) {
+      i++;
+      j = 0;
+    }
+  }
+}
+
+double evalDevice(RTNNState& tune, TuneGrid& g, const TuneConfig& cfg, const CellOrder* qOrder, const CellOrder* pOrder,
+                  const std::vector<double>& seeds) {
+  float cellSize = g.cellSize;
+  float maxWidth = maxInscribedWidth(tune.radius, 3);
+  unsigned int N = tune.numPoints, Q = tune.numQueries;
+  bool gasSort = (tune.qGasSortMode != 0);
+
+  std::vector<float3> lanes;
+  std::set<int> masks;
+  double tSearch = 0;
+  for (double u : seeds) {
+    // after a GAS sort queries go in the order of the first point they hit,
+    // i.e., of the points; a warp then spans the points between 32
+    // consecutive queries.
+    if (gasSort) {
+      unsigned int stride = std::max(1u, N / Q);
+      sampleWarp(pOrder, g.pointOffsets, g.pointIds, tune.h_points, N, u, kWarpSize * stride, stride, lanes);
+    } else {
+      sampleWarp(qOrder, g.queryOffsets, g.queryIds, tune.h_queries, Q, u, kWarpSize, 1, lanes);
+    }
+    if (lanes.empty()) continue;
+
+    // a warp runs as long as its slowest lane.
+    float maxLane = 0;
+    for (float3 q : lanes) {
+      float h = tune.radius;
+      bool sphereTest = true;
+      if (tune.partition) {
+        int3 c = cellOf(g, q);
+        int& mask = g.cellMask[rasterIdx(g, c)];
+        if (mask < 0) calcSearchSize(c, g.gridInfo, false, g.pointCounts.data(), cellSize, maxWidth, tune.knn, g.cellMask.data());
+        masks.insert(mask);
+        float width = getWidthFromIter(mask, cellSize);
+        if (width <= maxWidth) {
+          // see |genBatches|; the last batch searches with the full radius.
+          if (tune.searchMode == "knn") h = std::min(tune.radius, radiusFromMegacell(width, tune.approxMode));
+          else {
+            h = width / 2;
+            sphereTest = false;
+          }
+        }
+      }
+      float tests = cubeCount(g, q, h);
+      // partitioned range search accepts the AABB hits and stops at K.
+      if (!sphereTest) tests = std::min(tests, (float)tune.knn);
+      maxLane = std::max(maxLane, tests * (sphereTest ? kSphereTest_PerIS : kAABBTest_PerIS));
+    }
+    tSearch += kWarpSize * maxLane;
+  }
+  tSearch *= (double)Q / kWarpSize / seeds.size();
+
+  int numBatches = 1;
+  if (tune.partition) {
+    numBatches = std::max(1, (int)masks.size());
+    if (!tune.autoNB && tune.numOfBatches != -1) numBatches = std::min(numBatches, tune.numOfBatches);
+  }
+  double tGAS = numBatches * (N * kBuildGas_PerAABB + kBuildGas_Intercept);
+  if (gasSort) {
+    tGAS += Q * kAABBTest_PerIS; // the initial traversal stops at the first hit
+    if (cfg.gsrRatio != 1) tGAS += N * kBuildGas_PerAABB + kBuildGas_Intercept;
+  }
+
+  return tSearch + tGAS;
+}
+
+// every host thread searches a contiguous chunk of the queries one after
+// another in the order of the file, on a grid whose points are sorted by
+// cell, so the lines of a query stay cached for the next one unless the next
+// one is far away.
+double evalHost(RTNNState& tune, TuneGrid& g, float pointJumpRate, float queryJumpRate, unsigned int paddedCells,
+                const std::vector<double>& seeds) {
+  unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<float3> lanes;
+  double tSearch = 0;
+  for (double u : seeds) {
+    sampleWarp(nullptr, g.queryOffsets, g.queryIds, tune.h_queries, tune.numQueries, u, kWarpSize, 1, lanes);
+    for (float3 q : lanes) {
+      // every point of the cells overlapped by the AABB of the sphere is
+      // tested (see |forEachCandidate|), but a radius search stops at K;
+      // about pi/6 of the tested points are in the sphere.
+      int3 cLo = cellOf(g, q - tune.radius);
+      int3 cHi = cellOf(g, q + tune.radius);
+      float tests = boxCount(g, cLo, cHi);
+      float cells = (cHi.x - cLo.x + 1) * (cHi.y - cLo.y + 1) * (cHi.z - cLo.z + 1);
+      if (tune.searchMode == "radius" && tune.multiRadius.empty() && tune.reduce == "none" && tests > 0) {
+        float visited = std::min(1.0f, tune.knn / (tests * (float)M_PI / 6));
+        tests *= visited;
+        cells *= visited;
+      }
+      float lines = tests / kPointsPerLine + cells * pointJumpRate;
+      tSearch += tests * kHostTest + cells * kHostCell +
+                 lines * (queryJumpRate + (1 - queryJumpRate) / kPointsPerLine) * kHostLine;
+    }
+  }
+  tSearch *= (double)tune.numQueries / kWarpSize / seeds.size() / numThreads;
+
+  return tSearch + tune.numPoints * kHostBuild_PerPoint + paddedCells * kHostBuild_PerCell;
+}
+
+void printConfig(const RTNNState& state, const TuneConfig& c) {
+  fprintf(stdout, "\t%12.3f   -ps %d -qs %d -cr %g -mc %d", c.cost, c.pointSortMode, c.querySortMode, c.crRatio, c.mcScale);
+  if (state.backend != "host" && state.qGasSortMode) fprintf(stdout, " -sg %g", c.gsrRatio);
+  fprintf(stdout, "\n");
+}
+
+} // namespace
+
+void autoTune(RTNNState& state) {
+  Timing::startTiming("autotune");
+  bool host = (state.backend == "host");
+
+  // a scratch copy for |genGridInfo|, which needs the scene bounds.
+  RTNNState tune = state;
+  computeMinMaxHost(tune.numPoints, tune.h_points, tune.pMin, tune.pMax);
+  computeMinMaxHost(tune.numQueries, tune.h_queries, tune.qMin, tune.qMax);
+  tune.Min = fminf(tune.qMin, tune.pMin);
+  tune.Max = fmaxf(tune.qMax, tune.pMax);
+  if (tune.periodic) {
+    tune.Min = tune.boxMin;
+    tune.Max = tune.boxMax;
+  }
+
+  std::vector<float> crRatios = host ? std::vector<float>{1, 2, 4, 8} : std::vector<float>{1, 2, 4, 8, 16, 32};
+  if (std::find(crRatios.begin(), crRatios.end(), state.crRatio) == crRatios.end()) crRatios.push_back(state.crRatio);
+  std::vector<int> mcScales = {1, 2, 4, 8, 16};
+  if (std::find(mcScales.begin(), mcScales.end(), state.mcScale) == mcScales.end()) mcScales.push_back(state.mcScale);
+  // 1D sorting (3) is left out; it doesn't partition queries.
+  std::vector<int> sortModes = host ? std::vector<int>{1, 2} : std::vector<int>{0, 1, 2};
+  std::vector<float> gsrRatios = (!host && state.qGasSortMode) ? std::vector<float>{1, 2, 4} : std::vector<float>{state.gsrRatio};
+
+  // the same warps for every configuration, so that they differ only in the
+  // configuration.
+  std::vector<double> seeds(kNumWarps);
+  std::mt19937 gen(1);
+  for (auto& u : seeds) u = std::uniform_real_distribution<double>(0, 1)(gen);
+
+  // queries are only searched in the order of a query sort without a GAS
+  // sort; the host searches them in the order of the file.
+  bool queryOrders = !host && !state.qGasSortMode;
+
+  // every cell size is a batch of |BatchScheduler|: its tuning grid is built,
+  // then the configurations on it are evaluated. cell sizes don't depend on
+  // each other, so a pool of two runs them at once, with two grids (of up to
+  // |kMaxTuneCells| cells each) in memory at a time. the configurations are
+  // kept per cell size, so their order doesn't depend on the schedule.
+  int numSizes = (int)crRatios.size();
+  std::vector<TuneGrid> grids(numSizes);
+  std::vector<char> built(numSizes, 0);
+  std::vector<std::vector<TuneConfig>> sizeConfigs(numSizes);
+
+  BatchScheduler scheduler(std::min(2u, std::max(1u, std::thread::hardware_concurrency())));
+  scheduler.setMaxInFlight(2);
+  int build = scheduler.addStage("tune grid", [&](int i) {
+    built[i] = buildTuneGrid(tune, tune.radius / crRatios[i], queryOrders, grids[i]);
+    if (!built[i]) fprintf(stdout, "\tautotune: skipping crRatio %g, too many cells\n", crRatios[i]);
+  });
+  scheduler.addStage("evaluate", [&](int i) {
+    if (!built[i]) return;
+    float cr = crRatios[i];
+    TuneGrid& g = grids[i];
+    // a copy of |tune| for every cell size, whose meta grid scale varies below.
+    RTNNState local = tune;
+    std::vector<TuneConfig>& configs = sizeConfigs[i];
+
+    // only the host model counts cache lines.
+    float fileRate = host ? fileJumpRate(g, tune.h_points, tune.numPoints) : 0;
+    float queryFileRate = host ? fileJumpRate(g, tune.h_queries, tune.numQueries) : 0;
+    CellOrder rasterQ, rasterP;
+    if (queryOrders) buildOrder(g, g.gridInfo, false, g.queryOffsets, rasterQ);
+    buildOrder(g, g.gridInfo, false, g.pointOffsets, rasterP);
+
+    for (int mc : mcScales) {
+      local.mcScale = mc;
+      GridInfo keyInfo;
+      unsigned int paddedCells = genGridInfo(local, local.numPoints, g.cellSize, keyInfo, false);
+      CellOrder mortonQ, mortonP;
+      if (queryOrders) buildOrder(g, keyInfo, true, g.queryOffsets, mortonQ);
+      buildOrder(g, keyInfo, true, g.pointOffsets, mortonP);
+
+      for (int ps : sortModes) {
+        const CellOrder* pOrder = (ps == 1) ? &mortonP : (ps == 2) ? &rasterP : nullptr;
+        if (host) {
+          // the host grid only knows morton and raster order; the query sort
+          // and GAS sort don't apply.
+          float pRate = pOrder ? pOrder->jumpRate : fileRate;
+          TuneConfig c = {ps, state.querySortMode, cr, mc, state.gsrRatio, 0};
+          c.cost = evalHost(local, g, pRate, queryFileRate, paddedCells, seeds);
+          configs.push_back(c);
+          continue;
+        }
+        for (int qs : sortModes) {
+          // see |parseArgs|: half lists need queries sorted like the points.
+          if (state.halfList && qs != ps) continue;
+          const CellOrder* qOrder = (qs == 1) ? &mortonQ : (qs == 2) ? &rasterQ : nullptr;
+          for (float gsr : gsrRatios) {
+            TuneConfig c = {ps, qs, cr, mc, gsr, 0};
+            c.cost = evalDevice(local, g, c, qOrder, pOrder, seeds);
+            configs.push_back(c);
+          }
+        }
+      }
+    }
+    g = TuneGrid();
+  }, {build});
+  scheduler.run(numSizes);
+
+  std::vector<TuneConfig> configs;
+  for (auto& c : sizeConfigs) configs.insert(configs.end(), c.begin(), c.end());
+
+  if (configs.empty()) {
+    fprintf(stdout, "\tautotune: no configuration fits; keeping the current one\n");
+    Timing::stopTiming(true);
+    return;
+  }
+
+  std::stable_sort(configs.begin(), configs.end(), [](const TuneConfig& a, const TuneConfig& b) { return a.cost < b.cost; });
+  fprintf(stdout, "\tautotune: %zu configurations, %u warps of %u queries each; estimated ms:\n", configs.size(), kNumWarps, kWarpSize);
+  for (size_t i = 0; i < std::min<size_t>(5, configs.size()); i++) printConfig(state, configs[i]);
+  for (auto& c : configs) {
+    if (c.pointSortMode == state.pointSortMode && c.querySortMode == state.querySortMode && c.crRatio == state.crRatio &&
+        c.mcScale == state.mcScale && c.gsrRatio == state.gsrRatio) {
+      fprintf(stdout, "\tcurrent:\n");
+      printConfig(state, c);
+      break;
+    }
+  }
+
+  const TuneConfig& best = configs[0];
+  state.pointSortMode = best.pointSortMode;
+  state.querySortMode = best.querySortMode;
+  state.crRatio = best.crRatio;
+  state.autoCR = false; // see |initBatches| for the memory limit
+  state.mcScale = best.mcScale;
+  state.gsrRatio = best.gsrRatio;
+
+  // queries share the host memory of the points if and only if they are the
+  // same data sorted the same way; see |parseArgs| and |readData|.
+  bool samepq = state.sameData && state.rfile.empty() && (state.pointSortMode == state.querySortMode);
+  if (samepq && !state.samepq) {
+    if (state.h_queries != state.h_points) delete[] state.h_queries;
+    state.h_queries = state.h_points;
+  } else if (!samepq && state.samepq) {
+    state.h_queries = new float3[state.numQueries];
+    std::copy(state.h_points, state.h_points + state.numQueries, state.h_queries);
+  }
+  state.samepq = samepq;
+  Timing::stopTiming(true);
+}
@@ -0,0 +1,163 @@
+#include <sutil/Exception.h>
+
+#include <thrust/host_vector.h>
+
+#include <algorithm>
+#include <vector>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+
+#include "optixNSearch.h"
+#include "func.h"
+#include "state.h"
+#include "grid.h"
+
+// batching of the partitioned queries; host only, so it's kept apart from the
+// device code.
+
+// this function returns the width of the inscribed cube (square) of a sphere (circle)
+float maxInscribedWidth(float radius, int dim) {
+  if (dim == 2) return radius/sqrt(2)*2;
+  else if (dim == 3) return radius/sqrt(3)*2;
+  else assert(0);
+}
+
+// this function returns the radius of the circumsphere (circumcircle) of a cube (square)
+float minCircumscribedRadius(float width, int dim) {
+  if (dim == 2) return width/2*sqrt(2);
+  else if (dim == 3) return width/2*sqrt(3);
+  else assert(0);
+}
+
+// this function returns the radius of a sphere (circle) with same volume of a cube (square)
+float radiusEquiVolume(float width, int dim) {
+  if (dim == 2) return width*sqrt(1/M_PI);
+  else if (dim == 3) return width*cbrt(3/(4*M_PI));
+  else assert(0);
+}
+
+void autoBatchingRange(RTNNState& state, const thrust::host_vector<unsigned int>& h_rayHist, std::vector<int>& batches, int numAvailBatches) {
+  // now that we allow AABBTEST in all but the last batch in radius search,
+  // batching could save time, since doing sphere test is much more costly than
+  // aabb test. build the cost model and find the optimal batching.
+
+  // empirical coefficients on 2080Ti
+  //const float kD2H_PerB = 6e-7; // D2H memcpy time in *ms* / byte (TODO)
+  const float kBuildGas_PerAABB = 3.8e-6; // GAS building time in *ms* / AABB
+  // higher values encourage batching.
+  //const float kAABBTest_PerIS = 4e-5/50; // IS call time in *ms* if doing aabb test (by 50 as the data was ubenchmarked using K=50)
+  //const float kSphereTest_PerIS = 4e-4/50; // IS call time in *ms* if doing sphere test
+
+  // empirical coefficients on 2080
+  const float kAABBTest_PerIS = 1e-5/50;
+  const float kSphereTest_PerIS = 1e-4/50;
+
+  //float tMemcpy = state.numQueries * state.knn * sizeof(unsigned int) * kD2H_PerB; // TODO: consider max(memcpy, compute)
+  float tBuildGAS = state.numPoints * kBuildGas_PerAABB + 20; // 20 is the empirical intercept (TODO)
+  //fprintf(stdout, "tBuildGAS: %f\n", tBuildGAS);
+
+  // incrementally combine batch i with the last batch (assuming all other
+  // batches are independent) and calculate the cost. choose the min cost.
+  float overhead = 0;
+  float maxOverhead = 0; // overhead must be negative for bundling to be useful
+  int splitId = numAvailBatches - 1; // by default we don't bundle
+  for (int i = numAvailBatches - 2; i >= 0; i--) {
+    float extraTime = h_rayHist[i] * (kSphereTest_PerIS - kAABBTest_PerIS) * state.knn;
+    overhead += extraTime - tBuildGAS;
+    //fprintf(stdout, "i: %d, %u extraTime: %f, overhead: %f\n", i, h_rayHist[i], extraTime, overhead);
+    if (overhead < maxOverhead) {
+      maxOverhead = overhead;
+      splitId = i;
+    }
+  }
+
+  for (int i = 0; i <= splitId - 1; i++) {
+    batches.push_back(i);
+  }
+  batches.push_back(numAvailBatches - 1);
+}
+
+float radiusFromMegacell(float width, int approxMode) {
+  if (approxMode == 2) return radiusEquiVolume(width, 3); // 0.62; works well for uniform density
+  // for a sphere to be of the same volume as the cube, its radius is width *
+  // 0.62. if we use 2 in |minCircumscribedRadius|, the radius is width * 0.71.
+  // so very likely the sphere will still have more than K neighbors.
+  else if (approxMode == 1) return minCircumscribedRadius(width, 2); // 0.71
+  else return minCircumscribedRadius(width, 3); // 0.87
+}
+
+void autoBatchingKNN(RTNNState& state, const thrust::host_vector<unsigned int>& h_rayHist, std::vector<int>& batches, int numAvailBatches) {
+  // Logic: given CR (which has been decided beforehand), we know that max # of
+  //   available batches (|numAvailBatches|). launching as many batches as
+  //   available minimizes the work, but also introduces gas building overhead.
+  // So we build a cost model = gas building time + searching time.
+  // GAS building time is linear w.r.t. to the # of AABBs, which is the total amount of points.
+  // Searching time = max(memcpy time, compute time).
+  // The memcpy time is empirically observed to be linear w.r.t., to the # of queries
+  // The compute time, without considering CKE, is the lump sum of the compute time of each batch, which is linear w.r.t. the # of queries in the batch and cubic w.r.t., to the radius in the batch.
+
+  // empirical coefficients on 2080Ti
+  //const float kD2H_PerB = 6e-7; // D2H memcpy time in *ms* / byte (TODO)
+  const float kBuildGas_PerAABB = 3.8e-6; // GAS building time in *ms* / AABB
+  // TODO: fit a better model for IS calls? N_tl * T_tl + N_is * T_is
+  // TODO: this should depend K.
+  const float kSearch_PerIS = 6e-2; // knn search time in *ms* per IS call
+
+  //float tMemcpy = state.numQueries * state.knn * sizeof(unsigned int) * kD2H_PerB; // TODO: consider max(memcpy, compute)
+  float tBuildGAS = state.numPoints * kBuildGas_PerAABB + 20; // 20 is the empirical intercept (TODO)
+  float cellSize = state.radius / state.crRatio;
+  //fprintf(stdout, "tBuildGAS: %f\n", tBuildGAS);
+
+  float maxWidth = getWidthFromIter(numAvailBatches - 1, cellSize);
+  float maxRadius = std::min(state.radius, radiusFromMegacell(maxWidth, state.approxMode));
+  // incrementally combine batch i with the last batch (assuming all other
+  // batches are independent) and calculate the cost. choose the min cost.
+  float overhead = 0;
+  float maxOverhead = 0;
+  int splitId = numAvailBatches - 1;
+  for (int i = numAvailBatches - 2; i >= 0; i--) {
+    float curWidth = getWidthFromIter(i, cellSize);
+    float curRadius = std::min(state.radius, radiusFromMegacell(curWidth, state.approxMode));
+    float density = state.knn / ((curWidth - cellSize) * (curWidth - cellSize) * (curWidth - cellSize));
+
+    // TODO: assuming density doesn't change dramatically; consider non-uniform density?
+    float extraWork = h_rayHist[i] * 8 * (maxRadius * maxRadius * maxRadius - curRadius * curRadius * curRadius) * density;
+    float extraTime = extraWork * kSearch_PerIS;
+    overhead += extraTime - tBuildGAS;
+    //fprintf(stdout, "i: %d, density: %f, extraWork: %f, extraTime: %f, overhead: %f\n", i, density, extraWork, extraTime, overhead);
+    if (overhead < maxOverhead) {
+      maxOverhead = overhead;
+      splitId = i;
+    }
+  }
+
+  for (int i = 0; i <= splitId - 1; i++) {
+    batches.push_back(i);
+  }
+  batches.push_back(numAvailBatches - 1);
+}
+
+void prepBatches(RTNNState& state, std::vector<int>& batches, const thrust::host_vector<unsigned int>& h_rayHist) {
+  int numAvailBatches = (int)h_rayHist.size();
+  fprintf(stdout, "\tnumAvailBatches: %d\n", numAvailBatches);
+
+  if (state.autoNB) {
+    if (state.searchMode == "knn") autoBatchingKNN(state, h_rayHist, batches, numAvailBatches);
+    else autoBatchingRange(state, h_rayHist, batches, numAvailBatches);
+  } else {
+    if (numAvailBatches == 1) {
+      batches.push_back(0);
+      return;
+    }
+
+    int numBatches;
+    if (state.numOfBatches == -1) numBatches = (int)numAvailBatches;
+    else numBatches = std::min(state.numOfBatches, (int)numAvailBatches);
+
+    for (int i = 0; i < numAvailBatches; i++) {
+      if (i <= numBatches - 2 || i == numAvailBatches - 1) batches.push_back(i);
+    }
+    assert(batches.size() <= (unsigned int)numBatches);
+  }
+}
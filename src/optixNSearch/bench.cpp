@@ -0,0 +1,469 @@
+// Microbenchmarks of the host-side hot paths: cell indexing, the grid layout,
+// the search size and batching of query partitioning, the cell size solver of
+// |calcCRRatio|, the input reader, and the host grid's counting sort. Every
+// case runs on synthetic points of every size and distribution asked for,
+// except for the batch scheduler, which runs stages that only sleep; a case
+// is repeated until it has run for the min time (and at least the min number
+// of runs), and the min and median time per run are reported on stdout and,
+// with -o, as JSON to track these paths across commits.
+
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <thrust/host_vector.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "grid.h"
+#include "hostgrid.h"
+#include "scheduler.h"
+#include "resultfile.h"
+
+struct BenchResult
+{
+  std::string bench;
+  std::string dist;
+  unsigned int n;
+  unsigned int runs;
+  double minTime; // ms per run
+  double medianTime;
+  double meanTime;
+  double items; // items processed per run
+};
+
+// keeps the results of the timed code alive.
+static volatile unsigned long g_sink;
+
+static void printUsageAndExit(const char* argv0) {
+  std::cerr << "\e[1mUsage:\e[0m " << argv0 << " [options]\n\n";
+  std::cerr << "  --sizes           | -n      Comma-separated numbers of points, e.g., 1000,1e6,1e8. Default is 1000,10000,100000,1000000.\n";
+  std::cerr << "  --dists           | -d      Comma-separated distributions: \"uniform\" (unit density cube), \"clustered\" (Gaussian blobs) and \"surface\" (a sphere shell, like a scan). Default is all three.\n";
+  std::cerr << "  --bench           | -b      Comma-separated cases to run: morton, cellindex, gridinfo, searchsize, batching, crsolve, crstep, tokenize, readpc, gridbuild, gridupdate, pipeline, resultwrite. crstep is the stepping crsolve replaces, and both fail if they disagree. pipeline runs stages of simulated latencies through the batch scheduler. resultwrite writes -k neighbors of every query to a result file in -t and fails if it doesn't read back. Default is all of them.\n";
+  std::cerr << "  --radius          | -r      Search radius. Default is 2.\n";
+  std::cerr << "  --knn             | -k      K of the search size and batching. Default is 50.\n";
+  std::cerr << "  --cellRadiusRatio | -cr     Radius over the cell size of the partitioning grid. Default is 2.\n";
+  std::cerr << "  --minTime         | -mt     Min seconds to repeat each case for. Default is 0.5.\n";
+  std::cerr << "  --minRuns         | -mr     Min runs of each case. Default is 3.\n";
+  std::cerr << "  --output          | -o      Write the results to this JSON file. Default is empty.\n";
+  std::cerr << "  --label           | -l      Label of the run in the JSON, e.g., a commit hash. Default is empty.\n";
+  std::cerr << "  --tmpdir          | -t      Directory of the point files that readpc reads. Default is /tmp.\n";
+  std::cerr << "  --verbose         | -v      Keep the messages the benchmarked code prints? Default is false.\n";
+  std::cerr << "  --help            | -h      Print this usage message\n";
+  exit(0);
+}
+
+static std::vector<std::string> splitList(const std::string& s) {
+  std::vector<std::string> list;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) list.push_back(item);
+  }
+  return list;
+}
+
+// |n| points in a cube of side cbrt(n), so that the density, and with it the
+// neighbors per query, stays the same across sizes.
+static std::vector<float3> genPoints(const std::string& dist, unsigned int n) {
+  std::mt19937 gen(n);
+  float side = cbrtf((float)n);
+  std::uniform_real_distribution<float> uniform(0, side);
+  std::vector<float3> points(n);
+
+  if (dist == "uniform") {
+    for (auto& p : points) p = make_float3(uniform(gen), uniform(gen), uniform(gen));
+  } else if (dist == "clustered") {
+    // blobs around random centres; the density varies by orders of magnitude.
+    std::vector<float3> centres(64);
+    for (auto& c : centres) c = make_float3(uniform(gen), uniform(gen), uniform(gen));
+    std::normal_distribution<float> normal(0, side / 32);
+    std::uniform_int_distribution<unsigned int> pick(0, centres.size() - 1);
+    for (auto& p : points) p = centres[pick(gen)] + make_float3(normal(gen), normal(gen), normal(gen));
+  } else {
+    std::normal_distribution<float> normal(0, 1);
+    std::uniform_real_distribution<float> shell(0.98f, 1.0f);
+    float3 centre = make_float3(side / 2);
+    for (auto& p : points) {
+      float3 dir = normalize(make_float3(normal(gen), normal(gen), normal(gen)));
+      p = centre + dir * (side / 2 * shell(gen));
+    }
+  }
+  return points;
+}
+
+// runs |f| until |minTime| seconds and |minRuns| runs have passed, after one
+// run to warm up.
+template <typename F>
+static BenchResult measure(F f, double minTime, unsigned int minRuns) {
+  typedef std::chrono::steady_clock Clock;
+  f();
+
+  std::vector<double> times;
+  double total = 0;
+  while (total < minTime * 1000 || times.size() < minRuns) {
+    Clock::time_point start = Clock::now();
+    f();
+    double t = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    times.push_back(t);
+    total += t;
+  }
+  std::sort(times.begin(), times.end());
+
+  BenchResult res;
+  res.runs = times.size();
+  res.minTime = times.front();
+  res.medianTime = times[times.size() / 2];
+  res.meanTime = total / times.size();
+  return res;
+}
+
+static void writeJSON(const std::string& path, const std::string& label, const std::vector<BenchResult>& results) {
+  FILE* fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    std::cerr << "Could not write " << path << "\n";
+    exit(1);
+  }
+  fprintf(fp, "{\"label\": \"%s\", \"results\": [", label.c_str());
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult& r = results[i];
+    fprintf(fp, "%s\n  {\"bench\": \"%s\", \"dist\": \"%s\", \"n\": %u, \"runs\": %u, \"min_ms\": %.6f, \"median_ms\": %.6f, \"mean_ms\": %.6f, \"items_per_s\": %.1f}",
+            i ? "," : "", r.bench.c_str(), r.dist.c_str(), r.n, r.runs, r.minTime, r.medianTime, r.meanTime, r.items / r.minTime * 1000);
+  }
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> sizeList = splitList("1000,10000,100000,1000000");
+  std::vector<std::string> dists = splitList("uniform,clustered,surface");
+  std::vector<std::string> benches = splitList("morton,cellindex,gridinfo,searchsize,batching,crsolve,crstep,tokenize,readpc,gridbuild,gridupdate,pipeline,resultwrite");
+  float radius = 2, crRatio = 2;
+  unsigned int knn = 50, minRuns = 3;
+  double minTime = 0.5;
+  std::string output, label, tmpdir = "/tmp";
+  bool verbose = false;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") printUsageAndExit(argv[0]);
+    if (i >= argc - 1) printUsageAndExit(argv[0]);
+    const std::string val = argv[++i];
+    if (arg == "--sizes" || arg == "-n") sizeList = splitList(val);
+    else if (arg == "--dists" || arg == "-d") dists = splitList(val);
+    else if (arg == "--bench" || arg == "-b") benches = splitList(val);
+    else if (arg == "--radius" || arg == "-r") radius = std::stof(val);
+    else if (arg == "--knn" || arg == "-k") knn = std::stoul(val);
+    else if (arg == "--cellRadiusRatio" || arg == "-cr") crRatio = std::stof(val);
+    else if (arg == "--minTime" || arg == "-mt") minTime = std::stod(val);
+    else if (arg == "--minRuns" || arg == "-mr") minRuns = std::stoul(val);
+    else if (arg == "--output" || arg == "-o") output = val;
+    else if (arg == "--label" || arg == "-l") label = val;
+    else if (arg == "--tmpdir" || arg == "-t") tmpdir = val;
+    else if (arg == "--verbose" || arg == "-v") verbose = (bool)std::stoi(val);
+    else {
+      std::cerr << "Unknown option '" << arg << "'\n";
+      printUsageAndExit(argv[0]);
+    }
+  }
+
+  std::vector<unsigned int> sizes;
+  for (auto& s : sizeList) sizes.push_back((unsigned int)std::stod(s));
+  for (auto& d : dists) {
+    if ((d != "uniform") && (d != "clustered") && (d != "surface")) printUsageAndExit(argv[0]);
+  }
+  if (sizes.empty() || dists.empty() || benches.empty() || !(radius > 0) || !(crRatio > 0)) printUsageAndExit(argv[0]);
+  auto selected = [&](const char* name) { return std::find(benches.begin(), benches.end(), name) != benches.end(); };
+
+  // the benchmarked code reports its progress on stdout; keep stdout for the
+  // results and drop the rest.
+  FILE* report = fdopen(dup(fileno(stdout)), "w");
+  if (!verbose && !freopen("/dev/null", "w", stdout)) {
+    std::cerr << "Could not silence stdout\n";
+    exit(1);
+  }
+  fprintf(report, "%-12s %-10s %10s %6s %12s %12s %14s\n", "bench", "dist", "n", "runs", "min ms", "median ms", "items/s");
+
+  std::vector<BenchResult> results;
+  auto record = [&](const char* bench, const std::string& dist, unsigned int n, double items, BenchResult res) {
+    res.bench = bench;
+    res.dist = dist;
+    res.n = n;
+    res.items = items;
+    fprintf(report, "%-12s %-10s %10u %6u %12.4f %12.4f %14.0f\n", bench, dist.c_str(), n, res.runs, res.minTime, res.medianTime, items / res.minTime * 1000);
+    fflush(report);
+    results.push_back(res);
+  };
+
+  // an upload, a computation and an ordered download of every batch, each on
+  // a resource of its own, as the stages of a device with copy engines, run by
+  // a pool that overlaps them; tests/scheduler_test.cpp checks the schedules.
+  if (selected("pipeline")) {
+    const int numBatches = 16;
+    const double latency[3] = {1, 2, 1}; // ms
+    auto sleepFor = [](double ms) { std::this_thread::sleep_for(std::chrono::microseconds((long)(ms * 1000))); };
+
+    BatchScheduler sched(4);
+    int upload = sched.addStage("upload", [&](int) { sleepFor(latency[0]); }, {}, sched.addResource("h2d", 1));
+    int compute = sched.addStage("compute", [&](int) { sleepFor(latency[1]); }, {upload}, sched.addResource("device", 1));
+    sched.addStage("download", [&](int) { sleepFor(latency[2]); }, {compute}, sched.addResource("d2h", 1), true);
+    sched.setMaxInFlight(3);
+    record("pipeline", "simulated", numBatches, numBatches, measure([&]() { sched.run(numBatches); }, minTime, minRuns));
+  }
+
+  // the result file of n queries with up to K neighbors each, written by
+  // |ResultWriter| in chunks of two batches, as dense rows and as CSR with
+  // remapped IDs, with the queries' input positions reversed, and read back
+  // through |ResultReader| by input position.
+  if (selected("resultwrite")) {
+    for (unsigned int n : sizes) {
+      const unsigned int chunk = 1 << 16;
+      std::vector<unsigned int> rows((size_t)n * knn, UINT_MAX);
+      std::vector<unsigned int> idMap(n);
+      for (unsigned int q = 0; q < n; q++) {
+        idMap[q] = n - 1 - q;
+        for (unsigned int k = 0; k < q % (knn + 1); k++) rows[(size_t)q * knn + k] = (q * 31u + k) % n;
+      }
+      std::string path = tmpdir + "/rtnn_bench_results.bin";
+      unsigned int half = n / 2;
+      const unsigned int* queryIds[2] = {idMap.data(), idMap.data() + half};
+
+      for (int csr = 0; csr < 2; csr++) {
+        auto write = [&]() {
+          ResultWriter writer(path, csr, csr ? idMap.data() : nullptr, queryIds);
+          // batch 0 is the first half of the queries.
+          for (int batch = 0; batch < 2; batch++) {
+            unsigned int begin = batch ? half : 0, end = batch ? n : half;
+            for (unsigned int first = begin; first < end; first += chunk)
+              writer.consume(batch, first - begin, std::min(chunk, end - first), knn, rows.data() + (size_t)first * knn);
+          }
+          writer.finish();
+        };
+        write();
+
+        ResultReader reader(path);
+        bool ok = (reader.csr() == (bool)csr) && (reader.remapped() == (bool)csr) && reader.hasQueryIds();
+        for (unsigned int q = 0; q < n && ok; q++) {
+          const unsigned int* ids;
+          unsigned int count = reader.neighborsOf(idMap[q], &ids);
+          const unsigned int* row = rows.data() + (size_t)q * knn;
+          if (csr) {
+            ok = (count == q % (knn + 1));
+            for (unsigned int k = 0; k < count && ok; k++) ok = (ids[k] == idMap[row[k]]);
+          } else {
+            ok = (count == knn) && std::equal(row, row + knn, ids);
+          }
+        }
+        if (!ok) {
+          std::cerr << "resultwrite: the " << (csr ? "CSR" : "dense") << " file of " << n << " queries reads back wrong\n";
+          exit(1);
+        }
+        record("resultwrite", csr ? "csr" : "dense", n, n, measure(write, minTime, minRuns));
+      }
+      remove(path.c_str());
+    }
+  }
+
+  for (auto& dist : dists) {
+    for (unsigned int n : sizes) {
+      std::vector<float3> points = genPoints(dist, n);
+
+      // the search state as the host backend would set it up; |partState|
+      // is that of a KNN search with query partitioning, whose grid is finer
+      // (see |genCellMask|).
+      RTNNState state;
+      state.backend = "host";
+      state.h_points = points.data();
+      state.h_queries = points.data();
+      state.numPoints = n;
+      state.numQueries = n;
+      state.radius = radius;
+      computeMinMaxHost(n, state.h_points, state.pMin, state.pMax);
+      state.Min = state.pMin;
+      state.Max = state.pMax;
+
+      RTNNState partState = state;
+      partState.searchMode = "knn";
+      partState.knn = knn;
+      partState.autoCR = false;
+      partState.crRatio = crRatio;
+      HostGrid partGrid;
+      buildHostGrid(partState, partGrid);
+      const GridInfo& gridInfo = partGrid.gridInfo;
+      float cellSize = partGrid.cellSize;
+
+      std::vector<int3> cells(n);
+      for (unsigned int i = 0; i < n; i++) {
+        float3 gridCellF = (points[i] - gridInfo.GridMin) * gridInfo.GridDelta;
+        cells[i] = make_int3(int(gridCellF.x), int(gridCellF.y), int(gridCellF.z));
+      }
+
+      if (selected("morton")) {
+        record("morton", dist, n, n, measure([&]() {
+          unsigned long sum = 0;
+          for (unsigned int i = 0; i < n; i++) sum += MortonCode3(cells[i].x & 1023, cells[i].y & 1023, cells[i].z & 1023);
+          g_sink = sum;
+        }, minTime, minRuns));
+      }
+
+      if (selected("cellindex")) {
+        record("cellindex", dist, n, n, measure([&]() {
+          unsigned long sum = 0;
+          for (unsigned int i = 0; i < n; i++) sum += ToCellIndex_MortonMetaGrid(gridInfo, cells[i]);
+          g_sink = sum;
+        }, minTime, minRuns));
+      }
+
+      if (selected("gridinfo")) {
+        // a single call is too short to time.
+        const unsigned int calls = 1000;
+        record("gridinfo", dist, n, calls, measure([&]() {
+          GridInfo gi;
+          unsigned long sum = 0;
+          for (unsigned int i = 0; i < calls; i++) sum += genGridInfo(partState, n, cellSize, gi, false);
+          g_sink = sum;
+        }, minTime, minRuns));
+      }
+
+      // one representative query per non-empty cell, as in |sortGenBatch|.
+      std::vector<unsigned int> repQueries;
+      for (unsigned int c = 0; c < partGrid.numberOfCells; c++) {
+        if (partGrid.CellParticleCounts[c]) repQueries.push_back(partGrid.SortedIndices[partGrid.CellOffsets[c]]);
+      }
+      float maxWidth = maxInscribedWidth(radius, 3);
+      std::vector<int> cellMask(partGrid.numberOfCells, 0);
+      auto genMask = [&]() {
+        for (unsigned int q : repQueries) {
+          calcSearchSize(cells[q], gridInfo, partGrid.morton, partGrid.CellParticleCounts.data(), cellSize, maxWidth, knn, cellMask.data());
+        }
+      };
+
+      if (selected("searchsize")) {
+        record("searchsize", dist, n, repQueries.size(), measure(genMask, minTime, minRuns));
+      }
+
+      if (selected("batching")) {
+        // from the cell masks to the batches and their launch radii, i.e.,
+        // the host part of |sortGenBatch| and |genBatches|.
+        genMask();
+        record("batching", dist, n, n, measure([&]() {
+          thrust::host_vector<unsigned int> h_rayHist;
+          for (unsigned int i = 0; i < n; i++) {
+            unsigned int mask = cellMask[partGrid.ParticleCellIndices[i]];
+            if (mask >= h_rayHist.size()) h_rayHist.resize(mask + 1, 0);
+            h_rayHist[mask]++;
+          }
+          std::vector<int> batches;
+          prepBatches(partState, batches, h_rayHist);
+          float sum = 0;
+          for (int b : batches) sum += radiusFromMegacell(getWidthFromIter(b, cellSize), partState.approxMode);
+          g_sink = (unsigned long)sum + batches.size();
+        }, minTime, minRuns));
+      }
+
+      // the deferFree cell size of |calcCRRatio|, from a cell size with
+      // about 8 cells per point to a memory budget that fits about 1/8.
+      if (selected("crsolve") || selected("crstep")) {
+        MemPlan plan;
+        estimateMemory(partState, plan);
+        float3 size = partState.Max - partState.Min;
+        float start = cbrtf(size.x * size.y * size.z / (8.0f * n));
+        float spaceAvail = memFootprint(partState, 4 * start, plan.cellArrayCount, plan.gasSize);
+        float solved = fitCellSize(partState, spaceAvail, start, plan.cellArrayCount, plan.gasSize);
+        float stepped = fitCellSize(partState, spaceAvail, start, plan.cellArrayCount, plan.gasSize, true);
+        if (solved != stepped) {
+          std::cerr << "crsolve found cell size " << solved << " but stepping finds " << stepped << " (" << dist << ", " << n << ")\n";
+          exit(1);
+        }
+        for (int stepwise = 0; stepwise < 2; stepwise++) {
+          const char* name = stepwise ? "crstep" : "crsolve";
+          if (!selected(name)) continue;
+          record(name, dist, n, 1, measure([&]() {
+            g_sink = (unsigned long)fitCellSize(partState, spaceAvail, start, plan.cellArrayCount, plan.gasSize, stepwise);
+          }, minTime, minRuns));
+        }
+      }
+
+      if (selected("tokenize")) {
+        std::vector<std::string> lines(n);
+        char line[128];
+        for (unsigned int i = 0; i < n; i++) {
+          snprintf(line, sizeof(line), "%f,%f,%f", points[i].x, points[i].y, points[i].z);
+          lines[i] = line;
+        }
+        std::vector<float3> parsed(n);
+        float3* ndpoints[1] = {parsed.data()};
+        record("tokenize", dist, n, n, measure([&]() {
+          for (unsigned int i = 0; i < n; i++) tokenize(lines[i], ",", ndpoints, i);
+        }, minTime, minRuns));
+      }
+
+      if (selected("readpc")) {
+        std::string file = tmpdir + "/rtnn_bench_" + dist + "_" + std::to_string(n) + ".txt";
+        FILE* fp = fopen(file.c_str(), "w");
+        if (!fp) {
+          std::cerr << "Could not write " << file << "\n";
+          exit(1);
+        }
+        for (auto& p : points) fprintf(fp, "%f,%f,%f\n", p.x, p.y, p.z);
+        fclose(fp);
+        record("readpc", dist, n, n, measure([&]() {
+          unsigned int N;
+          float3* read = read_pc_data(file.c_str(), &N);
+          g_sink = N;
+          delete[] read;
+        }, minTime, minRuns));
+        remove(file.c_str());
+      }
+
+      // the counting sort and scan of the points into the cells of the grid
+      // of a radius search.
+      if (selected("gridbuild")) {
+        record("gridbuild", dist, n, n, measure([&]() {
+          HostGrid grid;
+          buildHostGrid(state, grid);
+          g_sink = grid.SortedIndices.size();
+        }, minTime, minRuns));
+      }
+
+      // every point moves by up to 2% of the radius and back again.
+      if (selected("gridupdate")) {
+        HostGrid grid;
+        buildHostGrid(state, grid);
+        std::vector<float3> moved(points);
+        std::mt19937 gen(1);
+        std::uniform_real_distribution<float> step(-0.02f * radius, 0.02f * radius);
+        for (auto& p : moved) {
+          p += make_float3(step(gen), step(gen), step(gen));
+          p = clamp(p, state.Min, state.Max - 1e-3f);
+        }
+        bool there = false;
+        record("gridupdate", dist, n, n, measure([&]() {
+          there = !there;
+          if (!updateHostGrid(grid, there ? moved.data() : points.data())) {
+            std::cerr << "The grid declined the update\n";
+            exit(1);
+          }
+        }, minTime, minRuns));
+      }
+    }
+  }
+
+  if (!output.empty()) writeJSON(output, label, results);
+  return 0;
+}
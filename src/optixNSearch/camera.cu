@@ -36,6 +36,30 @@ extern "C" {
 __constant__ Params params;
 }
 
+// in a periodic box, a query within |r| of a box face also searches from its
+// image across that face (and across the edges and corners between such
+// faces), which finds the points a ghost copy would have found. |images[0]|
+// is the query itself. no point is found twice as long as r <= half the box.
+static __forceinline__ __device__ unsigned int queryImages(float3 q, float r, float3* images)
+{
+    images[0] = q;
+    if (!params.periodic || (params.mode == NOTEST)) return 1;
+
+    float3 lo = params.boxMin;
+    float3 hi = params.boxMin + params.boxSize;
+    float3 shift = make_float3(0.0f);
+    if (q.x - lo.x < r) shift.x = params.boxSize.x; else if (hi.x - q.x < r) shift.x = -params.boxSize.x;
+    if (q.y - lo.y < r) shift.y = params.boxSize.y; else if (hi.y - q.y < r) shift.y = -params.boxSize.y;
+    if (q.z - lo.z < r) shift.z = params.boxSize.z; else if (hi.z - q.z < r) shift.z = -params.boxSize.z;
+
+    unsigned int n = 1;
+    for (unsigned int m = 1; m < 8; m++) {
+      if (((m & 1) && (shift.x == 0)) || ((m & 2) && (shift.y == 0)) || ((m & 4) && (shift.z == 0))) continue;
+      images[n++] = q + make_float3((m & 1) ? shift.x : 0, (m & 2) ? shift.y : 0, (m & 4) ? shift.z : 0);
+    }
+    return n;
+}
+
 extern "C" __global__ void __raygen__knn()
 {
     const uint3 idx = optixGetLaunchIndex();
@@ -75,25 +99,29 @@ extern "C" __global__ void __raygen__knn()
     unsigned int max_idx;
     unsigned int size = 0;
 
-    optixTrace(
-        params.handle,
-        ray_origin,
-        ray_direction,
-        tmin,
-        tmax,
-        0.0f,
-        OptixVisibilityMask( 1 ),
-        OPTIX_RAY_FLAG_NONE,
-        RAY_TYPE_RADIANCE,
-        1,
-        RAY_TYPE_RADIANCE,
-        reinterpret_cast<unsigned int&>(queryIdx),
-        u0, u1, // min_dists
-        u2, u3, // min_idxs
-        reinterpret_cast<unsigned int&>(max_key),
-        reinterpret_cast<unsigned int&>(max_idx),
-        reinterpret_cast<unsigned int&>(size)
-    );
+    float3 images[8];
+    unsigned int numImages = queryImages(ray_origin, params.radius, images);
+    for (unsigned int i = 0; i < numImages; i++) {
+      optixTrace(
+          params.handle,
+          images[i],
+          ray_direction,
+          tmin,
+          tmax,
+          0.0f,
+          OptixVisibilityMask( 1 ),
+          OPTIX_RAY_FLAG_NONE,
+          RAY_TYPE_RADIANCE,
+          1,
+          RAY_TYPE_RADIANCE,
+          reinterpret_cast<unsigned int&>(queryIdx),
+          u0, u1, // min_dists
+          u2, u3, // min_idxs
+          reinterpret_cast<unsigned int&>(max_key),
+          reinterpret_cast<unsigned int&>(max_idx),
+          reinterpret_cast<unsigned int&>(size)
+      );
+    }
 
     // write minK queue data to frame_buffer if is an actual search, i.e., not initial traversal
     if (params.mode == PRECISE) { // implies this is an actual search
@@ -126,21 +154,110 @@ extern "C" __global__ void __raygen__radius()
     const float tmin = 0.f;
     const float tmax = 1.e-16f;
 
-    optixTrace(
-        params.handle,
-        ray_origin,
-        ray_direction,
-        tmin,
-        tmax,
-        0.0f,
-        OptixVisibilityMask( 1 ),
-        OPTIX_RAY_FLAG_NONE,
-        //OPTIX_RAY_FLAG_DISABLE_ANYHIT |
-        //OPTIX_RAY_FLAG_DISABLE_CLOSESTHIT,
-        RAY_TYPE_RADIANCE,
-        1,
-        RAY_TYPE_RADIANCE,
-        reinterpret_cast<unsigned int&>(queryIdx),
-        reinterpret_cast<unsigned int&>(id)
-    );
+    float3 images[8];
+    unsigned int numImages = queryImages(ray_origin, params.radius, images);
+    for (unsigned int i = 0; (i < numImages) && (id < params.limit); i++) {
+      optixTrace(
+          params.handle,
+          images[i],
+          ray_direction,
+          tmin,
+          tmax,
+          0.0f,
+          OptixVisibilityMask( 1 ),
+          OPTIX_RAY_FLAG_NONE,
+          //OPTIX_RAY_FLAG_DISABLE_ANYHIT |
+          //OPTIX_RAY_FLAG_DISABLE_CLOSESTHIT,
+          RAY_TYPE_RADIANCE,
+          1,
+          RAY_TYPE_RADIANCE,
+          reinterpret_cast<unsigned int&>(queryIdx),
+          reinterpret_cast<unsigned int&>(id)
+      );
+    }
+}
+
+extern "C" __global__ void __raygen__count()
+{
+    const uint3 idx = optixGetLaunchIndex();
+    unsigned int rayIdx = idx.x;
+
+    unsigned int queryIdx;
+    if (params.d_r2q_map == nullptr)
+      queryIdx = rayIdx;
+    else
+      queryIdx = params.d_r2q_map[rayIdx];
+
+    float3 ray_origin = params.queries[queryIdx];
+    float3 ray_direction = normalize(make_float3(1, 0, 0));
+
+    // the IS program bumps |count| for every point in the sphere and never
+    // reports an intersection, so the traversal visits all candidates.
+    unsigned int count = 0;
+    const float tmin = 0.f;
+    const float tmax = 1.e-16f;
+
+    float3 images[8];
+    unsigned int numImages = queryImages(ray_origin, params.radius, images);
+    for (unsigned int i = 0; i < numImages; i++) {
+      optixTrace(
+          params.handle,
+          images[i],
+          ray_direction,
+          tmin,
+          tmax,
+          0.0f,
+          OptixVisibilityMask( 1 ),
+          OPTIX_RAY_FLAG_NONE,
+          RAY_TYPE_RADIANCE,
+          1,
+          RAY_TYPE_RADIANCE,
+          reinterpret_cast<unsigned int&>(queryIdx),
+          reinterpret_cast<unsigned int&>(count)
+      );
+    }
+
+    // in the initial traversal the IS program writes the first hit instead.
+    if (params.mode != NOTEST)
+      params.frame_buffer[queryIdx] = count;
+}
+
+extern "C" __global__ void __raygen__multi()
+{
+    const uint3 idx = optixGetLaunchIndex();
+    unsigned int rayIdx = idx.x;
+
+    unsigned int queryIdx;
+    if (params.d_r2q_map == nullptr)
+      queryIdx = rayIdx;
+    else
+      queryIdx = params.d_r2q_map[rayIdx];
+
+    float3 ray_origin = params.queries[queryIdx];
+    float3 ray_direction = normalize(make_float3(1, 0, 0));
+
+    // one neighbor count per radius; see |MAX_RADII|.
+    unsigned int c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    const float tmin = 0.f;
+    const float tmax = 1.e-16f;
+
+    float3 images[8];
+    unsigned int numImages = queryImages(ray_origin, params.radius, images);
+    for (unsigned int i = 0; i < numImages; i++) {
+      optixTrace(
+          params.handle,
+          images[i],
+          ray_direction,
+          tmin,
+          tmax,
+          0.0f,
+          OptixVisibilityMask( 1 ),
+          OPTIX_RAY_FLAG_NONE,
+          RAY_TYPE_RADIANCE,
+          1,
+          RAY_TYPE_RADIANCE,
+          reinterpret_cast<unsigned int&>(queryIdx),
+          c0, c1, c2, c3
+      );
+    }
 }
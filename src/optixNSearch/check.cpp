@@ -5,6 +5,7 @@
 #include <iterator>
 
 #include "state.h"
+#include "hostreduce.h"
 
 typedef std::pair<float, unsigned int> knn_res_t;
 class Compare
@@ -17,6 +18,18 @@ class Compare
 };
 typedef std::priority_queue<knn_res_t, std::vector<knn_res_t>, Compare> knn_queue;
 
+// |a - b|, as the minimum image in a periodic box.
+static float3 checkDiff( RTNNState& state, float3 a, float3 b ) {
+  if (state.periodic) return minImage(a - b, state.boxMax - state.boxMin);
+  return a - b;
+}
+
+// the search radius of query |q| in batch |batch_id|.
+static float checkRadius( RTNNState& state, int batch_id, unsigned int q ) {
+  if (state.h_actQRadius) return state.h_actQRadius[batch_id][q];
+  return state.gRadius;
+}
+
 void sanityCheckKNN( RTNNState& state, int batch_id ) {
   bool printRes = false;
   srand(time(NULL));
@@ -27,15 +40,16 @@ void sanityCheckKNN( RTNNState& state, int batch_id ) {
   for (unsigned int q = 0; q < state.numQueries; q++) {
     if (std::find(randQ.begin(), randQ.end(), q) == randQ.end()) continue;
     float3 query = state.h_queries[q];
+    float radius = checkRadius(state, batch_id, q);
 
     // generate ground truth res
     knn_queue topKQ;
     unsigned int size = 0;
     for (unsigned int p = 0; p < state.numPoints; p++) {
       float3 point = state.h_points[p];
-      float3 diff = query - point;
+      float3 diff = checkDiff(state, query, point);
       float dists = dot(diff, diff);
-      if ((dists > 0) && (dists < state.gRadius * state.gRadius)) {
+      if ((dists > 0) && (dists < radius * radius)) {
         knn_res_t res = std::make_pair(dists, p);
         if (size < state.knn) {
           topKQ.push(res);
@@ -66,7 +80,7 @@ void sanityCheckKNN( RTNNState& state, int batch_id ) {
       unsigned int p = static_cast<unsigned int*>( state.h_res[batch_id] )[ q * state.knn + n ];
       if (p == UINT_MAX) break;
       else {
-        float3 diff = state.h_points[p] - query;
+        float3 diff = checkDiff(state, state.h_points[p], query);
         float dists = dot(diff, diff);
         gpu_idxs.insert(p);
         gpu_dists.insert(sqrt(dists));
@@ -114,9 +128,10 @@ void sanityCheckRadius( RTNNState& state, int batch_id ) {
       if (p == UINT_MAX) break;
       else {
         totalNeighbors++;
-        float3 diff = state.h_points[p] - state.h_queries[q];
+        float3 diff = checkDiff(state, state.h_points[p], state.h_queries[q]);
         float dists = dot(diff, diff);
-        if (dists > state.gRadius * state.gRadius) {
+        float radius = checkRadius(state, batch_id, q);
+        if (dists > radius * radius) {
           fprintf(stdout, "Point %u [%f, %f, %f] is not a neighbor of query %u [%f, %f, %f]. Dist is %lf.\n",
             p, state.h_points[p].x, state.h_points[p].y, state.h_points[p].z,
             q, state.h_queries[q].x, state.h_queries[q].y, state.h_queries[q].z,
@@ -138,6 +153,199 @@ void sanityCheckRadius( RTNNState& state, int batch_id ) {
   if (totalWrongNeighbors != 0) std::cerr << "Avg wrong dist: " << totalWrongDist / totalWrongNeighbors << std::endl;
 }
 
+void sanityCheckHalfList( RTNNState& state, int batch_id ) {
+  // queries are the search points, so query q is point q. validate the half
+  // list against the full list: a reported pair (q, p) must have p > q and be
+  // in the full list of q, and for the sampled queries whose output isn't
+  // capped by K the half list must be exactly the part of the full list that
+  // has IDs larger than q.
+  srand(time(NULL));
+  std::vector<unsigned int> randQ {rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries};
+
+  unsigned int totalNeighbors = 0;
+  for (unsigned int q = 0; q < state.numQueries; q++) {
+    float3 query = state.h_queries[q];
+
+    std::unordered_set<unsigned int> half_idxs;
+    for (unsigned int n = 0; n < state.knn; n++) {
+      unsigned int p = static_cast<unsigned int*>( state.h_res[batch_id] )[ q * state.knn + n ];
+      if (p == UINT_MAX) break;
+
+      float3 diff = checkDiff(state, state.h_points[p], query);
+      float dists = dot(diff, diff);
+      if ((p <= q) || (dists > state.gRadius * state.gRadius)) {
+        fprintf(stdout, "Point %u [%f, %f, %f] shouldn't be in the half list of query %u [%f, %f, %f]. Dist is %lf.\n",
+          p, state.h_points[p].x, state.h_points[p].y, state.h_points[p].z,
+          q, query.x, query.y, query.z,
+          sqrt(dists));
+        exit(1);
+      }
+      half_idxs.insert(p);
+    }
+    totalNeighbors += half_idxs.size();
+
+    if (std::find(randQ.begin(), randQ.end(), q) == randQ.end()) continue;
+
+    // generate the full list and keep the part with larger IDs
+    knn_queue topKQ;
+    std::unordered_set<unsigned int> full_idxs;
+    for (unsigned int p = 0; p < state.numPoints; p++) {
+      float3 diff = checkDiff(state, query, state.h_points[p]);
+      float dists = dot(diff, diff);
+      if (dists >= state.gRadius * state.gRadius) continue;
+      if (state.searchMode == "knn") {
+        if ((p <= q) || (dists <= 0)) continue;
+        topKQ.push(std::make_pair(dists, p));
+        if (topKQ.size() > state.knn) topKQ.pop();
+      } else full_idxs.insert(p);
+    }
+
+    bool correct = true;
+    if (state.searchMode == "knn") {
+      // compare distances rather than IDs; see the TODO in |sanityCheckKNN|.
+      std::unordered_set<float> gt_dists, half_dists;
+      for (; !topKQ.empty(); topKQ.pop()) gt_dists.insert(sqrt(topKQ.top().first));
+      for (auto p : half_idxs) {
+        float3 diff = checkDiff(state, state.h_points[p], query);
+        half_dists.insert(sqrt(dot(diff, diff)));
+      }
+      correct = (gt_dists == half_dists);
+    } else {
+      unsigned int expected = 0;
+      for (auto p : full_idxs) {
+        if (p > q) expected++;
+        else if (half_idxs.count(p)) correct = false;
+      }
+      if (half_idxs.size() < state.knn) correct = correct && (half_idxs.size() == expected);
+    }
+
+    if (!correct) {
+      fprintf(stdout, "Incorrect half list of query [%u] %f, %f, %f\n", q, query.x, query.y, query.z);
+      exit(1);
+    }
+  }
+
+  std::cerr << "Half list sanity check done." << std::endl;
+  std::cerr << "Avg neighbor/query: " << (float)totalNeighbors/state.numQueries << std::endl;
+}
+
+void sanityCheckMultiRadius( RTNNState& state, int batch_id ) {
+  // every neighbor in list i must be within radius i. for the sampled
+  // queries, each list must be as long as the number of points within its
+  // radius, capped by its K.
+  srand(time(NULL));
+  std::vector<unsigned int> randQ {rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries};
+
+  unsigned int* res = static_cast<unsigned int*>( state.h_res[batch_id] );
+  for (unsigned int q = 0; q < state.numQueries; q++) {
+    float3 query = state.h_queries[q];
+    bool sampled = (std::find(randQ.begin(), randQ.end(), q) != randQ.end());
+
+    unsigned int offset = 0;
+    for (unsigned int i = 0; i < state.multiRadius.size(); i++) {
+      float r = state.multiRadius[i];
+      unsigned int size = 0;
+      for (; size < state.multiK[i]; size++) {
+        unsigned int p = res[q * state.knn + offset + size];
+        if (p == UINT_MAX) break;
+        float3 diff = checkDiff(state, state.h_points[p], query);
+        if ((dot(diff, diff) >= r * r) || (state.halfList && (p <= q))) {
+          fprintf(stdout, "Point %u isn't in the radius %f list of query %u.\n", p, r, q);
+          exit(1);
+        }
+      }
+
+      if (sampled) {
+        unsigned int expected = 0;
+        for (unsigned int p = 0; p < state.numPoints; p++) {
+          if (state.halfList && (p <= q)) continue;
+          float3 diff = checkDiff(state, query, state.h_points[p]);
+          if (dot(diff, diff) < r * r) expected++;
+        }
+        if (size != std::min(expected, state.multiK[i])) {
+          fprintf(stdout, "Query %u has %u neighbors within radius %f; expected %u.\n", q, size, r, std::min(expected, state.multiK[i]));
+          exit(1);
+        }
+      }
+      offset += state.multiK[i];
+    }
+  }
+
+  std::cerr << "Multi-radius sanity check done." << std::endl;
+}
+
+void sanityCheckCount( RTNNState& state, int batch_id ) {
+  // one count per query. brute-force the sampled queries; unlike radius
+  // search there is no K cap, so the counts must match exactly.
+  srand(time(NULL));
+  std::vector<unsigned int> randQ {rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries};
+
+  unsigned int* counts = static_cast<unsigned int*>( state.h_res[batch_id] );
+  double totalNeighbors = 0;
+  for (unsigned int q = 0; q < state.numQueries; q++) {
+    totalNeighbors += counts[q];
+    if (std::find(randQ.begin(), randQ.end(), q) == randQ.end()) continue;
+
+    float3 query = state.h_queries[q];
+    float radius = checkRadius(state, batch_id, q);
+    unsigned int expected = 0;
+    for (unsigned int p = 0; p < state.numPoints; p++) {
+      if (state.halfList && (p <= q)) continue;
+      float3 diff = checkDiff(state, query, state.h_points[p]);
+      if (dot(diff, diff) < radius * radius) expected++;
+    }
+
+    if (counts[q] != expected) {
+      fprintf(stdout, "Incorrect count of query [%u] %f, %f, %f: %u (expected %u)\n", q, query.x, query.y, query.z, counts[q], expected);
+      exit(1);
+    }
+  }
+
+  std::cerr << "Count sanity check done." << std::endl;
+  std::cerr << "Avg neighbor/query: " << totalNeighbors/state.numQueries << std::endl;
+}
+
+template <typename R>
+static typename R::value_t bruteForceReduce( RTNNState& state, float3 query, const R& reducer ) {
+  typename R::acc_t acc = reducer.init();
+  for (unsigned int p = 0; p < state.numPoints; p++) {
+    float3 diff = checkDiff(state, query, state.h_points[p]);
+    float dists = dot(diff, diff);
+    if (dists < state.gRadius * state.gRadius) reducer.update(acc, p, query - diff, dists);
+  }
+  return reducer.finalize(acc);
+}
+
+void sanityCheckReduce( RTNNState& state, int batch_id ) {
+  // the grid visits neighbors in a different order than the brute-force loop,
+  // so the float sums are compared with a relative tolerance.
+  srand(time(NULL));
+  std::vector<unsigned int> randQ {rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries, rand() % state.numQueries};
+  const float eps = 1e-4;
+
+  for (auto q : randQ) {
+    float3 query = state.h_queries[q];
+    float3 res, gt;
+    if (state.reduce == "density") {
+      res = make_float3(static_cast<float*>( state.h_res[batch_id] )[q]);
+      gt = make_float3(bruteForceReduce(state, query, SPHDensityReducer(state.radius)));
+    } else {
+      res = static_cast<float3*>( state.h_res[batch_id] )[q];
+      gt = bruteForceReduce(state, query, MeanPositionReducer());
+    }
+
+    float3 err = fmaxf(res - gt, gt - res);
+    float3 tol = eps * (fmaxf(gt, -gt) + 1.0f);
+    if ((err.x > tol.x) || (err.y > tol.y) || (err.z > tol.z)) {
+      fprintf(stdout, "Incorrect %s of query [%u] %f, %f, %f: (%f, %f, %f) vs. (%f, %f, %f)\n",
+        state.reduce.c_str(), q, query.x, query.y, query.z, res.x, res.y, res.z, gt.x, gt.y, gt.z);
+      exit(1);
+    }
+  }
+
+  std::cerr << "Reduce sanity check done." << std::endl;
+}
+
 void checkFilteredQueries(RTNNState& state) {
   // sanity check for filtered queries
   for (unsigned int q = 0; q < state.numFltQs; q++) {
@@ -157,6 +365,11 @@ void checkFilteredQueries(RTNNState& state) {
 }
 
 void sanityCheck(RTNNState& state) {
+  // the checks see one batch at a time as |h_queries|; restored at the end
+  // so that the cleanup can tell the caller's queries from the batches'.
+  float3* h_queries = state.h_queries;
+  unsigned int numQueries = state.numQueries;
+
   for (int i = 0; i < state.numOfBatches; i++) {
   //for (int i = 0; i < 1; i++) {
     state.numQueries = state.numActQueries[i];
@@ -165,9 +378,16 @@ void sanityCheck(RTNNState& state) {
     // for empty batches, skip sanity check.
     if (state.numQueries == 0) continue;
 
-    if (state.searchMode == "radius") sanityCheckRadius( state, i );
+    if (state.reduce != "none") sanityCheckReduce( state, i );
+    else if (!state.multiRadius.empty()) sanityCheckMultiRadius( state, i );
+    else if (state.searchMode == "count") sanityCheckCount( state, i );
+    else if (state.halfList) sanityCheckHalfList( state, i );
+    else if (state.searchMode == "radius") sanityCheckRadius( state, i );
     else sanityCheckKNN( state, i );
 
   }
   //checkFilteredQueries(state);
+
+  state.h_queries = h_queries;
+  state.numQueries = numQueries;
 }
@@ -0,0 +1,96 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "server.h"
+
+namespace rtnn {
+
+bool readFull(int fd, void* buf, size_t size) {
+  char* p = static_cast<char*>(buf);
+  while (size) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// a peer that has gone away fails the send with EPIPE; MSG_NOSIGNAL keeps it
+// from raising SIGPIPE, which would kill the process (e.g., the server).
+bool writeFull(int fd, const void* buf, size_t size) {
+  const char* p = static_cast<const char*>(buf);
+  while (size) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+Client::Client(const std::string& socketPath) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(addr.sun_path))
+    throw std::runtime_error("socket path too long: " + socketPath);
+  strcpy(addr.sun_path, socketPath.c_str());
+
+  m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_fd < 0) throw std::runtime_error(std::string("socket: ") + strerror(errno));
+  if (connect(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    std::string err = strerror(errno);
+    close(m_fd);
+    throw std::runtime_error("connect to " + socketPath + ": " + err);
+  }
+}
+
+Client::~Client() {
+  if (m_fd >= 0) close(m_fd);
+}
+
+NeighborList Client::query(const double3* queries, uint32_t numQueries, float radius, uint32_t k, bool knn) {
+  if (numQueries > kMaxRequestQueries) throw std::runtime_error("too many queries in one request");
+  RequestHeader req = {OP_QUERY, numQueries, radius, k, knn ? 1u : 0u};
+  uint64_t length = sizeof(req) + (uint64_t)numQueries * 3 * sizeof(double);
+  // double3 is three packed doubles, so the queries go out as they are.
+  static_assert(sizeof(double3) == 3 * sizeof(double), "double3 must be packed");
+  if (!writeFull(m_fd, &length, sizeof(length)) || !writeFull(m_fd, &req, sizeof(req)) ||
+      !writeFull(m_fd, queries, (size_t)numQueries * sizeof(double3)))
+    throw std::runtime_error("failed to send the request");
+
+  ResponseHeader res;
+  if (!readFull(m_fd, &length, sizeof(length)) || (length < sizeof(res)) || !readFull(m_fd, &res, sizeof(res)))
+    throw std::runtime_error("failed to receive the response");
+  if (res.status) {
+    std::string err(length - sizeof(res), '\0');
+    readFull(m_fd, &err[0], err.size());
+    throw std::runtime_error("server error: " + err);
+  }
+
+  NeighborList list;
+  list.offsets.resize((size_t)res.numQueries + 1);
+  list.ids.resize(res.numIds);
+  if ((length != sizeof(res) + (list.offsets.size() + list.ids.size()) * sizeof(uint32_t)) ||
+      !readFull(m_fd, list.offsets.data(), list.offsets.size() * sizeof(uint32_t)) ||
+      !readFull(m_fd, list.ids.data(), list.ids.size() * sizeof(uint32_t)))
+    throw std::runtime_error("malformed response");
+  return list;
+}
+
+void Client::shutdown() {
+  RequestHeader req = {OP_SHUTDOWN, 0, 0, 0, 0};
+  uint64_t length = sizeof(req);
+  if (!writeFull(m_fd, &length, sizeof(length)) || !writeFull(m_fd, &req, sizeof(req)))
+    throw std::runtime_error("failed to send the request");
+}
+
+} // namespace rtnn
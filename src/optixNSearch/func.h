@@ -10,6 +10,8 @@
 
 #include "state.h"
 #include "grid.h"
+#include "hostgrid.h"
+#include "memaccount.h"
 
 void sortByKey( thrust::device_ptr<float>, thrust::device_ptr<unsigned int>, unsigned int, cudaStream_t );
 void sortByKey( thrust::device_ptr<float>, thrust::device_ptr<unsigned int>, unsigned int );
@@ -18,6 +20,7 @@ void sortByKey( thrust::device_ptr<unsigned int>, thrust::device_ptr<unsigned in
 void sortByKey( thrust::device_vector<float>*, thrust::device_ptr<float3> );
 void sortByKey( thrust::device_ptr<float>, thrust::device_ptr<float3>, unsigned int );
 void sortByKey( thrust::device_ptr<unsigned int>, thrust::device_ptr<float3>, unsigned int );
+void sortByKey( thrust::device_ptr<unsigned int>, thrust::device_ptr<float>, unsigned int );
 void sortByKey( thrust::device_ptr<unsigned int>, thrust::device_ptr<int>, unsigned int );
 void gatherByKey ( thrust::device_vector<unsigned int>*, thrust::device_ptr<float3>, thrust::device_ptr<float3> );
 void gatherByKey ( thrust::device_vector<unsigned int>*, thrust::device_ptr<float3>, thrust::device_ptr<float3>, cudaStream_t );
@@ -25,6 +28,7 @@ void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_ptr<float3>,
 void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_ptr<float3>, thrust::device_ptr<float3>, unsigned int );
 void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_vector<float>*, thrust::device_ptr<float>, unsigned int, cudaStream_t );
 void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_vector<float>*, thrust::device_ptr<float>, unsigned int );
+void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_ptr<float>, thrust::device_ptr<float>, unsigned int, cudaStream_t );
 void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_ptr<float>, thrust::device_ptr<float>, unsigned int );
 void genSeqDevice(thrust::device_ptr<unsigned int>, unsigned int);
 void genSeqDevice(thrust::device_ptr<unsigned int>, unsigned int, cudaStream_t);
@@ -36,10 +40,13 @@ void copyIfIdMatch(float3*, unsigned int, thrust::device_ptr<int>, thrust::devic
 void copyIfInRange(float3*, unsigned int, thrust::device_ptr<float3>, thrust::device_ptr<float3>, float3, float3);
 void copyIfNotInRange(float3*, unsigned int, float3*, float3*, float3, float3);
 void copyIfIdInRange(float3*, unsigned int, thrust::device_ptr<int>, thrust::device_ptr<float3>, int, int);
+void copyIfIdInRange(float*, unsigned int, thrust::device_ptr<int>, thrust::device_ptr<float>, int, int);
+void copyIfIdInRange(unsigned int*, unsigned int, thrust::device_ptr<int>, thrust::device_ptr<unsigned int>, int, int);
 void copyIfNonZero(float3*, unsigned int, thrust::device_ptr<bool>, thrust::device_ptr<float3>);
 unsigned int countById(thrust::device_ptr<int>, unsigned int, int);
 unsigned int countIfInRange(thrust::device_ptr<float3>, unsigned int, float3, float3);
 unsigned int uniqueByKey(thrust::device_ptr<unsigned int>, unsigned int N, thrust::device_ptr<unsigned int> dest);
+unsigned int countUniq(thrust::device_ptr<unsigned int>, unsigned int, cudaStream_t);
 unsigned int countUniq(thrust::device_ptr<unsigned int>, unsigned int);
 void thrustCopyD2D(thrust::device_ptr<unsigned int>, thrust::device_ptr<unsigned int>, unsigned int N);
 unsigned int thrustGenHist(const thrust::device_ptr<int>, thrust::device_vector<unsigned int>&, unsigned int);
@@ -47,13 +54,14 @@ bool operator<=(float3, float3);
 bool operator>=(float3, float3);
 
 // take an unallocated thrust device pointer, allocate device memory and set the thrust pointer and return the raw pointer.
-// https://stackoverflow.com/questions/353180/how-do-i-find-the-name-of-the-calling-function/378165
-// https://gcc.gnu.org/onlinedocs/gcc/Other-Builtins.html
-// const char* str = __builtin_FUNCTION()
-template <typename T> T* allocThrustDevicePtr(thrust::device_ptr<T>* d_memory, unsigned int N, std::unordered_set<void*>* pSet=nullptr) {
+// memstatlib attributes the allocation to the caller by its call stack.
+// the allocation is accounted to |cat| (see |MemAccount|); free it with
+// |freeDevicePtr|.
+template <typename T> T* allocThrustDevicePtr(thrust::device_ptr<T>* d_memory, unsigned int N, std::unordered_set<void*>* pSet=nullptr, MemCategory cat=MEM_OTHER) {
   T* d_memory_raw;
   CUDA_CHECK( cudaMalloc(reinterpret_cast<void**>(&d_memory_raw),
              N * sizeof(T) ) );
+  MemAccount::add(cat, d_memory_raw, (size_t)N * sizeof(T));
   *d_memory = thrust::device_pointer_cast(d_memory_raw);
   if (pSet) {
      pSet->insert((void*)thrust::raw_pointer_cast(d_memory_raw));
@@ -62,6 +70,11 @@ template <typename T> T* allocThrustDevicePtr(thrust::device_ptr<T>* d_memory, u
   return d_memory_raw;
 }
 
+inline void freeDevicePtr(void* d_memory) {
+  MemAccount::release(d_memory);
+  CUDA_CHECK( cudaFree( d_memory ) );
+}
+
 void kComputeMinMax (unsigned int, unsigned int, float3*, unsigned int, int3*, int3*);
 void kInsertParticles(unsigned int, unsigned int, GridInfo, float3*, unsigned int*, unsigned int*, unsigned int*, bool);
 void kCountingSortIndices(unsigned int, unsigned int, GridInfo, unsigned int*, unsigned int*, unsigned int*, unsigned int*);
@@ -78,21 +91,14 @@ void kCalcSearchSize(unsigned int,
                      unsigned int,
                      int*
                     );
-void calcSearchSize(int3,
-                    GridInfo,
-                    bool, 
-                    unsigned int*,
-                    float,
-                    float,
-                    unsigned int,
-                    int*
-                   );
 float kGetWidthFromIter(int, float);
+void kAdjustRayMaskByRadius(unsigned int, unsigned int, int*, float*, unsigned int, float, float, bool, int);
 
 void sanityCheck(RTNNState&);
 
 void computeMinMax(unsigned, float3*, float3&, float3&);
 unsigned int genGridInfo(RTNNState&, unsigned int, GridInfo&);
+unsigned int genGridInfo(RTNNState&, unsigned int, float, GridInfo&, bool verbose = true);
 void gridSort(RTNNState&, unsigned int, float3*, float3*, bool, ParticleType);
 void sortParticles(RTNNState&, ParticleType, int);
 thrust::device_ptr<unsigned int> sortQueriesByFHCoord(RTNNState&, thrust::device_ptr<unsigned int>, int);
@@ -102,21 +108,56 @@ void gatherQueries(RTNNState&, thrust::device_ptr<unsigned int>, int);
 void kGenAABB(float3*, float, unsigned int, OptixAabb*, cudaStream_t);
 void uploadData(RTNNState&);
 void createGeometry(RTNNState&, int, float);
-void launchSubframe(unsigned int*, RTNNState&, int);
+void launchSubframe(unsigned int*, RTNNState&, int, unsigned int, unsigned int);
 void initLaunchParams(RTNNState&);
 void setupOptiX(RTNNState&);
 void cleanupState(RTNNState&);
 float maxInscribedWidth(float, int);
 float minCircumscribedRadius(float, int);
 float radiusEquiVolume(float, int);
+float radiusFromMegacell(float, int);
+void prepBatches(RTNNState&, std::vector<int>&, const thrust::host_vector<unsigned int>&);
 
 int tokenize(std::string, std::string, float3**, unsigned int);
+float3** read_pc_data(const char*, unsigned int*, int*);
+float3* read_pc_data(const char*, unsigned int*);
+double3* read_pc_data_double(const char*, unsigned int*);
+float* read_radius_data(const char*, unsigned int*);
 void parseArgs(RTNNState&, int, char**);
 void readData(RTNNState&);
+unsigned int calcChunkQueries(RTNNState&);
+bool estimateMemory(RTNNState&, MemPlan&);
+float memFootprint(RTNNState&, float, int, float);
+float fitCellSize(RTNNState&, float, float, int, float, bool stepwise = false);
+float calcCRRatio(RTNNState&);
 void initBatches(RTNNState&);
 bool isClose(float3, float3);
 void freeGridPointers(RTNNState&);
 
+void computeMinMaxHost(unsigned int, float3*, float3&, float3&);
+void growBounds(const double3*, unsigned int, double3&, double3&);
+void toLocal(const double3*, unsigned int, double3, float3*);
+void setupHost(RTNNState&);
+void buildHostGrid(RTNNState&, HostGrid&);
+bool updateHostGrid(HostGrid&, const float3*);
+bool insertHostGrid(HostGrid&, const float3*, unsigned int, unsigned int);
+void eraseHostGrid(HostGrid&, const unsigned int*, unsigned int);
+void benchmarkHostUpdate(RTNNState&);
+void searchHostGrid(RTNNState&, const HostGrid&, unsigned int*);
+void searchHost(RTNNState&);
+void reduceHost(RTNNState&);
+void cleanupHost(RTNNState&);
+void serveHost(RTNNState&);
+void setDevice(RTNNState&);
+void runHost(RTNNState&);
+void runOptiX(RTNNState&);
+void runSweep(RTNNState&);
+ResultSink* createSink(RTNNState&);
+void autoTune(RTNNState&);
+bool planMemory(RTNNState&);
+float planCategories(RTNNState&, const MemPlan&, bool, float*, int&, int&, unsigned int&);
+void setPlannedMemory(RTNNState&);
+
 void search(RTNNState&, int);
 void gasSortSearch(RTNNState&, int);
 thrust::device_ptr<unsigned int> initialTraversal(RTNNState&);
@@ -41,6 +41,11 @@ extern "C" __device__ bool check_intersect(SearchType mode)
   const float3 center = params.points[primIdx];
   const float3 ray_orig = optixGetWorldRayOrigin();
 
+  // with per-query radii, |params.radius| is the launch radius of the batch
+  // and the query's own radius further bounds the search.
+  float qRadius = params.radius;
+  if (params.queryRadius) qRadius = params.queryRadius[optixGetPayload_0()];
+
   bool intersect = false;
   if (mode == AABBTEST) {
     float3 topRight = center + params.radius;
@@ -48,6 +53,11 @@ extern "C" __device__ bool check_intersect(SearchType mode)
     if ((ray_orig > bottomLeft) && (ray_orig < topRight))
       intersect = true;
 
+    if (params.queryRadius) {
+      float3 O = ray_orig - center;
+      intersect = intersect && (dot(O, O) < qRadius * qRadius);
+    }
+
     //unsigned int queryIdx = optixGetPayload_0();
     //if (primIdx == 1269439 && queryIdx == 16702) {
     //  printf("ray: %f, %f, %f\n", ray_orig.x, ray_orig.y, ray_orig.z);
@@ -62,7 +72,8 @@ extern "C" __device__ bool check_intersect(SearchType mode)
     float sqdist = dot(O, O);
 
     // first check excludes the query itself; same as (ray_orig != center)
-    if (sqdist < params.radius * params.radius)
+    float r = fminf(params.radius, qRadius);
+    if (sqdist < r * r)
       intersect = true;
   }
 
@@ -76,9 +87,10 @@ extern "C" __device__ void write_res_radius()
     unsigned int queryIdx = optixGetPayload_0();
     unsigned int primIdx = optixGetPrimitiveIndex();
     params.frame_buffer[queryIdx * params.limit + id] = primIdx;
+    // always bump the id, so that the raygen knows when the output is full.
+    optixSetPayload_1( id+1 );
     if (id + 1 == params.limit)
       optixReportIntersection( 0, 0 );
-    else optixSetPayload_1( id+1 );
   }
 }
 
@@ -98,6 +110,10 @@ extern "C" __global__ void __intersection__sphere_radius()
     // possible that the point is just outside of the bbox and just intersects
     // with the bbox.
 
+    // in half-list mode queries and points are the same data, so each
+    // unordered pair is only reported by the query with the smaller ID.
+    if (params.halfList && (optixGetPrimitiveIndex() <= optixGetPayload_0() + params.queryOffset)) return;
+
     bool intersect = check_intersect(mode);
     if (intersect) {
       write_res_radius();
@@ -105,6 +121,81 @@ extern "C" __global__ void __intersection__sphere_radius()
   }
 }
 
+extern "C" __global__ void __intersection__sphere_count()
+{
+  SearchType mode = params.mode;
+
+  if (mode == NOTEST) {
+    // initial traversal for GAS sorting; |limit| is 1 so only the first hit
+    // is written, same as in radius search.
+    write_res_radius();
+  } else {
+    if (params.halfList && (optixGetPrimitiveIndex() <= optixGetPayload_0() + params.queryOffset)) return;
+
+    // only the per-query count lives in the payload; nothing is written to
+    // the frame_buffer here and the intersection is never reported, so there
+    // is no K cap.
+    if (check_intersect(mode))
+      optixSetPayload_1( optixGetPayload_1() + 1 );
+  }
+}
+
+extern "C" __device__ unsigned int getMultiCount(unsigned int i)
+{
+  switch (i) {
+    case 0: return optixGetPayload_1();
+    case 1: return optixGetPayload_2();
+    case 2: return optixGetPayload_3();
+    default: return optixGetPayload_4();
+  }
+}
+
+extern "C" __device__ void setMultiCount(unsigned int i, unsigned int count)
+{
+  switch (i) {
+    case 0: optixSetPayload_1(count); break;
+    case 1: optixSetPayload_2(count); break;
+    case 2: optixSetPayload_3(count); break;
+    default: optixSetPayload_4(count); break;
+  }
+}
+
+extern "C" __global__ void __intersection__sphere_multi()
+{
+  SearchType mode = params.mode;
+
+  if (mode == NOTEST) {
+    // initial traversal; the first count doubles as the id, and |limit| is 1.
+    write_res_radius();
+    return;
+  }
+
+  unsigned int queryIdx = optixGetPayload_0();
+  unsigned int primIdx = optixGetPrimitiveIndex();
+  if (params.halfList && (primIdx <= queryIdx + params.queryOffset)) return;
+
+  const float3 center = params.points[primIdx];
+  const float3 ray_orig = optixGetWorldRayOrigin();
+  float3 O = ray_orig - center;
+  float sqdist = dot(O, O);
+
+  // the traversal is at the largest radius; bin the point into the list of
+  // every radius that contains it, and stop once all lists are full.
+  bool full = true;
+  for (unsigned int i = 0; i < params.numRadii; i++) {
+    unsigned int id = getMultiCount(i);
+    if (id == params.multiK[i]) continue;
+
+    if (sqdist < params.multiRadius[i] * params.multiRadius[i]) {
+      params.frame_buffer[queryIdx * params.limit + params.multiOffset[i] + id] = primIdx;
+      setMultiCount(i, ++id);
+    }
+    if (id < params.multiK[i]) full = false;
+  }
+
+  if (full) optixReportIntersection( 0, 0 );
+}
+
 extern "C" __device__ void insertTopKQ(float key, unsigned int val)
 {
   const unsigned int u0 = optixGetPayload_1();
@@ -168,6 +259,9 @@ extern "C" __global__ void __intersection__sphere_knn()
     params.frame_buffer[queryIdx * params.limit] = primIdx;
     optixReportIntersection( 0, 0 );
   } else {
+    // in half-list mode only neighbors with a larger ID than the query count.
+    if (params.halfList && (primIdx <= queryIdx + params.queryOffset)) return;
+
     const float3 center = params.points[primIdx];
     const float3 ray_orig = optixGetWorldRayOrigin();
     float3 O = ray_orig - center;
@@ -184,7 +278,9 @@ extern "C" __global__ void __intersection__sphere_knn()
     // being in the optimized AABB doesn't mean it's in target sphere. this
     // checking against the optimized sphere is to make sure a point is also in
     // the target sphere.
-    if ((sqdist > 0) && (sqdist < params.radius * params.radius)) {
+    float r = params.radius;
+    if (params.queryRadius) r = fminf(r, params.queryRadius[queryIdx]);
+    if ((sqdist > 0) && (sqdist < r * r)) {
       insertTopKQ(sqdist, primIdx);
     }
   }
@@ -3,213 +3,11 @@
 
 #include <sutil/vec_math.h>
 
-#include "helper_mortonCode.h"
-#include "helper_linearIndex.h"
 #include "grid.h"
 
 #include <stdio.h>
 
 /* GPU code */
-inline __host__ __device__ uint ToCellIndex_MortonMetaGrid(const GridInfo &GridInfo, int3 gridCell)
-{
-  //int3 temp = gridCell;
-
-  int3 metaGridCell = make_int3(
-    gridCell.x / GridInfo.meta_grid_dim,
-    gridCell.y / GridInfo.meta_grid_dim,
-    gridCell.z / GridInfo.meta_grid_dim);
-
-  gridCell.x %= GridInfo.meta_grid_dim;
-  gridCell.y %= GridInfo.meta_grid_dim;
-  gridCell.z %= GridInfo.meta_grid_dim;
-  uint metaGridIndex = CellIndicesToLinearIndex(GridInfo.MetaGridDimension, metaGridCell);
-
-  //if (temp.x == 283 && temp.y == 10 && temp.z == 418)
-  //  printf("(%d, %d, %d), (%d, %d, %d), %u, %u, %u\n", metaGridCell.x, metaGridCell.y, metaGridCell.z, gridCell.x, gridCell.y, gridCell.z, metaGridIndex, metaGridIndex * GridInfo.meta_grid_size, MortonCode3(gridCell.x, gridCell.y, gridCell.z));
-
-  return metaGridIndex * GridInfo.meta_grid_size + MortonCode3(gridCell.x, gridCell.y, gridCell.z);
-}
-
-inline __host__ __device__
-float getWidthFromIter(int iter, float cellSize) {
-  // to be absolutely certain, we add 2 (not 1) to iter to accommodate points
-  // at the edges of the central cell. width means there are K points within
-  // the width^3 AABB, whose center is the center point of the current cell.
-  // for corner points in the cell, its width^3 AABB might have less than count
-  // # of points if the point distrition becomes dramatically sparse outside of
-  // the current AABB. we empirically observe no issue with >1M points, but
-  // with about ~100K points this could be an issue.
-
-  return (iter * 2 + 2) * cellSize;
-}
-
-inline __host__ __device__
-unsigned int getCellIdx(GridInfo gridInfo, int ix, int iy, int iz, bool morton) {
-  if (morton) // z-order sort
-    return ToCellIndex_MortonMetaGrid(gridInfo, make_int3(ix, iy, iz));
-  else // raster order
-    return (ix * gridInfo.GridDimension.y + iy) * gridInfo.GridDimension.z + iz;
-}
-
-inline __host__ __device__
-bool oob(GridInfo gridInfo, int ix, int iy, int iz) {
-  if (ix < 0 || ix >= (int)gridInfo.GridDimension.x
-   || iy < 0 || iy >= (int)gridInfo.GridDimension.y
-   || iz < 0 || iz >= (int)gridInfo.GridDimension.z)
-    return true;
-  else return false;
-}
-
-inline __host__ __device__
-void addCount(unsigned int& count, unsigned int* CellParticleCounts, GridInfo gridInfo, int ix, int iy, int iz, bool morton) {
-    if (oob(gridInfo, ix, iy, iz)) return;
-
-    // TODO: weird bug using nvcc V10.0.130, Driver Version: 470.42.01, and CUDA Version: 11.4
-    // (https://forums.developer.nvidia.com/t/weird-bug-involving-the-way-to-pass-parameters-to-kernels/183890)
-    // that the returned result from getCellIdx is incorrect.
-    // Fixed when using nvcc 11.3/.4, which, however, doesn't compile with thrust v101201. manually downgrading thrust.
-
-    //unsigned int iCellIdx = getCellIdx(gridInfo, ix, iy, iz, morton);
-    int3 cell = make_int3(ix, iy, iz);
-    unsigned int iCellIdx;
-    if (morton)
-      iCellIdx = ToCellIndex_MortonMetaGrid(gridInfo, cell);
-    else
-      iCellIdx = (cell.x * gridInfo.GridDimension.y + cell.y) * gridInfo.GridDimension.z + cell.z;
-
-    count += CellParticleCounts[iCellIdx];
-    //if (ix == 87 && iy == 22 && iz == 358) printf("[%d, %d, %d]\n", ix, iy, iz, iCellIdx);
-}
-
-__host__ __device__
-void calcSearchSize(int3 gridCell,
-                    GridInfo gridInfo,
-                    bool morton, 
-                    unsigned int* CellParticleCounts,
-                    float cellSize,
-                    float maxWidth,
-                    unsigned int knn,
-                    int* cellMask
-                   ) {
-  // important that x/y/z are ints not units, as we check oob when they become negative.
-  int x = gridCell.x;
-  int y = gridCell.y;
-  int z = gridCell.z;
-
-  // TODO: weird bug using nvcc V10.0.130, Driver Version: 470.42.01, and CUDA Version: 11.4
-  // (https://forums.developer.nvidia.com/t/weird-bug-involving-the-way-to-pass-parameters-to-kernels/183890)
-  // that the returned result from getCellIdx is incorrect.
-  // Fixed when using nvcc 11.3/.4, which, however, doesn't compile with thrust v101201. manually downgrading thrust.
-
-  //unsigned int cellIndex = getCellIdx(gridInfo, x, y, z, morton);
-  unsigned int cellIndex;
-  if (morton)
-    cellIndex = ToCellIndex_MortonMetaGrid(gridInfo, gridCell);
-  else
-    cellIndex = (gridCell.x * gridInfo.GridDimension.y + gridCell.y) * gridInfo.GridDimension.z + gridCell.z;
-
-
-  //if (x == 283 && y == 10 && z == 418) printf("cell %d has %d particles. morton? %d\n", cellIndex, CellParticleCounts[cellIndex], morton);
-  //assert(cellIndex <= numberOfCells);
-  //if (CellParticleCounts[cellIndex] == 0) return; // should never hit this.
-
-  int iter = 0;
-  unsigned int count = 0;
-  addCount(count, CellParticleCounts, gridInfo, x, y, z, morton);
-
-  int xmin = x;
-  int xmax = x;
-  int ymin = y;
-  int ymax = y;
-  int zmin = z;
-  int zmax = z;
- 
-  while(1) {
-    // TODO: there could be corner cases here, e.g., maxWidth is very
-    // small, cellSize will be 0 (same as uninitialized).
-    // TODO: another optimization we can do is what if a query is so far away
-    // from the search points? right now those queries will fall into the last
-    // batch and searched using the search radius. how can we skip searches for
-    // them altogether by doing something here? for that we need a different
-    // maxWidth that encloses the search sphere.
-    float width = getWidthFromIter(iter, cellSize);
- 
-    if (width > maxWidth) {
-      cellMask[cellIndex] = iter;
-      break;
-    }
-    else if (count >= (knn + 1)) {
-      // + 1 because the count in CellParticleCounts includes the point
-      // itself whereas our KNN search isn't going to return itself!
-      cellMask[cellIndex] = iter;
-      break;
-    }
-    else {
-      iter++;
-    }
- 
-    int ix, iy, iz;
- 
-    iz = zmin - 1;
-    for (ix = xmin; ix <= xmax; ix++) {
-      for (iy = ymin; iy <= ymax; iy++) {
-        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
-      }
-    }
- 
-    iz = zmax + 1;
-    for (ix = xmin; ix <= xmax; ix++) {
-      for (iy = ymin; iy <= ymax; iy++) {
-        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
-      }
-    }
-
-    ix = xmin - 1;
-    for (iy = ymin; iy <= ymax; iy++) {
-      for (iz = zmin; iz <= zmax; iz++) {
-        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
-      }
-    }
-
-    ix = xmax + 1;
-    for (iy = ymin; iy <= ymax; iy++) {
-      for (iz = zmin; iz <= zmax; iz++) {
-        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
-      }
-    }
- 
-    iy = ymin - 1;
-    for (ix = xmin; ix <= xmax; ix++) {
-      for (iz = zmin; iz <= zmax; iz++) {
-        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
-      }
-    }
- 
-    iy = ymax + 1;
-    for (ix = xmin; ix <= xmax; ix++) {
-      for (iz = zmin; iz <= zmax; iz++) {
-        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
-      }
-    }
- 
-    xmin--;
-    xmax++;
-    ymin--;
-    ymax++;
-    zmin--;
-    zmax++;
- 
-    addCount(count, CellParticleCounts, gridInfo, xmin, ymin, zmin, morton);
-    addCount(count, CellParticleCounts, gridInfo, xmin, ymin, zmax, morton);
-    addCount(count, CellParticleCounts, gridInfo, xmin, ymax, zmin, morton);
-    addCount(count, CellParticleCounts, gridInfo, xmin, ymax, zmax, morton);
-    addCount(count, CellParticleCounts, gridInfo, xmax, ymin, zmin, morton);
-    addCount(count, CellParticleCounts, gridInfo, xmax, ymin, zmax, morton);
-    addCount(count, CellParticleCounts, gridInfo, xmax, ymax, zmin, morton);
-    addCount(count, CellParticleCounts, gridInfo, xmax, ymax, zmax, morton);
-  }
-}
-
 __global__ void kComputeMinMax(
   const float3 *particles,
   unsigned int particleCount,
@@ -351,6 +149,35 @@ __global__ void kCountingSortIndices_setRayMask(
   //printf("%u, %u, %u, %u, %u\n", particleIndex, gridCellIndex, localSortedIndices[particleIndex], cellOffsets[gridCellIndex], sortIndex);
 }
 
+__global__ void kAdjustRayMaskByRadius(int* rayMask,
+                                       const float* qRadius,
+                                       unsigned int N,
+                                       float cellSize,
+                                       float radiusPerWidth,
+                                       bool inscribed,
+                                       int maxMask
+                                      )
+{
+  uint particleIndex = blockIdx.x * blockDim.x + threadIdx.x;
+  if (particleIndex >= N) return;
+
+  float r = qRadius[particleIndex];
+
+  // the smallest mask whose launch radius (|radiusPerWidth| * width) covers
+  // the query's own sphere; the query gets its complete result in that batch.
+  int radiusMask = max(0, (int)ceilf((r / (radiusPerWidth * cellSize) - 2) / 2));
+  while (getWidthFromIter(radiusMask, cellSize) * radiusPerWidth < r) radiusMask++;
+
+  // the density mask guarantees K points in the AABB of the mask's width. in
+  // radius search those points are reported without a distance test against
+  // the launch radius, so the AABB must also be inside the query's sphere.
+  int densityMask = rayMask[particleIndex];
+  if (inscribed && (getWidthFromIter(densityMask, cellSize) * sqrtf(3.0f) / 2 > r))
+    densityMask = maxMask;
+
+  rayMask[particleIndex] = min(min(densityMask, radiusMask), maxMask);
+}
+
 __global__ void kGenCellMask(GridInfo gridInfo,
                              bool morton, 
                              unsigned int* cellParticleCounts,
@@ -478,6 +305,27 @@ void kCalcSearchSize(unsigned int numOfBlocks,
             );
 }
 
+void kAdjustRayMaskByRadius(unsigned int numOfBlocks,
+                            unsigned int threadsPerBlock,
+                            int* rayMask,
+                            float* qRadius,
+                            unsigned int N,
+                            float cellSize,
+                            float radiusPerWidth,
+                            bool inscribed,
+                            int maxMask
+                           ) {
+  kAdjustRayMaskByRadius <<<numOfBlocks, threadsPerBlock>>> (
+             rayMask,
+             qRadius,
+             N,
+             cellSize,
+             radiusPerWidth,
+             inscribed,
+             maxMask
+            );
+}
+
 float kGetWidthFromIter(int iter, float cellSize) {
   return getWidthFromIter(iter, cellSize);
 }
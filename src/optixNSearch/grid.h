@@ -1,5 +1,12 @@
 #pragma once
 
+#include <cuda_runtime.h>
+#include <vector_types.h>
+#include <sutil/vec_math.h>
+
+#include "helper_mortonCode.h"
+#include "helper_linearIndex.h"
+
 struct GridInfo
 {
   float3 GridMin;
@@ -9,4 +16,238 @@ struct GridInfo
   uint3 MetaGridDimension;
   unsigned int meta_grid_dim;
   unsigned int meta_grid_size;
+  // in a periodic box, the number of cells that tile the box along each
+  // axis; cell coordinates wrap around at these. all 0 if not periodic.
+  uint3 PeriodicDimension;
 };
+
+inline __host__ __device__
+int wrapCell(int i, unsigned int n) {
+  int m = i % (int)n;
+  return (m < 0) ? m + (int)n : m;
+}
+
+// the minimum image of the displacement |d| in a periodic box.
+inline __host__ __device__
+float3 minImage(float3 d, float3 boxSize) {
+  return d - boxSize * make_float3(rintf(d.x / boxSize.x), rintf(d.y / boxSize.y), rintf(d.z / boxSize.z));
+}
+
+// map |p| into [boxMin, boxMin + boxSize).
+inline __host__ __device__
+float3 wrapIntoBox(float3 p, float3 boxMin, float3 boxSize) {
+  float3 o = p - boxMin;
+  o = o - boxSize * make_float3(floorf(o.x / boxSize.x), floorf(o.y / boxSize.y), floorf(o.z / boxSize.z));
+  return boxMin + o;
+}
+
+inline __host__ __device__ uint ToCellIndex_MortonMetaGrid(const GridInfo &GridInfo, int3 gridCell)
+{
+  //int3 temp = gridCell;
+
+  int3 metaGridCell = make_int3(
+    gridCell.x / GridInfo.meta_grid_dim,
+    gridCell.y / GridInfo.meta_grid_dim,
+    gridCell.z / GridInfo.meta_grid_dim);
+
+  gridCell.x %= GridInfo.meta_grid_dim;
+  gridCell.y %= GridInfo.meta_grid_dim;
+  gridCell.z %= GridInfo.meta_grid_dim;
+  uint metaGridIndex = CellIndicesToLinearIndex(GridInfo.MetaGridDimension, metaGridCell);
+
+  //if (temp.x == 283 && temp.y == 10 && temp.z == 418)
+  //  printf("(%d, %d, %d), (%d, %d, %d), %u, %u, %u\n", metaGridCell.x, metaGridCell.y, metaGridCell.z, gridCell.x, gridCell.y, gridCell.z, metaGridIndex, metaGridIndex * GridInfo.meta_grid_size, MortonCode3(gridCell.x, gridCell.y, gridCell.z));
+
+  return metaGridIndex * GridInfo.meta_grid_size + MortonCode3(gridCell.x, gridCell.y, gridCell.z);
+}
+
+inline __host__ __device__
+unsigned int getCellIdx(GridInfo gridInfo, int ix, int iy, int iz, bool morton) {
+  if (morton) // z-order sort
+    return ToCellIndex_MortonMetaGrid(gridInfo, make_int3(ix, iy, iz));
+  else // raster order
+    return (ix * gridInfo.GridDimension.y + iy) * gridInfo.GridDimension.z + iz;
+}
+
+// in a periodic grid nothing is out of bound: the coordinates are wrapped
+// in place into the box.
+inline __host__ __device__
+bool oob(GridInfo gridInfo, int& ix, int& iy, int& iz) {
+  if (gridInfo.PeriodicDimension.x) {
+    ix = wrapCell(ix, gridInfo.PeriodicDimension.x);
+    iy = wrapCell(iy, gridInfo.PeriodicDimension.y);
+    iz = wrapCell(iz, gridInfo.PeriodicDimension.z);
+    return false;
+  }
+
+  if (ix < 0 || ix >= (int)gridInfo.GridDimension.x
+   || iy < 0 || iy >= (int)gridInfo.GridDimension.y
+   || iz < 0 || iz >= (int)gridInfo.GridDimension.z)
+    return true;
+  else return false;
+}
+
+// query partitioning; |calcSearchSize| is shared by |kCalcSearchSize| and the
+// host (see |genCellMask|).
+inline __host__ __device__
+float getWidthFromIter(int iter, float cellSize) {
+  // to be absolutely certain, we add 2 (not 1) to iter to accommodate points
+  // at the edges of the central cell. width means there are K points within
+  // the width^3 AABB, whose center is the center point of the current cell.
+  // for corner points in the cell, its width^3 AABB might have less than count
+  // # of points if the point distrition becomes dramatically sparse outside of
+  // the current AABB. we empirically observe no issue with >1M points, but
+  // with about ~100K points this could be an issue.
+
+  return (iter * 2 + 2) * cellSize;
+}
+
+inline __host__ __device__
+void addCount(unsigned int& count, unsigned int* CellParticleCounts, GridInfo gridInfo, int ix, int iy, int iz, bool morton) {
+    if (oob(gridInfo, ix, iy, iz)) return;
+
+    // TODO: weird bug using nvcc V10.0.130, Driver Version: 470.42.01, and CUDA Version: 11.4
+    // (https://forums.developer.nvidia.com/t/weird-bug-involving-the-way-to-pass-parameters-to-kernels/183890)
+    // that the returned result from getCellIdx is incorrect.
+    // Fixed when using nvcc 11.3/.4, which, however, doesn't compile with thrust v101201. manually downgrading thrust.
+
+    //unsigned int iCellIdx = getCellIdx(gridInfo, ix, iy, iz, morton);
+    int3 cell = make_int3(ix, iy, iz);
+    unsigned int iCellIdx;
+    if (morton)
+      iCellIdx = ToCellIndex_MortonMetaGrid(gridInfo, cell);
+    else
+      iCellIdx = (cell.x * gridInfo.GridDimension.y + cell.y) * gridInfo.GridDimension.z + cell.z;
+
+    count += CellParticleCounts[iCellIdx];
+    //if (ix == 87 && iy == 22 && iz == 358) printf("[%d, %d, %d]\n", ix, iy, iz, iCellIdx);
+}
+
+inline __host__ __device__
+void calcSearchSize(int3 gridCell,
+                    GridInfo gridInfo,
+                    bool morton, 
+                    unsigned int* CellParticleCounts,
+                    float cellSize,
+                    float maxWidth,
+                    unsigned int knn,
+                    int* cellMask
+                   ) {
+  // important that x/y/z are ints not units, as we check oob when they become negative.
+  int x = gridCell.x;
+  int y = gridCell.y;
+  int z = gridCell.z;
+
+  // TODO: weird bug using nvcc V10.0.130, Driver Version: 470.42.01, and CUDA Version: 11.4
+  // (https://forums.developer.nvidia.com/t/weird-bug-involving-the-way-to-pass-parameters-to-kernels/183890)
+  // that the returned result from getCellIdx is incorrect.
+  // Fixed when using nvcc 11.3/.4, which, however, doesn't compile with thrust v101201. manually downgrading thrust.
+
+  //unsigned int cellIndex = getCellIdx(gridInfo, x, y, z, morton);
+  unsigned int cellIndex;
+  if (morton)
+    cellIndex = ToCellIndex_MortonMetaGrid(gridInfo, gridCell);
+  else
+    cellIndex = (gridCell.x * gridInfo.GridDimension.y + gridCell.y) * gridInfo.GridDimension.z + gridCell.z;
+
+
+  //if (x == 283 && y == 10 && z == 418) printf("cell %d has %d particles. morton? %d\n", cellIndex, CellParticleCounts[cellIndex], morton);
+  //assert(cellIndex <= numberOfCells);
+  //if (CellParticleCounts[cellIndex] == 0) return; // should never hit this.
+
+  int iter = 0;
+  unsigned int count = 0;
+  addCount(count, CellParticleCounts, gridInfo, x, y, z, morton);
+
+  int xmin = x;
+  int xmax = x;
+  int ymin = y;
+  int ymax = y;
+  int zmin = z;
+  int zmax = z;
+ 
+  while(1) {
+    // TODO: there could be corner cases here, e.g., maxWidth is very
+    // small, cellSize will be 0 (same as uninitialized).
+    // TODO: another optimization we can do is what if a query is so far away
+    // from the search points? right now those queries will fall into the last
+    // batch and searched using the search radius. how can we skip searches for
+    // them altogether by doing something here? for that we need a different
+    // maxWidth that encloses the search sphere.
+    float width = getWidthFromIter(iter, cellSize);
+ 
+    if (width > maxWidth) {
+      cellMask[cellIndex] = iter;
+      break;
+    }
+    else if (count >= (knn + 1)) {
+      // + 1 because the count in CellParticleCounts includes the point
+      // itself whereas our KNN search isn't going to return itself!
+      cellMask[cellIndex] = iter;
+      break;
+    }
+    else {
+      iter++;
+    }
+ 
+    int ix, iy, iz;
+ 
+    iz = zmin - 1;
+    for (ix = xmin; ix <= xmax; ix++) {
+      for (iy = ymin; iy <= ymax; iy++) {
+        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+      }
+    }
+ 
+    iz = zmax + 1;
+    for (ix = xmin; ix <= xmax; ix++) {
+      for (iy = ymin; iy <= ymax; iy++) {
+        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+      }
+    }
+
+    ix = xmin - 1;
+    for (iy = ymin; iy <= ymax; iy++) {
+      for (iz = zmin; iz <= zmax; iz++) {
+        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+      }
+    }
+
+    ix = xmax + 1;
+    for (iy = ymin; iy <= ymax; iy++) {
+      for (iz = zmin; iz <= zmax; iz++) {
+        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+      }
+    }
+ 
+    iy = ymin - 1;
+    for (ix = xmin; ix <= xmax; ix++) {
+      for (iz = zmin; iz <= zmax; iz++) {
+        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+      }
+    }
+ 
+    iy = ymax + 1;
+    for (ix = xmin; ix <= xmax; ix++) {
+      for (iz = zmin; iz <= zmax; iz++) {
+        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+      }
+    }
+ 
+    xmin--;
+    xmax++;
+    ymin--;
+    ymax++;
+    zmin--;
+    zmax++;
+ 
+    addCount(count, CellParticleCounts, gridInfo, xmin, ymin, zmin, morton);
+    addCount(count, CellParticleCounts, gridInfo, xmin, ymin, zmax, morton);
+    addCount(count, CellParticleCounts, gridInfo, xmin, ymax, zmin, morton);
+    addCount(count, CellParticleCounts, gridInfo, xmin, ymax, zmax, morton);
+    addCount(count, CellParticleCounts, gridInfo, xmax, ymin, zmin, morton);
+    addCount(count, CellParticleCounts, gridInfo, xmax, ymin, zmax, morton);
+    addCount(count, CellParticleCounts, gridInfo, xmax, ymax, zmin, morton);
+    addCount(count, CellParticleCounts, gridInfo, xmax, ymax, zmax, morton);
+  }
+}
@@ -0,0 +1,156 @@
+#include <sutil/Exception.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "optixNSearch.h"
+#include "func.h"
+#include "state.h"
+#include "grid.h"
+
+// grid layout shared by the device grid sort and the host grid, and the cell
+// size whose grid fits a memory budget; they only depend on the scene bounds,
+// so they're kept apart from the device code.
+unsigned int genGridInfo(RTNNState& state, unsigned int N, GridInfo& gridInfo) {
+  return genGridInfo(state, N, state.radius / state.crRatio, gridInfo);
+}
+
+unsigned int genGridInfo(RTNNState& state, unsigned int N, float cellSize, GridInfo& gridInfo, bool verbose) {
+  float3 sceneMin = state.Min;
+  float3 sceneMax = state.Max;
+
+  gridInfo.ParticleCount = N;
+  gridInfo.GridMin = sceneMin;
+
+  float3 gridSize = sceneMax - sceneMin;
+  if (state.periodic) {
+    // the cells tile the box exactly so that cell coordinates wrap around at
+    // the box faces. cells are stretched to be at least |cellSize| wide.
+    gridInfo.GridMin = state.boxMin;
+    gridSize = state.boxMax - state.boxMin;
+    gridInfo.GridDimension.x = std::max(1u, static_cast<unsigned int>(floorf(gridSize.x / cellSize)));
+    gridInfo.GridDimension.y = std::max(1u, static_cast<unsigned int>(floorf(gridSize.y / cellSize)));
+    gridInfo.GridDimension.z = std::max(1u, static_cast<unsigned int>(floorf(gridSize.z / cellSize)));
+    gridInfo.PeriodicDimension = gridInfo.GridDimension;
+  } else {
+    gridInfo.GridDimension.x = static_cast<unsigned int>(ceilf(gridSize.x / cellSize));
+    gridInfo.GridDimension.y = static_cast<unsigned int>(ceilf(gridSize.y / cellSize));
+    gridInfo.GridDimension.z = static_cast<unsigned int>(ceilf(gridSize.z / cellSize));
+    gridInfo.PeriodicDimension = make_uint3(0, 0, 0);
+
+    // Adjust grid size to multiple of cell size
+    gridSize.x = gridInfo.GridDimension.x * cellSize;
+    gridSize.y = gridInfo.GridDimension.y * cellSize;
+    gridSize.z = gridInfo.GridDimension.z * cellSize;
+  }
+
+  gridInfo.GridDelta.x = gridInfo.GridDimension.x / gridSize.x;
+  gridInfo.GridDelta.y = gridInfo.GridDimension.y / gridSize.y;
+  gridInfo.GridDelta.z = gridInfo.GridDimension.z / gridSize.z;
+
+  // morton code can only be correctly calcuated for a cubic, where each
+  //   dimension is of the same size and the dimension is a power of 2. if we
+  //   were to generate one single morton code for the entire grid, this would
+  //   waste a lot of space since a lot of empty cells will have to be padded.
+  //   the strategy is to divide the grid into smaller equal-dimension-power-of-2
+  //   smaller grids (meta_grid here). the order within each meta_grid is morton,
+  //   but the order across meta_grids is raster order.
+  // TODO: the current implementation uses a heuristics. we get the largest
+  //   power of 2 that doesn't exceed the shortest side, and then divide it by a
+  //   scaling factor. the result becomes the size of a meta grid. the smaller
+  //   the scaling factor, the more space waste (which limits the number of
+  //   cells) but enforces a more global order; maybe a better strategy?
+  unsigned int shortestSide = std::min({gridInfo.GridDimension.x, gridInfo.GridDimension.y, gridInfo.GridDimension.z});
+  // dim should at least be 1; otherwise we won't get 0 cells.
+  gridInfo.meta_grid_dim = std::max((int)pow(2, floorf(log2(shortestSide)))/state.mcScale, 1);
+  gridInfo.meta_grid_size = gridInfo.meta_grid_dim * gridInfo.meta_grid_dim * gridInfo.meta_grid_dim;
+
+  // One meta grid cell contains meta_grid_dim^3 cells. The morton curve is
+  // calculated for each metagrid, and the order of metagrid is raster order.
+  // So if meta_grid_dim is 1, this is basically the same as raster order
+  // across all cells. If meta_grid_dim is the same as GridDimension, this
+  // calculates one single morton curve for the entire grid.
+  gridInfo.MetaGridDimension.x = static_cast<unsigned int>(ceilf(gridInfo.GridDimension.x / (float)gridInfo.meta_grid_dim));
+  gridInfo.MetaGridDimension.y = static_cast<unsigned int>(ceilf(gridInfo.GridDimension.y / (float)gridInfo.meta_grid_dim));
+  gridInfo.MetaGridDimension.z = static_cast<unsigned int>(ceilf(gridInfo.GridDimension.z / (float)gridInfo.meta_grid_dim));
+
+  // metagrids will slightly increase the total cells
+  unsigned int numberOfCells = (gridInfo.MetaGridDimension.x * gridInfo.MetaGridDimension.y * gridInfo.MetaGridDimension.z) * gridInfo.meta_grid_size;
+  if (verbose) {
+    fprintf(stdout, "\tGrid dimension (without meta grids): %u, %u, %u\n", gridInfo.GridDimension.x, gridInfo.GridDimension.y, gridInfo.GridDimension.z);
+    fprintf(stdout, "\tGrid dimension (with meta grids): %u, %u, %u\n", gridInfo.MetaGridDimension.x * gridInfo.meta_grid_dim, gridInfo.MetaGridDimension.y * gridInfo.meta_grid_dim, gridInfo.MetaGridDimension.z * gridInfo.meta_grid_dim);
+    //fprintf(stdout, "\tMeta Grid dimension: %u, %u, %u\n", gridInfo.MetaGridDimension.x, gridInfo.MetaGridDimension.y, gridInfo.MetaGridDimension.z);
+    //fprintf(stdout, "\t# of cells in a meta grid: %u\n", gridInfo.meta_grid_dim);
+    //fprintf(stdout, "\tGridDelta: %f, %f, %f\n", gridInfo.GridDelta.x, gridInfo.GridDelta.y, gridInfo.GridDelta.z);
+    fprintf(stdout, "\tNumber of cells: %u\n", numberOfCells);
+    fprintf(stdout, "\tCell size: %f\n", cellSize);
+  }
+
+  // update GridDimension so that it can be used in the kernels (otherwise raster order is incorrect)
+  gridInfo.GridDimension.x = gridInfo.MetaGridDimension.x * gridInfo.meta_grid_dim;
+  gridInfo.GridDimension.y = gridInfo.MetaGridDimension.y * gridInfo.meta_grid_dim;
+  gridInfo.GridDimension.z = gridInfo.MetaGridDimension.z * gridInfo.meta_grid_dim;
+  return numberOfCells;
+}
+
+float memFootprint(RTNNState& state, float cellSize, int cellArrayCount, float gasSize) {
+  // total gas size = (state.radius / (sqrt(3) * cellSize) + 1) * gasSize; // TODO (sqrt(2) for 2D)
+  // total sorting structure size = # of cells * (cellArrayCount * sizeof(unsigned int));
+  bool isOneBatch = (!state.partition || (!state.autoNB && state.numOfBatches == 1));
+  float numOfBatches = isOneBatch ? 1.0 : state.radius / (sqrt(3) * cellSize) + 1;
+
+  GridInfo gridInfo;
+  float numOfSortingCells = genGridInfo(state, state.numPoints, cellSize, gridInfo, false);
+  return numOfBatches * gasSize + numOfSortingCells * (cellArrayCount * sizeof(unsigned int));
+}
+
+// a lower bound of |memFootprint| that only grows smaller as the cells grow:
+// the cell count before |genGridInfo| pads it to whole meta grids.
+static float memFootprintBound(RTNNState& state, float cellSize, int cellArrayCount, float gasSize) {
+  bool isOneBatch = (!state.partition || (!state.autoNB && state.numOfBatches == 1));
+  float numOfBatches = isOneBatch ? 1.0 : state.radius / (sqrt(3) * cellSize) + 1;
+
+  float3 size = state.periodic ? state.boxMax - state.boxMin : state.Max - state.Min;
+  auto cells = [&](float side) {
+    return state.periodic ? std::max(1.0f, floorf(side / cellSize)) : ceilf(side / cellSize);
+  };
+  double numOfCells = (double)cells(size.x) * cells(size.y) * cells(size.z);
+  return numOfBatches * gasSize + numOfCells * (cellArrayCount * sizeof(unsigned int));
+}
+
+// the smallest cell size of the form |cellSize| * crStep^i whose footprint
+// is below |spaceAvail|, i.e., the cell size to within a factor of crStep
+// (-crs); 0 if none up to |kMaxCellSteps| steps fits, e.g., if not even the
+// data do.
+float fitCellSize(RTNNState& state, float spaceAvail, float cellSize, int cellArrayCount, float gasSize, bool stepwise) {
+  const int kMaxCellSteps = 1 << 16;
+  auto size = [&](int i) { return cellSize * powf(state.crStep, i); };
+  auto fits = [&](int i) { return memFootprint(state, size(i), cellArrayCount, gasSize) < spaceAvail; };
+  auto scan = [&](int i) {
+    while ((i < kMaxCellSteps) && std::isfinite(size(i)) && !fits(i)) i++;
+    return ((i < kMaxCellSteps) && std::isfinite(size(i))) ? size(i) : 0.0f;
+  };
+
+  if (stepwise) return scan(0);
+
+  // the footprint isn't monotone in the cell size, since padding to whole meta
+  // grids can add more cells to a larger cell size, but its bound is: no step
+  // before the first one whose bound fits can fit. that step is found by
+  // doubling and bisecting, and the first step that fits from there on by
+  // stepping, which takes a few steps at most as padding adds little.
+  auto boundFits = [&](int i) { return memFootprintBound(state, size(i), cellArrayCount, gasSize) < spaceAvail; };
+  if (boundFits(0)) return scan(0);
+  int lo = 0, hi = 1;
+  while (!boundFits(hi)) {
+    if ((hi >= kMaxCellSteps) || !std::isfinite(size(hi))) return 0;
+    lo = hi;
+    hi *= 2;
+  }
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+    if (boundFits(mid)) hi = mid;
+    else lo = mid;
+  }
+  return scan(hi);
+}
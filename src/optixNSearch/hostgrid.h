@@ -0,0 +1,248 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+#include <sutil/vec_math.h>
+
+#include "grid.h"
+
+// A uniform grid on the host. Points are binned the same way |gridSort| bins
+// them on the device (same |GridInfo| and the same morton/raster cell order),
+// but the host keeps the point IDs in cell order instead of reordering the
+// points themselves, so the IDs reported by the host search are the IDs of
+// the caller's points.
+struct HostGrid
+{
+  GridInfo gridInfo;
+  unsigned int numberOfCells = 0;
+  float cellSize = 0;
+  bool morton = true;
+  // periodic box; cell coordinates wrap around (see |GridInfo|) and
+  // displacements are minimum images.
+  bool periodic = false;
+  float3 boxSize;
+
+  std::vector<unsigned int> CellParticleCounts;
+  std::vector<unsigned int> CellOffsets;
+  // |SortedIndices[i]| is the ID of the i-th point in cell order, and
+  // |SortedPoints[i]| is its coordinate, so that a cell is a contiguous run.
+  std::vector<unsigned int> SortedIndices;
+  std::vector<float3> SortedPoints;
+  // |ParticleCellIndices[id]| is the cell of point |id|, kept for
+  // |updateHostGrid| to find the points that moved to another cell.
+  std::vector<unsigned int> ParticleCellIndices;
+
+  // compressed storage (|SortedPoints| is then empty): a point is kept as 16
+  // bits per axis of fixed point within its cell, i.e., the cell's lower
+  // corner plus |PackedPoints[i]| * |packStep|, which halves the footprint of
+  // the points. a decoded distance is off by at most |packError|, so only
+  // candidates that close to the radius are rechecked with |Points|, the full
+  // precision points indexed by point ID.
+  bool compressed = false;
+  std::vector<ushort3> PackedPoints;
+  float3 packStep;
+  float packError = 0;
+  const float3* Points = nullptr;
+
+  // dynamic updates (|insertHostGrid| and |eraseHostGrid|). points inserted
+  // after the build go to a chain of fixed-size overflow chunks of their
+  // cell, |OverflowHeads[cellIdx]| being the newest chunk (-1 if none).
+  // erased points stay in place but are tombstoned by ID until the grid is
+  // built again, which also moves the overflow into the cell runs.
+  struct OverflowChunk
+  {
+    static const unsigned int Size = 16;
+    unsigned int count;
+    int next;
+    unsigned int ids[Size];
+    float3 points[Size];
+  };
+  std::vector<int> OverflowHeads;
+  std::vector<OverflowChunk> OverflowChunks;
+  unsigned int numOverflow = 0;
+  // by point ID; empty if no point is tombstoned.
+  std::vector<unsigned char> Tombstones;
+  unsigned int numTombstones = 0;
+
+  bool isDynamic() const { return numOverflow || numTombstones; }
+  bool isErased(unsigned int id) const { return numTombstones && Tombstones[id]; }
+};
+
+// split [0, N) into contiguous chunks, one per hardware thread.
+template <typename F>
+inline void parallelFor(unsigned int N, F f) {
+  unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+  numThreads = std::min(numThreads, std::max(1u, N / 1024));
+  unsigned int chunk = (N + numThreads - 1) / numThreads;
+
+  std::vector<std::thread> threads;
+  for (unsigned int t = 0; t < numThreads; t++) {
+    unsigned int begin = t * chunk;
+    unsigned int end = std::min(N, begin + chunk);
+    if (begin >= end) break;
+    threads.emplace_back([=, &f]() {
+      for (unsigned int i = begin; i < end; i++) f(i);
+    });
+  }
+  for (auto& t : threads) t.join();
+}
+
+// reduces |f(i)| over [0, N) with the associative |combine|, one partial
+// result per hardware thread (same chunks as |parallelFor|).
+template <typename T, typename F, typename C>
+inline T parallelReduce(unsigned int N, T init, F f, C combine) {
+  unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+  numThreads = std::min(numThreads, std::max(1u, N / 1024));
+  unsigned int chunk = (N + numThreads - 1) / numThreads;
+
+  std::vector<T> partial(numThreads, init);
+  std::vector<std::thread> threads;
+  for (unsigned int t = 0; t < numThreads; t++) {
+    unsigned int begin = t * chunk;
+    unsigned int end = std::min(N, begin + chunk);
+    if (begin >= end) break;
+    threads.emplace_back([=, &f, &combine, &partial]() {
+      T acc = init;
+      for (unsigned int i = begin; i < end; i++) acc = combine(acc, f(i));
+      partial[t] = acc;
+    });
+  }
+  for (auto& t : threads) t.join();
+
+  T res = init;
+  for (auto& p : partial) res = combine(res, p);
+  return res;
+}
+
+inline int3 hostGridCell(const GridInfo& gridInfo, float3 p) {
+  float3 gridCellF = (p - gridInfo.GridMin) * gridInfo.GridDelta;
+  return make_int3((int)floorf(gridCellF.x), (int)floorf(gridCellF.y), (int)floorf(gridCellF.z));
+}
+
+// lower and upper corners of cell (ix, iy, iz).
+inline void hostCellBounds(const GridInfo& gridInfo, int ix, int iy, int iz, float3& lo, float3& hi) {
+  float3 cellWidth = 1.0f / gridInfo.GridDelta;
+  lo = gridInfo.GridMin + make_float3(ix, iy, iz) * cellWidth;
+  hi = lo + cellWidth;
+}
+
+// calls |f(ix, iy, iz, cellIdx)| for every cell overlapped by the AABB of the
+// search sphere. |f| returns false to stop the traversal early. in a periodic
+// grid (ix, iy, iz) are not wrapped, i.e., they are the cell image next to the
+// query, but each cell is still visited at most once.
+template <typename F>
+inline void forEachCell(const HostGrid& grid, float3 query, float radius, F f) {
+  const GridInfo& gridInfo = grid.gridInfo;
+  int3 lo = hostGridCell(gridInfo, query - radius);
+  int3 hi = hostGridCell(gridInfo, query + radius);
+  if (grid.periodic) {
+    uint3 n = gridInfo.PeriodicDimension;
+    if (hi.x - lo.x + 1 > (int)n.x) hi.x = lo.x + n.x - 1;
+    if (hi.y - lo.y + 1 > (int)n.y) hi.y = lo.y + n.y - 1;
+    if (hi.z - lo.z + 1 > (int)n.z) hi.z = lo.z + n.z - 1;
+  } else {
+    lo = make_int3(std::max(lo.x, 0), std::max(lo.y, 0), std::max(lo.z, 0));
+    hi = make_int3(std::min(hi.x, (int)gridInfo.GridDimension.x - 1),
+                   std::min(hi.y, (int)gridInfo.GridDimension.y - 1),
+                   std::min(hi.z, (int)gridInfo.GridDimension.z - 1));
+  }
+
+  for (int ix = lo.x; ix <= hi.x; ix++) {
+    for (int iy = lo.y; iy <= hi.y; iy++) {
+      for (int iz = lo.z; iz <= hi.z; iz++) {
+        int wx = ix, wy = iy, wz = iz;
+        oob(gridInfo, wx, wy, wz); // wraps in a periodic grid
+        if (!f(ix, iy, iz, getCellIdx(gridInfo, wx, wy, wz, grid.morton))) return;
+      }
+    }
+  }
+}
+
+inline ushort3 packPoint(const HostGrid& grid, float3 p, float3 cellLo) {
+  float3 t = clamp((p - cellLo) / grid.packStep, 0.0f, 65535.0f);
+  return make_ushort3((unsigned short)lrintf(t.x), (unsigned short)lrintf(t.y), (unsigned short)lrintf(t.z));
+}
+
+inline float3 unpackPoint(const HostGrid& grid, ushort3 p, float3 cellLo) {
+  return cellLo + make_float3(p.x, p.y, p.z) * grid.packStep;
+}
+
+// calls |f(pointId, point, sqdist)| for every point of cell (ix, iy, iz) as
+// given by |forEachCell|. |f| returns false to stop early. in a periodic grid
+// |point| is the image of the point closest to the query. with compressed
+// points, points that are certainly outside |radius| are skipped, and |point|
+// and |sqdist| are only approximate for points that are certainly inside.
+// tombstoned points are skipped.
+template <typename F>
+inline bool forEachPointInCell(const HostGrid& grid, float3 query, float radius, int ix, int iy, int iz, unsigned int cellIdx, F f) {
+  unsigned int start = grid.CellOffsets[cellIdx];
+  unsigned int end = start + grid.CellParticleCounts[cellIdx];
+
+  // overflow points are not compressed.
+  if (grid.numOverflow) {
+    for (int c = grid.OverflowHeads[cellIdx]; c >= 0; c = grid.OverflowChunks[c].next) {
+      const HostGrid::OverflowChunk& chunk = grid.OverflowChunks[c];
+      for (unsigned int i = 0; i < chunk.count; i++) {
+        if (grid.isErased(chunk.ids[i])) continue;
+        float3 point = chunk.points[i];
+        float3 diff = query - point;
+        if (grid.periodic) {
+          diff = minImage(diff, grid.boxSize);
+          point = query - diff;
+        }
+        if (!f(chunk.ids[i], point, dot(diff, diff))) return false;
+      }
+    }
+  }
+
+  if (!grid.compressed) {
+    for (unsigned int i = start; i < end; i++) {
+      if (grid.isErased(grid.SortedIndices[i])) continue;
+      float3 point = grid.SortedPoints[i];
+      float3 diff = query - point;
+      if (grid.periodic) {
+        diff = minImage(diff, grid.boxSize);
+        point = query - diff;
+      }
+      if (!f(grid.SortedIndices[i], point, dot(diff, diff))) return false;
+    }
+    return true;
+  }
+
+  // decoding relative to the unwrapped cell yields the image next to the query.
+  float3 lo, hi;
+  hostCellBounds(grid.gridInfo, ix, iy, iz, lo, hi);
+  float inner = fmaxf(radius - grid.packError, 0.0f);
+  float outer = radius + grid.packError;
+  for (unsigned int i = start; i < end; i++) {
+    if (grid.isErased(grid.SortedIndices[i])) continue;
+    float3 point = unpackPoint(grid, grid.PackedPoints[i], lo);
+    float3 diff = query - point;
+    if (grid.periodic) diff = minImage(diff, grid.boxSize);
+    float sqdist = dot(diff, diff);
+    if (sqdist >= outer * outer) continue;
+
+    unsigned int id = grid.SortedIndices[i];
+    if (sqdist >= inner * inner) {
+      // near the radius boundary; decide with full precision.
+      diff = query - grid.Points[id];
+      if (grid.periodic) diff = minImage(diff, grid.boxSize);
+      sqdist = dot(diff, diff);
+    }
+    if (!f(id, query - diff, sqdist)) return false;
+  }
+  return true;
+}
+
+// calls |f(pointId, point, sqdist)| for every point in the cells overlapped by
+// the AABB of the search sphere (see |forEachPointInCell|). |f| returns false
+// to stop the traversal early (e.g., once K neighbors are found in radius
+// search).
+template <typename F>
+inline void forEachCandidate(const HostGrid& grid, float3 query, float radius, F f) {
+  forEachCell(grid, query, radius, [&](int ix, int iy, int iz, unsigned int cellIdx) {
+    return forEachPointInCell(grid, query, radius, ix, iy, iz, cellIdx, f);
+  });
+}
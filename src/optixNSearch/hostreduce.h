@@ -0,0 +1,79 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include "hostgrid.h"
+
+// Fused per-query reductions. Instead of writing out up to K neighbor IDs per
+// query and reducing over them in a second pass, a reducer folds every
+// neighbor into an accumulator while the grid is being traversed, and only
+// the finalized value of each query is stored. A reducer provides:
+//
+//   typedef ... acc_t;    // per-query accumulator
+//   typedef ... value_t;  // per-query result
+//   acc_t init() const;
+//   void update(acc_t& acc, unsigned int pointId, float3 point, float sqdist) const;
+//   value_t finalize(const acc_t& acc) const;
+//
+// |update| is called for every point strictly within |radius| of the query,
+// including the query itself if it is one of the points. there is no K cap.
+// with compressed points |point| and |sqdist| are decoded (see
+// |forEachPointInCell|), so the result is only approximate.
+template <typename R>
+inline typename R::value_t reduceQuery(const HostGrid& grid, float3 query, float radius, const R& reducer) {
+  typename R::acc_t acc = reducer.init();
+  forEachCandidate(grid, query, radius, [&](unsigned int p, float3 point, float sqdist) {
+    if (sqdist < radius * radius) reducer.update(acc, p, point, sqdist);
+    return true;
+  });
+  return reducer.finalize(acc);
+}
+
+template <typename R>
+inline void reduceNeighbors(const HostGrid& grid, const float3* queries, unsigned int numQueries, float radius, const R& reducer, typename R::value_t* out) {
+  parallelFor(numQueries, [&](unsigned int q) {
+    out[q] = reduceQuery(grid, queries[q], radius, reducer);
+  });
+}
+
+// SPH density with the poly6 kernel of smoothing length |h| (the search
+// radius) and uniform particle mass.
+struct SPHDensityReducer
+{
+  typedef float acc_t;
+  typedef float value_t;
+
+  float h2;
+  float coef;
+
+  SPHDensityReducer(float h, float mass = 1.0f) {
+    h2 = h * h;
+    coef = mass * 315.0f / (64.0f * (float)M_PI * powf(h, 9));
+  }
+
+  acc_t init() const { return 0; }
+  void update(acc_t& acc, unsigned int, float3, float sqdist) const {
+    float d = h2 - sqdist;
+    acc += d * d * d;
+  }
+  value_t finalize(const acc_t& acc) const { return coef * acc; }
+};
+
+// mean position of the neighbors, the simplest form of feature averaging.
+struct MeanPositionReducer
+{
+  struct acc_t {
+    float3 sum;
+    unsigned int count;
+  };
+  typedef float3 value_t;
+
+  acc_t init() const { return acc_t{make_float3(0.0f), 0}; }
+  void update(acc_t& acc, unsigned int, float3 point, float) const {
+    acc.sum += point;
+    acc.count++;
+  }
+  value_t finalize(const acc_t& acc) const {
+    return acc.count ? acc.sum / (float)acc.count : make_float3(0.0f);
+  }
+};
@@ -0,0 +1,559 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <climits>
+#include <cfloat>
+#include <atomic>
+#include <random>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "grid.h"
+#include "hostgrid.h"
+#include "hostreduce.h"
+
+void computeMinMaxHost(unsigned int N, float3* particles, float3& min, float3& max)
+{
+  // same semantics as |computeMinMax|: floor to the enclosing integer
+  // coordinates and extend max by 1 so that the scene is enclosed.
+  int3 minCell = make_int3(std::numeric_limits<int>().max(), std::numeric_limits<int>().max(), std::numeric_limits<int>().max());
+  int3 maxCell = make_int3(std::numeric_limits<int>().min(), std::numeric_limits<int>().min(), std::numeric_limits<int>().min());
+
+  for (unsigned int i = 0; i < N; i++) {
+    float3 particle = particles[i];
+    minCell.x = std::min(minCell.x, (int)floorf(particle.x));
+    minCell.y = std::min(minCell.y, (int)floorf(particle.y));
+    minCell.z = std::min(minCell.z, (int)floorf(particle.z));
+    maxCell.x = std::max(maxCell.x, (int)floorf(particle.x));
+    maxCell.y = std::max(maxCell.y, (int)floorf(particle.y));
+    maxCell.z = std::max(maxCell.z, (int)floorf(particle.z));
+  }
+
+  min = make_float3(minCell.x, minCell.y, minCell.z);
+  max = make_float3(maxCell.x + 1, maxCell.y + 1, maxCell.z + 1);
+
+  fprintf(stdout, "\tscene boundary: (%f, %f, %f), (%f, %f, %f)\n", min.x, min.y, min.z, max.x, max.y, max.z);
+}
+
+void growBounds(const double3* p, unsigned int N, double3& lo, double3& hi) {
+  for (unsigned int i = 0; i < N; i++) {
+    lo.x = std::min(lo.x, p[i].x); hi.x = std::max(hi.x, p[i].x);
+    lo.y = std::min(lo.y, p[i].y); hi.y = std::max(hi.y, p[i].y);
+    lo.z = std::min(lo.z, p[i].z); hi.z = std::max(hi.z, p[i].z);
+  }
+}
+
+// the difference is taken in double precision and only then narrowed.
+void toLocal(const double3* p, unsigned int N, double3 origin, float3* local) {
+  for (unsigned int i = 0; i < N; i++)
+    local[i] = make_float3(p[i].x - origin.x, p[i].y - origin.y, p[i].z - origin.z);
+}
+
+void setupHost(RTNNState& state) {
+  // the host counterpart of |uploadData| and |initBatches|: no query
+  // partitioning, so there is exactly one batch that has all the queries.
+  Timing::startTiming("setup host data structures");
+    computeMinMaxHost(state.numPoints, state.h_points, state.pMin, state.pMax);
+    if (state.h_queries == state.h_points) {
+      state.qMin = state.pMin;
+      state.qMax = state.pMax;
+    } else computeMinMaxHost(state.numQueries, state.h_queries, state.qMin, state.qMax);
+
+    state.Min = fminf(state.qMin, state.pMin);
+    state.Max = fmaxf(state.qMax, state.pMax);
+    if (state.periodic) {
+      state.Min = state.boxMin;
+      state.Max = state.boxMax;
+    }
+
+    state.gRadius = state.radius;
+    float3 O = state.Min - state.Max;
+    float dist = sqrtf(dot(O, O));
+    state.radius = std::min(state.radius, dist);
+    fprintf(stdout, "\tGiven radius: %f\n", state.gRadius);
+    fprintf(stdout, "\tActual radius: %f\n", state.radius);
+
+    state.maxBatchCount = 1;
+    state.numOfBatches = 1;
+    state.numActQueries = new unsigned int[1];
+    state.launchRadius = new float[1];
+    state.h_res = new void*[1]();
+    state.h_actQs = new float3*[1]();
+
+    state.numActQueries[0] = state.numQueries;
+    state.launchRadius[0] = state.radius;
+    state.h_actQs[0] = state.h_queries;
+    if (state.h_qRadius) {
+      state.h_actQRadius = new float*[1];
+      state.h_actQRadius[0] = state.h_qRadius;
+    }
+  Timing::stopTiming(true);
+}
+
+void buildHostGrid(RTNNState& state, HostGrid& grid) {
+  Timing::startTiming("build host grid");
+    unsigned int N = state.numPoints;
+
+    // a cell as wide as the search radius bounds the search to the 27 cells
+    // around the query. counting prefers smaller cells: a cell that is
+    // entirely inside the sphere is counted without any distance test, and
+    // with cells of radius/4 a good part of the sphere is made of such cells.
+    // an explicit crRatio (-ac 0) overrides both.
+    if (!state.autoCR) grid.cellSize = state.radius / state.crRatio;
+    else if (state.searchMode == "count") grid.cellSize = state.radius / 4;
+    else grid.cellSize = state.radius;
+    grid.morton = (state.pointSortMode == 1);
+    grid.periodic = state.periodic;
+    grid.boxSize = state.boxMax - state.boxMin;
+    grid.numberOfCells = genGridInfo(state, N, grid.cellSize, grid.gridInfo);
+
+    if (state.compress) {
+      // the rounding error of a coordinate is half a step, plus a few ulps of
+      // the coordinates for the arithmetic of packing and unpacking.
+      float3 cellWidth = 1.0f / grid.gridInfo.GridDelta;
+      float3 gridMax = grid.gridInfo.GridMin + make_float3(grid.gridInfo.GridDimension) * cellWidth;
+      float maxCoord = fmaxf(fmaxf(fmaxf(grid.gridInfo.GridMin, -grid.gridInfo.GridMin)), fmaxf(fmaxf(gridMax, -gridMax)));
+      grid.compressed = true;
+      grid.packStep = cellWidth / 65535.0f;
+      grid.packError = length(grid.packStep) + 8 * FLT_EPSILON * maxCoord;
+      grid.Points = state.h_points;
+    }
+
+    grid.CellParticleCounts.assign(grid.numberOfCells, 0);
+    grid.CellOffsets.assign(grid.numberOfCells, 0);
+
+    // a build compacts a dynamically updated grid: the overflow is merged
+    // into the cell runs, and tombstoned points (|grid.Tombstones| is kept by
+    // the caller) are left out for good.
+    grid.OverflowHeads.clear();
+    grid.OverflowChunks.clear();
+    grid.numOverflow = 0;
+    grid.Tombstones.resize(grid.Tombstones.empty() ? 0 : N, 0);
+    grid.numTombstones = 0;
+    unsigned int numLive = N;
+
+    // counting sort the points by cell, the host version of
+    // |kInsertParticles|, |exclusiveScan| and |kCountingSortIndices|.
+    std::vector<unsigned int>& particleCellIndices = grid.ParticleCellIndices;
+    particleCellIndices.resize(N);
+    std::vector<int3> particleCells(grid.compressed ? N : 0);
+    for (unsigned int i = 0; i < N; i++) {
+      if (!grid.Tombstones.empty() && grid.Tombstones[i]) {
+        particleCellIndices[i] = UINT_MAX;
+        numLive--;
+        continue;
+      }
+      int3 cell = hostGridCell(grid.gridInfo, state.h_points[i]);
+      // a point is packed relative to the cell it is in before wrapping: one
+      // on the upper face of a periodic box is stored in the first cell, and
+      // unpacks to its image there, at an offset of about 0.
+      if (grid.compressed) particleCells[i] = cell;
+      // a point on the upper face of a periodic box belongs to the first cell.
+      oob(grid.gridInfo, cell.x, cell.y, cell.z);
+      unsigned int cellIdx = getCellIdx(grid.gridInfo, cell.x, cell.y, cell.z, grid.morton);
+      particleCellIndices[i] = cellIdx;
+      grid.CellParticleCounts[cellIdx]++;
+    }
+
+    unsigned int offset = 0;
+    for (unsigned int c = 0; c < grid.numberOfCells; c++) {
+      grid.CellOffsets[c] = offset;
+      offset += grid.CellParticleCounts[c];
+    }
+
+    std::vector<unsigned int> cursor(grid.CellOffsets);
+    grid.SortedIndices.resize(numLive);
+    if (grid.compressed) grid.PackedPoints.resize(numLive);
+    else grid.SortedPoints.resize(numLive);
+    for (unsigned int i = 0; i < N; i++) {
+      if (particleCellIndices[i] == UINT_MAX) continue;
+      unsigned int pos = cursor[particleCellIndices[i]]++;
+      grid.SortedIndices[pos] = i;
+      if (grid.compressed) {
+        float3 lo, hi;
+        hostCellBounds(grid.gridInfo, particleCells[i].x, particleCells[i].y, particleCells[i].z, lo, hi);
+        grid.PackedPoints[pos] = packPoint(grid, state.h_points[i], lo);
+      }
+      else grid.SortedPoints[pos] = state.h_points[i];
+    }
+  Timing::stopTiming(true);
+}
+
+// moves the points of |grid| to |points| (same IDs) without rebuilding it
+// from scratch. when particles move a little, most stay in their cells: only
+// the points that crossed a cell boundary are re-binned and the counts are
+// updated by the difference. the points that stayed are still in cell order,
+// so the new order is a merge of them with the few re-binned points, sorted
+// by cell, rather than a full sort. the result is identical to
+// |buildHostGrid| with the same grid info. points erased before the build
+// aren't in the grid (|ParticleCellIndices| is UINT_MAX) and are skipped, so
+// an index keeps updating incrementally after erasing points. returns false,
+// leaving |grid| unchanged, when the grid has to be rebuilt instead: a point
+// left the (non-periodic) grid, too many points crossed cells for a merge to
+// pay off, or the grid is compressed or has changes since the build.
+bool updateHostGrid(HostGrid& grid, const float3* points) {
+  // a dynamically updated grid is compacted by the rebuild.
+  if (grid.compressed || grid.isDynamic()) return false;
+
+  // all points by ID, and those in the grid.
+  unsigned int N = grid.ParticleCellIndices.size();
+  unsigned int numLive = grid.SortedIndices.size();
+  std::vector<unsigned int> newCells(N);
+  std::atomic<bool> outside(false);
+  parallelFor(N, [&](unsigned int i) {
+    if (grid.ParticleCellIndices[i] == UINT_MAX) {
+      newCells[i] = UINT_MAX;
+      return;
+    }
+    int3 cell = hostGridCell(grid.gridInfo, points[i]);
+    if (oob(grid.gridInfo, cell.x, cell.y, cell.z)) outside = true;
+    else newCells[i] = getCellIdx(grid.gridInfo, cell.x, cell.y, cell.z, grid.morton);
+  });
+  if (outside) return false;
+
+  std::vector<unsigned int> movers;
+  for (unsigned int i = 0; i < N; i++) {
+    if (newCells[i] != grid.ParticleCellIndices[i]) movers.push_back(i);
+  }
+  // past about a tenth of the points moving cells a rebuild is faster (see -mb).
+  if (movers.size() > numLive / 10) return false;
+
+  if (!movers.empty()) {
+    for (auto i : movers) {
+      grid.CellParticleCounts[grid.ParticleCellIndices[i]]--;
+      grid.CellParticleCounts[newCells[i]]++;
+    }
+    unsigned int offset = 0;
+    for (unsigned int c = 0; c < grid.numberOfCells; c++) {
+      grid.CellOffsets[c] = offset;
+      offset += grid.CellParticleCounts[c];
+    }
+
+    // points are ordered by (cell, ID), which is the order of the counting
+    // sort in |buildHostGrid|.
+    auto before = [&](unsigned int a, unsigned int b) {
+      return (newCells[a] < newCells[b]) || ((newCells[a] == newCells[b]) && (a < b));
+    };
+    std::vector<unsigned int> stayers;
+    stayers.reserve(numLive - movers.size());
+    for (auto i : grid.SortedIndices) {
+      if (newCells[i] == grid.ParticleCellIndices[i]) stayers.push_back(i);
+    }
+    std::sort(movers.begin(), movers.end(), before);
+    std::merge(stayers.begin(), stayers.end(), movers.begin(), movers.end(), grid.SortedIndices.begin(), before);
+    grid.ParticleCellIndices.swap(newCells);
+  }
+
+  parallelFor(numLive, [&](unsigned int pos) {
+    grid.SortedPoints[pos] = points[grid.SortedIndices[pos]];
+  });
+  return true;
+}
+
+// adds points |firstId| to |firstId| + |count| - 1 of |points| to the grid
+// without rebuilding it: each point is appended to the newest overflow chunk
+// of its cell. IDs have to follow the points the grid already has. returns
+// false, leaving |grid| unchanged, if a point is outside of the
+// (non-periodic) grid, which then has to be rebuilt.
+bool insertHostGrid(HostGrid& grid, const float3* points, unsigned int firstId, unsigned int count) {
+  std::vector<unsigned int> cells(count);
+  for (unsigned int i = 0; i < count; i++) {
+    int3 cell = hostGridCell(grid.gridInfo, points[firstId + i]);
+    if (oob(grid.gridInfo, cell.x, cell.y, cell.z)) return false;
+    cells[i] = getCellIdx(grid.gridInfo, cell.x, cell.y, cell.z, grid.morton);
+  }
+
+  if (grid.OverflowHeads.empty()) grid.OverflowHeads.assign(grid.numberOfCells, -1);
+  grid.ParticleCellIndices.resize(firstId + count, UINT_MAX);
+  if (!grid.Tombstones.empty()) grid.Tombstones.resize(firstId + count, 0);
+
+  for (unsigned int i = 0; i < count; i++) {
+    int& head = grid.OverflowHeads[cells[i]];
+    if ((head < 0) || (grid.OverflowChunks[head].count == HostGrid::OverflowChunk::Size)) {
+      HostGrid::OverflowChunk chunk;
+      chunk.count = 0;
+      chunk.next = head;
+      grid.OverflowChunks.push_back(chunk);
+      head = grid.OverflowChunks.size() - 1;
+    }
+    HostGrid::OverflowChunk& chunk = grid.OverflowChunks[head];
+    chunk.ids[chunk.count] = firstId + i;
+    chunk.points[chunk.count] = points[firstId + i];
+    chunk.count++;
+    grid.ParticleCellIndices[firstId + i] = cells[i];
+  }
+  grid.numOverflow += count;
+  return true;
+}
+
+// tombstones points |ids|; searches skip them until the grid is rebuilt.
+void eraseHostGrid(HostGrid& grid, const unsigned int* ids, unsigned int count) {
+  if (grid.Tombstones.empty()) grid.Tombstones.assign(grid.ParticleCellIndices.size(), 0);
+  for (unsigned int i = 0; i < count; i++) {
+    if (grid.Tombstones[ids[i]]) continue;
+    grid.Tombstones[ids[i]] = 1;
+    grid.numTombstones++;
+  }
+}
+
+// compares |updateHostGrid| with rebuilding the grid after every point moves
+// by up to d along each axis, for each displacement d of -mb. the grid is
+// extended by the largest d so that moved points stay inside it.
+void benchmarkHostUpdate(RTNNState& state) {
+  unsigned int N = state.numPoints;
+  float maxD = *std::max_element(state.moveBench.begin(), state.moveBench.end());
+  if (!state.periodic) {
+    state.Min = state.Min - maxD;
+    state.Max = state.Max + maxD;
+  }
+
+  HostGrid grid;
+  buildHostGrid(state, grid);
+
+  float3* original = state.h_points;
+  float3 boxSize = state.boxMax - state.boxMin;
+  std::vector<float3> moved(N);
+  std::mt19937 gen(0);
+
+  for (float d : state.moveBench) {
+    std::uniform_real_distribution<float> dist(-d, d);
+    for (unsigned int i = 0; i < N; i++) {
+      moved[i] = original[i] + make_float3(dist(gen), dist(gen), dist(gen));
+      if (state.periodic) moved[i] = wrapIntoBox(moved[i], state.boxMin, boxSize);
+    }
+
+    // best of a few runs, as a single run of either is short.
+    HostGrid updated, rebuilt;
+    bool incremental = false;
+    double tUpdate = DBL_MAX, tRebuild = DBL_MAX;
+    for (int run = 0; run < 3; run++) {
+      updated = grid;
+      Timing::startTiming("incremental grid update");
+        incremental = updateHostGrid(updated, moved.data());
+      tUpdate = std::min(tUpdate, Timing::stopTiming(false));
+
+      state.h_points = moved.data();
+      rebuilt = HostGrid();
+      Timing::startTiming("full grid rebuild");
+        buildHostGrid(state, rebuilt);
+      tRebuild = std::min(tRebuild, Timing::stopTiming(false));
+      state.h_points = original;
+    }
+
+    unsigned int crossed = 0;
+    for (unsigned int i = 0; i < N; i++) {
+      if (rebuilt.ParticleCellIndices[i] != grid.ParticleCellIndices[i]) crossed++;
+    }
+    fprintf(stdout, "displacement %f: %.2f%% of points changed cells, rebuild %f ms, update %f ms%s\n",
+      d, 100.0 * crossed / N, tRebuild, tUpdate, incremental ? "" : " (too many changes, update declined)");
+
+    if (state.sanCheck && incremental &&
+        ((updated.SortedIndices != rebuilt.SortedIndices) || (updated.CellOffsets != rebuilt.CellOffsets) ||
+         (updated.CellParticleCounts != rebuilt.CellParticleCounts))) {
+      fprintf(stdout, "Incremental update of displacement %f differs from a rebuild.\n", d);
+      exit(1);
+    }
+  }
+
+  if (state.sanCheck) std::cerr << "Grid update sanity check done." << std::endl;
+}
+
+// the host reference for per-query radii: the grid is built for the largest
+// radius, and each query searches with its own.
+static inline float hostQueryRadius(const RTNNState& state, unsigned int q) {
+  return state.h_qRadius ? std::min(state.h_qRadius[q], state.radius) : state.radius;
+}
+
+static void searchHostRadius(RTNNState& state, const HostGrid& grid, unsigned int* res) {
+  unsigned int knn = state.knn;
+  bool halfList = state.halfList;
+
+  parallelFor(state.numQueries, [&](unsigned int q) {
+    float3 query = state.h_queries[q];
+    float radius = hostQueryRadius(state, q);
+    unsigned int* qRes = res + (size_t)q * knn;
+    unsigned int size = 0;
+
+    forEachCandidate(grid, query, radius, [&](unsigned int p, float3, float sqdist) {
+      // in half-list mode each unordered pair is only reported by the query with the smaller ID.
+      if (halfList && (p <= q)) return true;
+      if (sqdist < radius * radius) {
+        qRes[size++] = p;
+        if (size == knn) return false;
+      }
+      return true;
+    });
+  });
+}
+
+static void searchHostKNN(RTNNState& state, const HostGrid& grid, unsigned int* res) {
+  unsigned int knn = state.knn;
+  bool halfList = state.halfList;
+
+  typedef std::pair<float, unsigned int> knn_res_t;
+
+  parallelFor(state.numQueries, [&](unsigned int q) {
+    float3 query = state.h_queries[q];
+    float radius = hostQueryRadius(state, q);
+    unsigned int* qRes = res + (size_t)q * knn;
+
+    // a max-heap of the K nearest neighbors found so far.
+    std::vector<knn_res_t> topKQ;
+    topKQ.reserve(knn);
+
+    forEachCandidate(grid, query, radius, [&](unsigned int p, float3, float sqdist) {
+      if (halfList && (p <= q)) return true;
+      // same as the device: exclude the query itself.
+      if ((sqdist > 0) && (sqdist < radius * radius)) {
+        if (topKQ.size() < knn) {
+          topKQ.push_back(std::make_pair(sqdist, p));
+          std::push_heap(topKQ.begin(), topKQ.end());
+        } else if (sqdist < topKQ.front().first) {
+          std::pop_heap(topKQ.begin(), topKQ.end());
+          topKQ.back() = std::make_pair(sqdist, p);
+          std::push_heap(topKQ.begin(), topKQ.end());
+        }
+      }
+      return true;
+    });
+
+    std::sort_heap(topKQ.begin(), topKQ.end());
+    for (unsigned int i = 0; i < topKQ.size(); i++) qRes[i] = topKQ[i].second;
+  });
+}
+
+static void searchHostMulti(RTNNState& state, const HostGrid& grid, unsigned int* res) {
+  unsigned int knn = state.knn;
+  bool halfList = state.halfList;
+  unsigned int numRadii = state.multiRadius.size();
+
+  parallelFor(state.numQueries, [&](unsigned int q) {
+    float3 query = state.h_queries[q];
+    unsigned int* qRes = res + (size_t)q * knn;
+    unsigned int size[MAX_RADII] = {0};
+
+    // one traversal at the largest radius; each point goes to the list of
+    // every radius containing it, same as the device.
+    forEachCandidate(grid, query, state.radius, [&](unsigned int p, float3, float sqdist) {
+      if (halfList && (p <= q)) return true;
+      bool full = true;
+      unsigned int offset = 0;
+      for (unsigned int i = 0; i < numRadii; i++) {
+        float r = state.multiRadius[i];
+        if ((size[i] < state.multiK[i]) && (sqdist < r * r)) qRes[offset + size[i]++] = p;
+        if (size[i] < state.multiK[i]) full = false;
+        offset += state.multiK[i];
+      }
+      return !full;
+    });
+  });
+}
+
+static void searchHostCount(RTNNState& state, const HostGrid& grid, unsigned int* res) {
+  bool halfList = state.halfList;
+  // pad the cell bounds so that a point binned into a cell is inside the
+  // bounds of that cell despite rounding in |hostGridCell|.
+  float pad = grid.cellSize * 1e-4f;
+
+  parallelFor(state.numQueries, [&](unsigned int q) {
+    float3 query = state.h_queries[q];
+    float radius = hostQueryRadius(state, q);
+    unsigned int count = 0;
+
+    forEachCell(grid, query, radius, [&](int ix, int iy, int iz, unsigned int cellIdx) {
+      unsigned int num = grid.CellParticleCounts[cellIdx];
+      if ((num == 0) && (!grid.numOverflow || (grid.OverflowHeads[cellIdx] < 0))) return true;
+
+      float3 lo, hi;
+      hostCellBounds(grid.gridInfo, ix, iy, iz, lo, hi);
+      lo = lo - pad;
+      hi = hi + pad;
+
+      // the whole cell is inside the sphere if its farthest corner is. the
+      // half list has to look at the IDs, and so does a dynamically updated
+      // grid, whose counts don't account for the overflow and tombstones, so
+      // they can't take this shortcut.
+      float3 far = fmaxf(query - lo, hi - query);
+      if (!halfList && !grid.isDynamic() && (dot(far, far) < radius * radius)) {
+        count += num;
+        return true;
+      }
+
+      // the whole cell is outside the sphere if its nearest point is. in a
+      // periodic grid another image of the cell might still be inside, so
+      // only the points are tested. (the shortcut above does hold there: the
+      // minimum image of a point is never farther than its image in this cell.)
+      float3 near = query - clamp(query, lo, hi);
+      if (!grid.periodic && (dot(near, near) >= radius * radius)) return true;
+
+      return forEachPointInCell(grid, query, radius, ix, iy, iz, cellIdx, [&](unsigned int p, float3, float sqdist) {
+        if (halfList && (p <= q)) return true;
+        if (sqdist < radius * radius) count++;
+        return true;
+      });
+    });
+
+    res[q] = count;
+  });
+}
+
+// searches |state.h_queries| in an already built |grid|; |res| has to be
+// filled with UINT_MAX.
+void searchHostGrid(RTNNState& state, const HostGrid& grid, unsigned int* res) {
+  if (state.searchMode == "knn") searchHostKNN(state, grid, res);
+  else if (!state.multiRadius.empty()) searchHostMulti(state, grid, res);
+  else if (state.searchMode == "count") searchHostCount(state, grid, res);
+  else searchHostRadius(state, grid, res);
+}
+
+void searchHost(RTNNState& state) {
+  HostGrid grid;
+  buildHostGrid(state, grid);
+
+  Timing::startTiming("host search compute");
+    // count mode returns one count per query rather than K IDs.
+    unsigned int limit = (state.searchMode == "count") ? 1 : state.knn;
+    unsigned int* res = new unsigned int[(size_t)state.numQueries * limit];
+    // unused slots will become UINT_MAX, same as the device output.
+    std::fill(res, res + (size_t)state.numQueries * limit, UINT_MAX);
+
+    searchHostGrid(state, grid, res);
+
+    state.h_res[0] = res;
+  Timing::stopTiming(true);
+}
+
+void reduceHost(RTNNState& state) {
+  HostGrid grid;
+  buildHostGrid(state, grid);
+
+  // results are floats: one per query for density, three for the mean.
+  Timing::startTiming("host reduce compute");
+    if (state.reduce == "density") {
+      float* res = new float[state.numQueries];
+      reduceNeighbors(grid, state.h_queries, state.numQueries, state.radius, SPHDensityReducer(state.radius), res);
+      state.h_res[0] = res;
+    } else {
+      float3* res = new float3[state.numQueries];
+      reduceNeighbors(grid, state.h_queries, state.numQueries, state.radius, MeanPositionReducer(), res);
+      state.h_res[0] = res;
+    }
+  Timing::stopTiming(true);
+}
+
+void cleanupHost(RTNNState& state) {
+  if (state.reduce == "density") delete[] static_cast<float*>(state.h_res[0]);
+  else if (state.reduce == "mean") delete[] static_cast<float3*>(state.h_res[0]);
+  else delete[] static_cast<unsigned int*>(state.h_res[0]);
+
+  delete[] state.numActQueries;
+  delete[] state.launchRadius;
+  delete[] state.h_res;
+  delete[] state.h_actQs;
+  delete[] state.h_actQRadius;
+  delete[] state.h_qRadius;
+}
@@ -0,0 +1,192 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <climits>
+#include <cfloat>
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+
+#include "index.h"
+#include "func.h"
+
+namespace rtnn {
+
+Index::Index(const float3* points, unsigned int numPoints, bool copyPoints)
+{
+  if (copyPoints) {
+    m_points.assign(points, points + numPoints);
+    m_state.h_points = m_points.data();
+  } else m_state.h_points = const_cast<float3*>(points);
+  m_state.numPoints = numPoints;
+  m_state.backend = "host";
+  resetBounds();
+}
+
+Index::Index(const double3* points, unsigned int numPoints)
+{
+  double3 lo = make_double3(DBL_MAX, DBL_MAX, DBL_MAX);
+  double3 hi = make_double3(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+  growBounds(points, numPoints, lo, hi);
+  if (numPoints) m_state.origin = make_double3((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+  m_points = toLocal(points, numPoints);
+  m_state.h_points = m_points.data();
+  m_state.numPoints = numPoints;
+  m_state.backend = "host";
+  resetBounds();
+}
+
+std::vector<float3> Index::toLocal(const double3* points, unsigned int count) const {
+  std::vector<float3> local(count);
+  ::toLocal(points, count, m_state.origin, local.data());
+  return local;
+}
+
+// points that are changed or added have to be our own.
+void Index::ownPoints() {
+  if (m_state.h_points == m_points.data()) return;
+  m_points.assign(m_state.h_points, m_state.h_points + m_state.numPoints);
+  m_state.h_points = m_points.data();
+}
+
+// the grid only needs to enclose the points; cells outside of it would be
+// empty anyway, and |forEachCell| clamps the search to the grid.
+void Index::resetBounds() {
+  computeMinMaxHost(m_state.numPoints, m_state.h_points, m_state.pMin, m_state.pMax);
+  m_state.Min = m_state.pMin;
+  m_state.Max = m_state.pMax;
+}
+
+void Index::update(const float3* points) {
+  ownPoints();
+  std::copy(points, points + m_points.size(), m_points.begin());
+  if (m_hasGrid && updateHostGrid(m_grid, m_state.h_points)) return;
+
+  // points might have left the grid, so it's rebuilt around their new bounds.
+  resetBounds();
+  m_hasGrid = false;
+}
+
+unsigned int Index::insert(const float3* points, unsigned int count) {
+  ownPoints();
+  unsigned int firstId = m_points.size();
+  m_points.insert(m_points.end(), points, points + count);
+  if (!m_erased.empty()) m_erased.resize(m_points.size(), 0);
+  m_state.h_points = m_points.data();
+  m_state.numPoints = m_points.size();
+
+  if (m_hasGrid && !insertHostGrid(m_grid, m_state.h_points, firstId, count)) {
+    // a new point is outside of the grid.
+    resetBounds();
+    m_hasGrid = false;
+  }
+  compactIfNeeded();
+  return firstId;
+}
+
+void Index::erase(const unsigned int* ids, unsigned int count) {
+  // nothing is erased if any ID is out of range.
+  for (unsigned int i = 0; i < count; i++)
+    if (ids[i] >= m_state.numPoints)
+      throw std::out_of_range("point ID " + std::to_string(ids[i]) + " out of range");
+  if (m_erased.empty()) m_erased.assign(m_state.numPoints, 0);
+  for (unsigned int i = 0; i < count; i++) {
+    if (m_erased[ids[i]]) continue;
+    m_erased[ids[i]] = 1;
+    m_numErased++;
+  }
+  if (m_hasGrid) eraseHostGrid(m_grid, ids, count);
+  compactIfNeeded();
+}
+
+void Index::compactIfNeeded() {
+  if (!m_hasGrid) return;
+  unsigned int numLive = m_state.numPoints - m_numErased;
+  if ((m_grid.numOverflow + m_grid.numTombstones) * 10 > numLive) m_hasGrid = false;
+}
+
+void Index::prepareGrid(float radius, const std::string& mode) {
+  // |buildHostGrid| sizes the cells by the radius and the search mode. any
+  // cell size is correct, but cells much smaller than the radius visit too
+  // many cells and cells much larger test too many points.
+  float cellSize = (mode == "count") ? radius / 4 : radius;
+  if (m_hasGrid && (m_grid.cellSize <= cellSize * 2) && (m_grid.cellSize * 2 >= cellSize)) return;
+
+  m_state.radius = radius;
+  m_state.searchMode = mode;
+  m_grid = HostGrid();
+  m_grid.Tombstones = m_erased;
+  buildHostGrid(m_state, m_grid);
+  m_hasGrid = true;
+  m_numGridBuilds++;
+}
+
+Result Index::query(const float3* queries, unsigned int numQueries, float radius, unsigned int k, const std::string& mode) {
+  if ((mode != "radius") && (mode != "knn") && (mode != "count"))
+    throw std::invalid_argument("unknown search mode " + mode);
+
+  Result res;
+  res.numQueries = numQueries;
+  res.k = (mode == "count") ? 1 : k;
+  if ((numQueries == 0) || (res.k == 0)) return res;
+  // unused slots are UINT_MAX, same as the device output.
+  res.ids.assign((size_t)numQueries * res.k, UINT_MAX);
+  if (m_state.numPoints == 0) {
+    if (mode == "count") std::fill(res.ids.begin(), res.ids.end(), 0);
+    return res;
+  }
+
+  prepareGrid(radius, mode);
+
+  Timing::startTiming("index query");
+    m_state.h_queries = const_cast<float3*>(queries);
+    m_state.numQueries = numQueries;
+    m_state.radius = radius;
+    m_state.knn = k;
+    m_state.searchMode = mode;
+    searchHostGrid(m_state, m_grid, res.ids.data());
+    m_state.h_queries = nullptr;
+  // a tracker issues thousands of small queries, so accumulate the time
+  // rather than printing it; see |Timing::printAverageTimes|. shared by all
+  // indices, and initialized once even if they query concurrently.
+  static int timerId = IDFactory::getId();
+  Timing::stopTiming(false, timerId);
+
+  return res;
+}
+
+NeighborList Index::queryAll(const float3* queries, unsigned int numQueries, float radius) {
+  NeighborList res;
+  res.offsets.assign(numQueries + 1, 0);
+  if ((numQueries == 0) || (m_state.numPoints == 0)) return res;
+
+  prepareGrid(radius, "radius");
+
+  Timing::startTiming("index query all");
+    // count, scan and fill, so that the lists are written straight into
+    // place.
+    parallelFor(numQueries, [&](unsigned int q) {
+      unsigned int count = 0;
+      forEachCandidate(m_grid, queries[q], radius, [&](unsigned int, float3, float sqdist) {
+        if (sqdist < radius * radius) count++;
+        return true;
+      });
+      res.offsets[q + 1] = count;
+    });
+    for (unsigned int q = 0; q < numQueries; q++) res.offsets[q + 1] += res.offsets[q];
+
+    res.ids.resize(res.offsets[numQueries]);
+    parallelFor(numQueries, [&](unsigned int q) {
+      unsigned int* ids = res.ids.data() + res.offsets[q];
+      forEachCandidate(m_grid, queries[q], radius, [&](unsigned int p, float3, float sqdist) {
+        if (sqdist < radius * radius) *ids++ = p;
+        return true;
+      });
+    });
+  static int timerId = IDFactory::getId();
+  Timing::stopTiming(false, timerId);
+
+  return res;
+}
+
+} // namespace rtnn
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include <vector_types.h>
+
+#include "state.h"
+#include "hostgrid.h"
+
+namespace rtnn {
+
+// neighbors of a set of queries: |k| slots per query, the i-th query's
+// neighbors are |ids[i * k]| to |ids[i * k + k - 1]| and unused slots are
+// UINT_MAX, same as the output of a batch of the command line tool. in count
+// mode |k| is 1 and each slot is the number of neighbors.
+struct Result
+{
+  unsigned int numQueries = 0;
+  unsigned int k = 0;
+  std::vector<unsigned int> ids;
+};
+
+// all neighbors of a set of queries in CSR form: the i-th query's neighbors
+// are |ids[offsets[i]]| to |ids[offsets[i + 1] - 1]|, with no cap on their
+// number.
+struct NeighborList
+{
+  std::vector<unsigned int> offsets;
+  std::vector<unsigned int> ids;
+
+  unsigned int size(unsigned int q) const { return offsets[q + 1] - offsets[q]; }
+};
+
+// A search index over a set of points that answers any number of query
+// sets. The index keeps its own copy of the points by default, and the grid
+// (the cell order of the points and the per-cell counts and offsets) is built
+// once and reused by every query whose radius is close enough to the one it
+// was built for; only a radius at least twice as large or small rebuilds it.
+// The search runs on the host backend. An index is not thread-safe, but every
+// query is parallelized internally.
+class Index
+{
+public:
+  // with |copyPoints| false the index refers to |points| instead, which then
+  // have to outlive it and stay unchanged, until the index takes a copy on
+  // the first |update| or |insert|.
+  Index(const float3* points, unsigned int numPoints, bool copyPoints = true);
+
+  // points in double precision, e.g., UTM or ECEF coordinates, which the
+  // index keeps as float offsets from |origin()|, the centre of their
+  // bounding box (as -rc does). queries, moved and inserted points then have
+  // to be given as offsets from it too; see |toLocal|.
+  Index(const double3* points, unsigned int numPoints);
+
+  // |mode| is "radius", "knn" or "count", as in -sm. IDs index the points
+  // given to the constructor.
+  Result query(const float3* queries, unsigned int numQueries, float radius, unsigned int k, const std::string& mode = "radius");
+
+  // every point within |radius| of each query, including a query itself if
+  // it is one of the points.
+  NeighborList queryAll(const float3* queries, unsigned int numQueries, float radius);
+
+  // moves the points to |points| (same number and IDs), e.g., a simulation
+  // step. the grid is updated incrementally if few points changed cells and
+  // rebuilt by the next query otherwise.
+  void update(const float3* points);
+
+  // adds |count| points, which get the IDs numPoints() to numPoints() +
+  // |count| - 1, and tombstones points by ID; IDs are never reused. both go
+  // into the current grid (overflow chunks and tombstones) instead of
+  // rebuilding it, until the changes add up to a tenth of the points, when
+  // the next query rebuilds and thereby compacts the grid. |erase| throws
+  // std::out_of_range, and erases nothing, if an ID is not a point's.
+  unsigned int insert(const float3* points, unsigned int count);
+  void erase(const unsigned int* ids, unsigned int count);
+
+  // including erased points.
+  unsigned int numPoints() const { return m_state.numPoints; }
+  const float3* points() const { return m_state.h_points; }
+  // (0, 0, 0) unless the index was built from double precision points.
+  const double3& origin() const { return m_state.origin; }
+  // |points| as offsets from |origin()|, subtracted in double precision.
+  std::vector<float3> toLocal(const double3* points, unsigned int count) const;
+  // how many times the grid has been built, for profiling the reuse.
+  unsigned int numGridBuilds() const { return m_numGridBuilds; }
+
+private:
+  void prepareGrid(float radius, const std::string& mode);
+  void ownPoints();
+  void resetBounds();
+  void compactIfNeeded();
+
+  std::vector<float3> m_points;
+  // by point ID; empty if no point was erased.
+  std::vector<unsigned char> m_erased;
+  unsigned int m_numErased = 0;
+  RTNNState m_state;
+  HostGrid m_grid;
+  bool m_hasGrid = false;
+  unsigned int m_numGridBuilds = 0;
+};
+
+} // namespace rtnn
@@ -0,0 +1,164 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cstdio>
+
+#include <sutil/Exception.h>
+#include <sutil/vec_math.h>
+
+#include "func.h"
+
+// readers of the input files; host only, so they don't need the device code.
+
+int tokenize(std::string s, std::string del, float3** ndpoints, unsigned int lineId)
+{
+  int start = 0;
+  int end = s.find(del);
+  int dim = 0;
+
+  std::vector<float> vcoords;
+  while (end != -1) {
+    float coord = std::stof(s.substr(start, end - start));
+    //std::cout << coord << std::endl;
+    if (ndpoints != nullptr) {
+      vcoords.push_back(coord);
+    }
+    start = end + del.size();
+    end = s.find(del, start);
+    dim++;
+  }
+  float coord  = std::stof(s.substr(start, end - start));
+  //std::cout << coord << std::endl;
+  if (ndpoints != nullptr) {
+    vcoords.push_back(coord);
+  }
+  dim++;
+
+  assert(dim > 0);
+  if ((dim % 3) != 0) dim = (dim/3+1)*3;
+
+  if (ndpoints != nullptr) {
+    for (int batch = 0; batch < dim/3; batch++) {
+      float3 point = make_float3(vcoords[batch*3], vcoords[batch*3+1], vcoords[batch*3+2]);
+      ndpoints[batch][lineId] = point;
+    }
+  }
+
+  return dim;
+}
+
+float3** read_pc_data(const char* data_file, unsigned int* N, int* d) {
+  std::ifstream file;
+
+  file.open(data_file);
+  if( !file.good() ) {
+    std::cerr << "Could not read the frame data...\n";
+    assert(0);
+  }
+
+  char line[1024];
+  unsigned int lines = 0;
+  int dim = 0;
+
+  while (file.getline(line, 1024)) {
+    if (lines == 0) {
+      std::string str(line);
+      dim = tokenize(str, ",", nullptr, 0);
+    }
+    lines++;
+  }
+  file.clear();
+  file.seekg(0, std::ios::beg);
+
+  *N = lines;
+  *d = dim;
+
+  float3** ndpoints = new float3*[dim/3];
+  for (int i = 0; i < dim/3; i++) {
+    ndpoints[i] = new float3[lines];
+  }
+
+  lines = 0;
+  while (file.getline(line, 1024)) {
+    std::string str(line);
+    tokenize(str, ",", ndpoints, lines);
+
+    //std::cerr << ndpoints[0][lines].x << "," << ndpoints[0][lines].y << "," << ndpoints[0][lines].z << std::endl;
+    //std::cerr << ndpoints[1][lines].x << "," << ndpoints[1][lines].y << "," << ndpoints[1][lines].z << std::endl;
+    lines++;
+  }
+
+  file.close();
+
+  return ndpoints;
+}
+
+float* read_radius_data(const char* data_file, unsigned int* N) {
+  std::ifstream file;
+
+  file.open(data_file);
+  if( !file.good() ) {
+    std::cerr << "Could not read the radius data...\n";
+    assert(0);
+  }
+
+  std::vector<float> radii;
+  float r;
+  while (file >> r) radii.push_back(r);
+  file.close();
+
+  *N = radii.size();
+  float* t_radii = new float[radii.size()];
+  std::copy(radii.begin(), radii.end(), t_radii);
+
+  return t_radii;
+}
+
+template <typename T>
+static T* read_pc_data_as(const char* data_file, unsigned int* N) {
+  std::ifstream file;
+
+  file.open(data_file);
+  if( !file.good() ) {
+    std::cerr << "Could not read the frame data...\n";
+    assert(0);
+  }
+
+  char line[1024];
+  unsigned int lines = 0;
+
+  while (file.getline(line, 1024)) {
+    lines++;
+  }
+  file.clear();
+  file.seekg(0, std::ios::beg);
+  *N = lines;
+
+  T* t_points = new T[lines];
+
+  lines = 0;
+  while (file.getline(line, 1024)) {
+    double x, y, z;
+
+    sscanf(line, "%lf,%lf,%lf\n", &x, &y, &z);
+    t_points[lines].x = x;
+    t_points[lines].y = y;
+    t_points[lines].z = z;
+    //std::cerr << t_points[lines].x << ", " << t_points[lines].y << ", " << t_points[lines].z << std::endl;
+    lines++;
+  }
+
+  file.close();
+
+  return t_points;
+}
+
+float3* read_pc_data(const char* data_file, unsigned int* N) {
+  return read_pc_data_as<float3>(data_file, N);
+}
+
+double3* read_pc_data_double(const char* data_file, unsigned int* N) {
+  return read_pc_data_as<double3>(data_file, N);
+}
@@ -0,0 +1,139 @@
+// Load generator for the search server (-sv): |threads| clients each send
+// |requests| batches of |batch| queries, drawn from a query file, and the
+// throughput and latency percentiles over all requests are reported.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "server.h"
+
+static void printUsageAndExit(const char* argv0) {
+  std::cerr << "\e[1mUsage:\e[0m " << argv0 << " [options]\n\n";
+  std::cerr << "  --socket          | -s      Unix socket of the server. Required.\n";
+  std::cerr << "  --qfile           | -q      File of queries, one \"x,y,z\" per line, in the coordinates of the server's points. Required.\n";
+  std::cerr << "  --radius          | -r      Search radius. Default is 2.\n";
+  std::cerr << "  --knn             | -k      Max neighbors per query; 0 for all. Default is 0.\n";
+  std::cerr << "  --searchmode      | -sm     \"radius\" or \"knn\". Default is \"radius\".\n";
+  std::cerr << "  --batch           | -b      Queries per request, at most 1048576. Default is 64.\n";
+  std::cerr << "  --requests        | -n      Requests per client, at least 1. Default is 1000.\n";
+  std::cerr << "  --threads         | -t      Concurrent clients. Default is 1.\n";
+  std::cerr << "  --shutdown        | -x      Shut the server down at the end? Default is false.\n";
+  std::cerr << "  --help            | -h      Print this usage message\n";
+  exit(0);
+}
+
+static std::vector<double3> readQueries(const std::string& file) {
+  std::ifstream in(file);
+  if (!in.good()) {
+    std::cerr << "Could not read the query data...\n";
+    exit(1);
+  }
+  std::vector<double3> queries;
+  std::string line;
+  while (std::getline(in, line)) {
+    double3 q;
+    if (sscanf(line.c_str(), "%lf,%lf,%lf", &q.x, &q.y, &q.z) == 3) queries.push_back(q);
+  }
+  return queries;
+}
+
+int main(int argc, char* argv[]) {
+  std::string socketPath, qfile;
+  float radius = 2;
+  unsigned int k = 0, batch = 64, requests = 1000, threads = 1;
+  bool knn = false, shutdownServer = false;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") printUsageAndExit(argv[0]);
+    if (i >= argc - 1) printUsageAndExit(argv[0]);
+    const std::string val = argv[++i];
+    if (arg == "--socket" || arg == "-s") socketPath = val;
+    else if (arg == "--qfile" || arg == "-q") qfile = val;
+    else if (arg == "--radius" || arg == "-r") radius = std::stof(val);
+    else if (arg == "--knn" || arg == "-k") k = std::stoul(val);
+    else if (arg == "--searchmode" || arg == "-sm") {
+      if ((val != "radius") && (val != "knn")) printUsageAndExit(argv[0]);
+      knn = (val == "knn");
+    }
+    else if (arg == "--batch" || arg == "-b") batch = std::stoul(val);
+    else if (arg == "--requests" || arg == "-n") requests = std::stoul(val);
+    else if (arg == "--threads" || arg == "-t") threads = std::stoul(val);
+    else if (arg == "--shutdown" || arg == "-x") shutdownServer = (bool)std::stoi(val);
+    else {
+      std::cerr << "Unknown option '" << arg << "'\n";
+      printUsageAndExit(argv[0]);
+    }
+  }
+  if (socketPath.empty() || qfile.empty() || !batch || (batch > rtnn::kMaxRequestQueries) || !requests || !threads)
+    printUsageAndExit(argv[0]);
+
+  std::vector<double3> queries = readQueries(qfile);
+  if (queries.size() < batch) {
+    std::cerr << "Fewer queries than a batch.\n";
+    exit(1);
+  }
+
+  // per-request latency in ms, and neighbors returned, per client.
+  std::vector<std::vector<double>> latencies(threads);
+  std::vector<unsigned long> neighbors(threads, 0);
+  std::vector<std::string> errors(threads);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> clients;
+  for (unsigned int t = 0; t < threads; t++) {
+    clients.emplace_back([&, t]() {
+      try {
+        rtnn::Client client(socketPath);
+        std::mt19937 gen(t);
+        std::uniform_int_distribution<size_t> pick(0, queries.size() - batch);
+        latencies[t].reserve(requests);
+        for (unsigned int r = 0; r < requests; r++) {
+          const double3* q = queries.data() + pick(gen);
+          auto begin = std::chrono::steady_clock::now();
+          rtnn::NeighborList res = client.query(q, batch, radius, k, knn);
+          auto end = std::chrono::steady_clock::now();
+          latencies[t].push_back(std::chrono::duration<double, std::milli>(end - begin).count());
+          neighbors[t] += res.ids.size();
+        }
+      } catch (std::exception& e) {
+        errors[t] = e.what();
+      }
+    });
+  }
+  for (auto& c : clients) c.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  for (auto& e : errors) {
+    if (!e.empty()) {
+      std::cerr << "Client failed: " << e << "\n";
+      exit(1);
+    }
+  }
+
+  std::vector<double> all;
+  unsigned long totalNeighbors = 0;
+  for (unsigned int t = 0; t < threads; t++) {
+    all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+    totalNeighbors += neighbors[t];
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&](double p) { return all[std::min(all.size() - 1, (size_t)(p / 100 * all.size()))]; };
+
+  fprintf(stdout, "requests: %zu (%u clients x %u), queries per request: %u\n", all.size(), threads, requests, batch);
+  fprintf(stdout, "neighbors per query: %f\n", (double)totalNeighbors / all.size() / batch);
+  fprintf(stdout, "throughput: %f requests/s, %f queries/s\n", all.size() / seconds, all.size() * batch / seconds);
+  fprintf(stdout, "latency (ms): p50 %f, p90 %f, p99 %f, p99.9 %f, max %f\n",
+    percentile(50), percentile(90), percentile(99), percentile(99.9), all.back());
+
+  if (shutdownServer) rtnn::Client(socketPath).shutdown();
+  return 0;
+}
@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+
 #include <sutil/Exception.h>
 #include <sutil/Timing.h>
 
@@ -5,6 +9,8 @@
 #include "state.h"
 #include "func.h"
 #include "grid.h"
+#include "scheduler.h"
+#include "sink.h"
 
 void setDevice ( RTNNState& state ) {
   int32_t device_count = 0;
@@ -25,7 +31,7 @@ void setDevice ( RTNNState& state ) {
 
 void freeGridPointers( RTNNState& state ) {
   for (auto it = state.d_gridPointers.begin(); it != state.d_gridPointers.end(); it++) {
-    CUDA_CHECK( cudaFree( *it ) );
+    freeDevicePtr( *it );
   }
   //fprintf(stdout, "Finish early free\n");
 }
@@ -42,6 +48,133 @@ void setupSearch( RTNNState& state ) {
   state.d_actQs[0] = state.params.queries;
   state.h_actQs[0] = state.h_queries;
   state.launchRadius[0] = state.radius;
+  if (state.d_qRadius) {
+    state.d_actQRadius[0] = state.d_qRadius;
+    state.h_actQRadius[0] = state.h_qRadius;
+  }
+  if (state.d_qIds) {
+    state.h_actQIds[0] = new unsigned int[state.numQueries];
+    thrust::copy(thrust::device_pointer_cast(state.d_qIds), thrust::device_pointer_cast(state.d_qIds) + state.numQueries,
+                 state.h_actQIds[0]);
+  }
+}
+
+void writeProfile( RTNNState& state ) {
+  if (!state.profileFile.empty()) {
+    Timing::printProfile();
+    if (!Timing::writeJSON(state.profileFile))
+      fprintf(stderr, "cannot write the profile to %s\n", state.profileFile.c_str());
+  }
+  if (!state.traceFile.empty() && !Timing::writeChromeTrace(state.traceFile))
+    fprintf(stderr, "cannot write the trace to %s\n", state.traceFile.c_str());
+}
+
+// one search on the host with the loaded data.
+void runHost( RTNNState& state ) {
+  Timing::reset();
+  setupHost(state);
+
+  {
+    Timing::Scope total("total search time");
+    if (!state.moveBench.empty()) benchmarkHostUpdate(state);
+    else if (state.reduce != "none") reduceHost(state);
+    else searchHost(state);
+  }
+
+  // the grid update benchmark checks itself.
+  if(state.sanCheck && state.moveBench.empty()) sanityCheck(state);
+
+  writeProfile(state);
+  cleanupHost(state);
+}
+
+// builds the GAS of every batch and searches it, with the stages of the
+// batches run by |BatchScheduler| on a pool of host threads. every batch has
+// its own stream, launch parameters (|batchParams|) and allocations
+// (|d_batchPointers|), so stages of different batches run at once, as far as
+// the memory plan allows (see |estimateMemory|): it budgets the temporary
+// memory of one GAS build at a time, and the result chunks of one batch at a
+// time, which also go to |state.sink| in batch order. a GAS sort holds
+// neither, so it overlaps the builds and searches of other batches. ready
+// stages are picked one batch after another, or with interleaving each stage
+// for all batches before the next.
+static void searchBatches( RTNNState& state ) {
+  // it's possible that certain batches have 0 query (e.g., state.partThd too low).
+  std::vector<bool> active(state.numOfBatches);
+  int numActive = 0;
+  for (int i = 0; i < state.numOfBatches; i++) {
+    active[i] = state.numActQueries[i] > 0;
+    if (active[i]) numActive++;
+  }
+
+  // a worker for every kind of stage that can run at once.
+  BatchScheduler scheduler(std::min(numActive, state.qGasSortMode ? 3 : 2));
+  scheduler.setWorkerInit([&]() { CUDA_CHECK( cudaSetDevice( state.device_id ) ); });
+  int gasBuild = scheduler.addResource("gas build", 1);
+  int results = scheduler.addResource("results", 1);
+
+  // the GAS of the points at the launch radius of the batch over |gsrRatio|.
+  int last = scheduler.addStage("geometry", [&](int i) {
+    createGeometry(state, i, state.launchRadius[i]/state.gsrRatio); // batch_id ignored if not partition.
+  }, {}, gasBuild);
+
+  if (state.qGasSortMode) {
+    last = scheduler.addStage("gas sort", [&](int i) { gasSortSearch(state, i); }, {last});
+    if (state.gsrRatio != 1)
+      last = scheduler.addStage("geometry at the launch radius", [&](int i) {
+        createGeometry(state, i, state.launchRadius[i]);
+      }, {last}, gasBuild);
+  }
+
+  // a batch whose output doesn't fit is searched in chunks of queries; see |search|.
+  scheduler.addStage("search", [&](int i) { search(state, i); }, {last}, results, true);
+
+  scheduler.setOrder(state.interleave ? BatchScheduler::STAGE_MAJOR : BatchScheduler::BATCH_MAJOR);
+  scheduler.run(state.numOfBatches, active);
+}
+
+// one search with OptiX with the loaded data, after |setDevice|.
+void runOptiX( RTNNState& state ) {
+  Timing::reset();
+  MemAccount::reset();
+  uploadData(state);
+
+  // call this after set device.
+  initBatches(state);
+
+  setupOptiX(state);
+
+  Timing::startTiming("total search time");
+
+  // TODO: streamline the logic of partition and sorting.
+  sortParticles(state, QUERY, state.querySortMode);
+
+  // samepq indicates same underlying data and sorting mode, in which case
+  // queries have been sorted so no need to sort them again.
+  if (!state.samepq) sortParticles(state, POINT, state.pointSortMode);
+
+  // early free done here too
+  setupSearch(state);
+
+  // a sink set by the caller takes precedence over -sk.
+  bool ownSink = !state.sink;
+  if (ownSink) state.sink = createSink(state);
+
+  searchBatches(state);
+
+  CUDA_SYNC_CHECK();
+  if (state.sink) state.sink->finish();
+  Timing::stopTiming(true);
+
+  if(state.sanCheck) sanityCheck(state);
+
+  MemAccount::printReport(stdout);
+  writeProfile(state);
+  cleanupState(state);
+  if (ownSink) {
+    delete state.sink;
+    state.sink = nullptr;
+  }
 }
 
 int main( int argc, char* argv[] )
@@ -52,11 +185,22 @@ int main( int argc, char* argv[] )
 
   readData(state);
 
+  if (state.autoTune) autoTune(state);
+
+  Timing::m_recordEvents = !state.traceFile.empty();
+
   std::cout << "========================================" << std::endl;
   std::cout << "numPoints: " << state.numPoints << std::endl;
   std::cout << "numQueries: " << state.numQueries << std::endl;
   std::cout << "searchMode: " << state.searchMode << std::endl;
+  std::cout << "backend: " << state.backend << std::endl;
+  std::cout << "reduce: " << state.reduce << std::endl;
+  std::cout << "Compressed points? " << std::boolalpha << state.compress << std::endl;
+  std::cout << "Half list? " << std::boolalpha << state.halfList << std::endl;
+  std::cout << "Result sink: " << state.sinkType << std::endl;
   std::cout << "radius: " << state.radius << std::endl;
+  std::cout << "origin: " << std::setprecision(17) << state.origin.x << ", " << state.origin.y << ", " << state.origin.z << std::setprecision(6) << std::endl;
+  std::cout << "Per-query radius? " << std::boolalpha << !state.rfile.empty() << std::endl;
   std::cout << "Deferred free? " << std::boolalpha << state.deferFree << std::endl;
   std::cout << "E2E Measure? " << std::boolalpha << state.msr << std::endl;
   std::cout << "K: " << state.knn << std::endl;
@@ -78,78 +222,28 @@ int main( int argc, char* argv[] )
 
   try
   {
-    setDevice(state);
+    if (!state.planFile.empty())
+      exit(planMemory(state) ? 0 : 1);
 
-    Timing::reset();
-    uploadData(state);
-
-    // call this after set device.
-    initBatches(state);
-
-    setupOptiX(state);
-
-    Timing::startTiming("total search time");
-
-    // TODO: streamline the logic of partition and sorting.
-    sortParticles(state, QUERY, state.querySortMode);
-
-    // samepq indicates same underlying data and sorting mode, in which case
-    // queries have been sorted so no need to sort them again.
-    if (!state.samepq) sortParticles(state, POINT, state.pointSortMode);
-
-    // early free done here too
-    setupSearch(state);
-
-    if (state.interleave) {
-      for (int i = 0; i < state.numOfBatches; i++) {
-        // it's possible that certain batches have 0 query (e.g., state.partThd too low).
-        if (state.numActQueries[i] == 0) continue;
-	    // TODO: group buildGas together to allow overlapping; this would allow
-	    // us to batch-free temp storages and non-compacted gas storages. right
-	    // now free storage serializes gas building.
-        createGeometry (state, i, state.launchRadius[i]/state.gsrRatio); // batch_id ignored if not partition.
-      }
-
-      for (int i = 0; i < state.numOfBatches; i++) {
-        if (state.numActQueries[i] == 0) continue;
-        if (state.qGasSortMode) gasSortSearch(state, i);
-      }
-
-      for (int i = 0; i < state.numOfBatches; i++) {
-        if (state.numActQueries[i] == 0) continue;
-        if (state.qGasSortMode && state.gsrRatio != 1)
-          createGeometry (state, i, state.launchRadius[i]);
-      }
-
-      for (int i = 0; i < state.numOfBatches; i++) {
-        if (state.numActQueries[i] == 0) continue;
-        // TODO: when K is too big, we can't launch all rays together. split rays.
-        search(state, i);
-      }
-    } else {
-      for (int i = 0; i < state.numOfBatches; i++) {
-        if (state.numActQueries[i] == 0) continue;
-
-        // create the GAS using the current order of points and the launchRadius of the current batch.
-        // TODO: does it make sense to have per-batch |gsrRatio|?
-        createGeometry (state, i, state.launchRadius[i]/state.gsrRatio); // batch_id ignored if not partition.
-
-        if (state.qGasSortMode) {
-          gasSortSearch(state, i);
-          if (state.gsrRatio != 1)
-            createGeometry (state, i, state.launchRadius[i]);
-        }
-
-        search(state, i);
-      }
+    if (!state.sweepFile.empty()) {
+      runSweep(state);
+      exit(0);
     }
 
-    CUDA_SYNC_CHECK();
-    Timing::stopTiming(true);
+    if (!state.socketPath.empty()) {
+      Timing::reset();
+      serveHost(state);
+      writeProfile(state);
+      exit(0);
+    }
 
-    if(state.sanCheck) sanityCheck(state);
+    if (state.backend == "host") {
+      runHost(state);
+      exit(0);
+    }
 
-    cleanupState(state);
+    setDevice(state);
+    runOptiX(state);
   }
   catch( std::exception& e )
   {
@@ -0,0 +1,121 @@
+#include <algorithm>
+
+#include "memaccount.h"
+
+std::mutex MemAccount::m_mutex;
+std::unordered_map<const void*, MemAccount::Entry> MemAccount::m_live;
+size_t MemAccount::m_current[MEM_CATEGORY_COUNT] = {};
+size_t MemAccount::m_peak[MEM_CATEGORY_COUNT] = {};
+size_t MemAccount::m_total = 0;
+size_t MemAccount::m_totalPeak = 0;
+double MemAccount::m_planned[MEM_CATEGORY_COUNT] = {};
+double MemAccount::m_plannedPeak = 0;
+
+const char* MemAccount::name(MemCategory cat) {
+  static const char* names[MEM_CATEGORY_COUNT] = {
+    "particle data", "grid cells", "partition arrays", "GAS", "GAS build", "results", "other"
+  };
+  return (cat >= 0 && cat < MEM_CATEGORY_COUNT) ? names[cat] : "unknown";
+}
+
+// |m_mutex| must be held.
+void MemAccount::update(MemCategory cat, size_t bytes, bool added) {
+  if (added) {
+    m_current[cat] += bytes;
+    m_total += bytes;
+    m_peak[cat] = std::max(m_peak[cat], m_current[cat]);
+    m_totalPeak = std::max(m_totalPeak, m_total);
+  } else {
+    m_current[cat] -= bytes;
+    m_total -= bytes;
+  }
+}
+
+void MemAccount::add(MemCategory cat, const void* ptr, size_t bytes) {
+  if (!ptr) return;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  // an address can only be live once; a stale entry means its free was missed.
+  auto it = m_live.find(ptr);
+  if (it != m_live.end()) {
+    update(it->second.cat, it->second.bytes, false);
+    m_live.erase(it);
+  }
+  m_live[ptr] = {cat, bytes};
+  update(cat, bytes, true);
+}
+
+void MemAccount::release(const void* ptr) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_live.find(ptr);
+  if (it == m_live.end()) return;
+  update(it->second.cat, it->second.bytes, false);
+  m_live.erase(it);
+}
+
+void MemAccount::retag(const void* ptr, MemCategory cat) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_live.find(ptr);
+  if (it == m_live.end() || it->second.cat == cat) return;
+  // the total doesn't change, so neither does its peak.
+  m_current[it->second.cat] -= it->second.bytes;
+  m_current[cat] += it->second.bytes;
+  m_peak[cat] = std::max(m_peak[cat], m_current[cat]);
+  it->second.cat = cat;
+}
+
+void MemAccount::setPlanned(MemCategory cat, double bytes) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_planned[cat] = bytes;
+}
+
+void MemAccount::setPlannedPeak(double bytes) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_plannedPeak = bytes;
+}
+
+size_t MemAccount::current(MemCategory cat) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_current[cat];
+}
+
+size_t MemAccount::peak(MemCategory cat) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_peak[cat];
+}
+
+size_t MemAccount::totalPeak() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_totalPeak;
+}
+
+double MemAccount::planned(MemCategory cat) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_planned[cat];
+}
+
+void MemAccount::reset() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_live.clear();
+  std::fill(m_current, m_current + MEM_CATEGORY_COUNT, 0);
+  std::fill(m_peak, m_peak + MEM_CATEGORY_COUNT, 0);
+  std::fill(m_planned, m_planned + MEM_CATEGORY_COUNT, 0);
+  m_total = 0;
+  m_totalPeak = 0;
+  m_plannedPeak = 0;
+}
+
+static void printRow(FILE* fp, const char* name, double planned, double peak) {
+  const double MB = 1024 * 1024;
+  if (planned > 0)
+    fprintf(fp, "\t%-18s %12.3f %12.3f %9.2f\n", name, planned / MB, peak / MB, peak / planned);
+  else
+    fprintf(fp, "\t%-18s %12.3f %12.3f %9s\n", name, planned / MB, peak / MB, "-");
+}
+
+void MemAccount::printReport(FILE* fp) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  fprintf(fp, "\t%-18s %12s %12s %9s\n", "device memory", "planned MB", "peak MB", "peak/plan");
+  for (int c = 0; c < MEM_CATEGORY_COUNT; c++)
+    printRow(fp, name((MemCategory)c), m_planned[c], m_peak[c]);
+  printRow(fp, "total", m_plannedPeak, m_totalPeak);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+
+// what a device allocation is for; the categories follow the memory planner
+// (see |estimateMemory| and |planCategories|).
+enum MemCategory
+{
+  MEM_PARTICLE_DATA = 0, // points, queries, their partitioned copies and radii
+  MEM_GRID_CELLS,        // arrays of one element per grid cell
+  MEM_PARTITION_ARRAYS,  // arrays of N or Q indices or keys for sorting and partitioning
+  MEM_GAS,               // the (compacted) GASes
+  MEM_GAS_BUILD,         // AABBs and the temporary buffers of a GAS build
+  MEM_RESULTS,           // neighbor lists and first hits on the device
+  MEM_OTHER,             // launch parameters and SBT records
+  MEM_CATEGORY_COUNT
+};
+
+// Bookkeeping of device allocations by category: the current and peak bytes
+// of every category and the peak of their sum, next to what the planner
+// expected. Only allocations reported with |add| are counted, e.g., not the
+// temporaries of thrust algorithms. It never touches the device, so it works
+// (and can be tested) without one. Thread-safe.
+class MemAccount
+{
+public:
+  static void add(MemCategory cat, const void* ptr, size_t bytes);
+  // pointers that weren't added are ignored.
+  static void release(const void* ptr);
+  // moves an allocation to |cat|, e.g., the output of a GAS build that is
+  // kept as the GAS.
+  static void retag(const void* ptr, MemCategory cat);
+
+  static void setPlanned(MemCategory cat, double bytes);
+  static void setPlannedPeak(double bytes);
+
+  static size_t current(MemCategory cat);
+  static size_t peak(MemCategory cat);
+  static size_t totalPeak();
+  static double planned(MemCategory cat);
+
+  // forgets all allocations and plans.
+  static void reset();
+
+  // planned and peak MB of every category and of the total; an actual peak
+  // far below the plan means the planner is too conservative there.
+  static void printReport(FILE* fp);
+
+  static const char* name(MemCategory cat);
+
+private:
+  struct Entry
+  {
+    MemCategory cat;
+    size_t bytes;
+  };
+
+  static void update(MemCategory cat, size_t bytes, bool added);
+
+  static std::mutex m_mutex;
+  static std::unordered_map<const void*, Entry> m_live;
+  static size_t m_current[MEM_CATEGORY_COUNT];
+  static size_t m_peak[MEM_CATEGORY_COUNT];
+  static size_t m_total;
+  static size_t m_totalPeak;
+  static double m_planned[MEM_CATEGORY_COUNT];
+  static double m_plannedPeak;
+};
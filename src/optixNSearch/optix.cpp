@@ -78,7 +78,7 @@ void filterRemoteQueries ( RTNNState& state ) {
 
   unsigned int count = countIfInRange(thrust::device_pointer_cast(state.params.queries), state.numQueries, tMin, tMax);
   thrust::device_ptr<float3> tQueries;
-  allocThrustDevicePtr(&tQueries, count, &state.d_pointers);
+  allocThrustDevicePtr(&tQueries, count, &state.d_pointers, MEM_PARTICLE_DATA);
   copyIfInRange(state.params.queries, state.numQueries, thrust::device_pointer_cast(state.params.queries), tQueries, tMin, tMax);
   fprintf(stdout, "Filter queries: %u (%.3f)\n", state.numQueries - count, (1 - (float)count/state.numQueries)*100);
 
@@ -97,7 +97,7 @@ void filterRemoteQueries ( RTNNState& state ) {
 
   assert(state.params.points != state.params.queries); // otherwise it's samepq, which wouldn't pass the test earlier
   state.d_pointers.erase(state.d_pointers.find(state.params.queries));
-  CUDA_CHECK( cudaFree( state.params.queries ) );
+  freeDevicePtr( state.params.queries );
 
   state.params.queries = thrust::raw_pointer_cast(tQueries);
   state.numQueries = count;
@@ -118,7 +118,7 @@ void uploadData ( RTNNState& state ) {
   Timing::startTiming("upload points and/or queries");
     // Allocate device memory for points/queries
     thrust::device_ptr<float3> d_points_ptr;
-    state.params.points = allocThrustDevicePtr(&d_points_ptr, state.numPoints, &state.d_pointers);
+    state.params.points = allocThrustDevicePtr(&d_points_ptr, state.numPoints, &state.d_pointers, MEM_PARTICLE_DATA);
 
     thrust::copy(state.h_points, state.h_points + state.numPoints, d_points_ptr);
     computeMinMax(state.numPoints, state.params.points, state.pMin, state.pMax);
@@ -133,12 +133,26 @@ void uploadData ( RTNNState& state ) {
       state.qMax = state.pMax;
     } else {
       thrust::device_ptr<float3> d_queries_ptr;
-      state.params.queries = allocThrustDevicePtr(&d_queries_ptr, state.numQueries, &state.d_pointers);
+      state.params.queries = allocThrustDevicePtr(&d_queries_ptr, state.numQueries, &state.d_pointers, MEM_PARTICLE_DATA);
       
       thrust::copy(state.h_queries, state.h_queries + state.numQueries, d_queries_ptr);
       computeMinMax(state.numQueries, state.params.queries, state.qMin, state.qMax);
     }
 
+    if (state.h_qRadius) {
+      thrust::device_ptr<float> d_qRadius_ptr;
+      state.d_qRadius = allocThrustDevicePtr(&d_qRadius_ptr, state.numQueries, &state.d_pointers, MEM_PARTICLE_DATA);
+      thrust::copy(state.h_qRadius, state.h_qRadius + state.numQueries, d_qRadius_ptr);
+    }
+
+    // a result file records where in the input every query of a row was, as
+    // the queries are sorted and partitioned.
+    if (state.sinkType != "memory") {
+      thrust::device_ptr<unsigned int> d_qIds_ptr;
+      state.d_qIds = allocThrustDevicePtr(&d_qIds_ptr, state.numQueries, &state.d_pointers, MEM_PARTICLE_DATA);
+      genSeqDevice(d_qIds_ptr, state.numQueries);
+    }
+
     Timing::startTiming("filter queries");
       // filter out queries that are theorerically impossible to reach any search
       // points given the search radius, then create a unified grid. why? query
@@ -151,6 +165,11 @@ void uploadData ( RTNNState& state ) {
 
       state.Min = fminf(state.qMin, state.pMin);
       state.Max = fmaxf(state.qMax, state.pMax);
+      // in a periodic box the scene is the box.
+      if (state.periodic) {
+        state.Min = state.boxMin;
+        state.Max = state.boxMax;
+      }
 
       if (state.filterQueries) filterRemoteQueries(state);
 
@@ -191,6 +210,7 @@ static void buildGas(
     CUDA_CHECK( cudaMalloc(
         reinterpret_cast<void**>( &d_temp_buffer_gas ),
         gas_buffer_sizes.tempSizeInBytes));
+    MemAccount::add(MEM_GAS_BUILD, (void*)d_temp_buffer_gas, gas_buffer_sizes.tempSizeInBytes);
 
     // non-compacted output and size of compacted GAS.
     CUdeviceptr d_buffer_temp_output_gas_and_compacted_size;
@@ -200,6 +220,7 @@ static void buildGas(
                 reinterpret_cast<void**>( &d_buffer_temp_output_gas_and_compacted_size ),
                 compactedSizeOffset + 8
                 ) );
+    MemAccount::add(MEM_GAS_BUILD, (void*)d_buffer_temp_output_gas_and_compacted_size, compactedSizeOffset + 8);
 
     OptixAccelEmitDesc emitProperty = {};
     emitProperty.type = OPTIX_PROPERTY_TYPE_COMPACTED_SIZE;
@@ -221,7 +242,7 @@ static void buildGas(
 
     // once the initial tree is built, the temporary storage used for building the tree could be freed
     state.d_temp_buffer_gas[batch_id] = reinterpret_cast<void*>(d_temp_buffer_gas);
-    CUDA_CHECK( cudaFree( state.d_temp_buffer_gas[batch_id] ) );
+    freeDevicePtr( state.d_temp_buffer_gas[batch_id] );
 
     size_t compacted_gas_size;
     CUDA_CHECK( cudaMemcpyAsync( &compacted_gas_size, (void*)emitProperty.result, sizeof(size_t), cudaMemcpyDeviceToHost, state.stream[batch_id] ) );
@@ -230,17 +251,19 @@ static void buildGas(
     {
         // compacted size is smaller, so store the compacted GAS in new device memory and free the original GAS memory/
         CUDA_CHECK( cudaMalloc( reinterpret_cast<void**>( &d_gas_output_buffer ), compacted_gas_size ) );
+        MemAccount::add(MEM_GAS, (void*)d_gas_output_buffer, compacted_gas_size);
 
         // use handle as input and output
         OPTIX_CHECK( optixAccelCompact( state.context, state.stream[batch_id], gas_handle, d_gas_output_buffer, compacted_gas_size, &gas_handle ) );
 
         //state.d_buffer_temp_output_gas_and_compacted_size[batch_id] = (void*)d_buffer_temp_output_gas_and_compacted_size;
-        CUDA_CHECK( cudaFree( (void*)d_buffer_temp_output_gas_and_compacted_size ) );
+        freeDevicePtr( (void*)d_buffer_temp_output_gas_and_compacted_size );
     }
     else
     {
         // original size is smaller, so point d_gas_output_buffer directly to the original device GAS memory.
         d_gas_output_buffer = d_buffer_temp_output_gas_and_compacted_size;
+        MemAccount::retag((void*)d_gas_output_buffer, MEM_GAS);
     }
     fprintf(stdout, "\tFinal GAS size: %f MB\n", (float)compacted_gas_size/(1024 * 1024));
 }
@@ -258,7 +281,7 @@ CUdeviceptr createAABB( RTNNState& state, int batch_id, float radius )
   if (state.d_aabb[batch_id] == nullptr) {
     thrust::device_ptr<OptixAabb> d_aabb_ptr;
     // do not track it so that we can free it early
-    d_aabb = allocThrustDevicePtr(&d_aabb_ptr, numPrims);
+    d_aabb = allocThrustDevicePtr(&d_aabb_ptr, numPrims, nullptr, MEM_GAS_BUILD);
   } else {
     // if pointers are not null, simply reuse the previously allocated device
     // memory to save memory consumption and/or free overhead. this can happen
@@ -278,7 +301,7 @@ CUdeviceptr createAABB( RTNNState& state, int batch_id, float radius )
 
 void createGeometry( RTNNState& state, int batch_id, float radius )
 {
-  Timing::startTiming("create and upload geometry");
+  Timing::startTiming("create and upload geometry", batch_id);
     CUdeviceptr d_aabb = createAABB(state, batch_id, radius);
 
     unsigned int numPrims = state.numPoints;
@@ -310,8 +333,10 @@ void createGeometry( RTNNState& state, int batch_id, float radius )
         state.d_gas_output_buffer[batch_id],
         batch_id);
 
-    state.d_aabb[batch_id] = reinterpret_cast<void*>(d_aabb);
-    CUDA_CHECK( cudaFree( reinterpret_cast<void*>(d_aabb) ) );
+    // freed right after the build, so a second build of the batch (|gsrRatio|
+    // != 1) allocates its own; reusing the freed pointer would write into
+    // memory that a stage of this or another batch may since have allocated.
+    freeDevicePtr( reinterpret_cast<void*>(d_aabb) );
     OMIT_ON_E2EMSR( CUDA_CHECK( cudaStreamSynchronize( state.stream[batch_id] ) ) );
   Timing::stopTiming(true);
 }
@@ -360,8 +385,12 @@ static void createCameraProgram( RTNNState &state, std::vector<OptixProgramGroup
     OptixProgramGroupDesc       cam_prog_group_desc = {};
     cam_prog_group_desc.kind = OPTIX_PROGRAM_GROUP_KIND_RAYGEN;
     cam_prog_group_desc.raygen.module = state.camera_module;
-    if (state.searchMode == "knn")
+    if (!state.multiRadius.empty())
+      cam_prog_group_desc.raygen.entryFunctionName = "__raygen__multi";
+    else if (state.searchMode == "knn")
       cam_prog_group_desc.raygen.entryFunctionName = "__raygen__knn";
+    else if (state.searchMode == "count")
+      cam_prog_group_desc.raygen.entryFunctionName = "__raygen__count";
     else
       cam_prog_group_desc.raygen.entryFunctionName = "__raygen__radius";
 
@@ -390,8 +419,12 @@ static void createMetalSphereProgram( RTNNState &state, std::vector<OptixProgram
     OptixProgramGroupDesc       radiance_sphere_prog_group_desc = {};
     radiance_sphere_prog_group_desc.kind   = OPTIX_PROGRAM_GROUP_KIND_HITGROUP,
     radiance_sphere_prog_group_desc.hitgroup.moduleIS               = state.geometry_module;
-    if (state.searchMode == "knn")
+    if (!state.multiRadius.empty())
+      radiance_sphere_prog_group_desc.hitgroup.entryFunctionNameIS    = "__intersection__sphere_multi";
+    else if (state.searchMode == "knn")
       radiance_sphere_prog_group_desc.hitgroup.entryFunctionNameIS    = "__intersection__sphere_knn";
+    else if (state.searchMode == "count")
+      radiance_sphere_prog_group_desc.hitgroup.entryFunctionNameIS    = "__intersection__sphere_count";
     else
       radiance_sphere_prog_group_desc.hitgroup.entryFunctionNameIS    = "__intersection__sphere_radius";
     radiance_sphere_prog_group_desc.hitgroup.moduleCH               = nullptr;
@@ -505,6 +538,7 @@ void createSBT( RTNNState &state )
         CUDA_CHECK( cudaMalloc(
             reinterpret_cast<void**>( &d_raygen_record ),
             sizeof( RayGenRecord ) ) );
+        MemAccount::add(MEM_OTHER, (void*)d_raygen_record, sizeof( RayGenRecord ));
 
         RayGenRecord rg_sbt;
         optixSbtRecordPackHeader( state.raygen_prog_group, &rg_sbt );
@@ -526,6 +560,7 @@ void createSBT( RTNNState &state )
         CUDA_CHECK( cudaMalloc(
             reinterpret_cast<void**>( &d_miss_record ),
             sizeof_miss_record*RAY_TYPE_COUNT ) );
+        MemAccount::add(MEM_OTHER, (void*)d_miss_record, sizeof_miss_record*RAY_TYPE_COUNT);
 
         MissRecord ms_sbt;
         optixSbtRecordPackHeader( state.radiance_miss_prog_group, &ms_sbt );
@@ -550,6 +585,7 @@ void createSBT( RTNNState &state )
             reinterpret_cast<void**>( &d_hitgroup_records ),
             sizeof_hitgroup_record
         ) );
+        MemAccount::add(MEM_OTHER, (void*)d_hitgroup_records, sizeof_hitgroup_record);
 
         HitGroupRecord hit_sbt;
         OPTIX_CHECK( optixSbtRecordPackHeader(
@@ -592,22 +628,29 @@ void createContext( RTNNState& state )
     state.context = context;
 }
 
-void launchSubframe( unsigned int* output_buffer, RTNNState& state, int batch_id )
+// searches the |numQueries| queries of the batch starting at |firstQuery|;
+// |output_buffer| holds the results of just those.
+void launchSubframe( unsigned int* output_buffer, RTNNState& state, int batch_id, unsigned int firstQuery, unsigned int numQueries )
 {
-    unsigned int numQueries = state.numActQueries[batch_id];
-    state.params.handle = state.gas_handle[batch_id];
-    state.params.queries = state.d_actQs[batch_id];
-    state.params.frame_buffer = output_buffer;
+    Params& params = state.batchParams[batch_id];
+    params.handle = state.gas_handle[batch_id];
+    params.queries = state.d_actQs[batch_id] + firstQuery;
+    params.queryOffset = firstQuery;
+    params.frame_buffer = output_buffer;
 
     fprintf(stdout, "\tLaunch %u (%.4f%%) queries\n", numQueries, (float)numQueries/(float)state.numQueries*100.0);
-    fprintf(stdout, "\tSearch radius: %f\n", state.params.radius);
-    fprintf(stdout, "\tSearch K: %u\n", state.params.limit);
-    fprintf(stdout, "\tSearch mode: %d\n", state.params.mode);
-
-    thrust::device_ptr<Params> d_params_ptr;
-    state.d_params = allocThrustDevicePtr(&d_params_ptr, 1, &state.d_pointers);
-    CUDA_CHECK( cudaMemcpyAsync( reinterpret_cast<void*>( state.d_params ),
-                                 &state.params,
+    if (numQueries < state.numActQueries[batch_id])
+      fprintf(stdout, "\tChunk: queries %u to %u of %u\n", firstQuery, firstQuery + numQueries, state.numActQueries[batch_id]);
+    fprintf(stdout, "\tSearch radius: %f\n", params.radius);
+    fprintf(stdout, "\tSearch K: %u\n", params.limit);
+    fprintf(stdout, "\tSearch mode: %d\n", params.mode);
+
+    // launches of a batch are ordered on its stream, so the copy for a chunk
+    // only overwrites the parameters once the launch of the chunk before it
+    // is done.
+    Params* d_params = state.d_params + batch_id;
+    CUDA_CHECK( cudaMemcpyAsync( reinterpret_cast<void*>( d_params ),
+                                 &params,
                                  sizeof( Params ),
                                  cudaMemcpyHostToDevice,
                                  state.stream[batch_id]
@@ -616,7 +659,7 @@ void launchSubframe( unsigned int* output_buffer, RTNNState& state, int batch_id
     OPTIX_CHECK( optixLaunch(
         state.pipeline[batch_id],
         state.stream[batch_id],
-        reinterpret_cast<CUdeviceptr>( state.d_params ),
+        reinterpret_cast<CUdeviceptr>( d_params ),
         sizeof( Params ),
         &state.sbt,
         numQueries, // launch width
@@ -638,18 +681,22 @@ void cleanupState( RTNNState& state )
     OPTIX_CHECK( optixDeviceContextDestroy( state.context                 ) );
 
     for (int i = 0; i < state.numOfBatches; i++) {
+      if (state.h_actQIds) delete[] state.h_actQIds[i];
       if (state.numActQueries[i] == 0) continue;
 
       CUDA_CHECK( cudaStreamDestroy(state.stream[i]) );
 
-      CUDA_CHECK( cudaFreeHost(state.h_res[i] ) );
-      delete state.h_actQs[i];
+      // results streamed to a sink aren't kept.
+      if (state.h_res[i]) CUDA_CHECK( cudaFreeHost(state.h_res[i] ) );
+      // the caller's queries are not ours to free.
+      if (state.h_actQs[i] != state.h_queries) delete[] state.h_actQs[i];
+      if (state.h_actQRadius && state.partition) delete[] state.h_actQRadius[i];
 
       //CUDA_CHECK( cudaFree( state.d_temp_buffer_gas[i] ) );
       // if compaction isn't successful, d_gas and d_buffer_temp point will point to the same device memory.
       //if (reinterpret_cast<void*>(state.d_gas_output_buffer[i]) != state.d_buffer_temp_output_gas_and_compacted_size[i] )
       //  CUDA_CHECK( cudaFree( state.d_buffer_temp_output_gas_and_compacted_size[i] ) );
-      CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.d_gas_output_buffer[i] ) ) );
+      freeDevicePtr( reinterpret_cast<void*>( state.d_gas_output_buffer[i] ) );
     }
 
     delete state.gas_handle;
@@ -664,15 +711,32 @@ void cleanupState( RTNNState& state )
     delete state.d_temp_buffer_gas;
     delete state.d_buffer_temp_output_gas_and_compacted_size;
     delete state.d_r2q_map;
+    delete[] state.d_actQRadius;
+    delete[] state.h_actQRadius;
+    delete[] state.h_qRadius;
+    delete[] state.h_actQIds;
+    state.h_actQIds = nullptr;
+    delete[] state.h_pointIds;
+    state.h_pointIds = nullptr;
+    delete[] state.h_fltQs;
     //delete state.h_points;
 
-    CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.sbt.raygenRecord       ) ) );
-    CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.sbt.missRecordBase     ) ) );
-    CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.sbt.hitgroupRecordBase ) ) );
+    freeDevicePtr( reinterpret_cast<void*>( state.sbt.raygenRecord       ) );
+    freeDevicePtr( reinterpret_cast<void*>( state.sbt.missRecordBase     ) );
+    freeDevicePtr( reinterpret_cast<void*>( state.sbt.hitgroupRecordBase ) );
 
     for (auto it = state.d_pointers.begin(); it != state.d_pointers.end(); it++) {
-      CUDA_CHECK( cudaFree( *it ) );
+      freeDevicePtr( *it );
+    }
+    for (int i = 0; i < state.maxBatchCount; i++) {
+      for (auto it = state.d_batchPointers[i].begin(); it != state.d_batchPointers[i].end(); it++) {
+        freeDevicePtr( *it );
+      }
     }
+    delete[] state.d_batchPointers;
+    state.d_batchPointers = nullptr;
+    delete[] state.batchParams;
+    state.batchParams = nullptr;
     if (state.deferFree) freeGridPointers(state);
 }
 
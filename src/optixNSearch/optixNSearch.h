@@ -45,6 +45,10 @@ enum RayType
     RAY_TYPE_COUNT
 };
 
+// max number of radii in a multi-radius search; each needs a payload slot for
+// its neighbor count, next to the query index.
+#define MAX_RADII 4
+
 enum SearchType
 {
     PRECISE = 0, // test against the sphere
@@ -58,9 +62,25 @@ struct Params
     float3*          points;
     float3*          queries;
     float            radius;
+    float*           queryRadius; // per-query radius of the current batch; nullptr if all queries use |radius|
     unsigned int*    d_r2q_map;
     unsigned int     limit; // 1 for the initial run to sort indices; knn for future runs.
     SearchType       mode;
+    bool             halfList; // only report neighbors whose ID is larger than the query's
+    unsigned int     queryOffset; // of |queries| in the batch's queries when a launch searches a chunk of them
+
+    // multi-radius search: neighbors within multiRadius[i] go to the
+    // multiK[i] slots starting at multiOffset[i] of the query's |limit| slots.
+    unsigned int     numRadii; // 0 if not a multi-radius search
+    float            multiRadius[MAX_RADII];
+    unsigned int     multiK[MAX_RADII];
+    unsigned int     multiOffset[MAX_RADII];
+
+    // periodic box; queries near a face are also traced from their images
+    // across the face, so distances follow the minimum image convention.
+    bool             periodic;
+    float3           boxMin;
+    float3           boxSize;
 
     OptixTraversableHandle handle;
 };
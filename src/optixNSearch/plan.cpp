@@ -0,0 +1,155 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "grid.h"
+#include "memaccount.h"
+
+// the device memory the planning of |initBatches| expects the search to need,
+// by the categories of |MemAccount|: as the plan the allocations of a search
+// are reported against (|setPlannedMemory|), and as a dry run on the host
+// (|planMemory|) with the cell size |calcCRRatio| would pick for a device of
+// |planMemGB|. the dry run never touches the GPU, so a job can be sized (and
+// rejected) on a machine without one.
+
+namespace {
+
+const float kMB = 1024 * 1024;
+
+} // namespace
+
+float planCategories(RTNNState& state, const MemPlan& plan, bool grid, float planned[MEM_CATEGORY_COUNT],
+                     int& numOfBatches, int& maxBatchCount, unsigned int& numOfCells) {
+  // see |initBatches|.
+  float cellSize = state.radius / state.crRatio;
+  float maxWidth = maxInscribedWidth(state.radius, 3);
+  maxBatchCount = (int)floorf(maxWidth / (2 * cellSize) - 1) + 2;
+  // auto batching picks the count at run time, at most |maxBatchCount|.
+  numOfBatches = !state.partition ? 1 : (!state.autoNB && state.numOfBatches > 0) ? state.numOfBatches : maxBatchCount;
+
+  numOfCells = 0;
+  if (grid) {
+    GridInfo gridInfo;
+    numOfCells = genGridInfo(state, state.numPoints, cellSize, gridInfo, false);
+  }
+
+  std::fill(planned, planned + MEM_CATEGORY_COUNT, 0.0f);
+  planned[MEM_PARTICLE_DATA] = plan.particleDataSize;
+  planned[MEM_GRID_CELLS] = (float)numOfCells * plan.cellArrayCount * sizeof(unsigned int);
+  planned[MEM_PARTITION_ARRAYS] = plan.particleArraysSize;
+  planned[MEM_GAS] = numOfBatches * plan.gasSize;
+  planned[MEM_GAS_BUILD] = plan.instGasSize;
+  planned[MEM_RESULTS] = plan.returnDataSize;
+
+  // the return data and the GAS build temporaries don't co-exist. with
+  // deferred freeing the sorting arrays live through the search; otherwise
+  // only the gas sort arrays do, and the peak is the larger phase.
+  float fixedSize = plan.particleDataSize + plan.particleArraysSize + std::max(plan.returnDataSize, plan.instGasSize);
+  if (state.deferFree)
+    return fixedSize + planned[MEM_GRID_CELLS] + planned[MEM_GAS];
+  return std::max(plan.particleDataSize + plan.particleArraysSize + planned[MEM_GRID_CELLS],
+                  plan.particleDataSize + plan.gasSortArraysSize + std::max(plan.returnDataSize, plan.instGasSize) + planned[MEM_GAS]);
+}
+
+void setPlannedMemory(RTNNState& state) {
+  MemPlan plan;
+  bool grid = estimateMemory(state, plan);
+  float planned[MEM_CATEGORY_COUNT];
+  int numOfBatches, maxBatchCount;
+  unsigned int numOfCells;
+  float peak = planCategories(state, plan, grid, planned, numOfBatches, maxBatchCount, numOfCells);
+  for (int c = 0; c < MEM_CATEGORY_COUNT; c++) MemAccount::setPlanned((MemCategory)c, planned[c]);
+  // |gpuMemUsed| is someone else's and isn't counted.
+  MemAccount::setPlannedPeak(peak);
+}
+
+bool planMemory(RTNNState& state) {
+  // the bounds |uploadData| would compute on the device.
+  computeMinMaxHost(state.numPoints, state.h_points, state.pMin, state.pMax);
+  computeMinMaxHost(state.numQueries, state.h_queries, state.qMin, state.qMax);
+  state.Min = fminf(state.qMin, state.pMin);
+  state.Max = fmaxf(state.qMax, state.pMax);
+  if (state.periodic) {
+    state.Min = state.boxMin;
+    state.Max = state.boxMax;
+  }
+
+  // the data read is a sample of a larger job; only the counts change.
+  if (state.planPoints) state.numPoints = state.planPoints;
+  if (state.samepq) state.numQueries = state.numPoints;
+  else if (state.planQueries) state.numQueries = state.planQueries;
+
+  // the same reserve as |setDevice|.
+  state.totDRAMSize = state.planMemGB - 0.25;
+  float budget = state.totDRAMSize * 1024 * kMB - state.gpuMemUsed * kMB;
+
+  MemPlan plan;
+  bool grid = estimateMemory(state, plan);
+
+  // |calcCRRatio| fails if not even the data leave room for a grid, as
+  // |initBatches| would; the plan then keeps -cr.
+  float fixedSize = plan.particleDataSize + plan.particleArraysSize + std::max(plan.returnDataSize, plan.instGasSize);
+  bool dataFit = fixedSize < budget;
+  if (grid && state.autoCR && dataFit) {
+    float ratio = calcCRRatio(state);
+    if (ratio < 0) dataFit = false;
+    else state.crRatio = ratio;
+  }
+
+  float planned[MEM_CATEGORY_COUNT];
+  int numOfBatches, maxBatchCount;
+  unsigned int numOfCells;
+  float peak = planCategories(state, plan, grid, planned, numOfBatches, maxBatchCount, numOfCells);
+  float cellSize = state.radius / state.crRatio;
+  float cellArraysSize = planned[MEM_GRID_CELLS];
+  float gasTotalSize = planned[MEM_GAS];
+  bool fits = dataFit && peak <= budget;
+
+  FILE* fp = fopen(state.planFile.c_str(), "w");
+  if (!fp) {
+    fprintf(stderr, "Cannot write the plan to %s.\n", state.planFile.c_str());
+    exit(1);
+  }
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"device_memory_gb\": %g,\n", state.planMemGB);
+  fprintf(fp, "  \"budget_mb\": %.3f,\n", budget / kMB);
+  fprintf(fp, "  \"points\": %u,\n", state.numPoints);
+  fprintf(fp, "  \"queries\": %u,\n", state.numQueries);
+  fprintf(fp, "  \"search_mode\": \"%s\",\n", state.searchMode.c_str());
+  fprintf(fp, "  \"radius\": %g,\n", state.radius);
+  fprintf(fp, "  \"k\": %u,\n", state.knn);
+  fprintf(fp, "  \"partition\": %s,\n", state.partition ? "true" : "false");
+  fprintf(fp, "  \"defer_free\": %s,\n", state.deferFree ? "true" : "false");
+  fprintf(fp, "  \"auto_cr\": %s,\n", state.autoCR ? "true" : "false");
+  fprintf(fp, "  \"cr_ratio\": %g,\n", state.crRatio);
+  fprintf(fp, "  \"cell_size\": %g,\n", cellSize);
+  fprintf(fp, "  \"cells\": %u,\n", numOfCells);
+  fprintf(fp, "  \"n_arrays\": %d,\n", plan.pNArrayCount);
+  fprintf(fp, "  \"q_arrays\": %d,\n", plan.qNArrayCount);
+  fprintf(fp, "  \"cell_arrays\": %d,\n", plan.cellArrayCount);
+  fprintf(fp, "  \"particle_data_mb\": %.3f,\n", plan.particleDataSize / kMB);
+  fprintf(fp, "  \"particle_arrays_mb\": %.3f,\n", plan.particleArraysSize / kMB);
+  fprintf(fp, "  \"gas_sort_arrays_mb\": %.3f,\n", plan.gasSortArraysSize / kMB);
+  fprintf(fp, "  \"cell_arrays_mb\": %.3f,\n", cellArraysSize / kMB);
+  fprintf(fp, "  \"return_data_mb\": %.3f,\n", plan.returnDataSize / kMB);
+  fprintf(fp, "  \"gas_per_batch_mb\": %.3f,\n", plan.gasSize / kMB);
+  fprintf(fp, "  \"gas_mb\": %.3f,\n", gasTotalSize / kMB);
+  fprintf(fp, "  \"gas_build_temp_mb\": %.3f,\n", plan.instGasSize / kMB);
+  fprintf(fp, "  \"gpu_mem_used_mb\": %.3f,\n", state.gpuMemUsed);
+  fprintf(fp, "  \"batches\": %d,\n", numOfBatches);
+  fprintf(fp, "  \"max_batches\": %d,\n", maxBatchCount);
+  fprintf(fp, "  \"peak_mb\": %.3f,\n", (peak + state.gpuMemUsed * kMB) / kMB);
+  fprintf(fp, "  \"fits\": %s\n", fits ? "true" : "false");
+  fprintf(fp, "}\n");
+  fclose(fp);
+
+  fprintf(stdout, "\tPlan written to %s: peak %.3f MB of %.3f MB, %s\n", state.planFile.c_str(),
+          (peak + state.gpuMemUsed * kMB) / kMB, state.totDRAMSize * 1024, fits ? "fits" : "does not fit");
+  return fits;
+}
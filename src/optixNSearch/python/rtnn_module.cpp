@@ -0,0 +1,160 @@
+// Python bindings: |import rtnn|. Points and queries are (N, 3) float32
+// C-contiguous NumPy arrays, which are used in place; anything else is
+// rejected rather than silently copied. Results are NumPy arrays that take
+// over the result buffers, and the GIL is released while searching.
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include <cmath>
+#include <climits>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <sutil/vec_math.h>
+
+#include "index.h"
+#include "verlet.h"
+
+namespace py = pybind11;
+
+typedef py::array_t<float, py::array::c_style> PointArray;
+typedef py::array_t<unsigned int, py::array::c_style> IdArray;
+
+static const float3* asPoints(const PointArray& a, const char* name) {
+  if ((a.ndim() != 2) || (a.shape(1) != 3))
+    throw py::value_error(std::string(name) + " must be an (N, 3) float32 array");
+  return reinterpret_cast<const float3*>(a.data());
+}
+
+// hands |v| over to a NumPy array without copying it.
+template <typename T>
+static py::array_t<T> toArray(std::vector<T>&& v, std::vector<py::ssize_t> shape) {
+  std::vector<T>* owner = new std::vector<T>(std::move(v));
+  py::capsule free(owner, [](void* p) { delete static_cast<std::vector<T>*>(p); });
+  return py::array_t<T>(shape, owner->data(), free);
+}
+
+static float distance(const float3* points, const float3& query, unsigned int id) {
+  float3 d = query - points[id];
+  return sqrtf(dot(d, d));
+}
+
+static py::object toPython(rtnn::NeighborList&& list, const float3* points, const float3* queries, bool distances) {
+  std::vector<float> dists;
+  if (distances) {
+    py::gil_scoped_release release;
+    dists.resize(list.ids.size());
+    for (size_t q = 0; q + 1 < list.offsets.size(); q++)
+      for (unsigned int i = list.offsets[q]; i < list.offsets[q + 1]; i++)
+        dists[i] = distance(points, queries[q], list.ids[i]);
+  }
+
+  py::ssize_t numIds = list.ids.size();
+  py::ssize_t numOffsets = list.offsets.size();
+  py::array_t<unsigned int> offsets = toArray(std::move(list.offsets), {numOffsets});
+  py::array_t<unsigned int> ids = toArray(std::move(list.ids), {numIds});
+  if (!distances) return py::make_tuple(offsets, ids);
+  return py::make_tuple(offsets, ids, toArray(std::move(dists), {numIds}));
+}
+
+PYBIND11_MODULE(rtnn, m) {
+  m.doc() = "RTNN neighbor search";
+
+  m.def("backends", []() { return std::vector<std::string>{"host"}; },
+        "Backends usable from Python.");
+
+  py::class_<rtnn::Index>(m, "Index",
+      "A search index over (N, 3) float32 points. The array is used in place, so it must not be "
+      "modified while the index refers to it (until update() or insert()).")
+    .def(py::init([](PointArray points, const std::string& backend) {
+           if (backend != "host")
+             throw py::value_error("backend \"" + backend + "\" is not available; see rtnn.backends()");
+           return new rtnn::Index(asPoints(points, "points"), points.shape(0), false);
+         }),
+         py::arg("points").noconvert(), py::arg("backend") = "host",
+         py::keep_alive<1, 2>())
+    .def("query",
+         [](rtnn::Index& self, PointArray queries, float radius, unsigned int k, const std::string& mode, bool distances) -> py::object {
+           const float3* q = asPoints(queries, "queries");
+           unsigned int n = queries.shape(0);
+           rtnn::Result res;
+           std::vector<float> dists;
+           {
+             py::gil_scoped_release release;
+             res = self.query(q, n, radius, k, mode);
+             if (distances && (mode != "count")) {
+               dists.assign(res.ids.size(), std::numeric_limits<float>::infinity());
+               for (size_t i = 0; i < res.ids.size(); i++)
+                 if (res.ids[i] != UINT_MAX) dists[i] = distance(self.points(), q[i / res.k], res.ids[i]);
+             }
+           }
+           if (mode == "count") return toArray(std::move(res.ids), {(py::ssize_t)n});
+
+           py::array_t<unsigned int> ids = toArray(std::move(res.ids), {(py::ssize_t)n, (py::ssize_t)res.k});
+           if (!distances) return ids;
+           return py::make_tuple(ids, toArray(std::move(dists), {(py::ssize_t)n, (py::ssize_t)res.k}));
+         },
+         py::arg("queries").noconvert(), py::arg("radius"), py::arg("k"), py::arg("mode") = "radius",
+         py::arg("distances") = false,
+         "Up to k neighbors per query as an (n, k) uint32 array padded with 0xffffffff, plus (n, k) "
+         "distances padded with inf if distances is true. mode is \"radius\", \"knn\" or \"count\"; "
+         "count returns an (n,) array of neighbor counts.")
+    .def("query_all",
+         [](rtnn::Index& self, PointArray queries, float radius, bool distances) {
+           const float3* q = asPoints(queries, "queries");
+           rtnn::NeighborList list;
+           {
+             py::gil_scoped_release release;
+             list = self.queryAll(q, queries.shape(0), radius);
+           }
+           return toPython(std::move(list), self.points(), q, distances);
+         },
+         py::arg("queries").noconvert(), py::arg("radius"), py::arg("distances") = false,
+         "All neighbors within radius in CSR form: (offsets, ids[, distances]).")
+    .def("update",
+         [](rtnn::Index& self, PointArray points) {
+           if ((unsigned int)points.shape(0) != self.numPoints())
+             throw py::value_error("update() needs the same number of points");
+           const float3* p = asPoints(points, "points");
+           py::gil_scoped_release release;
+           self.update(p);
+         },
+         py::arg("points").noconvert())
+    .def("insert",
+         [](rtnn::Index& self, PointArray points) {
+           const float3* p = asPoints(points, "points");
+           py::gil_scoped_release release;
+           return self.insert(p, points.shape(0));
+         },
+         py::arg("points").noconvert(), "Adds points; returns the ID of the first.")
+    .def("erase",
+         [](rtnn::Index& self, IdArray ids) {
+           // an ID out of range throws std::out_of_range, i.e., IndexError.
+           py::gil_scoped_release release;
+           self.erase(ids.data(), ids.size());
+         },
+         py::arg("ids"))
+    .def_property_readonly("num_points", &rtnn::Index::numPoints);
+
+  py::class_<rtnn::VerletList>(m, "VerletList",
+      "Neighbor lists within radius cached at radius + skin across timesteps.")
+    .def(py::init<float, float>(), py::arg("radius"), py::arg("skin"))
+    .def("step",
+         [](rtnn::VerletList& self, PointArray points, bool distances) {
+           const float3* p = asPoints(points, "points");
+           rtnn::NeighborList list;
+           {
+             py::gil_scoped_release release;
+             // the lists are reused by the next step, so they are copied out.
+             list = self.step(p, points.shape(0));
+           }
+           return toPython(std::move(list), p, p, distances);
+         },
+         py::arg("points").noconvert(), py::arg("distances") = false,
+         "Neighbors of every particle in CSR form: (offsets, ids[, distances]).")
+    .def_property_readonly("num_builds", &rtnn::VerletList::numBuilds)
+    .def_property_readonly("num_steps", &rtnn::VerletList::numSteps);
+}
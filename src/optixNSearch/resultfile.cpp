@@ -0,0 +1,322 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+#include "resultfile.h"
+
+// O_DIRECT needs the buffer, the size and the file offset of a write to be
+// multiples of the logical block size, which this covers on all common
+// devices.
+static const size_t kAlign = 4096;
+
+static size_t padTo(size_t size, size_t align) { return (size + align - 1) / align * align; }
+
+ResultWriter::ResultWriter(const std::string& path, bool csr, const unsigned int* idMap,
+                           const unsigned int* const* queryIds, size_t bufferSize, size_t maxQueued)
+    : m_path(path), m_csr(csr), m_idMap(idMap), m_queryIds(queryIds),
+      m_bufferSize(padTo(std::max(bufferSize, kAlign), kAlign)), m_maxQueued(maxQueued) {
+  // file systems without O_DIRECT (e.g., tmpfs) refuse it at open.
+  m_direct = true;
+  m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if (m_fd < 0 && errno == EINVAL) {
+    m_direct = false;
+    m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if (m_fd < 0) throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+
+  void* buffer = nullptr;
+  if (posix_memalign(&buffer, kAlign, m_bufferSize) != 0) {
+    close(m_fd);
+    throw std::runtime_error("cannot allocate the write buffer of " + path);
+  }
+  m_buffer = static_cast<char*>(buffer);
+
+  ResultFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RESULT_FILE_MAGIC, sizeof(header.magic));
+  header.version = 1;
+  header.flags = (csr ? RESULT_CSR : 0) | (idMap ? RESULT_REMAPPED : 0) | (queryIds ? RESULT_QUERY_IDS : 0);
+  append(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  m_thread = std::thread(&ResultWriter::work, this);
+}
+
+ResultWriter::~ResultWriter() {
+  // not finished, e.g., when the search failed; the file has no index.
+  if (m_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_done = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+  }
+  if (m_fd >= 0) close(m_fd);
+  free(m_buffer);
+}
+
+void ResultWriter::consume(int batch, unsigned int firstQuery, unsigned int numQueries, unsigned int width,
+                           const unsigned int* rows) {
+  size_t numRows = (size_t)numQueries * width;
+  ResultBlockHeader header = {batch, firstQuery, numQueries, width, 0};
+  if (m_csr) {
+    for (size_t i = 0; i < numRows; i++) header.numIds += (rows[i] != UINT_MAX);
+  }
+
+  size_t queryIdsSize = m_queryIds ? padTo((size_t)numQueries * sizeof(unsigned int), 8) : 0;
+  size_t payload = m_csr ? ((size_t)numQueries + 1) * sizeof(uint64_t) + header.numIds * sizeof(unsigned int)
+                         : numRows * sizeof(unsigned int);
+  std::vector<char> block(padTo(sizeof(header) + queryIdsSize + payload, 8));
+  memcpy(block.data(), &header, sizeof(header));
+  if (m_queryIds)
+    memcpy(block.data() + sizeof(header), m_queryIds[batch] + firstQuery, (size_t)numQueries * sizeof(unsigned int));
+  char* data = block.data() + sizeof(header) + queryIdsSize;
+
+  if (m_csr) {
+    uint64_t* offsets = reinterpret_cast<uint64_t*>(data);
+    unsigned int* ids = reinterpret_cast<unsigned int*>(offsets + numQueries + 1);
+    uint64_t n = 0;
+    offsets[0] = 0;
+    for (unsigned int q = 0; q < numQueries; q++) {
+      const unsigned int* row = rows + (size_t)q * width;
+      for (unsigned int k = 0; k < width; k++)
+        if (row[k] != UINT_MAX) ids[n++] = m_idMap ? m_idMap[row[k]] : row[k];
+      offsets[q + 1] = n;
+    }
+  } else {
+    unsigned int* out = reinterpret_cast<unsigned int*>(data);
+    if (m_idMap) {
+      for (size_t i = 0; i < numRows; i++) out[i] = (rows[i] == UINT_MAX) ? UINT_MAX : m_idMap[rows[i]];
+    } else {
+      memcpy(out, rows, numRows * sizeof(unsigned int));
+    }
+  }
+
+  // a block larger than |m_maxQueued| still goes through, alone.
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_cv.wait(lock, [&]() { return m_error || m_queued == 0 || m_queued + block.size() <= m_maxQueued; });
+  if (m_error) std::rethrow_exception(m_error);
+  m_queued += block.size();
+  m_queue.push_back(std::move(block));
+  m_cv.notify_all();
+}
+
+void ResultWriter::work() {
+  try {
+    while (true) {
+      std::vector<char> block;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&]() { return m_done || !m_queue.empty(); });
+        if (m_queue.empty()) return;
+        block = std::move(m_queue.front());
+        m_queue.pop_front();
+      }
+
+      m_index.push_back(m_fileSize);
+      append(block.data(), block.size());
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queued -= block.size();
+      m_cv.notify_all();
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_error = std::current_exception();
+    m_cv.notify_all();
+  }
+}
+
+// buffers |data| and writes every full buffer.
+void ResultWriter::append(const char* data, size_t size) {
+  m_fileSize += size;
+  while (size) {
+    size_t n = std::min(size, m_bufferSize - m_filled);
+    memcpy(m_buffer + m_filled, data, n);
+    m_filled += n;
+    data += n;
+    size -= n;
+    if (m_filled == m_bufferSize) flush(m_bufferSize);
+  }
+}
+
+// writes the first |size| bytes of the buffer, which is a multiple of
+// |kAlign| unless it's the end of the file, and empties the buffer.
+void ResultWriter::flush(size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pwrite(m_fd, m_buffer + done, size - done, m_flushed + done);
+    if (n < 0 && errno == EINTR) continue;
+    // some file systems accept O_DIRECT at open but not the writes.
+    if (n < 0 && errno == EINVAL && m_direct) {
+      m_direct = false;
+      if (fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT) == 0) continue;
+    }
+    if (n <= 0) throw std::runtime_error("failed to write the results to " + m_path + ": " + strerror(errno));
+    done += n;
+  }
+  m_flushed += size;
+  m_filled = 0;
+}
+
+void ResultWriter::finish() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_done = true;
+  }
+  m_cv.notify_all();
+  m_thread.join();
+  if (m_error) std::rethrow_exception(m_error);
+
+  ResultFileTrailer trailer;
+  trailer.indexOffset = m_fileSize;
+  trailer.numBlocks = m_index.size();
+  memcpy(trailer.magic, RESULT_FILE_MAGIC, sizeof(trailer.magic));
+  append(reinterpret_cast<const char*>(m_index.data()), m_index.size() * sizeof(uint64_t));
+  append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+
+  // the last write is padded to the alignment, and the file cut back to size.
+  uint64_t size = m_fileSize;
+  if (m_filled) {
+    size_t padded = m_direct ? padTo(m_filled, kAlign) : m_filled;
+    memset(m_buffer + m_filled, 0, padded - m_filled);
+    flush(padded);
+  }
+  int fd = m_fd;
+  m_fd = -1;
+  if (ftruncate(fd, size) != 0 || close(fd) != 0)
+    throw std::runtime_error("failed to write the results to " + m_path + ": " + strerror(errno));
+}
+
+ResultReader::ResultReader(const std::string& path) : m_data(nullptr), m_size(0), m_flags(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ResultFileHeader) + sizeof(ResultFileTrailer)) {
+    close(fd);
+    throw std::runtime_error(path + " is not a result file");
+  }
+  m_size = st.st_size;
+  m_data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m_data == MAP_FAILED) {
+    m_data = nullptr;
+    throw std::runtime_error("cannot map " + path + ": " + strerror(errno));
+  }
+
+  const char* base = static_cast<const char*>(m_data);
+  const ResultFileHeader* header = reinterpret_cast<const ResultFileHeader*>(base);
+  const ResultFileTrailer* trailer = reinterpret_cast<const ResultFileTrailer*>(base + m_size - sizeof(ResultFileTrailer));
+  size_t indexEnd = m_size - sizeof(ResultFileTrailer);
+  bool valid = !memcmp(header->magic, RESULT_FILE_MAGIC, sizeof(header->magic)) &&
+               !memcmp(trailer->magic, RESULT_FILE_MAGIC, sizeof(trailer->magic)) && header->version == 1 &&
+               trailer->indexOffset >= sizeof(ResultFileHeader) && trailer->indexOffset <= indexEnd &&
+               trailer->indexOffset % 8 == 0 && (indexEnd - trailer->indexOffset) % sizeof(uint64_t) == 0 &&
+               (indexEnd - trailer->indexOffset) / sizeof(uint64_t) == trailer->numBlocks;
+  m_flags = header->flags;
+
+  const uint64_t* index = reinterpret_cast<const uint64_t*>(base + trailer->indexOffset);
+  for (uint64_t i = 0; valid && i < trailer->numBlocks; i++) {
+    uint64_t offset = index[i];
+    if (offset % 8 || offset < sizeof(ResultFileHeader) || offset > trailer->indexOffset ||
+        trailer->indexOffset - offset < sizeof(ResultBlockHeader)) {
+      valid = false;
+      break;
+    }
+    const ResultBlockHeader* bh = reinterpret_cast<const ResultBlockHeader*>(base + offset);
+    const char* data = base + offset + sizeof(ResultBlockHeader);
+    Block b = {bh->batch, bh->firstQuery, bh->numQueries, bh->width, bh->numIds, nullptr, nullptr, nullptr, nullptr};
+
+    // every size is checked against what's left of the blocks before it's
+    // added up, so that a corrupt header can't wrap a sum around.
+    uint64_t left = trailer->indexOffset - offset - sizeof(ResultBlockHeader);
+    uint64_t numQueries = b.numQueries;
+    if (hasQueryIds()) {
+      uint64_t size = padTo(numQueries * sizeof(unsigned int), 8);
+      if (size > left) {
+        valid = false;
+        break;
+      }
+      b.queryIds = reinterpret_cast<const unsigned int*>(data);
+      data += size;
+      left -= size;
+    }
+    if (csr()) {
+      valid = (numQueries + 1 <= left / sizeof(uint64_t)) &&
+              (b.numIds <= (left - (numQueries + 1) * sizeof(uint64_t)) / sizeof(unsigned int));
+      b.offsets = reinterpret_cast<const uint64_t*>(data);
+      b.ids = reinterpret_cast<const unsigned int*>(b.offsets + numQueries + 1);
+      valid = valid && (b.offsets[0] == 0) && (b.offsets[numQueries] == b.numIds);
+    } else {
+      valid = (b.width == 0) || (numQueries <= left / sizeof(unsigned int) / b.width);
+      b.rows = reinterpret_cast<const unsigned int*>(data);
+    }
+    if (!valid) break;
+    m_batchBlocks[b.batch].push_back(m_blocks.size());
+    m_blocks.push_back(b);
+  }
+
+  // a query is in at most one block.
+  for (size_t i = 0; valid && hasQueryIds() && i < m_blocks.size(); i++) {
+    const Block& b = m_blocks[i];
+    for (unsigned int q = 0; q < b.numQueries; q++) m_byQueryId.push_back({b.queryIds[q], b.batch, b.firstQuery + q});
+  }
+  std::sort(m_byQueryId.begin(), m_byQueryId.end(),
+            [](const QueryPos& a, const QueryPos& b) { return a.queryId < b.queryId; });
+  for (size_t i = 1; valid && i < m_byQueryId.size(); i++) valid = (m_byQueryId[i - 1].queryId != m_byQueryId[i].queryId);
+
+  if (!valid) {
+    munmap(m_data, m_size);
+    m_data = nullptr;
+    throw std::runtime_error(path + " is not a complete result file");
+  }
+
+  for (auto& it : m_batchBlocks)
+    std::sort(it.second.begin(), it.second.end(),
+              [&](size_t a, size_t b) { return m_blocks[a].firstQuery < m_blocks[b].firstQuery; });
+}
+
+ResultReader::~ResultReader() {
+  if (m_data) munmap(m_data, m_size);
+}
+
+unsigned int ResultReader::neighbors(int batch, unsigned int query, const unsigned int** ids) const {
+  *ids = nullptr;
+  auto it = m_batchBlocks.find(batch);
+  if (it == m_batchBlocks.end()) return 0;
+
+  // the last block of the batch that starts at or before |query|.
+  const std::vector<size_t>& blocks = it->second;
+  auto next = std::upper_bound(blocks.begin(), blocks.end(), query,
+                               [&](unsigned int q, size_t b) { return q < m_blocks[b].firstQuery; });
+  if (next == blocks.begin()) return 0;
+  const Block& b = m_blocks[*(next - 1)];
+  if (query >= b.firstQuery + b.numQueries) return 0;
+
+  unsigned int q = query - b.firstQuery;
+  if (csr()) {
+    // only the ends are checked when the file is mapped.
+    if ((b.offsets[q] > b.offsets[q + 1]) || (b.offsets[q + 1] > b.numIds))
+      throw std::runtime_error("corrupt neighbor offsets in a result file");
+    *ids = b.ids + b.offsets[q];
+    return b.offsets[q + 1] - b.offsets[q];
+  }
+  *ids = b.rows + (size_t)q * b.width;
+  return b.width;
+}
+
+unsigned int ResultReader::neighborsOf(unsigned int queryId, const unsigned int** ids) const {
+  *ids = nullptr;
+  auto it = std::lower_bound(m_byQueryId.begin(), m_byQueryId.end(), queryId,
+                             [](const QueryPos& p, unsigned int id) { return p.queryId < id; });
+  if ((it == m_byQueryId.end()) || (it->queryId != queryId)) return 0;
+  return neighbors(it->batch, it->query, ids);
+}
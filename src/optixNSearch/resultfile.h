@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sink.h"
+
+// The result file of a search, written by |ResultWriter| and mapped by
+// |ResultReader|. It is a |ResultFileHeader|, the blocks, an index of their
+// offsets (uint64 each), and a |ResultFileTrailer|. A block holds a chunk of
+// queries of a batch (see |ResultSink|): a |ResultBlockHeader|, in a file with
+// query IDs the position in the input of every query of the block (uint32,
+// padded to 8 bytes), since the search reorders and partitions the queries,
+// and then either the rows, |width| uint32 per query padded with UINT_MAX, or
+// in a CSR file the |numQueries + 1| uint64 offsets of the queries' neighbors
+// in the |numIds| uint32 ids that follow. Blocks start at multiples of 8
+// bytes.
+#define RESULT_FILE_MAGIC "RTNNRES2"
+
+enum ResultFileFlags
+{
+  RESULT_CSR = 1,     // blocks are compressed sparse rows
+  RESULT_REMAPPED = 2, // neighbor IDs are the input order of the points rather than the sorted order
+  RESULT_QUERY_IDS = 4 // blocks hold the input position of their queries
+};
+
+struct ResultFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+};
+
+struct ResultBlockHeader
+{
+  int32_t batch;
+  uint32_t firstQuery;
+  uint32_t numQueries;
+  uint32_t width;
+  uint64_t numIds; // CSR only
+};
+
+struct ResultFileTrailer
+{
+  uint64_t indexOffset;
+  uint64_t numBlocks;
+  char magic[8];
+};
+
+// A sink that writes the chunks to a result file on a thread of its own, so
+// that writing overlaps with the search. |consume| only compacts the rows to
+// CSR and remaps their IDs, if asked to, into a block that it queues; the
+// writer thread packs the blocks into large aligned buffers and writes them
+// with O_DIRECT, bypassing the page cache, where the file system allows it.
+// |consume| waits while more than |maxQueued| bytes are queued, which bounds
+// the memory if the disk is slower than the search. A failed write is thrown
+// by the next |consume| or by |finish|.
+class ResultWriter : public ResultSink
+{
+public:
+  // |idMap|, if not null, maps every neighbor ID to the one written.
+  // |queryIds|, if not null, holds for every batch the input position of its
+  // queries in the order they are consumed (|state.h_actQIds|); it is read
+  // at every |consume|, so a batch's array only has to be final by then. both
+  // have to live until |finish|. throws std::runtime_error if |path| can't be
+  // created.
+  ResultWriter(const std::string& path, bool csr, const unsigned int* idMap = nullptr,
+               const unsigned int* const* queryIds = nullptr, size_t bufferSize = 8 << 20,
+               size_t maxQueued = 256 << 20);
+  ~ResultWriter();
+
+  void consume(int batch, unsigned int firstQuery, unsigned int numQueries, unsigned int width,
+               const unsigned int* rows) override;
+  // writes what is queued and the index and closes the file.
+  void finish() override;
+
+  bool direct() const { return m_direct; }
+  uint64_t bytesWritten() const { return m_fileSize; }
+
+private:
+  void work();
+  void append(const char* data, size_t size);
+  void flush(size_t size);
+
+  std::string m_path;
+  bool m_csr;
+  const unsigned int* m_idMap;
+  const unsigned int* const* m_queryIds;
+  int m_fd;
+  bool m_direct;
+  size_t m_bufferSize;
+  size_t m_maxQueued;
+
+  // of the writer thread.
+  char* m_buffer; // |m_bufferSize| bytes aligned for O_DIRECT
+  size_t m_filled = 0;
+  uint64_t m_fileSize = 0; // bytes appended so far, including what is buffered
+  uint64_t m_flushed = 0;  // bytes written, where the buffer starts in the file
+  std::vector<uint64_t> m_index;
+
+  // guarded by |m_mutex|.
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::deque<std::vector<char>> m_queue;
+  size_t m_queued = 0;
+  bool m_done = false;
+  std::exception_ptr m_error;
+
+  std::thread m_thread;
+};
+
+// Maps a result file read-only; blocks point into the mapping, so the file is
+// paged in as it's read. throws std::runtime_error if the file isn't a
+// complete result file.
+class ResultReader
+{
+public:
+  struct Block
+  {
+    int batch;
+    unsigned int firstQuery;
+    unsigned int numQueries;
+    unsigned int width;
+    uint64_t numIds;               // CSR only
+    const unsigned int* queryIds;  // null if the file has none
+    const unsigned int* rows;      // dense only
+    const uint64_t* offsets;       // CSR only
+    const unsigned int* ids;       // CSR only
+  };
+
+  explicit ResultReader(const std::string& path);
+  ~ResultReader();
+  ResultReader(const ResultReader&) = delete;
+  ResultReader& operator=(const ResultReader&) = delete;
+
+  bool csr() const { return m_flags & RESULT_CSR; }
+  bool remapped() const { return m_flags & RESULT_REMAPPED; }
+  bool hasQueryIds() const { return m_flags & RESULT_QUERY_IDS; }
+  size_t numBlocks() const { return m_blocks.size(); }
+  const Block& block(size_t i) const { return m_blocks[i]; }
+
+  // the neighbors of query |query| of batch |batch|: their count, and in
+  // |*ids| where they start. a dense row is |width| entries, UINT_MAX for
+  // unused ones. returns 0 with |*ids| null if the query isn't in the file.
+  // throws std::runtime_error if the offsets of a CSR block are corrupt.
+  unsigned int neighbors(int batch, unsigned int query, const unsigned int** ids) const;
+  // the same by the position of the query in the input, in a file with query
+  // IDs; queries that weren't searched (e.g., filtered) aren't in it.
+  unsigned int neighborsOf(unsigned int queryId, const unsigned int** ids) const;
+
+private:
+  void* m_data;
+  size_t m_size;
+  uint32_t m_flags;
+  std::vector<Block> m_blocks;
+  std::map<int, std::vector<size_t>> m_batchBlocks; // blocks of every batch by first query
+  struct QueryPos
+  {
+    unsigned int queryId;
+    int batch;
+    unsigned int query;
+  };
+  std::vector<QueryPos> m_byQueryId; // sorted by query ID
+};
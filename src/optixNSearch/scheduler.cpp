@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+#include "scheduler.h"
+
+BatchScheduler::BatchScheduler(unsigned int numWorkers) : m_numWorkers(std::max(1u, numWorkers)) {}
+
+int BatchScheduler::addResource(const std::string& name, unsigned int capacity) {
+  if (capacity == 0) throw std::invalid_argument("resource " + name + " has no capacity");
+  m_resources.push_back({name, capacity, 0});
+  return (int)m_resources.size() - 1;
+}
+
+int BatchScheduler::addStage(const std::string& name, std::function<void(int)> run, const std::vector<int>& deps,
+                             int resource, bool ordered) {
+  int stage = (int)m_stages.size();
+  // dependencies on earlier stages only keep the graph acyclic.
+  for (int d : deps) {
+    if (d < 0 || d >= stage) throw std::invalid_argument("stage " + name + " depends on a later or unknown stage");
+    m_stages[d].dependents.push_back(stage);
+  }
+  if (resource >= (int)m_resources.size()) throw std::invalid_argument("stage " + name + " holds an unknown resource");
+  m_stages.push_back({name, run, deps, std::vector<int>(), resource, ordered});
+  return stage;
+}
+
+// |m_mutex| must be held by all of the below.
+void BatchScheduler::release(int task) {
+  int batch = task / numStages();
+  if (--m_waiting[task] == 0 && m_pos[batch] < (int)m_admitted) m_ready.push_back(task);
+}
+
+void BatchScheduler::admit() {
+  int S = numStages();
+  while (m_admitted < m_batches.size() && (m_maxInFlight == 0 || m_inFlight < m_maxInFlight)) {
+    int batch = m_batches[m_admitted++];
+    m_inFlight++;
+    for (int s = 0; s < S; s++)
+      if (m_waiting[batch * S + s] == 0) m_ready.push_back(batch * S + s);
+  }
+}
+
+// the first ready task by |m_order| whose resource has room; -1 if none.
+int BatchScheduler::pick() {
+  int S = numStages();
+  int best = -1;
+  for (size_t i = 0; i < m_ready.size(); i++) {
+    int task = m_ready[i];
+    int resource = m_stages[task % S].resource;
+    if (resource >= 0 && m_resources[resource].used == m_resources[resource].capacity) continue;
+    if (best < 0) {
+      best = (int)i;
+      continue;
+    }
+    int other = m_ready[best];
+    bool earlier = (m_order == BATCH_MAJOR) ? (task < other)
+                 : (task % S < other % S) || (task % S == other % S && task < other);
+    if (earlier) best = (int)i;
+  }
+  if (best < 0) return -1;
+  int task = m_ready[best];
+  m_ready.erase(m_ready.begin() + best);
+  return task;
+}
+
+void BatchScheduler::finish(int task) {
+  int S = numStages();
+  int batch = task / S, stage = task % S;
+  m_tasksLeft--;
+  for (int d : m_stages[stage].dependents) release(batch * S + d);
+  if (m_stages[stage].ordered && m_pos[batch] + 1 < (int)m_batches.size())
+    release(m_batches[m_pos[batch] + 1] * S + stage);
+  if (--m_left[batch] == 0) {
+    m_inFlight--;
+    admit();
+  }
+}
+
+void BatchScheduler::work(int worker) {
+  typedef std::chrono::steady_clock Clock;
+  int S = numStages();
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (m_tasksLeft > 0 && !m_error) {
+    int task = pick();
+    if (task < 0) {
+      // nothing runs that could make a task ready.
+      if (m_running == 0) {
+        m_error = std::make_exception_ptr(std::logic_error("the batch scheduler is stuck"));
+        break;
+      }
+      m_cv.wait(lock);
+      continue;
+    }
+    const Stage& stage = m_stages[task % S];
+    if (stage.resource >= 0) m_resources[stage.resource].used++;
+    m_running++;
+    lock.unlock();
+
+    TaskRecord rec = {task % S, task / S, worker, 0, 0};
+    rec.start = std::chrono::duration<double, std::milli>(Clock::now() - m_start).count();
+    std::exception_ptr error;
+    try {
+      stage.run(task / S);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    rec.end = std::chrono::duration<double, std::milli>(Clock::now() - m_start).count();
+
+    lock.lock();
+    if (stage.resource >= 0) m_resources[stage.resource].used--;
+    m_running--;
+    m_records.push_back(rec);
+    if (error && !m_error) m_error = error;
+    if (!error) finish(task);
+    m_cv.notify_all();
+  }
+  m_cv.notify_all();
+}
+
+void BatchScheduler::run(int numBatches, const std::vector<bool>& active) {
+  int S = numStages();
+  m_batches.clear();
+  m_pos.assign(numBatches, -1);
+  for (int b = 0; b < numBatches; b++) {
+    if (!active.empty() && !active[b]) continue;
+    m_pos[b] = (int)m_batches.size();
+    m_batches.push_back(b);
+  }
+  m_waiting.assign((size_t)numBatches * S, 0);
+  m_left.assign(numBatches, S);
+  for (int b : m_batches)
+    for (int s = 0; s < S; s++)
+      m_waiting[b * S + s] = (int)m_stages[s].deps.size() + ((m_stages[s].ordered && m_pos[b] > 0) ? 1 : 0);
+  for (auto& r : m_resources) r.used = 0;
+  m_ready.clear();
+  m_records.clear();
+  m_admitted = 0;
+  m_inFlight = 0;
+  m_running = 0;
+  m_tasksLeft = m_batches.size() * S;
+  m_error = nullptr;
+  m_start = std::chrono::steady_clock::now();
+  admit();
+
+  if (m_numWorkers == 1) {
+    work(0);
+  } else {
+    std::vector<std::thread> workers;
+    for (unsigned int w = 0; w < m_numWorkers; w++) {
+      workers.emplace_back([this, w]() {
+        try {
+          if (m_workerInit) m_workerInit();
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          if (!m_error) m_error = std::current_exception();
+          m_cv.notify_all();
+          return;
+        }
+        work(w);
+      });
+    }
+    for (auto& t : workers) t.join();
+  }
+  if (m_error) std::rethrow_exception(m_error);
+}
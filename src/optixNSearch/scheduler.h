@@ -0,0 +1,120 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Runs the stages of a set of batches by their dependencies. Every batch goes
+// through the same DAG of stages; the stage of a batch is ready once the
+// stages it depends on are done for that batch, and, for an ordered stage,
+// once the stage is done for the previous batch. Ready tasks are run by a pool
+// of host threads, within the capacity of the resource every stage holds
+// (e.g., a device that runs one stage at a time) and a limit on the batches
+// in flight (e.g., the GASes that fit in memory), so the stages of different
+// batches overlap as far as those allow. It knows nothing of the device or
+// the search; backends provide the stages.
+class BatchScheduler
+{
+public:
+  // which ready task runs first: the earliest batch, i.e., one batch after
+  // another, or the earliest stage, i.e., each stage for all batches.
+  enum Order
+  {
+    BATCH_MAJOR,
+    STAGE_MAJOR
+  };
+
+  // times in ms from the start of |run|.
+  struct TaskRecord
+  {
+    int stage;
+    int batch;
+    int worker;
+    double start;
+    double end;
+  };
+
+  // with a single worker the tasks run on the calling thread.
+  explicit BatchScheduler(unsigned int numWorkers = 1);
+
+  int addResource(const std::string& name, unsigned int capacity);
+  // |deps| are stages added before; |resource| is -1 for none.
+  int addStage(const std::string& name, std::function<void(int)> run, const std::vector<int>& deps = std::vector<int>(),
+               int resource = -1, bool ordered = false);
+
+  void setOrder(Order order) { m_order = order; }
+  // batches started but not finished; 0 for no limit. batches start in order.
+  void setMaxInFlight(unsigned int maxInFlight) { m_maxInFlight = maxInFlight; }
+  // called by every thread of the pool before its first task, e.g., to set
+  // the device of the thread; a single worker is the calling thread and
+  // doesn't call it.
+  void setWorkerInit(std::function<void()> init) { m_workerInit = init; }
+
+  // runs all stages of the batches for which |active| is true (all if it is
+  // empty). the first exception thrown by a stage is rethrown once the
+  // running tasks are done; no task starts after it.
+  void run(int numBatches, const std::vector<bool>& active = std::vector<bool>());
+
+  // the tasks of the last |run| in the order they finished.
+  const std::vector<TaskRecord>& records() const { return m_records; }
+
+  int numStages() const { return (int)m_stages.size(); }
+  const std::string& stageName(int stage) const { return m_stages[stage].name; }
+  const std::vector<int>& stageDeps(int stage) const { return m_stages[stage].deps; }
+  int stageResource(int stage) const { return m_stages[stage].resource; }
+  bool stageOrdered(int stage) const { return m_stages[stage].ordered; }
+  unsigned int resourceCapacity(int resource) const { return m_resources[resource].capacity; }
+  unsigned int maxInFlight() const { return m_maxInFlight; }
+
+private:
+  struct Stage
+  {
+    std::string name;
+    std::function<void(int)> run;
+    std::vector<int> deps;
+    std::vector<int> dependents;
+    int resource;
+    bool ordered;
+  };
+
+  struct Resource
+  {
+    std::string name;
+    unsigned int capacity;
+    unsigned int used;
+  };
+
+  void admit();
+  void release(int task);
+  int pick();
+  void finish(int task);
+  void work(int worker);
+
+  std::vector<Stage> m_stages;
+  std::vector<Resource> m_resources;
+  unsigned int m_numWorkers;
+  Order m_order = BATCH_MAJOR;
+  unsigned int m_maxInFlight = 0;
+  std::function<void()> m_workerInit;
+
+  // the state of a run, guarded by |m_mutex|. a task is a stage of a batch,
+  // |batch * numStages() + stage|.
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::vector<int> m_batches;  // the active batches in order
+  std::vector<int> m_pos;      // of every batch in |m_batches|, -1 if inactive
+  std::vector<int> m_waiting;  // unfinished dependencies of every task
+  std::vector<int> m_ready;    // tasks whose dependencies are done
+  std::vector<int> m_left;     // unfinished stages of every batch
+  size_t m_admitted = 0;       // of |m_batches|
+  unsigned int m_inFlight = 0;
+  unsigned int m_running = 0;
+  size_t m_tasksLeft = 0;
+  std::exception_ptr m_error;
+  std::vector<TaskRecord> m_records;
+  std::chrono::steady_clock::time_point m_start;
+};
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include <sutil/Exception.h>
 #include <sutil/Timing.h>
 #include <thrust/device_vector.h>
@@ -5,79 +7,171 @@
 #include "optixNSearch.h"
 #include "state.h"
 #include "func.h"
+#include "sink.h"
 
+// searches the queries of a batch in chunks, whose size |calcChunkQueries|
+// picks from the memory budget of the output. a chunk is searched into one of
+// two device buffers on the batch's stream and copied off the device on a
+// stream of its own, so copying a chunk out overlaps with searching the next.
+// results go to |h_res|, or chunk by chunk to |state.sink|.
 void search(RTNNState& state, int batch_id) {
-  Timing::startTiming("batch search time");
+  Timing::startTiming("batch search time", batch_id);
+    unsigned int numQueries = state.numActQueries[batch_id];
+    // the parameters of this batch's launches, which run alongside other
+    // batches' stages; see |searchBatches|.
+    Params& params = state.batchParams[batch_id];
+    params = state.params;
+
+    // count mode returns one count per query rather than K IDs.
+    params.limit = (state.searchMode == "count") ? 1 : state.knn;
+    unsigned int width = params.limit;
+    size_t rowSize = (size_t)width * sizeof(unsigned int);
+
+    if (state.qGasSortMode && !state.toGather) params.d_r2q_map = state.d_r2q_map[batch_id];
+    else params.d_r2q_map = nullptr; // if no GAS-sorting or has done gather, this map is null.
+
+    // a chunked output doesn't stay on the device, so every batch reuses the
+    // budget. GAS-sorted queries that aren't gathered get a single chunk.
+    unsigned int chunkSize = calcChunkQueries(state);
+    bool chunked = chunkSize < state.numQueries;
+    chunkSize = std::min(chunkSize, numQueries);
+    unsigned int numChunks = (numQueries + chunkSize - 1) / chunkSize;
+    int numBuffers = (numChunks > 1) ? 2 : 1;
+
+    params.mode = PRECISE;
+    if ((state.searchMode == "radius") && state.partition && (batch_id < state.numOfBatches - 1)) {
+      // note that hardware AABB test during traversal in the current OptiX
+      // implementation is inherently approximate, so if we want to guarantee
+      // that a point is inside an AABB we still have to do an explicit aabb
+      // test (instead of using NOTEST). see:
+      // https://forums.developer.nvidia.com/t/numerical-imprecision-in-intersection-test/183665/4.
+
+      // in radius mode use AABBTEST except for the last batch. see how the
+      // launchRadius is calculated in the |genBatches| function. AABBTEST is
+      // faster than PRECISE since sphere test is much more costly then aabb test.
+      params.mode = AABBTEST;
+    }
+
+    params.radius = state.launchRadius[batch_id];
+    params.halfList = state.halfList;
+    params.periodic = state.periodic;
+    params.boxMin = state.boxMin;
+    params.boxSize = state.boxMax - state.boxMin;
+
+    // per-radius lists are laid out back to back in each query's row.
+    params.numRadii = state.multiRadius.size();
+    unsigned int offset = 0;
+    for (unsigned int i = 0; i < params.numRadii; i++) {
+      params.multiRadius[i] = state.multiRadius[i];
+      params.multiK[i] = state.multiK[i];
+      params.multiOffset[i] = offset;
+      offset += state.multiK[i];
+    }
+
+    thrust::device_ptr<unsigned int> output_buffer[2];
+    for (int b = 0; b < numBuffers; b++)
+      allocThrustDevicePtr(&output_buffer[b], chunkSize * width, chunked ? nullptr : &state.d_batchPointers[batch_id], MEM_RESULTS);
+
+    // a sink reads every chunk from a pinned staging buffer; otherwise the
+    // chunks are copied to their place in |h_res|, which holds the whole
+    // batch, so only a sink bounds the host memory of the results.
+    unsigned int* h_res = nullptr;
+    unsigned int* staging[2] = {nullptr, nullptr};
+    if (state.sink) {
+      for (int b = 0; b < numBuffers; b++)
+        CUDA_CHECK( cudaMallocHost(reinterpret_cast<void**>(&staging[b]), chunkSize * rowSize) );
+    } else {
+      CUDA_CHECK( cudaMallocHost(reinterpret_cast<void**>(&h_res), numQueries * rowSize) );
+      state.h_res[batch_id] = h_res;
+    }
+
+    cudaStream_t stream = state.stream[batch_id];
+    cudaStream_t copyStream = stream;
+    cudaEvent_t searched[2], copied[2];
+    if (numChunks > 1) CUDA_CHECK( cudaStreamCreate( &copyStream ) );
+    for (int b = 0; b < numBuffers; b++) {
+      CUDA_CHECK( cudaEventCreateWithFlags( &searched[b], cudaEventDisableTiming ) );
+      CUDA_CHECK( cudaEventCreateWithFlags( &copied[b], cudaEventDisableTiming ) );
+    }
+
+    auto chunkQueries = [&](unsigned int c) { return std::min(chunkSize, numQueries - c * chunkSize); };
+    auto enqueue = [&](unsigned int c) {
+      int b = c % 2;
+      unsigned int first = c * chunkSize;
+      unsigned int count = chunkQueries(c);
+      unsigned int* d_out = thrust::raw_pointer_cast(output_buffer[b]);
+
+      // the buffer is free once the chunk before the last is copied out.
+      if (c >= 2) CUDA_CHECK( cudaStreamWaitEvent( stream, copied[b], 0 ) );
+      // unused slots will become UINT_MAX; every count is written so no fill is needed.
+      if (state.searchMode != "count")
+        fillByValue(output_buffer[b], count * width, UINT_MAX, stream);
+
+      params.queryRadius = state.d_actQRadius ? state.d_actQRadius[batch_id] + first : nullptr;
+      launchSubframe( d_out, state, batch_id, first, count );
+      CUDA_CHECK( cudaEventRecord( searched[b], stream ) );
+
+      CUDA_CHECK( cudaStreamWaitEvent( copyStream, searched[b], 0 ) );
+      void* dst = state.sink ? static_cast<void*>(staging[b]) : static_cast<void*>(h_res + (size_t)first * width);
+      CUDA_CHECK( cudaMemcpyAsync( dst, d_out, count * rowSize, cudaMemcpyDeviceToHost, copyStream ) );
+      CUDA_CHECK( cudaEventRecord( copied[b], copyStream ) );
+    };
+
     Timing::startTiming("search compute");
-      unsigned int numQueries = state.numActQueries[batch_id];
-
-      state.params.limit = state.knn;
-      thrust::device_ptr<unsigned int> output_buffer;
-      allocThrustDevicePtr(&output_buffer, numQueries * state.params.limit, &state.d_pointers);
-      // unused slots will become UINT_MAX
-      fillByValue(output_buffer, numQueries * state.params.limit, UINT_MAX);
-
-      if (state.qGasSortMode && !state.toGather) state.params.d_r2q_map = state.d_r2q_map[batch_id];
-      else state.params.d_r2q_map = nullptr; // if no GAS-sorting or has done gather, this map is null.
-
-      state.params.mode = PRECISE;
-      if ((state.searchMode == "radius") && state.partition && (batch_id < state.numOfBatches - 1)) {
-        // note that hardware AABB test during traversal in the current OptiX
-        // implementation is inherently approximate, so if we want to guarantee
-        // that a point is inside an AABB we still have to do an explicit aabb
-        // test (instead of using NOTEST). see:
-        // https://forums.developer.nvidia.com/t/numerical-imprecision-in-intersection-test/183665/4.
-
-        // in radius mode use AABBTEST except for the last batch. see how the
-        // launchRadius is calculated in the |genBatches| function. AABBTEST is
-        // faster than PRECISE since sphere test is much more costly then aabb test.
-        state.params.mode = AABBTEST;
+      // the staging buffer of a chunk is reused two chunks later, after the
+      // sink has consumed it.
+      enqueue(0);
+      for (unsigned int c = 0; c < numChunks; c++) {
+        if (c + 1 < numChunks) enqueue(c + 1);
+        if (state.sink) {
+          CUDA_CHECK( cudaEventSynchronize( copied[c % 2] ) );
+          state.sink->consume(batch_id, c * chunkSize, chunkQueries(c), width, staging[c % 2]);
+        }
       }
-
-      state.params.radius = state.launchRadius[batch_id];
-
-      launchSubframe( thrust::raw_pointer_cast(output_buffer), state, batch_id );
-      OMIT_ON_E2EMSR( CUDA_CHECK( cudaStreamSynchronize( state.stream[batch_id] ) ) );
+      OMIT_ON_E2EMSR( CUDA_CHECK( cudaStreamSynchronize( stream ) ) );
     Timing::stopTiming(true);
 
     Timing::startTiming("result copy D2H");
-      void* data;
-      cudaMallocHost(reinterpret_cast<void**>(&data), numQueries * state.params.limit * sizeof(unsigned int));
-      state.h_res[batch_id] = data;
-
-      CUDA_CHECK( cudaMemcpyAsync(
-                      static_cast<void*>( data ),
-                      thrust::raw_pointer_cast(output_buffer),
-                      numQueries * state.params.limit * sizeof(unsigned int),
-                      cudaMemcpyDeviceToHost,
-                      state.stream[batch_id]
-                      ) );
-      OMIT_ON_E2EMSR( CUDA_CHECK( cudaStreamSynchronize( state.stream[batch_id] ) ) );
+      if (chunked) CUDA_CHECK( cudaStreamSynchronize( copyStream ) );
+      else OMIT_ON_E2EMSR( CUDA_CHECK( cudaStreamSynchronize( copyStream ) ) );
     Timing::stopTiming(true);
+
+    for (int b = 0; b < numBuffers; b++) {
+      CUDA_CHECK( cudaEventDestroy( searched[b] ) );
+      CUDA_CHECK( cudaEventDestroy( copied[b] ) );
+      if (staging[b]) CUDA_CHECK( cudaFreeHost( staging[b] ) );
+      if (chunked) freeDevicePtr( thrust::raw_pointer_cast(output_buffer[b]) );
+    }
+    if (copyStream != stream) CUDA_CHECK( cudaStreamDestroy( copyStream ) );
   Timing::stopTiming(true);
 
-  // this frees device memory but will block until the previous optix launch finish and the res is written back.
-  //CUDA_CHECK( cudaFree( (void*)thrust::raw_pointer_cast(output_buffer) ) );
+  // an unchunked output is freed at cleanup; freeing it here would block
+  // until the launch finishes and the results are written back.
 }
 
 thrust::device_ptr<unsigned int> initialTraversal(RTNNState& state, int batch_id) {
-  Timing::startTiming("initial traversal");
+  Timing::startTiming("initial traversal", batch_id);
     unsigned int numQueries = state.numActQueries[batch_id];
+    Params& params = state.batchParams[batch_id];
+    params = state.params;
 
-    state.params.limit = 1;
+    params.limit = 1;
     thrust::device_ptr<unsigned int> output_buffer;
-    allocThrustDevicePtr(&output_buffer, numQueries * state.params.limit, &state.d_pointers);
+    allocThrustDevicePtr(&output_buffer, numQueries * params.limit, &state.d_batchPointers[batch_id], MEM_RESULTS);
     // for initial sort fill with 0. it's possible that a query has no
     // neighbors (no intersection with any of the AABB), in which case during
     // gas-sort using FHCoord, gather might use UINT_MAX as a key if filled
     // with UINT_MAX.
-    fillByValue(output_buffer, numQueries * state.params.limit, 0);
+    fillByValue(output_buffer, numQueries * params.limit, 0, state.stream[batch_id]);
 
-    state.params.d_r2q_map = nullptr; // contains the index to reorder rays
-    state.params.mode = NOTEST;
-    state.params.radius = state.launchRadius[batch_id]; // doesn't quite matter since we never check radius in approx mode
+    params.d_r2q_map = nullptr; // contains the index to reorder rays
+    params.mode = NOTEST;
+    params.radius = state.launchRadius[batch_id]; // doesn't quite matter since we never check radius in approx mode
+    params.queryRadius = nullptr;
+    params.halfList = false; // the first hit is only used for sorting
+    params.numRadii = 0;
 
-    launchSubframe( thrust::raw_pointer_cast(output_buffer), state, batch_id );
+    launchSubframe( thrust::raw_pointer_cast(output_buffer), state, batch_id, 0, numQueries );
     // TODO: could delay this until sort, but initial traversal is lightweight anyways
     OMIT_ON_E2EMSR( CUDA_CHECK( cudaStreamSynchronize( state.stream[batch_id] ) ) );
   Timing::stopTiming(true);
@@ -91,6 +185,9 @@ void gasSortSearch(RTNNState& state, int batch_id) {
   // pre-sorting is done, and might even out-perform it since we are sorting
   // fewer points.
 
+  // groups the phases below in the profile; their own times are printed.
+  Timing::Scope scope("gas-sort search", false, batch_id);
+
   // Initial traversal to aggregate the queries
   thrust::device_ptr<unsigned int> d_firsthit_idx_ptr = initialTraversal(state, batch_id);
 
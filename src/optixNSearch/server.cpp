@@ -0,0 +1,159 @@
+#include <sutil/Exception.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "server.h"
+#include "state.h"
+#include "func.h"
+
+namespace {
+
+bool sendError(int fd, const std::string& msg) {
+  rtnn::ResponseHeader res = {1, 0, 0};
+  uint64_t length = sizeof(res) + msg.size();
+  return rtnn::writeFull(fd, &length, sizeof(length)) && rtnn::writeFull(fd, &res, sizeof(res)) &&
+         rtnn::writeFull(fd, msg.data(), msg.size());
+}
+
+bool sendList(int fd, const rtnn::NeighborList& list) {
+  rtnn::ResponseHeader res = {0, (uint32_t)list.offsets.size() - 1, (uint32_t)list.ids.size()};
+  uint64_t length = sizeof(res) + (list.offsets.size() + list.ids.size()) * sizeof(uint32_t);
+  return rtnn::writeFull(fd, &length, sizeof(length)) && rtnn::writeFull(fd, &res, sizeof(res)) &&
+         rtnn::writeFull(fd, list.offsets.data(), list.offsets.size() * sizeof(uint32_t)) &&
+         rtnn::writeFull(fd, list.ids.data(), list.ids.size() * sizeof(uint32_t));
+}
+
+// K-capped results come padded with UINT_MAX; drop the padding.
+rtnn::NeighborList toList(const rtnn::Result& res) {
+  rtnn::NeighborList list;
+  list.offsets.assign(res.numQueries + 1, 0);
+  list.ids.reserve(res.ids.size());
+  for (unsigned int q = 0; q < res.numQueries; q++) {
+    for (unsigned int i = 0; i < res.k; i++) {
+      unsigned int id = res.ids[(size_t)q * res.k + i];
+      if (id == UINT_MAX) break;
+      list.ids.push_back(id);
+    }
+    list.offsets[q + 1] = list.ids.size();
+  }
+  return list;
+}
+
+struct Server
+{
+  rtnn::Index index;
+  // the index isn't thread-safe; each query is parallelized internally.
+  std::mutex indexMutex;
+  double3 origin;
+  int listenFd = -1;
+  std::atomic<bool> stopping;
+  std::atomic<unsigned long> numRequests;
+
+  Server(const RTNNState& state)
+    : index(state.h_points, state.numPoints), origin(state.origin), stopping(false), numRequests(0) {}
+
+  void serveConnection(int fd);
+};
+
+// answers requests on |fd| until the client closes it.
+void Server::serveConnection(int fd) {
+  std::vector<double3> request;
+  std::vector<float3> queries;
+  uint64_t length;
+  rtnn::RequestHeader req;
+
+  while (rtnn::readFull(fd, &length, sizeof(length))) {
+    if ((length < sizeof(req)) || !rtnn::readFull(fd, &req, sizeof(req))) break;
+
+    if (req.op == rtnn::OP_SHUTDOWN) {
+      stopping = true;
+      // wakes up |accept|.
+      ::shutdown(listenFd, SHUT_RDWR);
+      break;
+    }
+    // the queries of an oversized request are not read, so the connection
+    // can't go on.
+    if ((req.op == rtnn::OP_QUERY) && (req.numQueries > rtnn::kMaxRequestQueries)) {
+      sendError(fd, "more than " + std::to_string(rtnn::kMaxRequestQueries) + " queries in a request");
+      break;
+    }
+    if ((req.op != rtnn::OP_QUERY) || (length != sizeof(req) + (uint64_t)req.numQueries * sizeof(double3))) {
+      sendError(fd, "malformed request");
+      break;
+    }
+
+    request.resize(req.numQueries);
+    if (!rtnn::readFull(fd, request.data(), request.size() * sizeof(double3))) break;
+    if (req.knn && (req.k == 0)) {
+      if (!sendError(fd, "KNN search needs a K")) break;
+      continue;
+    }
+
+    // points are stored relative to |origin| (see -rc); queries come in the
+    // original coordinates.
+    queries.resize(req.numQueries);
+    toLocal(request.data(), req.numQueries, origin, queries.data());
+
+    rtnn::NeighborList list;
+    {
+      std::lock_guard<std::mutex> lock(indexMutex);
+      if (req.k == 0) list = index.queryAll(queries.data(), req.numQueries, req.radius);
+      else list = toList(index.query(queries.data(), req.numQueries, req.radius, req.k, req.knn ? "knn" : "radius"));
+    }
+    numRequests++;
+    if (!sendList(fd, list)) break;
+  }
+  close(fd);
+}
+
+} // namespace
+
+void serveHost(RTNNState& state) {
+  Server server(state);
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (state.socketPath.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long.\n", state.socketPath.c_str());
+    exit(1);
+  }
+  strcpy(addr.sun_path, state.socketPath.c_str());
+
+  server.listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(state.socketPath.c_str());
+  if ((server.listenFd < 0) || (bind(server.listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) ||
+      (listen(server.listenFd, 64) < 0)) {
+    fprintf(stderr, "Can't listen on %s: %s\n", state.socketPath.c_str(), strerror(errno));
+    exit(1);
+  }
+  fprintf(stdout, "Serving %u points on %s\n", state.numPoints, state.socketPath.c_str());
+  fflush(stdout);
+
+  std::vector<std::thread> connections;
+  while (!server.stopping) {
+    int fd = accept(server.listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      if (!server.stopping) fprintf(stderr, "accept: %s\n", strerror(errno));
+      break;
+    }
+    connections.emplace_back(&Server::serveConnection, &server, fd);
+  }
+
+  for (auto& t : connections) t.join();
+  close(server.listenFd);
+  unlink(state.socketPath.c_str());
+  fprintf(stdout, "Served %lu requests\n", server.numRequests.load());
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <vector_types.h>
+
+#include "index.h"
+
+// The protocol of the search server (-sv), a Unix domain socket that answers
+// query batches against the points it was started with. Every message is a
+// uint64_t byte length followed by that many bytes, in the byte order of the
+// host (the socket is local). A request is
+//
+//   uint32_t op;            // |ServerOp|
+//   uint32_t numQueries;
+//   float    radius;
+//   uint32_t k;             // max neighbors per query; 0 for all (radius only)
+//   uint32_t knn;           // 1 for KNN search, 0 for radius search
+//   double   queries[numQueries][3];
+//
+// with the queries in the original coordinates of the points, in double
+// precision; the server subtracts the origin it stores the points relative to
+// (see -rc) before narrowing them. a request of more than
+// |kMaxRequestQueries| queries gets an error response and the connection is
+// closed.
+// and a response is
+//
+//   uint32_t status;        // 0 on success; otherwise the rest is an error message
+//   uint32_t numQueries;
+//   uint32_t numIds;
+//   uint32_t offsets[numQueries + 1];
+//   uint32_t ids[numIds];
+//
+// i.e., neighbor lists in CSR form (see |rtnn::NeighborList|).
+namespace rtnn {
+
+enum ServerOp : uint32_t
+{
+  OP_QUERY = 1,
+  OP_SHUTDOWN = 2,
+};
+
+// 24 MB of queries per request.
+const uint32_t kMaxRequestQueries = 1 << 20;
+
+struct RequestHeader
+{
+  uint32_t op;
+  uint32_t numQueries;
+  float radius;
+  uint32_t k;
+  uint32_t knn;
+};
+
+struct ResponseHeader
+{
+  uint32_t status;
+  uint32_t numQueries;
+  uint32_t numIds;
+};
+
+// read or write exactly |size| bytes of a socket; false if the connection is
+// closed or fails.
+bool readFull(int fd, void* buf, size_t size);
+bool writeFull(int fd, const void* buf, size_t size);
+
+// A connection to a search server. Not thread-safe; use one client per
+// thread. Failures throw std::runtime_error.
+class Client
+{
+public:
+  explicit Client(const std::string& socketPath);
+  ~Client();
+
+  // |k| = 0 returns all neighbors within |radius| (radius search only).
+  // |numQueries| is at most |kMaxRequestQueries|.
+  NeighborList query(const double3* queries, uint32_t numQueries, float radius, uint32_t k = 0, bool knn = false);
+  // asks the server to exit once its open connections close.
+  void shutdown();
+
+private:
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+
+  int m_fd = -1;
+};
+
+} // namespace rtnn
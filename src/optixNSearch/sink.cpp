@@ -0,0 +1,18 @@
+#include <sutil/Exception.h>
+
+#include <stdexcept>
+
+#include "state.h"
+#include "func.h"
+#include "resultfile.h"
+#include "sink.h"
+
+// the sink of -sk; nullptr for "memory", where results stay in |h_res|. call
+// it after sorting, since -rm maps IDs by the final order of the points.
+ResultSink* createSink(RTNNState& state) {
+  if (state.sinkType == "memory") return nullptr;
+  if ((state.sinkType != "file") && (state.sinkType != "csr"))
+    throw std::invalid_argument("unknown result sink " + state.sinkType);
+  return new ResultWriter(state.outFile, state.sinkType == "csr", state.remapIds ? state.h_pointIds : nullptr,
+                          state.h_actQIds);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <functional>
+
+// Receives the results of a search one chunk of queries at a time, as the
+// chunks are copied off the device; see |search|. A chunk is the queries
+// [firstQuery, firstQuery + numQueries) of batch |batch|, in the order of
+// |state.h_actQs[batch]|, and |rows| holds |width| entries per query: neighbor
+// IDs padded with UINT_MAX, or one count in count mode. The chunks of a batch
+// come in order, and |rows| is only valid during |consume|.
+class ResultSink
+{
+public:
+  virtual ~ResultSink() {}
+  virtual void consume(int batch, unsigned int firstQuery, unsigned int numQueries, unsigned int width,
+                       const unsigned int* rows) = 0;
+  // after the last chunk of the search.
+  virtual void finish() {}
+};
+
+// calls a function with every chunk, e.g., to consume the results in place
+// when RTNN is embedded.
+class CallbackSink : public ResultSink
+{
+public:
+  typedef std::function<void(int, unsigned int, unsigned int, unsigned int, const unsigned int*)> Callback;
+
+  explicit CallbackSink(Callback callback) : m_callback(callback) {}
+  void consume(int batch, unsigned int firstQuery, unsigned int numQueries, unsigned int width,
+               const unsigned int* rows) override {
+    m_callback(batch, firstQuery, numQueries, width, rows);
+  }
+
+private:
+  Callback m_callback;
+};
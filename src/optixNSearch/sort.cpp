@@ -18,7 +18,7 @@
 #include <cstdlib>
 #include <queue>
 #include <unordered_set>
-#include <map>
+#include <vector>
 #include <float.h>
 
 #include "optixNSearch.h"
@@ -26,11 +26,6 @@
 #include "state.h"
 #include "grid.h"
 
-#ifdef MEM_STATS
-  extern std::map<void*, double> memmap;
-  extern double tot_alloc_size;
-#endif
-
 void computeMinMax(unsigned int N, float3* particles, float3& min, float3& max)
 {
   // TODO: maybe use long since we are going to convert a float to its floor value?
@@ -70,71 +65,6 @@ void computeMinMax(unsigned int N, float3* particles, float3& min, float3& max)
   fprintf(stdout, "\tscene boundary: (%f, %f, %f), (%f, %f, %f)\n", min.x, min.y, min.z, max.x, max.y, max.z);
 }
 
-unsigned int genGridInfo(RTNNState& state, unsigned int N, GridInfo& gridInfo) {
-  float3 sceneMin = state.Min;
-  float3 sceneMax = state.Max;
-
-  gridInfo.ParticleCount = N;
-  gridInfo.GridMin = sceneMin;
-
-  float cellSize = state.radius / state.crRatio;
-  float3 gridSize = sceneMax - sceneMin;
-  gridInfo.GridDimension.x = static_cast<unsigned int>(ceilf(gridSize.x / cellSize));
-  gridInfo.GridDimension.y = static_cast<unsigned int>(ceilf(gridSize.y / cellSize));
-  gridInfo.GridDimension.z = static_cast<unsigned int>(ceilf(gridSize.z / cellSize));
-
-  // Adjust grid size to multiple of cell size
-  gridSize.x = gridInfo.GridDimension.x * cellSize;
-  gridSize.y = gridInfo.GridDimension.y * cellSize;
-  gridSize.z = gridInfo.GridDimension.z * cellSize;
-
-  gridInfo.GridDelta.x = gridInfo.GridDimension.x / gridSize.x;
-  gridInfo.GridDelta.y = gridInfo.GridDimension.y / gridSize.y;
-  gridInfo.GridDelta.z = gridInfo.GridDimension.z / gridSize.z;
-
-  // morton code can only be correctly calcuated for a cubic, where each
-  //   dimension is of the same size and the dimension is a power of 2. if we
-  //   were to generate one single morton code for the entire grid, this would
-  //   waste a lot of space since a lot of empty cells will have to be padded.
-  //   the strategy is to divide the grid into smaller equal-dimension-power-of-2
-  //   smaller grids (meta_grid here). the order within each meta_grid is morton,
-  //   but the order across meta_grids is raster order.
-  // TODO: the current implementation uses a heuristics. we get the largest
-  //   power of 2 that doesn't exceed the shortest side, and then divide it by a
-  //   scaling factor. the result becomes the size of a meta grid. the smaller
-  //   the scaling factor, the more space waste (which limits the number of
-  //   cells) but enforces a more global order; maybe a better strategy?
-  unsigned int shortestSide = std::min({gridInfo.GridDimension.x, gridInfo.GridDimension.y, gridInfo.GridDimension.z});
-  // dim should at least be 1; otherwise we won't get 0 cells.
-  gridInfo.meta_grid_dim = std::max((int)pow(2, floorf(log2(shortestSide)))/state.mcScale, 1);
-  gridInfo.meta_grid_size = gridInfo.meta_grid_dim * gridInfo.meta_grid_dim * gridInfo.meta_grid_dim;
-
-  // One meta grid cell contains meta_grid_dim^3 cells. The morton curve is
-  // calculated for each metagrid, and the order of metagrid is raster order.
-  // So if meta_grid_dim is 1, this is basically the same as raster order
-  // across all cells. If meta_grid_dim is the same as GridDimension, this
-  // calculates one single morton curve for the entire grid.
-  gridInfo.MetaGridDimension.x = static_cast<unsigned int>(ceilf(gridInfo.GridDimension.x / (float)gridInfo.meta_grid_dim));
-  gridInfo.MetaGridDimension.y = static_cast<unsigned int>(ceilf(gridInfo.GridDimension.y / (float)gridInfo.meta_grid_dim));
-  gridInfo.MetaGridDimension.z = static_cast<unsigned int>(ceilf(gridInfo.GridDimension.z / (float)gridInfo.meta_grid_dim));
-
-  // metagrids will slightly increase the total cells
-  unsigned int numberOfCells = (gridInfo.MetaGridDimension.x * gridInfo.MetaGridDimension.y * gridInfo.MetaGridDimension.z) * gridInfo.meta_grid_size;
-  fprintf(stdout, "\tGrid dimension (without meta grids): %u, %u, %u\n", gridInfo.GridDimension.x, gridInfo.GridDimension.y, gridInfo.GridDimension.z);
-  fprintf(stdout, "\tGrid dimension (with meta grids): %u, %u, %u\n", gridInfo.MetaGridDimension.x * gridInfo.meta_grid_dim, gridInfo.MetaGridDimension.y * gridInfo.meta_grid_dim, gridInfo.MetaGridDimension.z * gridInfo.meta_grid_dim);
-  //fprintf(stdout, "\tMeta Grid dimension: %u, %u, %u\n", gridInfo.MetaGridDimension.x, gridInfo.MetaGridDimension.y, gridInfo.MetaGridDimension.z);
-  //fprintf(stdout, "\t# of cells in a meta grid: %u\n", gridInfo.meta_grid_dim);
-  //fprintf(stdout, "\tGridDelta: %f, %f, %f\n", gridInfo.GridDelta.x, gridInfo.GridDelta.y, gridInfo.GridDelta.z);
-  fprintf(stdout, "\tNumber of cells: %u\n", numberOfCells);
-  fprintf(stdout, "\tCell size: %f\n", cellSize);
-
-  // update GridDimension so that it can be used in the kernels (otherwise raster order is incorrect)
-  gridInfo.GridDimension.x = gridInfo.MetaGridDimension.x * gridInfo.meta_grid_dim;
-  gridInfo.GridDimension.y = gridInfo.MetaGridDimension.y * gridInfo.meta_grid_dim;
-  gridInfo.GridDimension.z = gridInfo.MetaGridDimension.z * gridInfo.meta_grid_dim;
-  return numberOfCells;
-}
-
 void test(GridInfo);
 
 thrust::device_ptr<int> genCellMask (RTNNState& state, unsigned int* d_repQueries, float3* particles, unsigned int* d_CellParticleCounts, unsigned int numberOfCells, GridInfo gridInfo, unsigned int N, unsigned int numUniqQs, bool morton) {
@@ -155,7 +85,7 @@ thrust::device_ptr<int> genCellMask (RTNNState& state, unsigned int* d_repQuerie
 
   thrust::device_ptr<int> d_cellMask;
   // no need to memset this since every single cell will be updated.
-  allocThrustDevicePtr(&d_cellMask, numberOfCells, &state.d_gridPointers);
+  allocThrustDevicePtr(&d_cellMask, numberOfCells, &state.d_gridPointers, MEM_GRID_CELLS);
   //CUDA_CHECK( cudaMemset ( thrust::raw_pointer_cast(d_cellMask), 0xFF, numberOfCells * sizeof(int) ) );
 
   //test(gridInfo); // to demonstrate the weird parameter passing bug.
@@ -218,131 +148,6 @@ thrust::device_ptr<int> genCellMask (RTNNState& state, unsigned int* d_repQuerie
   return d_cellMask;
 }
 
-void autoBatchingRange(RTNNState& state, const thrust::host_vector<unsigned int>& h_rayHist, std::vector<int>& batches, int numAvailBatches) {
-  // now that we allow AABBTEST in all but the last batch in radius search,
-  // batching could save time, since doing sphere test is much more costly than
-  // aabb test. build the cost model and find the optimal batching.
-
-  // empirical coefficients on 2080Ti
-  //const float kD2H_PerB = 6e-7; // D2H memcpy time in *ms* / byte (TODO)
-  const float kBuildGas_PerAABB = 3.8e-6; // GAS building time in *ms* / AABB
-  // higher values encourage batching.
-  //const float kAABBTest_PerIS = 4e-5/50; // IS call time in *ms* if doing aabb test (by 50 as the data was ubenchmarked using K=50)
-  //const float kSphereTest_PerIS = 4e-4/50; // IS call time in *ms* if doing sphere test
-
-  // empirical coefficients on 2080
-  const float kAABBTest_PerIS = 1e-5/50;
-  const float kSphereTest_PerIS = 1e-4/50;
-
-  //float tMemcpy = state.numQueries * state.knn * sizeof(unsigned int) * kD2H_PerB; // TODO: consider max(memcpy, compute)
-  float tBuildGAS = state.numPoints * kBuildGas_PerAABB + 20; // 20 is the empirical intercept (TODO)
-  //fprintf(stdout, "tBuildGAS: %f\n", tBuildGAS);
-
-  // incrementally combine batch i with the last batch (assuming all other
-  // batches are independent) and calculate the cost. choose the min cost.
-  float overhead = 0;
-  float maxOverhead = 0; // overhead must be negative for bundling to be useful
-  int splitId = numAvailBatches - 1; // by default we don't bundle
-  for (int i = numAvailBatches - 2; i >= 0; i--) {
-    float extraTime = h_rayHist[i] * (kSphereTest_PerIS - kAABBTest_PerIS) * state.knn;
-    overhead += extraTime - tBuildGAS;
-    //fprintf(stdout, "i: %d, %u extraTime: %f, overhead: %f\n", i, h_rayHist[i], extraTime, overhead);
-    if (overhead < maxOverhead) {
-      maxOverhead = overhead;
-      splitId = i;
-    }
-  }
-
-  for (int i = 0; i <= splitId - 1; i++) {
-    batches.push_back(i);
-  }
-  batches.push_back(numAvailBatches - 1);
-}
-
-float radiusFromMegacell(float width, int approxMode) {
-  if (approxMode == 2) return radiusEquiVolume(width, 3); // 0.62; works well for uniform density
-  // for a sphere to be of the same volume as the cube, its radius is width *
-  // 0.62. if we use 2 in |minCircumscribedRadius|, the radius is width * 0.71.
-  // so very likely the sphere will still have more than K neighbors.
-  else if (approxMode == 1) return minCircumscribedRadius(width, 2); // 0.71
-  else return minCircumscribedRadius(width, 3); // 0.87
-}
-
-void autoBatchingKNN(RTNNState& state, const thrust::host_vector<unsigned int>& h_rayHist, std::vector<int>& batches, int numAvailBatches) {
-  // Logic: given CR (which has been decided beforehand), we know that max # of
-  //   available batches (|numAvailBatches|). launching as many batches as
-  //   available minimizes the work, but also introduces gas building overhead.
-  // So we build a cost model = gas building time + searching time.
-  // GAS building time is linear w.r.t. to the # of AABBs, which is the total amount of points.
-  // Searching time = max(memcpy time, compute time).
-  // The memcpy time is empirically observed to be linear w.r.t., to the # of queries
-  // The compute time, without considering CKE, is the lump sum of the compute time of each batch, which is linear w.r.t. the # of queries in the batch and cubic w.r.t., to the radius in the batch.
-
-  // empirical coefficients on 2080Ti
-  //const float kD2H_PerB = 6e-7; // D2H memcpy time in *ms* / byte (TODO)
-  const float kBuildGas_PerAABB = 3.8e-6; // GAS building time in *ms* / AABB
-  // TODO: fit a better model for IS calls? N_tl * T_tl + N_is * T_is
-  // TODO: this should depend K.
-  const float kSearch_PerIS = 6e-2; // knn search time in *ms* per IS call
-
-  //float tMemcpy = state.numQueries * state.knn * sizeof(unsigned int) * kD2H_PerB; // TODO: consider max(memcpy, compute)
-  float tBuildGAS = state.numPoints * kBuildGas_PerAABB + 20; // 20 is the empirical intercept (TODO)
-  float cellSize = state.radius / state.crRatio;
-  //fprintf(stdout, "tBuildGAS: %f\n", tBuildGAS);
-
-  float maxWidth = kGetWidthFromIter(numAvailBatches - 1, cellSize);
-  float maxRadius = std::min(state.radius, radiusFromMegacell(maxWidth, state.approxMode));
-  // incrementally combine batch i with the last batch (assuming all other
-  // batches are independent) and calculate the cost. choose the min cost.
-  float overhead = 0;
-  float maxOverhead = 0;
-  int splitId = numAvailBatches - 1;
-  for (int i = numAvailBatches - 2; i >= 0; i--) {
-    float curWidth = kGetWidthFromIter(i, cellSize);
-    float curRadius = std::min(state.radius, radiusFromMegacell(curWidth, state.approxMode));
-    float density = state.knn / ((curWidth - cellSize) * (curWidth - cellSize) * (curWidth - cellSize));
-
-    // TODO: assuming density doesn't change dramatically; consider non-uniform density?
-    float extraWork = h_rayHist[i] * 8 * (maxRadius * maxRadius * maxRadius - curRadius * curRadius * curRadius) * density;
-    float extraTime = extraWork * kSearch_PerIS;
-    overhead += extraTime - tBuildGAS;
-    //fprintf(stdout, "i: %d, density: %f, extraWork: %f, extraTime: %f, overhead: %f\n", i, density, extraWork, extraTime, overhead);
-    if (overhead < maxOverhead) {
-      maxOverhead = overhead;
-      splitId = i;
-    }
-  }
-
-  for (int i = 0; i <= splitId - 1; i++) {
-    batches.push_back(i);
-  }
-  batches.push_back(numAvailBatches - 1);
-}
-
-void prepBatches(RTNNState& state, std::vector<int>& batches, const thrust::host_vector<unsigned int>& h_rayHist) {
-  int numAvailBatches = (int)h_rayHist.size();
-  fprintf(stdout, "\tnumAvailBatches: %d\n", numAvailBatches);
-
-  if (state.autoNB) {
-    if (state.searchMode == "knn") autoBatchingKNN(state, h_rayHist, batches, numAvailBatches);
-    else autoBatchingRange(state, h_rayHist, batches, numAvailBatches);
-  } else {
-    if (numAvailBatches == 1) {
-      batches.push_back(0);
-      return;
-    }
-
-    int numBatches;
-    if (state.numOfBatches == -1) numBatches = (int)numAvailBatches;
-    else numBatches = std::min(state.numOfBatches, (int)numAvailBatches);
-
-    for (int i = 0; i < numAvailBatches; i++) {
-      if (i <= numBatches - 2 || i == numAvailBatches - 1) batches.push_back(i);
-    }
-    assert(batches.size() <= (unsigned int)numBatches);
-  }
-}
-
 void genBatches(RTNNState& state,
                 std::vector<int>& batches,
                 thrust::host_vector<unsigned int> h_rayHist,
@@ -376,7 +181,7 @@ void genBatches(RTNNState& state,
     // on will only be used to point to device queries used in kernels, and
     // will be set right before launch using d_actQs.
     thrust::device_ptr<float3> d_actQs;
-    allocThrustDevicePtr(&d_actQs, numActQs, &state.d_pointers);
+    allocThrustDevicePtr(&d_actQs, numActQs, &state.d_pointers, MEM_PARTICLE_DATA);
     copyIfIdInRange(particles, N, d_rayMask, d_actQs, lastMask + 1, maxMask);
     state.d_actQs[batchId] = thrust::raw_pointer_cast(d_actQs);
 
@@ -386,10 +191,83 @@ void genBatches(RTNNState& state,
       thrust::copy(d_actQs, d_actQs + numActQs, state.h_actQs[batchId]);
     }
 
+    // per-query radii are partitioned the same way as the queries.
+    if (state.d_qRadius) {
+      thrust::device_ptr<float> d_actQRadius;
+      allocThrustDevicePtr(&d_actQRadius, numActQs, &state.d_pointers, MEM_PARTICLE_DATA);
+      copyIfIdInRange(state.d_qRadius, N, d_rayMask, d_actQRadius, lastMask + 1, maxMask);
+      state.d_actQRadius[batchId] = thrust::raw_pointer_cast(d_actQRadius);
+
+      if (state.sanCheck) {
+        state.h_actQRadius[batchId] = new float[numActQs];
+        thrust::copy(d_actQRadius, d_actQRadius + numActQs, state.h_actQRadius[batchId]);
+      }
+    }
+
+    // and so are the input positions of the queries, which the result file
+    // reads on the host.
+    if (state.d_qIds && numActQs) {
+      thrust::device_ptr<unsigned int> d_actQIds;
+      allocThrustDevicePtr(&d_actQIds, numActQs, nullptr, MEM_PARTITION_ARRAYS);
+      copyIfIdInRange(state.d_qIds, N, d_rayMask, d_actQIds, lastMask + 1, maxMask);
+      state.h_actQIds[batchId] = new unsigned int[numActQs];
+      thrust::copy(d_actQIds, d_actQIds + numActQs, state.h_actQIds[batchId]);
+      freeDevicePtr(thrust::raw_pointer_cast(d_actQIds));
+    }
+
     lastMask = maxMask;
   }
 }
 
+// sorts |d_ids| the way the particles are sorted by |d_keys|, which are
+// copied rather than consumed, or with the 1D sort by the x coordinates of
+// |h_particles|.
+static void sortIdsByKey(thrust::device_ptr<unsigned int> d_keys, thrust::device_ptr<unsigned int> d_ids, unsigned int N) {
+  thrust::device_ptr<unsigned int> d_keys_copy;
+  allocThrustDevicePtr(&d_keys_copy, N, nullptr, MEM_PARTITION_ARRAYS);
+  thrustCopyD2D(d_keys_copy, d_keys, N);
+  sortByKey(d_keys_copy, d_ids, N);
+  freeDevicePtr(thrust::raw_pointer_cast(d_keys_copy));
+}
+
+static void sortIdsByX(const float3* h_particles, thrust::device_ptr<unsigned int> d_ids, unsigned int N) {
+  thrust::host_vector<float> h_key(N);
+  for (unsigned int i = 0; i < N; i++) h_key[i] = h_particles[i].x;
+  thrust::device_ptr<float> d_key;
+  allocThrustDevicePtr(&d_key, N, nullptr, MEM_PARTITION_ARRAYS);
+  thrust::copy(h_key.begin(), h_key.end(), d_key);
+  sortByKey(d_key, d_ids, N);
+  freeDevicePtr(thrust::raw_pointer_cast(d_key));
+}
+
+// with -rm the input position of every point follows it, in
+// |state.h_pointIds|, through the sorts that reorder the points, which
+// include those of the queries if they share the points' memory. either
+// |d_keys| or |h_particles| (for the 1D sort) is given.
+static void sortPointIds(RTNNState& state, ParticleType type, thrust::device_ptr<unsigned int> d_keys,
+                         const float3* h_particles, unsigned int N) {
+  if (!state.remapIds || ((type != POINT) && !state.samepq)) return;
+
+  thrust::device_ptr<unsigned int> d_ids;
+  allocThrustDevicePtr(&d_ids, N, nullptr, MEM_PARTITION_ARRAYS);
+  thrust::copy(state.h_pointIds, state.h_pointIds + N, d_ids);
+  if (h_particles) sortIdsByX(h_particles, d_ids, N);
+  else sortIdsByKey(d_keys, d_ids, N);
+  thrust::copy(d_ids, d_ids + N, state.h_pointIds);
+  freeDevicePtr(thrust::raw_pointer_cast(d_ids));
+}
+
+// the same for the input positions of the queries, |state.d_qIds|, which
+// stay on the device until the queries are partitioned.
+static void sortQueryIds(RTNNState& state, ParticleType type, thrust::device_ptr<unsigned int> d_keys,
+                         const float3* h_particles, unsigned int N) {
+  if (!state.d_qIds || (type != QUERY)) return;
+
+  thrust::device_ptr<unsigned int> d_ids = thrust::device_pointer_cast(state.d_qIds);
+  if (h_particles) sortIdsByX(h_particles, d_ids, N);
+  else sortIdsByKey(d_keys, d_ids, N);
+}
+
 void sortGenBatch(RTNNState& state,
                   unsigned int N,
                   bool morton,
@@ -407,10 +285,10 @@ void sortGenBatch(RTNNState& state,
 {
     // pick one particle from each cell, and store all their indices in |d_repQueries|
     thrust::device_ptr<unsigned int> d_ParticleCellIndices_ptr_copy;
-    allocThrustDevicePtr(&d_ParticleCellIndices_ptr_copy, N, &state.d_gridPointers);
+    allocThrustDevicePtr(&d_ParticleCellIndices_ptr_copy, N, &state.d_gridPointers, MEM_PARTITION_ARRAYS);
     thrustCopyD2D(d_ParticleCellIndices_ptr_copy, d_ParticleCellIndices_ptr, N);
     thrust::device_ptr<unsigned int> d_repQueries;
-    allocThrustDevicePtr(&d_repQueries, N, &state.d_gridPointers);
+    allocThrustDevicePtr(&d_repQueries, N, &state.d_gridPointers, MEM_PARTITION_ARRAYS);
     genSeqDevice(d_repQueries, N);
     sortByKey(d_ParticleCellIndices_ptr_copy, d_repQueries, N);
     unsigned int numUniqQs = uniqueByKey(d_ParticleCellIndices_ptr_copy, N, d_repQueries);
@@ -436,7 +314,7 @@ void sortGenBatch(RTNNState& state,
     //}
 
     thrust::device_ptr<int> d_rayMask;
-    allocThrustDevicePtr(&d_rayMask, N, &state.d_gridPointers);
+    allocThrustDevicePtr(&d_rayMask, N, &state.d_gridPointers, MEM_PARTITION_ARRAYS);
 
     // TODO: generate the sorted indices, and also set the rayMask according to
     //   cellMask. the sorted indices |d_posInSortedPoints_ptr| is not useful
@@ -458,6 +336,28 @@ void sortGenBatch(RTNNState& state,
                                     thrust::raw_pointer_cast(d_rayMask)
                                    );
 
+    // with per-query radii, also bucket queries by radius: a query goes to the
+    // batch of its density mask or the batch whose launch radius covers its
+    // own radius, whichever is earlier.
+    if (state.d_qRadius) {
+      float cellSize = state.radius / state.crRatio;
+      float maxWidth = maxInscribedWidth(state.radius, 3);
+      int maxMask = (int)floorf(maxWidth / (2 * cellSize) - 1) + 1; // see |initBatches|.
+      bool knn = (state.searchMode == "knn");
+      // launch radius per mask width; see |genBatches|.
+      float radiusPerWidth = knn ? radiusFromMegacell(1, state.approxMode) : 0.5;
+      kAdjustRayMaskByRadius(numOfBlocks,
+                             threadsPerBlock,
+                             thrust::raw_pointer_cast(d_rayMask),
+                             state.d_qRadius,
+                             N,
+                             cellSize,
+                             radiusPerWidth,
+                             !knn,
+                             maxMask
+                            );
+    }
+
     // get a histogram of d_rayMask, which won't be mutated. this needs to happen before sorting |d_rayMask|.
     // the last mask in the histogram indicates the number of rays that need full search.
     thrust::device_vector<unsigned int> d_rayHist;
@@ -481,10 +381,16 @@ void sortGenBatch(RTNNState& state,
       // queries are gauranteed to be sorted in exactly the same way.
       // TODO: Can we do away with the extra copy by replacing sort by key with scatter? That'll need new space too...
       thrust::device_ptr<unsigned int> d_posInSortedPoints_ptr_copy;
-      allocThrustDevicePtr(&d_posInSortedPoints_ptr_copy, N, &state.d_gridPointers);
+      allocThrustDevicePtr(&d_posInSortedPoints_ptr_copy, N, &state.d_gridPointers, MEM_PARTITION_ARRAYS);
       thrustCopyD2D(d_posInSortedPoints_ptr_copy, d_posInSortedPoints_ptr, N);
 
       sortByKey(d_posInSortedPoints_ptr_copy, d_rayMask, N);
+      if (state.d_qRadius) {
+        thrustCopyD2D(d_posInSortedPoints_ptr_copy, d_posInSortedPoints_ptr, N);
+        sortByKey(d_posInSortedPoints_ptr_copy, thrust::device_pointer_cast(state.d_qRadius), N);
+      }
+      sortPointIds(state, QUERY, d_posInSortedPoints_ptr, nullptr, N);
+      sortQueryIds(state, QUERY, d_posInSortedPoints_ptr, nullptr, N);
       sortByKey(d_posInSortedPoints_ptr, thrust::device_pointer_cast(particles), N);
     }
 
@@ -513,9 +419,9 @@ void gridSort(RTNNState& state, unsigned int N, float3* particles, float3* h_par
       thrust::device_pointer_cast(reinterpret_cast<unsigned int*>(state.d_CellOffsets_ptr_p));
   thrust::device_ptr<unsigned int> d_posInSortedPoints_ptr;
 
-  allocThrustDevicePtr(&d_ParticleCellIndices_ptr, N, &state.d_gridPointers);
-  allocThrustDevicePtr(&d_LocalSortedIndices_ptr, N, &state.d_gridPointers);
-  allocThrustDevicePtr(&d_posInSortedPoints_ptr, N, &state.d_gridPointers);
+  allocThrustDevicePtr(&d_ParticleCellIndices_ptr, N, &state.d_gridPointers, MEM_PARTITION_ARRAYS);
+  allocThrustDevicePtr(&d_LocalSortedIndices_ptr, N, &state.d_gridPointers, MEM_PARTITION_ARRAYS);
+  allocThrustDevicePtr(&d_posInSortedPoints_ptr, N, &state.d_gridPointers, MEM_PARTITION_ARRAYS);
 
   unsigned int threadsPerBlock = 64;
   unsigned int numOfBlocks = N / threadsPerBlock + 1;
@@ -528,8 +434,8 @@ void gridSort(RTNNState& state, unsigned int N, float3* particles, float3* h_par
     // initializing the two N arrays.
   } else {
     // numberOfCells takes a lot of memory
-    allocThrustDevicePtr(&d_CellParticleCounts_ptr, numberOfCells, &state.d_gridPointers);
-    allocThrustDevicePtr(&d_CellOffsets_ptr, numberOfCells, &state.d_gridPointers);
+    allocThrustDevicePtr(&d_CellParticleCounts_ptr, numberOfCells, &state.d_gridPointers, MEM_GRID_CELLS);
+    allocThrustDevicePtr(&d_CellOffsets_ptr, numberOfCells, &state.d_gridPointers, MEM_GRID_CELLS);
   }
 
   fillByValue(d_CellParticleCounts_ptr, numberOfCells, 0);
@@ -608,6 +514,17 @@ void gridSort(RTNNState& state, unsigned int N, float3* particles, float3* h_par
                          thrust::raw_pointer_cast(d_LocalSortedIndices_ptr),
                          thrust::raw_pointer_cast(d_posInSortedPoints_ptr)
                         );
+    if ((type == QUERY) && state.d_qRadius) {
+      // the radii follow the queries; the keys are consumed by the sort so sort a copy.
+      thrust::device_ptr<unsigned int> d_posInSortedPoints_ptr_copy;
+      allocThrustDevicePtr(&d_posInSortedPoints_ptr_copy, N, &state.d_gridPointers, MEM_PARTITION_ARRAYS);
+      thrustCopyD2D(d_posInSortedPoints_ptr_copy, d_posInSortedPoints_ptr, N);
+      sortByKey(d_posInSortedPoints_ptr_copy, thrust::device_pointer_cast(state.d_qRadius), N);
+      thrust::copy(thrust::device_pointer_cast(state.d_qRadius), thrust::device_pointer_cast(state.d_qRadius) + N, state.h_qRadius);
+    }
+
+    sortPointIds(state, type, d_posInSortedPoints_ptr, nullptr, N);
+    sortQueryIds(state, type, d_posInSortedPoints_ptr, nullptr, N);
     // in-place sort; no new device memory is allocated
     sortByKey(d_posInSortedPoints_ptr, thrust::device_pointer_cast(particles), N);
   }
@@ -637,7 +554,7 @@ void oneDSort ( RTNNState& state, unsigned int N, float3* particles, float3* h_p
   }
 
   thrust::device_ptr<float> d_key_ptr;
-  allocThrustDevicePtr(&d_key_ptr, state.numQueries, &state.d_pointers);
+  allocThrustDevicePtr(&d_key_ptr, state.numQueries, &state.d_pointers, MEM_PARTITION_ARRAYS);
   thrust::copy(h_key.begin(), h_key.end(), d_key_ptr);
 
   // actual sort
@@ -676,8 +593,16 @@ void sortParticles ( RTNNState& state, ParticleType type, int sortMode ) {
     Timing::startTiming("sort and/or partition queries");
   }
 
+  // the points start in their input order.
+  if (state.remapIds && !state.h_pointIds) {
+    state.h_pointIds = new unsigned int[state.numPoints];
+    for (unsigned int i = 0; i < state.numPoints; i++) state.h_pointIds[i] = i;
+  }
+
   // the semantices of sorting is: sort data in device, and copy the sorted data back to host.
   if (sortMode == 3) {
+    sortPointIds(state, type, thrust::device_ptr<unsigned int>(), h_particles, N);
+    sortQueryIds(state, type, thrust::device_ptr<unsigned int>(), h_particles, N);
     oneDSort(state, N, particles, h_particles);
   } else {
     // TODO: a slight issue is if ps and qs are 0, we will still use raster
@@ -698,7 +623,7 @@ thrust::device_ptr<unsigned int> sortQueriesByFHCoord( RTNNState& state, thrust:
   Timing::startTiming("gas-sort queries init");
     // allocate device memory for storing the keys, which will be generated by a gather and used in sort_by_keys
     thrust::device_ptr<float> d_key_ptr;
-    allocThrustDevicePtr(&d_key_ptr, numQueries, &state.d_pointers);
+    allocThrustDevicePtr(&d_key_ptr, numQueries, &state.d_batchPointers[batch_id], MEM_PARTITION_ARRAYS);
   
     // create keys (1d coordinate), which will become the source of gather, the
     // result of which will be the keys for sort; the size must be
@@ -710,19 +635,25 @@ thrust::device_ptr<unsigned int> sortQueriesByFHCoord( RTNNState& state, thrust:
     for (unsigned int i = 0; i < state.numPoints; i++) {
       h_orig_points_1d[i] = state.h_points[i].z; // could be other dimensions
     }
-    thrust::device_vector<float> d_orig_points_1d = h_orig_points_1d; // one P NArray
+    // one P NArray, uploaded on the batch's stream like the rest of its stages.
+    thrust::device_ptr<float> d_orig_points_1d;
+    allocThrustDevicePtr(&d_orig_points_1d, state.numPoints, nullptr, MEM_PARTITION_ARRAYS);
+    CUDA_CHECK( cudaMemcpyAsync( thrust::raw_pointer_cast(d_orig_points_1d), h_orig_points_1d.data(),
+                                 state.numPoints * sizeof(float), cudaMemcpyHostToDevice, state.stream[batch_id] ) );
 
     // initialize a sequence to be sorted, which will become the r2q map.
     thrust::device_ptr<unsigned int> d_r2q_map_ptr;
-    allocThrustDevicePtr(&d_r2q_map_ptr, numQueries, &state.d_pointers);
+    allocThrustDevicePtr(&d_r2q_map_ptr, numQueries, &state.d_batchPointers[batch_id], MEM_PARTITION_ARRAYS);
     genSeqDevice(d_r2q_map_ptr, numQueries, state.stream[batch_id]);
   Timing::stopTiming(true);
  
   Timing::startTiming("gas-sort queries");
     // first use a gather to generate the keys, then sort by keys
-    gatherByKey(d_firsthit_idx_ptr, &d_orig_points_1d, d_key_ptr, numQueries, state.stream[batch_id]);
+    gatherByKey(d_firsthit_idx_ptr, d_orig_points_1d, d_key_ptr, numQueries, state.stream[batch_id]);
     sortByKey( d_key_ptr, d_r2q_map_ptr, numQueries, state.stream[batch_id] );
     state.d_r2q_map[batch_id] = thrust::raw_pointer_cast(d_r2q_map_ptr);
+    // not needed past the gather; cudaFree waits for it.
+    freeDevicePtr( thrust::raw_pointer_cast(d_orig_points_1d) );
   Timing::stopTiming(true);
  
   // if debug, copy the sorted keys and values back to host
@@ -755,13 +686,13 @@ thrust::device_ptr<unsigned int> sortQueriesByFHIdx( RTNNState& state, thrust::d
   // initialize a sequence to be sorted, which will become the r2q map
   Timing::startTiming("gas-sort queries init");
     thrust::device_ptr<unsigned int> d_r2q_map_ptr;
-    allocThrustDevicePtr(&d_r2q_map_ptr, numQueries, &state.d_pointers);
+    allocThrustDevicePtr(&d_r2q_map_ptr, numQueries, &state.d_batchPointers[batch_id], MEM_PARTITION_ARRAYS);
     genSeqDevice(d_r2q_map_ptr, numQueries, state.stream[batch_id]);
   Timing::stopTiming(true);
 
   Timing::startTiming("gas-sort queries");
     sortByKey( d_firsthit_idx_ptr, d_r2q_map_ptr, numQueries, state.stream[batch_id] );
-    unsigned int uniqFHs = countUniq(d_firsthit_idx_ptr, numQueries);
+    unsigned int uniqFHs = countUniq(d_firsthit_idx_ptr, numQueries, state.stream[batch_id]);
     fprintf(stdout, "\tUnique FH AABBs: %u\n", uniqFHs);
 
     // thrust can't be used in kernel code since NVRTC supports only a
@@ -822,7 +753,7 @@ void gatherQueries( RTNNState& state, thrust::device_ptr<unsigned int> d_indices
 
     // allocate device memory for reordered/gathered queries
     thrust::device_ptr<float3> d_reord_queries_ptr;
-    allocThrustDevicePtr(&d_reord_queries_ptr, numQueries, &state.d_pointers);
+    allocThrustDevicePtr(&d_reord_queries_ptr, numQueries, &state.d_batchPointers[batch_id], MEM_PARTITION_ARRAYS);
 
     // get pointer to original queries in device memory
     thrust::device_ptr<float3> d_orig_queries_ptr = thrust::device_pointer_cast(state.d_actQs[batch_id]);
@@ -832,14 +763,29 @@ void gatherQueries( RTNNState& state, thrust::device_ptr<unsigned int> d_indices
 
     state.d_actQs[batch_id] = thrust::raw_pointer_cast(d_reord_queries_ptr);
     //assert(state.params.points != state.params.queries);
+
+    // the positions in -q of the queries, for a sink, follow them.
+    if (state.h_actQIds) {
+      std::vector<unsigned int> h_indices(numQueries);
+      CUDA_CHECK( cudaMemcpyAsync( h_indices.data(), thrust::raw_pointer_cast(d_indices_ptr), numQueries * sizeof(unsigned int),
+                                   cudaMemcpyDeviceToHost, state.stream[batch_id] ) );
+      CUDA_CHECK( cudaStreamSynchronize( state.stream[batch_id] ) );
+      unsigned int* ids = new unsigned int[numQueries];
+      for (unsigned int i = 0; i < numQueries; i++) ids[i] = state.h_actQIds[batch_id][h_indices[i]];
+      delete[] state.h_actQIds[batch_id];
+      state.h_actQIds[batch_id] = ids;
+    }
   Timing::stopTiming(true);
 
   // Copy reordered queries to host for sanity check
   if (state.sanCheck) {
-    // if not samepq, free the original query host memory first
-    if (!state.samepq || state.partition) delete state.h_actQs[batch_id];
+    // free the batch's own copy of the queries first; the caller's queries
+    // (no partition) are left alone.
+    if (state.h_actQs[batch_id] != state.h_queries) delete[] state.h_actQs[batch_id];
     state.h_actQs[batch_id] = new float3[numQueries]; // don't overwrite h_points
-    thrust::copy(d_reord_queries_ptr, d_reord_queries_ptr+numQueries, state.h_actQs[batch_id]);
+    CUDA_CHECK( cudaMemcpyAsync( state.h_actQs[batch_id], thrust::raw_pointer_cast(d_reord_queries_ptr), numQueries * sizeof(float3),
+                                 cudaMemcpyDeviceToHost, state.stream[batch_id] ) );
+    CUDA_CHECK( cudaStreamSynchronize( state.stream[batch_id] ) );
   }
 }
 
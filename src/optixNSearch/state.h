@@ -32,6 +32,8 @@
 #include <vector_types.h>
 #include <optix_types.h>
 #include <unordered_set>
+#include <vector>
+#include <string>
 #include "optixNSearch.h"
 
 // the SDK cmake defines NDEBUG in the Release build, but we still want to use assert
@@ -39,9 +41,26 @@
 #undef NDEBUG
 #include <assert.h>
 
+class ResultSink;
+
 #define OMIT_ON_E2EMSR(x) \
   if (state.msr == 0) x   \
 
+// device memory the search needs apart from the grid and the GASes, in bytes;
+// see |estimateMemory|.
+struct MemPlan
+{
+    int                         pNArrayCount              = 0; // index arrays of N elements for sorting and partitioning
+    int                         qNArrayCount              = 0; // and of Q elements
+    int                         cellArrayCount            = 0; // arrays of one element per cell
+    float                       particleDataSize          = 0; // points, queries, partitioned queries and radii
+    float                       particleArraysSize        = 0; // the N and Q arrays
+    float                       gasSortArraysSize         = 0; // the part of them kept until the search
+    float                       returnDataSize            = 0;
+    float                       gasSize                   = 0; // of one batch
+    float                       instGasSize               = 0; // temporary, while a GAS is built
+};
+
 struct RTNNState
 {
     OptixDeviceContext          context                   = 0;
@@ -60,7 +79,8 @@ struct RTNNState
 
     cudaStream_t*               stream                    = nullptr;
     Params                      params;
-    Params*                     d_params                  = nullptr;
+    Params*                     d_params                  = nullptr; // one per batch (stream), reused by its launches
+    Params*                     batchParams               = nullptr; // one per batch: what its launches copy to its |d_params| slot
 
     float3*                     h_points                  = nullptr;
     float3*                     h_queries                 = nullptr;
@@ -72,8 +92,11 @@ struct RTNNState
 
     int32_t                     device_id                 = 0;
     std::string                 searchMode                = "radius";
+    std::string                 backend                   = "optix";
+    std::string                 reduce                    = "none"; // fused per-query reduction; "none" returns neighbor lists
     std::string                 pfile;
     std::string                 qfile;
+    std::string                 rfile; // per-query radius, one per line; empty if all queries use |radius|
     unsigned int                knn                       = 50;
     float                       gRadius                   = 2.0;
     float                       radius                    = 2.0;
@@ -94,6 +117,33 @@ struct RTNNState
     float                       crStep                    = 1.01;
     bool                        deferFree                 = true;
     bool                        filterQueries             = false;
+    bool                        halfList                  = false;
+    std::vector<float>          multiRadius; // ascending; empty unless a multi-radius search
+    std::vector<unsigned int>   multiK; // max neighbors per radius
+    bool                        periodic                  = false; // periodic box [boxMin, boxMax)
+    float3                      boxMin; // relative to |origin|
+    float3                      boxMax;
+    double3                     periodicMin; // the box as given to -pb, in the original coordinates
+    double3                     periodicMax;
+    bool                        recenter                  = true;
+    bool                        compress                  = false; // 16-bit fixed point points in the host grid
+    std::vector<float>          moveBench; // displacements to benchmark incremental grid updates with
+    std::string                 socketPath; // serve queries on this Unix socket if not empty
+    std::string                 profileFile; // write the timing tree as JSON here if not empty
+    std::string                 traceFile; // write the timings in the Chrome trace format here if not empty
+    bool                        autoTune                  = false; // pick the sort modes, crRatio, mcScale and gsrRatio with |autoTune|
+    std::string                 sweepFile; // run the configurations of this sweep spec if not empty
+    std::string                 sweepOut                  = "sweep.csv"; // where a sweep appends its measurements
+    std::string                 planFile; // only plan the device memory and write the plan here if not empty
+    float                       planMemGB                 = 0; // device memory to plan for
+    unsigned int                planPoints                = 0; // plan for this many points instead of those read, if not 0
+    unsigned int                planQueries               = 0; // and queries
+    double3                     origin                    = {0, 0, 0}; // points and queries are stored relative to it
+    float                       chunkMem                  = 0; // MB of device memory for the search output; 0 for a quarter of the device
+    std::string                 sinkType                  = "memory"; // where the results go: "memory" (|h_res|), "file" or "csr"
+    std::string                 outFile; // the result file of a "file" or "csr" sink; see resultfile.h
+    bool                        remapIds                  = false; // write neighbor IDs in the input order of the points
+    ResultSink*                 sink                      = nullptr; // if not null the results stream here instead of |h_res|
 
     unsigned int                numPoints                 = 0;
     unsigned int                numQueries                = 0;
@@ -103,6 +153,13 @@ struct RTNNState
     void**                      h_res                     = nullptr;
     float3**                    d_actQs                   = nullptr;
     float3**                    h_actQs                   = nullptr;
+    unsigned int*               h_pointIds                = nullptr; // input position of every point in the order of h_points; only with |remapIds|
+    float*                      h_qRadius                 = nullptr; // in the same order as h_queries
+    float*                      d_qRadius                 = nullptr; // in the same order as params.queries
+    float**                     d_actQRadius              = nullptr; // in the same order as d_actQs
+    float**                     h_actQRadius              = nullptr; // in the same order as h_actQs
+    unsigned int*               d_qIds                    = nullptr; // input position of every query, in the same order as params.queries; only with a result file
+    unsigned int**              h_actQIds                 = nullptr; // in the same order as d_actQs
     void**                      d_aabb                    = nullptr;
     void**                      d_temp_buffer_gas         = nullptr;
     void**                      d_buffer_temp_output_gas_and_compacted_size = nullptr;
@@ -112,6 +169,7 @@ struct RTNNState
     unsigned int                numFltQs                  = 0;
 
     std::unordered_set<void*>   d_pointers;
+    std::unordered_set<void*>*  d_batchPointers           = nullptr; // one per batch, for the allocations of its stages
     std::unordered_set<void*>   d_gridPointers;
 
     int                         numOfBatches              = -1;
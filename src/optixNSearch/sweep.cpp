@@ -0,0 +1,422 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include "state.h"
+#include "func.h"
+
+namespace {
+
+// the knobs a sweep can vary; everything that would need the data to be
+// read again (files, recentering, the periodic box, multi-radius) stays fixed.
+const char* sweepKnobs[][2] = {
+  {"--partition", "-p"}, {"--autobatch", "-ab"}, {"--numbatch", "-nb"},
+  {"--gassort", "-s"}, {"--gsrRatio", "-sg"}, {"--gather", "-g"},
+  {"--pointsort", "-ps"}, {"--querysort", "-qs"}, {"--autocrratio", "-ac"},
+  {"--crratio", "-cr"}, {"--crStep", "-crs"}, {"--metacellScale", "-mc"},
+  {"--approx", "-a"}, {"--interleave", "-i"}, {"--deferFree", "-df"},
+  {"--filterQueries", "-fq"}, {"--estgassize", "-egs"}, {"--gpumemused", "-gmu"},
+  {"--backend", "-be"}, {"--radius", "-r"}, {"--knn", "-k"},
+};
+
+struct SweepSpec {
+  std::string mode = "grid";
+  unsigned int samples = 16;
+  unsigned int seed = 1;
+  unsigned int repeat = 1;
+  // (short flag, values) in the order of the spec.
+  std::vector<std::pair<std::string, std::vector<std::string>>> knobs;
+};
+
+// a configuration is a list of flags and values, as on the command line.
+typedef std::vector<std::string> Config;
+
+void specError(const std::string& path, int line, const std::string& msg) {
+  fprintf(stderr, "%s:%d: %s\n", path.c_str(), line, msg.c_str());
+  exit(1);
+}
+
+// one setting per line, '#' starts a comment:
+//   mode grid|random   all combinations, or |samples| distinct random ones
+//   samples N          (random mode) default 16
+//   seed S             (random mode) default 1
+//   repeat R           runs per configuration, default 1
+//   -flag v1 v2 ...    the values of a knob, e.g., "-cr 4 8 16"
+SweepSpec readSpec(const std::string& path) {
+  std::ifstream in(path.c_str());
+  if (!in.good()) {
+    fprintf(stderr, "Cannot open sweep spec %s.\n", path.c_str());
+    exit(1);
+  }
+
+  SweepSpec spec;
+  std::string line;
+  int lineNo = 0;
+  while (std::getline(in, line)) {
+    lineNo++;
+    size_t comment = line.find('#');
+    if (comment != std::string::npos) line.erase(comment);
+    std::stringstream ss(line);
+    std::string key;
+    if (!(ss >> key)) continue;
+    std::vector<std::string> values;
+    std::string v;
+    while (ss >> v) values.push_back(v);
+    if (values.empty()) specError(path, lineNo, "\"" + key + "\" has no value");
+
+    if (key[0] == '-') {
+      std::string flag;
+      for (auto& knob : sweepKnobs)
+        if (key == knob[0] || key == knob[1]) flag = knob[1];
+      if (flag.empty()) specError(path, lineNo, "\"" + key + "\" can't be swept");
+      for (auto& k : spec.knobs)
+        if (k.first == flag) specError(path, lineNo, "\"" + key + "\" is given twice");
+      spec.knobs.push_back(std::make_pair(flag, values));
+    } else if (values.size() != 1) {
+      specError(path, lineNo, "\"" + key + "\" takes one value");
+    } else if (key == "mode") {
+      if (values[0] != "grid" && values[0] != "random") specError(path, lineNo, "mode is grid or random");
+      spec.mode = values[0];
+    } else if (key == "samples" || key == "seed" || key == "repeat") {
+      int n = atoi(values[0].c_str());
+      if (n <= 0 && key != "seed") specError(path, lineNo, key + " must be positive");
+      if (key == "samples") spec.samples = n;
+      else if (key == "seed") spec.seed = n;
+      else spec.repeat = n;
+    } else {
+      specError(path, lineNo, "unknown setting \"" + key + "\"");
+    }
+  }
+  return spec;
+}
+
+Config makeConfig(const SweepSpec& spec, const std::vector<size_t>& choice) {
+  Config config;
+  for (size_t i = 0; i < spec.knobs.size(); i++) {
+    config.push_back(spec.knobs[i].first);
+    config.push_back(spec.knobs[i].second[choice[i]]);
+  }
+  return config;
+}
+
+std::string configLabel(const Config& config) {
+  std::string label;
+  for (size_t i = 0; i < config.size(); i++) label += (i ? " " : "") + config[i];
+  return label.empty() ? "default" : label;
+}
+
+std::vector<Config> genConfigs(const SweepSpec& spec) {
+  std::vector<Config> configs;
+  double gridSize = 1;
+  for (auto& k : spec.knobs) gridSize *= k.second.size();
+
+  std::vector<size_t> choice(spec.knobs.size(), 0);
+  if (spec.mode == "grid") {
+    // mixed-radix counter over the knobs, the last knob varying fastest.
+    while (true) {
+      configs.push_back(makeConfig(spec, choice));
+      int i = (int)spec.knobs.size() - 1;
+      for (; i >= 0; i--) {
+        if (++choice[i] < spec.knobs[i].second.size()) break;
+        choice[i] = 0;
+      }
+      if (i < 0) break;
+    }
+  } else {
+    std::mt19937 gen(spec.seed);
+    std::set<std::string> seen;
+    unsigned int target = (unsigned int)std::min<double>(spec.samples, gridSize);
+    while (configs.size() < target) {
+      for (size_t i = 0; i < spec.knobs.size(); i++)
+        choice[i] = std::uniform_int_distribution<size_t>(0, spec.knobs[i].second.size() - 1)(gen);
+      Config config = makeConfig(spec, choice);
+      if (seen.insert(configLabel(config)).second) configs.push_back(config);
+    }
+  }
+  return configs;
+}
+
+// |base| with |config| applied the same way as the command line, so the same
+// checks and derived settings apply. |parseArgs| exits on invalid values.
+RTNNState applyConfig(const RTNNState& base, const Config& config, const char* argv0) {
+  RTNNState state = base;
+  // derived from the sort modes, which the configuration may change.
+  state.samepq = false;
+
+  std::vector<std::string> args(1, argv0);
+  args.insert(args.end(), config.begin(), config.end());
+  std::vector<char*> argv;
+  for (auto& a : args) argv.push_back(&a[0]);
+  parseArgs(state, (int)argv.size(), argv.data());
+  return state;
+}
+
+// resident set size of the process and its peak since |resetPeakRSS|, in MB.
+void readRSS(double& rss, double& peak) {
+  rss = peak = 0;
+  FILE* fp = fopen("/proc/self/status", "r");
+  if (!fp) return;
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    unsigned long kb;
+    if (sscanf(line, "VmRSS: %lu kB", &kb) == 1) rss = kb / 1024.0;
+    else if (sscanf(line, "VmHWM: %lu kB", &kb) == 1) peak = kb / 1024.0;
+  }
+  fclose(fp);
+}
+
+void resetPeakRSS() {
+  FILE* fp = fopen("/proc/self/clear_refs", "w");
+  if (!fp) return;
+  fputs("5", fp);
+  fclose(fp);
+}
+
+// polls the used device memory while a run is in flight. the peak is relative
+// to what was used when sampling started, so it's what the run allocated.
+class DeviceMemSampler {
+public:
+  void start(int device) {
+    m_stop = false;
+    m_peak = 0;
+    // errors only end the sampling; an exception would terminate the process.
+    m_thread = std::thread([this, device]() {
+      size_t free, total;
+      if (cudaSetDevice(device) != cudaSuccess || cudaMemGetInfo(&free, &total) != cudaSuccess) return;
+      size_t baseline = total - free;
+      while (!m_stop) {
+        if (cudaMemGetInfo(&free, &total) != cudaSuccess) return;
+        if (total - free > baseline) m_peak = std::max(m_peak, total - free - baseline);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+  }
+
+  // in MB.
+  double stop() {
+    m_stop = true;
+    m_thread.join();
+    return m_peak / 1024.0 / 1024.0;
+  }
+
+private:
+  std::thread m_thread;
+  std::atomic<bool> m_stop;
+  size_t m_peak;
+};
+
+// the total time of every phase of the profile, by path from the root, e.g.,
+// "total search time > batch search time".
+void collectPhases(int n, const std::string& prefix, std::vector<std::pair<std::string, double>>& phases) {
+  const ProfileNode& node = Timing::m_profile[n];
+  std::string path = prefix;
+  if (n) {
+    path += (prefix.empty() ? "" : " > ") + node.name;
+    phases.push_back(std::make_pair(path, node.total.totalTime));
+  }
+  for (int c : node.children) collectPhases(c, path, phases);
+}
+
+std::string csvField(const std::string& s) {
+  if (s.find_first_of(",\"\n") == std::string::npos) return s;
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"') out += '"';
+    out += c;
+  }
+  return out + "\"";
+}
+
+std::vector<std::string> csvSplit(const std::string& line) {
+  std::vector<std::string> fields(1);
+  bool quoted = false;
+  for (size_t i = 0; i < line.size(); i++) {
+    char c = line[i];
+    if (quoted) {
+      if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') fields.back() += line[++i];
+      else if (c == '"') quoted = false;
+      else fields.back() += c;
+    } else if (c == '"') quoted = true;
+    else if (c == ',') fields.push_back("");
+    else fields.back() += c;
+  }
+  return fields;
+}
+
+std::string numField(double v) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%g", v);
+  return buf;
+}
+
+std::string baseName(const std::string& path) {
+  size_t slash = path.find_last_of('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+const char* csvHeader = "dataset,queries,mode,radius,k,backend,config,rep,metric,value";
+
+// the configurations of each group (same dataset, queries, mode, radius, K
+// and backend) in |path| that no other configuration of the group beats in
+// both the best total search time over its runs and its worst peak memory;
+// device memory for optix, host memory for the host backend.
+void reportPareto(const std::string& path) {
+  struct Point {
+    double time = -1;
+    double mem = 0;
+  };
+  std::map<std::string, std::map<std::string, Point>> groups;
+
+  std::ifstream in(path.c_str());
+  std::string line;
+  while (std::getline(in, line)) {
+    std::vector<std::string> f = csvSplit(line);
+    if (f.size() != 10 || line == csvHeader) continue;
+    std::string group = f[0] + " (queries " + f[1] + "), " + f[2] + " search, radius " + f[3] + ", K " + f[4] + ", " + f[5];
+    Point& p = groups[group][f[6]];
+    double v = atof(f[9].c_str());
+    if (f[8] == "time:total search time") {
+      if (p.time < 0 || v < p.time) p.time = v;
+    } else if (f[8] == (f[5] == "host" ? "peak host MB" : "peak device MB")) {
+      p.mem = std::max(p.mem, v);
+    }
+  }
+
+  fprintf(stdout, "Pareto-best configurations (best total search time, peak memory) from %s:\n", path.c_str());
+  for (auto& g : groups) {
+    std::vector<std::pair<std::string, Point>> front;
+    for (auto& a : g.second) {
+      if (a.second.time < 0) continue; // failed runs
+      bool dominated = false;
+      for (auto& b : g.second) {
+        if (b.second.time < 0) continue;
+        if (b.second.time <= a.second.time && b.second.mem <= a.second.mem &&
+            (b.second.time < a.second.time || b.second.mem < a.second.mem)) {
+          dominated = true;
+          break;
+        }
+      }
+      if (!dominated) front.push_back(a);
+    }
+    std::sort(front.begin(), front.end(), [](const std::pair<std::string, Point>& a, const std::pair<std::string, Point>& b) {
+      return a.second.time < b.second.time;
+    });
+
+    fprintf(stdout, "  %s:\n", g.first.c_str());
+    for (auto& p : front)
+      fprintf(stdout, "    %12.3f ms %10.1f MB   %s\n", p.second.time, p.second.mem, p.first.c_str());
+  }
+}
+
+} // namespace
+
+void runSweep(RTNNState& base) {
+  SweepSpec spec = readSpec(base.sweepFile);
+  std::vector<Config> configs = genConfigs(spec);
+
+  // |parseArgs| exits on an invalid configuration, so check them all before
+  // spending time on any run.
+  const char* argv0 = "sweep";
+  std::vector<RTNNState> states;
+  for (auto& config : configs) states.push_back(applyConfig(base, config, argv0));
+
+  FILE* csv = fopen(base.sweepOut.c_str(), "a");
+  if (!csv) {
+    fprintf(stderr, "Cannot open %s.\n", base.sweepOut.c_str());
+    exit(1);
+  }
+  if (ftell(csv) == 0) fprintf(csv, "%s\n", csvHeader);
+
+  std::string dataset = csvField(baseName(base.pfile));
+  std::string queries = csvField(base.sameData ? std::string("same") : baseName(base.qfile));
+
+  bool deviceSet = false;
+  Timing::m_recordEvents = false;
+  unsigned int numRuns = configs.size() * spec.repeat;
+  unsigned int runId = 0;
+  for (size_t c = 0; c < configs.size(); c++) {
+    std::string label = configLabel(configs[c]);
+    for (unsigned int rep = 0; rep < spec.repeat; rep++) {
+      RTNNState state = states[c];
+      fprintf(stdout, "\n========== sweep run %u/%u: %s (rep %u) ==========\n", ++runId, numRuns, label.c_str(), rep);
+      fflush(stdout);
+
+      bool optix = (state.backend != "host");
+      if (optix && !deviceSet) {
+        setDevice(state);
+        deviceSet = true;
+      }
+
+      // every run gets its own copy of the data, since sorting reorders the
+      // points and queries in place. the radii are freed by the cleanup.
+      float3* h_points = new float3[base.numPoints];
+      std::copy(base.h_points, base.h_points + base.numPoints, h_points);
+      float3* h_queries = h_points;
+      if (!state.samepq) {
+        h_queries = new float3[base.numQueries];
+        std::copy(base.h_queries, base.h_queries + base.numQueries, h_queries);
+      }
+      state.h_points = h_points;
+      state.h_queries = h_queries;
+      if (base.h_qRadius) {
+        state.h_qRadius = new float[base.numQueries];
+        std::copy(base.h_qRadius, base.h_qRadius + base.numQueries, state.h_qRadius);
+      }
+
+      double rss, peak;
+      resetPeakRSS();
+      readRSS(rss, peak);
+      DeviceMemSampler sampler;
+      if (optix) sampler.start(state.device_id);
+
+      bool ok = true;
+      try {
+        if (optix) runOptiX(state);
+        else runHost(state);
+      } catch (std::exception& e) {
+        fprintf(stderr, "Sweep run failed (%s): %s\n", label.c_str(), e.what());
+        ok = false;
+      }
+
+      double deviceMB = optix ? sampler.stop() : 0;
+      double rssAfter, peakAfter;
+      readRSS(rssAfter, peakAfter);
+
+      std::string prefix = dataset + "," + queries + "," + state.searchMode + "," +
+                           numField(state.radius) + "," + numField(state.knn) + "," +
+                           state.backend + "," + csvField(label) + "," + std::to_string(rep) + ",";
+      if (ok) {
+        std::vector<std::pair<std::string, double>> phases;
+        {
+          std::lock_guard<std::mutex> lock(Timing::m_mutex);
+          if (!Timing::m_profile.empty()) collectPhases(0, "", phases);
+        }
+        for (auto& p : phases)
+          fprintf(csv, "%s%s,%.6f\n", prefix.c_str(), csvField("time:" + p.first).c_str(), p.second);
+        fprintf(csv, "%speak host MB,%.3f\n", prefix.c_str(), std::max(0.0, peakAfter - rss));
+        if (optix) fprintf(csv, "%speak device MB,%.3f\n", prefix.c_str(), deviceMB);
+      } else {
+        fprintf(csv, "%sfailed,1\n", prefix.c_str());
+      }
+      fflush(csv);
+
+      delete[] h_points;
+      if (h_queries != h_points) delete[] h_queries;
+    }
+  }
+  fclose(csv);
+
+  fprintf(stdout, "\n");
+  reportPareto(base.sweepOut);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// the tests are plain programs registered with CTest; a failed check prints
+// where it failed and exits non-zero.
+#define CHECK(cond)                                                              \
+  do {                                                                           \
+    if (!(cond)) {                                                               \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);  \
+      exit(1);                                                                   \
+    }                                                                            \
+  } while (0)
@@ -0,0 +1,62 @@
+// |fitCellSize|: the bisection lands on the same crStep multiple as stepping
+// one at a time, for scenes of different shapes, periodic or not, with and
+// without the GAS term, over budgets from a loose to a tight fit, and both
+// fail on a budget nothing fits in.
+
+#include <cmath>
+
+#include <sutil/Exception.h>
+#include <sutil/vec_math.h>
+
+#include "state.h"
+#include "func.h"
+#include "check.h"
+
+namespace {
+
+const int kCellArrayCount = 3;
+
+void checkScene(float3 size, unsigned int numPoints, float gasSize, bool periodic = false) {
+  RTNNState state;
+  state.Min = make_float3(0, 0, 0);
+  state.Max = size;
+  state.periodic = periodic;
+  state.boxMin = state.Min;
+  state.boxMax = state.Max;
+  state.numPoints = numPoints;
+  state.radius = fminf(size) / 20;
+
+  float start = cbrtf(size.x * size.y * size.z / (8.0f * numPoints));
+  // the footprint isn't monotone, so budgets are tried finely.
+  for (float scale = 1.25f; scale <= 8; scale *= 1.05f) {
+    float spaceAvail = memFootprint(state, scale * start, kCellArrayCount, gasSize);
+    float solved = fitCellSize(state, spaceAvail, start, kCellArrayCount, gasSize);
+    float stepped = fitCellSize(state, spaceAvail, start, kCellArrayCount, gasSize, true);
+    CHECK(solved == stepped);
+    CHECK(memFootprint(state, solved, kCellArrayCount, gasSize) < spaceAvail);
+    // and the step before it doesn't.
+    CHECK(memFootprint(state, solved / state.crStep, kCellArrayCount, gasSize) >= spaceAvail);
+  }
+
+  // a budget that fits from the start keeps the cell size.
+  float loose = memFootprint(state, start, kCellArrayCount, gasSize) * 2;
+  CHECK(fitCellSize(state, loose, start, kCellArrayCount, gasSize) == start);
+
+  // the GAS alone doesn't fit, or there's no room at all.
+  for (float none : {gasSize, 0.0f, -1.0f}) {
+    CHECK(fitCellSize(state, none, start, kCellArrayCount, gasSize) == 0);
+    CHECK(fitCellSize(state, none, start, kCellArrayCount, gasSize, true) == 0);
+  }
+}
+
+} // namespace
+
+int main() {
+  checkScene(make_float3(100, 100, 100), 1000000, 0);
+  checkScene(make_float3(100, 100, 100), 1000000, 64e6);
+  checkScene(make_float3(400, 100, 10), 200000, 0);
+  checkScene(make_float3(1, 1, 1), 5000000, 16e6);
+  checkScene(make_float3(100, 100, 100), 1000000, 0, true);
+  checkScene(make_float3(400, 100, 10), 200000, 64e6, true);
+  return 0;
+}
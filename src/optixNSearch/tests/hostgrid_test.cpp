@@ -0,0 +1,119 @@
+// the host grid in a periodic box, with and without compressed points (-cp):
+// radius and KNN search against brute force under the minimum image, with
+// points on the upper faces and corners of the box, which belong to the first
+// cells, and queries near both sides of every face.
+
+#include <algorithm>
+#include <climits>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sutil/Exception.h>
+#include <sutil/vec_math.h>
+
+#include "state.h"
+#include "func.h"
+#include "grid.h"
+#include "check.h"
+
+namespace {
+
+const float kRadius = 0.1f;
+const unsigned int kK = 64;
+
+std::vector<unsigned int> bruteForce(const std::vector<float3>& points, float3 query, float3 boxSize) {
+  std::vector<std::pair<float, unsigned int>> near;
+  for (unsigned int p = 0; p < points.size(); p++) {
+    float3 d = minImage(query - points[p], boxSize);
+    float sqdist = dot(d, d);
+    if (sqdist < kRadius * kRadius) near.push_back(std::make_pair(sqdist, p));
+  }
+  std::sort(near.begin(), near.end());
+  std::vector<unsigned int> ids;
+  for (auto& n : near) ids.push_back(n.second);
+  return ids;
+}
+
+std::vector<unsigned int> found(const unsigned int* res, unsigned int q) {
+  std::vector<unsigned int> ids;
+  for (unsigned int i = 0; i < kK; i++) {
+    if (res[(size_t)q * kK + i] != UINT_MAX) ids.push_back(res[(size_t)q * kK + i]);
+  }
+  return ids;
+}
+
+void check(std::vector<float3> points, std::vector<float3> queries, bool compress, const std::string& mode) {
+  RTNNState state;
+  state.h_points = points.data();
+  state.numPoints = points.size();
+  state.h_queries = queries.data();
+  state.numQueries = queries.size();
+  state.periodic = true;
+  state.boxMin = make_float3(0, 0, 0);
+  state.boxMax = make_float3(1, 1, 1);
+  state.compress = compress;
+  state.radius = kRadius;
+  state.knn = kK;
+  state.searchMode = mode;
+
+  setupHost(state);
+  HostGrid grid;
+  buildHostGrid(state, grid);
+  std::vector<unsigned int> res((size_t)queries.size() * kK, UINT_MAX);
+  searchHostGrid(state, grid, res.data());
+
+  float3 boxSize = state.boxMax - state.boxMin;
+  for (unsigned int q = 0; q < queries.size(); q++) {
+    std::vector<unsigned int> expected = bruteForce(points, queries[q], boxSize);
+    std::vector<unsigned int> ids = found(res.data(), q);
+    // all neighbors fit in K, so KNN finds them all too, but compressed
+    // points only have approximate distances to order them by.
+    CHECK(expected.size() < kK);
+    std::sort(expected.begin(), expected.end());
+    std::sort(ids.begin(), ids.end());
+    CHECK(ids == expected);
+  }
+  cleanupHost(state);
+}
+
+} // namespace
+
+int main() {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> u(0, 1);
+  std::vector<float3> points(2000);
+  for (auto& p : points) p = make_float3(u(gen), u(gen), u(gen));
+
+  // on the upper faces, edges and corner: wrapped, they are at 0.
+  for (unsigned int i = 0; i < 50; i++) {
+    float a = u(gen), b = u(gen);
+    points.push_back(make_float3(1, a, b));
+    points.push_back(make_float3(a, 1, b));
+    points.push_back(make_float3(a, b, 1));
+    points.push_back(make_float3(1, 1, a));
+  }
+  points.push_back(make_float3(1, 1, 1));
+
+  std::vector<float3> queries(500);
+  for (auto& q : queries) q = make_float3(u(gen), u(gen), u(gen));
+  for (unsigned int i = 0; i < 100; i++) {
+    float a = u(gen), b = u(gen), t = u(gen) * kRadius;
+    queries.push_back(make_float3(t, a, b));
+    queries.push_back(make_float3(1 - t, a, b));
+    queries.push_back(make_float3(a, t, b));
+    queries.push_back(make_float3(a, 1 - t, b));
+    queries.push_back(make_float3(a, b, t));
+    queries.push_back(make_float3(a, b, 1 - t));
+  }
+  // none of them is a point, which KNN would leave out.
+  queries.push_back(make_float3(0.001f, 0.001f, 0.001f));
+  queries.push_back(make_float3(0.999f, 0.999f, 0.999f));
+
+  for (bool compress : {false, true}) {
+    check(points, queries, compress, "radius");
+    check(points, queries, compress, "knn");
+  }
+  return 0;
+}
@@ -0,0 +1,153 @@
+// |rtnn::Index|: dynamic updates (update, insert, erase) against brute force,
+// that moving the points after an erase keeps updating the grid
+// incrementally instead of rebuilding it, and that double precision points
+// far from zero are searched as offsets from their centre. erasing validates
+// the IDs, and separate indices can be queried from several threads.
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <sutil/vec_math.h>
+
+#include "index.h"
+#include "check.h"
+
+namespace {
+
+const float kRadius = 0.05f;
+
+std::vector<float3> randomPoints(unsigned int n, std::mt19937& gen) {
+  std::uniform_real_distribution<float> u(0, 1);
+  std::vector<float3> points(n);
+  for (auto& p : points) p = make_float3(u(gen), u(gen), u(gen));
+  return points;
+}
+
+// the neighbors of every query by brute force, sorted, skipping |erased|.
+void checkAgainstBruteForce(rtnn::Index& index, const std::vector<float3>& queries,
+                            const std::vector<unsigned char>& erased) {
+  rtnn::NeighborList list = index.queryAll(queries.data(), queries.size(), kRadius);
+  CHECK(list.offsets.size() == queries.size() + 1);
+  for (unsigned int q = 0; q < queries.size(); q++) {
+    std::vector<unsigned int> expected;
+    for (unsigned int p = 0; p < index.numPoints(); p++) {
+      if ((p < erased.size()) && erased[p]) continue;
+      float3 d = index.points()[p] - queries[q];
+      if (dot(d, d) < kRadius * kRadius) expected.push_back(p);
+    }
+    std::vector<unsigned int> got(list.ids.begin() + list.offsets[q], list.ids.begin() + list.offsets[q + 1]);
+    std::sort(got.begin(), got.end());
+    CHECK(got == expected);
+  }
+}
+
+// moves every point by a small fraction of the radius, so that few of them
+// change cells, and keeps them inside of the grid, which is built around
+// the points of the first two corners.
+void jitter(std::vector<float3>& points, std::mt19937& gen) {
+  std::uniform_real_distribution<float> u(-kRadius / 100, kRadius / 100);
+  for (size_t i = 2; i < points.size(); i++)
+    points[i] = clamp(points[i] + make_float3(u(gen), u(gen), u(gen)), 0.0f, 1.0f);
+}
+
+} // namespace
+
+int main() {
+  std::mt19937 gen(1);
+  std::vector<float3> points = randomPoints(20000, gen);
+  points[0] = make_float3(0, 0, 0);
+  points[1] = make_float3(1, 1, 1);
+  std::vector<float3> queries = randomPoints(500, gen);
+  std::vector<unsigned char> erased(points.size(), 0);
+
+  rtnn::Index index(points.data(), points.size());
+  checkAgainstBruteForce(index, queries, erased);
+  CHECK(index.numGridBuilds() == 1);
+
+  // a few erased points are tombstoned in the current grid.
+  std::vector<unsigned int> ids;
+  for (unsigned int i = 2; i < points.size(); i += 97) ids.push_back(i);
+  index.erase(ids.data(), ids.size());
+  for (auto id : ids) erased[id] = 1;
+  checkAgainstBruteForce(index, queries, erased);
+  CHECK(index.numGridBuilds() == 1);
+
+  // an ID out of range throws and erases none of the others.
+  unsigned int bad[2] = {3, (unsigned int)points.size()};
+  bool threw = false;
+  try {
+    index.erase(bad, 2);
+  } catch (std::out_of_range&) {
+    threw = true;
+  }
+  CHECK(threw);
+  checkAgainstBruteForce(index, queries, erased);
+
+  // the first move after the erase compacts the grid, and every later one
+  // updates it in place.
+  jitter(points, gen);
+  index.update(points.data());
+  checkAgainstBruteForce(index, queries, erased);
+  CHECK(index.numGridBuilds() == 2);
+  for (int step = 0; step < 3; step++) {
+    jitter(points, gen);
+    index.update(points.data());
+    checkAgainstBruteForce(index, queries, erased);
+    CHECK(index.numGridBuilds() == 2);
+  }
+
+  // inserted points go to the overflow; the next move rebuilds once.
+  std::vector<float3> more = randomPoints(100, gen);
+  unsigned int firstId = index.insert(more.data(), more.size());
+  CHECK(firstId == points.size());
+  points.insert(points.end(), more.begin(), more.end());
+  erased.resize(points.size(), 0);
+  checkAgainstBruteForce(index, queries, erased);
+  CHECK(index.numGridBuilds() == 2);
+  for (int step = 0; step < 2; step++) {
+    jitter(points, gen);
+    index.update(points.data());
+    checkAgainstBruteForce(index, queries, erased);
+    CHECK(index.numGridBuilds() == 3);
+  }
+
+  // the same points in ECEF-sized coordinates, where floats are 0.5 apart;
+  // the offsets from the origin keep their resolution.
+  const double3 far = make_double3(6378137.25, -4000000.5, 1234567.75);
+  std::vector<double3> farPoints(points.size());
+  for (size_t i = 0; i < points.size(); i++)
+    farPoints[i] = make_double3(far.x + points[i].x, far.y + points[i].y, far.z + points[i].z);
+  rtnn::Index farIndex(farPoints.data(), farPoints.size());
+  CHECK(fabs(farIndex.origin().x - (far.x + 0.5)) < 1e-6);
+  CHECK(fabs(farIndex.origin().y - (far.y + 0.5)) < 1e-6);
+  CHECK(fabs(farIndex.origin().z - (far.z + 0.5)) < 1e-6);
+  for (size_t i = 0; i < points.size(); i++) {
+    float3 d = farIndex.points()[i] - (points[i] - 0.5f);
+    CHECK(dot(d, d) < 1e-12f);
+  }
+  std::vector<double3> farQueries(queries.size());
+  for (size_t i = 0; i < queries.size(); i++)
+    farQueries[i] = make_double3(far.x + queries[i].x, far.y + queries[i].y, far.z + queries[i].z);
+  std::vector<float3> localQueries = farIndex.toLocal(farQueries.data(), farQueries.size());
+  checkAgainstBruteForce(farIndex, localQueries, std::vector<unsigned char>());
+  rtnn::NeighborList list = farIndex.queryAll(localQueries.data(), localQueries.size(), kRadius);
+  CHECK(!list.ids.empty());
+
+  // separate indices may be queried concurrently.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++)
+    threads.emplace_back([&]() {
+      rtnn::Index own(points.data(), points.size());
+      for (int i = 0; i < 20; i++) {
+        own.query(queries.data(), queries.size(), kRadius, 8, "knn");
+        own.queryAll(queries.data(), queries.size(), kRadius);
+      }
+    });
+  for (auto& t : threads) t.join();
+
+  return 0;
+}
@@ -0,0 +1,61 @@
+// |MemAccount|: current and peak bytes per category and in total across
+// adds, releases and retags, and what it does with addresses it doesn't
+// expect.
+
+#include "memaccount.h"
+#include "check.h"
+
+int main() {
+  // the pointers are only keys; nothing is allocated.
+  char buf[4];
+  const void* a = buf;
+  const void* b = buf + 1;
+  const void* c = buf + 2;
+
+  MemAccount::reset();
+  MemAccount::add(MEM_PARTICLE_DATA, a, 100);
+  MemAccount::add(MEM_GAS_BUILD, b, 300);
+  CHECK(MemAccount::current(MEM_PARTICLE_DATA) == 100);
+  CHECK(MemAccount::current(MEM_GAS_BUILD) == 300);
+  CHECK(MemAccount::totalPeak() == 400);
+
+  // the output of a build kept as the GAS moves without changing the total.
+  MemAccount::retag(b, MEM_GAS);
+  CHECK(MemAccount::current(MEM_GAS_BUILD) == 0);
+  CHECK(MemAccount::peak(MEM_GAS_BUILD) == 300);
+  CHECK(MemAccount::current(MEM_GAS) == 300);
+  CHECK(MemAccount::peak(MEM_GAS) == 300);
+  CHECK(MemAccount::totalPeak() == 400);
+
+  MemAccount::release(a);
+  MemAccount::add(MEM_RESULTS, c, 50);
+  CHECK(MemAccount::current(MEM_PARTICLE_DATA) == 0);
+  CHECK(MemAccount::peak(MEM_PARTICLE_DATA) == 100);
+  CHECK(MemAccount::totalPeak() == 400);
+
+  // unknown pointers and null are ignored.
+  MemAccount::release(buf + 3);
+  MemAccount::retag(buf + 3, MEM_OTHER);
+  MemAccount::add(MEM_OTHER, nullptr, 1000);
+  CHECK(MemAccount::current(MEM_OTHER) == 0);
+
+  // an address added again replaces the stale entry instead of counting twice.
+  MemAccount::add(MEM_RESULTS, c, 70);
+  CHECK(MemAccount::current(MEM_RESULTS) == 70);
+  MemAccount::release(c);
+  CHECK(MemAccount::current(MEM_RESULTS) == 0);
+  CHECK(MemAccount::peak(MEM_RESULTS) == 70);
+
+  MemAccount::setPlanned(MEM_GAS, 512);
+  CHECK(MemAccount::planned(MEM_GAS) == 512);
+
+  MemAccount::reset();
+  CHECK(MemAccount::current(MEM_GAS) == 0);
+  CHECK(MemAccount::peak(MEM_GAS) == 0);
+  CHECK(MemAccount::totalPeak() == 0);
+  CHECK(MemAccount::planned(MEM_GAS) == 0);
+  // released after a reset, the old entry is gone.
+  MemAccount::release(b);
+  CHECK(MemAccount::current(MEM_GAS) == 0);
+  return 0;
+}
@@ -0,0 +1,152 @@
+// the search server (-sv) and |rtnn::Client|: radius and KNN requests in
+// double precision far from zero round trip to the same lists as the index
+// they are served from, and bad requests get an error response without
+// taking the server down.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sutil/Exception.h>
+#include <sutil/vec_math.h>
+
+#include "server.h"
+#include "state.h"
+#include "func.h"
+#include "check.h"
+
+namespace {
+
+const float kRadius = 0.05f;
+
+// the server listens once it has built its index; until then connecting fails.
+rtnn::Client* connect(const std::string& path) {
+  for (int attempt = 0; attempt < 500; attempt++) {
+    try {
+      return new rtnn::Client(path);
+    } catch (std::runtime_error&) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  return nullptr;
+}
+
+// a connection without |rtnn::Client|, to send what it wouldn't.
+int rawConnect(const std::string& path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ((fd >= 0) && (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+std::vector<unsigned int> sorted(const rtnn::NeighborList& list, unsigned int q) {
+  std::vector<unsigned int> ids(list.ids.begin() + list.offsets[q], list.ids.begin() + list.offsets[q + 1]);
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+} // namespace
+
+int main() {
+  // points are stored relative to the origin, as after -rc.
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> u(-0.5f, 0.5f);
+  std::vector<float3> points(20000);
+  for (auto& p : points) p = make_float3(u(gen), u(gen), u(gen));
+  const double3 origin = make_double3(6378137.25, -4000000.5, 1234567.75);
+
+  std::vector<float3> local(300);
+  std::vector<double3> queries(local.size());
+  for (size_t i = 0; i < local.size(); i++) {
+    local[i] = make_float3(u(gen), u(gen), u(gen));
+    queries[i] = make_double3(origin.x + local[i].x, origin.y + local[i].y, origin.z + local[i].z);
+  }
+
+  RTNNState state;
+  state.h_points = points.data();
+  state.numPoints = points.size();
+  state.origin = origin;
+  state.socketPath = "/tmp/rtnn_protocol_test." + std::to_string(getpid()) + ".sock";
+  std::thread server([&]() { serveHost(state); });
+
+  rtnn::Client* client = connect(state.socketPath);
+  CHECK(client);
+  rtnn::Index index(points.data(), points.size());
+
+  // every neighbor within the radius.
+  rtnn::NeighborList all = client->query(queries.data(), queries.size(), kRadius);
+  rtnn::NeighborList expected = index.queryAll(local.data(), local.size(), kRadius);
+  CHECK(all.offsets.size() == queries.size() + 1);
+  CHECK(!all.ids.empty());
+  for (unsigned int q = 0; q < queries.size(); q++) CHECK(sorted(all, q) == sorted(expected, q));
+
+  // KNN drops the UINT_MAX padding of queries with fewer than K neighbors.
+  const unsigned int k = 8;
+  rtnn::NeighborList knn = client->query(queries.data(), queries.size(), kRadius, k, true);
+  rtnn::Result res = index.query(local.data(), local.size(), kRadius, k, "knn");
+  for (unsigned int q = 0; q < queries.size(); q++) {
+    std::vector<unsigned int> ids(res.ids.begin() + q * k, res.ids.begin() + (q + 1) * k);
+    ids.erase(std::remove(ids.begin(), ids.end(), UINT_MAX), ids.end());
+    std::sort(ids.begin(), ids.end());
+    CHECK(sorted(knn, q) == ids);
+  }
+
+  // an error leaves the connection usable.
+  bool failed = false;
+  try {
+    client->query(queries.data(), queries.size(), kRadius, 0, true);
+  } catch (std::runtime_error&) {
+    failed = true;
+  }
+  CHECK(failed);
+  CHECK(client->query(queries.data(), 1, kRadius).offsets.size() == 2);
+
+  // too many queries are refused by the client before anything is sent.
+  failed = false;
+  try {
+    client->query(queries.data(), rtnn::kMaxRequestQueries + 1, kRadius);
+  } catch (std::runtime_error&) {
+    failed = true;
+  }
+  CHECK(failed);
+  delete client;
+
+  // and by the server, which answers and closes only that connection.
+  rtnn::Client other(state.socketPath);
+  {
+    int fd = rawConnect(state.socketPath);
+    CHECK(fd >= 0);
+    rtnn::RequestHeader req = {rtnn::OP_QUERY, rtnn::kMaxRequestQueries + 1, kRadius, 0, 0};
+    uint64_t length = sizeof(req) + (uint64_t)req.numQueries * sizeof(double3);
+    CHECK(rtnn::writeFull(fd, &length, sizeof(length)) && rtnn::writeFull(fd, &req, sizeof(req)));
+    rtnn::ResponseHeader header;
+    CHECK(rtnn::readFull(fd, &length, sizeof(length)) && rtnn::readFull(fd, &header, sizeof(header)));
+    CHECK(header.status != 0);
+    std::string msg(length - sizeof(header), '\0');
+    CHECK(rtnn::readFull(fd, &msg[0], msg.size()));
+    char byte;
+    CHECK(!rtnn::readFull(fd, &byte, 1));
+    close(fd);
+  }
+  CHECK(other.query(queries.data(), queries.size(), kRadius).ids.size() == all.ids.size());
+
+  other.shutdown();
+  server.join();
+  return 0;
+}
@@ -0,0 +1,101 @@
+# the Python bindings (|import rtnn|): arrays that can't be used in place are
+# rejected, query and query_all against brute force, and erasing an ID out of
+# range raises IndexError and erases nothing. run by ctest with the directory
+# of the built module as the argument.
+
+import sys
+
+if len(sys.argv) > 1:
+    sys.path.insert(0, sys.argv[1])
+
+import numpy as np
+import rtnn
+
+RADIUS = 0.1
+
+
+def check(cond, what):
+    if not cond:
+        sys.stderr.write("check failed: %s\n" % what)
+        sys.exit(1)
+
+
+def raises(error, f, *args, **kwargs):
+    try:
+        f(*args, **kwargs)
+    except error:
+        return True
+    return False
+
+
+def sq_dists(points, queries):
+    # in float32, as the search computes them.
+    d = queries[:, None, :] - points[None, :, :]
+    return (d * d).sum(axis=2, dtype=np.float32)
+
+
+def check_query_all(index, points, queries, erased=()):
+    offsets, ids, dists = index.query_all(queries, RADIUS, distances=True)
+    check(offsets.dtype == np.uint32 and ids.dtype == np.uint32, "query_all returns uint32 arrays")
+    check(offsets.shape == (len(queries) + 1,) and offsets[-1] == len(ids), "query_all offsets")
+    sq = sq_dists(points, queries)
+    for q in range(len(queries)):
+        expected = [p for p in np.nonzero(sq[q] < RADIUS * RADIUS)[0] if p not in erased]
+        found = ids[offsets[q]:offsets[q + 1]]
+        check(sorted(found) == sorted(expected), "query_all of query %d" % q)
+        check(np.allclose(dists[offsets[q]:offsets[q + 1]], np.sqrt(sq[q][found]), atol=1e-6),
+              "query_all distances of query %d" % q)
+
+
+def main():
+    rng = np.random.default_rng(1)
+    points = rng.random((2000, 3), dtype=np.float32)
+    queries = rng.random((300, 3), dtype=np.float32)
+    index = rtnn.Index(points)
+    check(index.num_points == len(points), "num_points")
+
+    # only (N, 3) float32 C-contiguous arrays are used in place; nothing is
+    # converted.
+    check(raises(TypeError, rtnn.Index, points.astype(np.float64)), "float64 points are rejected")
+    check(raises(TypeError, rtnn.Index, np.asfortranarray(points)), "Fortran order points are rejected")
+    check(raises(TypeError, index.query_all, queries[::2], RADIUS), "strided queries are rejected")
+    check(raises(TypeError, index.query, queries.astype(np.float16), RADIUS, 8), "float16 queries are rejected")
+    check(raises(ValueError, rtnn.Index, points[:, :2].copy()), "(N, 2) points are rejected")
+    check(raises(ValueError, rtnn.Index, points, backend="optix"), "unknown backends are rejected")
+
+    check_query_all(index, points, queries)
+    sq = sq_dists(points, queries)
+    within = sq < RADIUS * RADIUS
+
+    # radius: up to k of the neighbors, padded.
+    k = 8
+    ids = index.query(queries, RADIUS, k)
+    check(ids.shape == (len(queries), k) and ids.dtype == np.uint32, "query shape")
+    for q in range(len(queries)):
+        found = ids[q][ids[q] != 0xffffffff]
+        check(len(found) == min(k, within[q].sum()), "radius query size of query %d" % q)
+        check(all(within[q][found]), "radius query of query %d" % q)
+
+    # KNN: the k nearest in distance order.
+    ids, dists = index.query(queries, RADIUS, k, mode="knn", distances=True)
+    for q in range(len(queries)):
+        found = ids[q][ids[q] != 0xffffffff]
+        nearest = np.sort(sq[q][within[q]])[:k]
+        check(len(found) == len(nearest), "knn size of query %d" % q)
+        check(np.allclose(sq[q][found], nearest, atol=1e-7), "knn of query %d" % q)
+        check(np.all(np.isinf(dists[q][len(found):])), "knn distance padding of query %d" % q)
+
+    counts = index.query(queries, RADIUS, 1, mode="count")
+    check(counts.shape == (len(queries),), "count shape")
+    check(np.array_equal(counts, within.sum(axis=1)), "counts")
+
+    # an ID out of range erases nothing.
+    check(raises(IndexError, index.erase, np.array([3, len(points)], dtype=np.uint32)), "erase out of range")
+    check_query_all(index, points, queries)
+    index.erase(np.array([3, 5], dtype=np.uint32))
+    check(index.num_points == len(points), "erased IDs aren't reused")
+    check_query_all(index, points, queries, erased=(3, 5))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,163 @@
+// |ResultWriter| and |ResultReader|: dense and CSR files round trip, by batch
+// and by input query position, and truncated or corrupt files are rejected
+// rather than read out of bounds.
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "resultfile.h"
+#include "check.h"
+
+namespace {
+
+const char* kPath = "resultfile_test.bin";
+const unsigned int kWidth = 5;
+
+// query q of the input has q % (kWidth + 1) neighbors, (q * 7 + k) % 1000.
+unsigned int neighbor(unsigned int q, unsigned int k) { return (q * 7 + k) % 1000; }
+
+// two batches of 300 and 200 queries, in chunks of up to 128; the input
+// position of the i-th query of a batch is |queryIds[batch][i]|.
+void writeFile(bool csr, const std::vector<unsigned int>& idMap, const std::vector<unsigned int> queryIds[2]) {
+  const unsigned int* batchIds[2] = {queryIds[0].data(), queryIds[1].data()};
+  // a small buffer, so that the blocks span writes.
+  ResultWriter writer(kPath, csr, idMap.empty() ? nullptr : idMap.data(), batchIds, 4096);
+  for (int batch = 0; batch < 2; batch++) {
+    unsigned int n = queryIds[batch].size();
+    std::vector<unsigned int> rows((size_t)n * kWidth, UINT_MAX);
+    for (unsigned int i = 0; i < n; i++) {
+      unsigned int q = queryIds[batch][i];
+      for (unsigned int k = 0; k < q % (kWidth + 1); k++) rows[i * kWidth + k] = neighbor(q, k);
+    }
+    for (unsigned int first = 0; first < n; first += 128)
+      writer.consume(batch, first, std::min(128u, n - first), kWidth, rows.data() + first * kWidth);
+  }
+  writer.finish();
+}
+
+void checkFile(bool csr, const std::vector<unsigned int>& idMap, const std::vector<unsigned int> queryIds[2]) {
+  ResultReader reader(kPath);
+  CHECK(reader.csr() == csr);
+  CHECK(reader.remapped() == !idMap.empty());
+  CHECK(reader.hasQueryIds());
+  CHECK(reader.numBlocks() == 3 + 2);
+
+  for (int batch = 0; batch < 2; batch++) {
+    for (unsigned int i = 0; i < queryIds[batch].size(); i++) {
+      unsigned int q = queryIds[batch][i];
+      const unsigned int* ids;
+      const unsigned int* byId;
+      unsigned int count = reader.neighbors(batch, i, &ids);
+      CHECK(reader.neighborsOf(q, &byId) == count);
+      CHECK(byId == ids);
+
+      unsigned int expected = q % (kWidth + 1);
+      CHECK(count == (csr ? expected : kWidth));
+      for (unsigned int k = 0; k < count; k++) {
+        unsigned int id = (k < expected) ? neighbor(q, k) : UINT_MAX;
+        if (!idMap.empty() && (id != UINT_MAX)) id = idMap[id];
+        CHECK(ids[k] == id);
+      }
+    }
+  }
+
+  const unsigned int* ids;
+  CHECK(reader.neighborsOf(499, &ids) == 0);
+  CHECK(ids == nullptr);
+  CHECK(reader.neighbors(2, 0, &ids) == 0);
+  CHECK(reader.neighbors(1, 200, &ids) == 0);
+}
+
+std::vector<char> readBytes() {
+  std::ifstream in(kPath, std::ios::binary);
+  return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void writeBytes(const std::vector<char>& bytes) {
+  std::ofstream out(kPath, std::ios::binary | std::ios::trunc);
+  out.write(bytes.data(), bytes.size());
+}
+
+bool rejected() {
+  try {
+    ResultReader reader(kPath);
+  } catch (std::runtime_error&) {
+    return true;
+  }
+  return false;
+}
+
+} // namespace
+
+int main() {
+  // the input positions 500 down to 0 but 499, as if sorted.
+  std::vector<unsigned int> queryIds[2];
+  for (unsigned int q = 501; q-- > 0;) {
+    if (q != 499) queryIds[queryIds[0].size() < 300 ? 0 : 1].push_back(q);
+  }
+  CHECK(queryIds[1].size() == 200);
+
+  std::vector<unsigned int> idMap(1000);
+  for (unsigned int i = 0; i < idMap.size(); i++) idMap[i] = 999 - i;
+
+  writeFile(false, std::vector<unsigned int>(), queryIds);
+  checkFile(false, std::vector<unsigned int>(), queryIds);
+  writeFile(true, idMap, queryIds);
+  checkFile(true, idMap, queryIds);
+
+  std::vector<char> good = readBytes();
+  // the first block follows the file header.
+  size_t block = sizeof(ResultFileHeader);
+
+  // a file cut short has no trailer.
+  writeBytes(std::vector<char>(good.begin(), good.end() - 8));
+  CHECK(rejected());
+
+  // a block claiming UINT_MAX queries, which would wrap |numQueries + 1|.
+  std::vector<char> bad = good;
+  unsigned int numQueries = UINT_MAX;
+  memcpy(bad.data() + block + offsetof(ResultBlockHeader, numQueries), &numQueries, sizeof(numQueries));
+  writeBytes(bad);
+  CHECK(rejected());
+
+  // a block claiming more IDs than the file holds.
+  bad = good;
+  uint64_t numIds = UINT64_MAX / 2;
+  memcpy(bad.data() + block + offsetof(ResultBlockHeader, numIds), &numIds, sizeof(numIds));
+  writeBytes(bad);
+  CHECK(rejected());
+
+  // the same query in two blocks.
+  bad = good;
+  memcpy(bad.data() + block + sizeof(ResultBlockHeader), bad.data() + block + sizeof(ResultBlockHeader) + 4, 4);
+  writeBytes(bad);
+  CHECK(rejected());
+
+  // an offset in the middle of a CSR block past its IDs is caught by the
+  // lookup, which is the only one to read it.
+  bad = good;
+  size_t offsets = block + sizeof(ResultBlockHeader) + 128 * sizeof(unsigned int);
+  uint64_t past = UINT64_MAX;
+  memcpy(bad.data() + offsets + 5 * sizeof(uint64_t), &past, sizeof(past));
+  writeBytes(bad);
+  {
+    ResultReader reader(kPath);
+    const unsigned int* ids;
+    bool threw = false;
+    try {
+      reader.neighbors(0, 4, &ids);
+    } catch (std::runtime_error&) {
+      threw = true;
+    }
+    CHECK(threw);
+  }
+
+  remove(kPath);
+  return 0;
+}
@@ -0,0 +1,191 @@
+// |BatchScheduler|: stages of simulated latencies (an upload, a computation
+// and an ordered download of every batch, each on a resource of its own) run
+// by one worker in either order and by a pool that overlaps them; every
+// schedule keeps the dependencies, the batch order of ordered stages, the
+// resource capacities and the limit on batches in flight. a stage that throws
+// stops the run and the exception is rethrown.
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "scheduler.h"
+#include "check.h"
+
+namespace {
+
+typedef BatchScheduler::TaskRecord Task;
+
+const int kNumBatches = 16;
+const int kInactive = 5;
+const double kLatency[3] = {1, 2, 1}; // ms
+
+void sleepFor(double ms) { std::this_thread::sleep_for(std::chrono::microseconds((long)(ms * 1000))); }
+
+// the compute stage of batch |throwAt| throws, if it isn't -1.
+void build(BatchScheduler& sched, int throwAt = -1) {
+  int upload = sched.addStage("upload", [](int) { sleepFor(kLatency[0]); }, {}, sched.addResource("h2d", 1));
+  int compute = sched.addStage("compute", [throwAt](int batch) {
+    sleepFor(kLatency[1]);
+    if (batch == throwAt) throw std::runtime_error("compute failed");
+  }, {upload}, sched.addResource("device", 1));
+  sched.addStage("download", [](int) { sleepFor(kLatency[2]); }, {compute}, sched.addResource("d2h", 1), true);
+}
+
+std::vector<bool> activeBatches() {
+  std::vector<bool> active(kNumBatches, true);
+  active[kInactive] = false;
+  return active;
+}
+
+// the most batches in flight at the start of any task: a batch is in flight
+// from the start of its first task to the end of its last.
+unsigned int maxInFlight(const BatchScheduler& sched, const std::vector<const Task*>& tasks, const std::vector<bool>& active) {
+  int S = sched.numStages();
+  unsigned int most = 0;
+  for (const Task& t : sched.records()) {
+    unsigned int inFlight = 0;
+    for (int b = 0; b < kNumBatches; b++) {
+      if (!active[b]) continue;
+      double first = tasks[b * S]->start, last = tasks[b * S]->end;
+      for (int s = 1; s < S; s++) {
+        first = std::min(first, tasks[b * S + s]->start);
+        last = std::max(last, tasks[b * S + s]->end);
+      }
+      if (first <= t.start && t.start < last) inFlight++;
+    }
+    most = std::max(most, inFlight);
+  }
+  return most;
+}
+
+// every stage of every active batch ran once and after its dependencies,
+// ordered stages ran in batch order, and neither a resource nor the batches
+// in flight were ever over their limit. returns the most batches in flight.
+unsigned int checkSchedule(const BatchScheduler& sched, const std::vector<bool>& active) {
+  int S = sched.numStages();
+  std::vector<const Task*> tasks((size_t)kNumBatches * S, nullptr);
+  for (const Task& t : sched.records()) {
+    CHECK(active[t.batch]);
+    CHECK(!tasks[t.batch * S + t.stage]);
+    tasks[t.batch * S + t.stage] = &t;
+  }
+  int prev = -1;
+  for (int b = 0; b < kNumBatches; b++) {
+    if (!active[b]) continue;
+    for (int s = 0; s < S; s++) {
+      const Task* t = tasks[b * S + s];
+      CHECK(t);
+      for (int d : sched.stageDeps(s)) CHECK(t->start >= tasks[b * S + d]->end);
+      if (sched.stageOrdered(s) && prev >= 0) CHECK(t->start >= tasks[prev * S + s]->end);
+    }
+    prev = b;
+  }
+
+  for (const Task& t : sched.records()) {
+    int resource = sched.stageResource(t.stage);
+    if (resource < 0) continue;
+    unsigned int sharing = 0;
+    for (const Task& u : sched.records())
+      if (sched.stageResource(u.stage) == resource && u.start <= t.start && t.start < u.end) sharing++;
+    CHECK(sharing <= sched.resourceCapacity(resource));
+  }
+
+  unsigned int most = maxInFlight(sched, tasks, active);
+  if (sched.maxInFlight()) CHECK(most <= sched.maxInFlight());
+  return most;
+}
+
+double makespan(const BatchScheduler& sched) {
+  double end = 0;
+  for (const Task& t : sched.records()) end = std::max(end, t.end);
+  return end;
+}
+
+} // namespace
+
+int main() {
+  std::vector<bool> active = activeBatches();
+  const int numActive = kNumBatches - 1;
+
+  // a single worker runs the batches one after another, or each stage for all
+  // batches, like the two orders of |runOptiX|.
+  for (int order = 0; order < 2; order++) {
+    BatchScheduler sched(1);
+    build(sched);
+    sched.setOrder(order ? BatchScheduler::STAGE_MAJOR : BatchScheduler::BATCH_MAJOR);
+    sched.run(kNumBatches, active);
+    checkSchedule(sched, active);
+    const std::vector<Task>& recs = sched.records();
+    for (size_t i = 1; i < recs.size(); i++) {
+      bool inOrder = order ? (recs[i - 1].stage < recs[i].stage || (recs[i - 1].stage == recs[i].stage && recs[i - 1].batch < recs[i].batch))
+                           : (recs[i - 1].batch < recs[i].batch || (recs[i - 1].batch == recs[i].batch && recs[i - 1].stage < recs[i].stage));
+      CHECK(inOrder);
+    }
+  }
+
+  // a pool overlaps the uploads and downloads with the computations: run one
+  // after another the batches take the sum of their latencies, overlapped
+  // about the computations alone. halfway between the two leaves plenty of
+  // room for oversleeping.
+  {
+    BatchScheduler sched(4);
+    build(sched);
+    sched.setMaxInFlight(3);
+    sched.run(kNumBatches, active);
+    checkSchedule(sched, active);
+    double serial = numActive * (kLatency[0] + kLatency[1] + kLatency[2]);
+    double overlapped = kLatency[0] + kLatency[2] + numActive * kLatency[1];
+    CHECK(makespan(sched) < (serial + overlapped) / 2);
+
+    // the same scheduler runs again from scratch.
+    sched.run(kNumBatches, active);
+    checkSchedule(sched, active);
+    CHECK((int)sched.records().size() == numActive * sched.numStages());
+  }
+
+  // the limit on batches in flight: one at a time leaves nothing to overlap
+  // however many workers there are, and two are enough to keep the device busy
+  // most of the time.
+  {
+    BatchScheduler sched(4);
+    build(sched);
+    sched.setMaxInFlight(1);
+    sched.run(kNumBatches, active);
+    CHECK(checkSchedule(sched, active) == 1);
+    CHECK(makespan(sched) >= numActive * (kLatency[0] + kLatency[1] + kLatency[2]));
+
+    sched.setMaxInFlight(2);
+    sched.run(kNumBatches, active);
+    CHECK(checkSchedule(sched, active) == 2);
+  }
+
+  // a throwing stage: the exception comes out of |run|, and the batches that
+  // depend on it through the ordered download never finish.
+  for (unsigned int numWorkers : {1u, 4u}) {
+    const int throwAt = 7;
+    BatchScheduler sched(numWorkers);
+    build(sched, throwAt);
+    std::string what;
+    try {
+      sched.run(kNumBatches, active);
+    } catch (const std::runtime_error& e) {
+      what = e.what();
+    }
+    CHECK(what == "compute failed");
+    int S = sched.numStages();
+    bool threw = false;
+    for (const Task& t : sched.records()) {
+      if (t.stage == S - 1) CHECK(t.batch < throwAt);
+      if (t.stage == 1 && t.batch == throwAt) threw = true;
+    }
+    CHECK(threw);
+    CHECK((int)sched.records().size() < numActive * S);
+    // one worker starts nothing after the throw.
+    if (numWorkers == 1) CHECK(sched.records().back().batch == throwAt && sched.records().back().stage == 1);
+  }
+  return 0;
+}
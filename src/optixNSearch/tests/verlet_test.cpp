@@ -0,0 +1,91 @@
+// |rtnn::VerletList|: particles drift over many steps, by less than half the
+// skin between rebuilds for a while and then past it, and jump by more than
+// that in one step; the lists of every step match brute force, and the lists
+// are only rebuilt when some particle moved more than half the skin since
+// the last rebuild, or the number of particles changed.
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <sutil/vec_math.h>
+
+#include "verlet.h"
+#include "check.h"
+
+namespace {
+
+const float kRadius = 0.05f;
+const float kSkin = 0.02f;
+
+void checkAgainstBruteForce(const rtnn::NeighborList& list, const std::vector<float3>& points) {
+  CHECK(list.offsets.size() == points.size() + 1);
+  for (unsigned int i = 0; i < points.size(); i++) {
+    std::vector<unsigned int> expected;
+    for (unsigned int j = 0; j < points.size(); j++) {
+      float3 d = points[i] - points[j];
+      if ((i != j) && (dot(d, d) < kRadius * kRadius)) expected.push_back(j);
+    }
+    std::vector<unsigned int> ids(list.ids.begin() + list.offsets[i], list.ids.begin() + list.offsets[i + 1]);
+    std::sort(ids.begin(), ids.end());
+    CHECK(ids == expected);
+  }
+}
+
+// whether any particle moved more than half the skin from |ref|.
+bool pastSkin(const std::vector<float3>& points, const std::vector<float3>& ref) {
+  if (points.size() != ref.size()) return true;
+  for (unsigned int i = 0; i < points.size(); i++) {
+    float3 d = points[i] - ref[i];
+    if (dot(d, d) > kSkin * kSkin / 4) return true;
+  }
+  return false;
+}
+
+} // namespace
+
+int main() {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> u(0, 1);
+  std::uniform_real_distribution<float> v(-1, 1);
+  std::vector<float3> points(3000);
+  for (auto& p : points) p = make_float3(u(gen), u(gen), u(gen));
+
+  // each particle drifts in its own direction at up to a tenth of the skin per
+  // step, so the first particles cross half the skin after a few steps.
+  std::vector<float3> velocity(points.size());
+  for (auto& vel : velocity) vel = make_float3(v(gen), v(gen), v(gen)) * (kSkin / 10 / sqrtf(3));
+
+  rtnn::VerletList verlet(kRadius, kSkin);
+  checkAgainstBruteForce(verlet.step(points.data(), points.size()), points);
+  CHECK(verlet.numBuilds() == 1);
+  std::vector<float3> ref = points;
+
+  unsigned int numBuilds = 1;
+  for (int s = 0; s < 30; s++) {
+    for (unsigned int i = 0; i < points.size(); i++) points[i] += velocity[i];
+    // every tenth step one particle jumps by the whole skin.
+    if (s % 10 == 9) points[s] += make_float3(kSkin, 0, 0);
+
+    bool rebuild = pastSkin(points, ref);
+    const rtnn::NeighborList& list = verlet.step(points.data(), points.size());
+    if (rebuild) {
+      numBuilds++;
+      ref = points;
+    }
+    CHECK(verlet.numBuilds() == numBuilds);
+    checkAgainstBruteForce(list, points);
+  }
+  // drifting alone, the lists last a few steps.
+  CHECK(numBuilds > 3);
+  CHECK(numBuilds < 20);
+
+  // fewer particles rebuild even without moving.
+  points.resize(points.size() - 100);
+  checkAgainstBruteForce(verlet.step(points.data(), points.size()), points);
+  CHECK(verlet.numBuilds() == numBuilds + 1);
+  checkAgainstBruteForce(verlet.step(points.data(), points.size()), points);
+  CHECK(verlet.numBuilds() == numBuilds + 1);
+  CHECK(verlet.numSteps() == 33);
+  return 0;
+}
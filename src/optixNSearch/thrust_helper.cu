@@ -38,6 +38,10 @@ void sortByKey( thrust::device_ptr<unsigned int> d_key_ptr, thrust::device_ptr<f
   thrust::sort_by_key(d_key_ptr, d_key_ptr + N, d_val_ptr);
 }
 
+void sortByKey( thrust::device_ptr<unsigned int> d_key_ptr, thrust::device_ptr<float> d_val_ptr, unsigned int N ) {
+  thrust::sort_by_key(d_key_ptr, d_key_ptr + N, d_val_ptr);
+}
+
 void sortByKey( thrust::device_ptr<unsigned int> d_key_ptr, thrust::device_ptr<int> d_val_ptr, unsigned int N ) {
   thrust::sort_by_key(d_key_ptr, d_key_ptr + N, d_val_ptr);
 }
@@ -62,6 +66,10 @@ void gatherByKey ( thrust::device_ptr<unsigned int> d_key_ptr, thrust::device_ve
   thrust::gather(d_key_ptr, d_key_ptr + N, d_orig_queries->begin(), d_new_val_ptr);
 }
 
+void gatherByKey ( thrust::device_ptr<unsigned int> d_key_ptr, thrust::device_ptr<float> d_orig_val_ptr, thrust::device_ptr<float> d_new_val_ptr, unsigned int N, cudaStream_t stream ) {
+  thrust::gather(thrust::cuda::par.on(stream), d_key_ptr, d_key_ptr + N, d_orig_val_ptr, d_new_val_ptr);
+}
+
 void gatherByKey ( thrust::device_ptr<unsigned int> d_key_ptr, thrust::device_ptr<float> d_orig_val_ptr, thrust::device_ptr<float> d_new_val_ptr, unsigned int N ) {
   thrust::gather(d_key_ptr, d_key_ptr + N, d_orig_val_ptr, d_new_val_ptr);
 }
@@ -183,6 +191,18 @@ void copyIfIdInRange(float3* source, unsigned int N, thrust::device_ptr<int> mas
                     mask, dest, isInRange(min, max));
 }
 
+void copyIfIdInRange(float* source, unsigned int N, thrust::device_ptr<int> mask, thrust::device_ptr<float> dest, int min, int max) {
+    thrust::copy_if(thrust::device_pointer_cast(source),
+                    thrust::device_pointer_cast(source) + N,
+                    mask, dest, isInRange(min, max));
+}
+
+void copyIfIdInRange(unsigned int* source, unsigned int N, thrust::device_ptr<int> mask, thrust::device_ptr<unsigned int> dest, int min, int max) {
+    thrust::copy_if(thrust::device_pointer_cast(source),
+                    thrust::device_pointer_cast(source) + N,
+                    mask, dest, isInRange(min, max));
+}
+
 void copyIfNonZero(float3* source, unsigned int N, thrust::device_ptr<bool> mask, thrust::device_ptr<float3> dest) {
     thrust::copy_if(thrust::device_pointer_cast(source),
                     thrust::device_pointer_cast(source) + N,
@@ -206,6 +226,11 @@ unsigned int uniqueByKey(thrust::device_ptr<unsigned int> key, unsigned int N, t
   return thrust::get<0>(end) - key;
 }
 
+unsigned int countUniq(thrust::device_ptr<unsigned int> d_value_ptr, unsigned int N, cudaStream_t stream) {
+  auto end = thrust::unique(thrust::cuda::par.on(stream), d_value_ptr, d_value_ptr + N);
+  return end - d_value_ptr;
+}
+
 unsigned int countUniq(thrust::device_ptr<unsigned int> d_value_ptr, unsigned int N) {
   auto end = thrust::unique(d_value_ptr, d_value_ptr + N);
   return end - d_value_ptr;
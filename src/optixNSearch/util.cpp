@@ -5,6 +5,10 @@
 #include <fstream>
 #include <string>
 #include <cstdlib>
+#include <algorithm>
+#include <sstream>
+#include <cfloat>
+#include <climits>
 
 #include <sutil/Timing.h>
 #include <sutil/Exception.h>
@@ -15,123 +19,13 @@
 #include "func.h"
 #include "state.h"
 
-int tokenize(std::string s, std::string del, float3** ndpoints, unsigned int lineId)
-{
-  int start = 0;
-  int end = s.find(del);
-  int dim = 0;
-
-  std::vector<float> vcoords;
-  while (end != -1) {
-    float coord = std::stof(s.substr(start, end - start));
-    //std::cout << coord << std::endl;
-    if (ndpoints != nullptr) {
-      vcoords.push_back(coord);
-    }
-    start = end + del.size();
-    end = s.find(del, start);
-    dim++;
-  }
-  float coord  = std::stof(s.substr(start, end - start));
-  //std::cout << coord << std::endl;
-  if (ndpoints != nullptr) {
-    vcoords.push_back(coord);
-  }
-  dim++;
-
-  assert(dim > 0);
-  if ((dim % 3) != 0) dim = (dim/3+1)*3;
-
-  if (ndpoints != nullptr) {
-    for (int batch = 0; batch < dim/3; batch++) {
-      float3 point = make_float3(vcoords[batch*3], vcoords[batch*3+1], vcoords[batch*3+2]);
-      ndpoints[batch][lineId] = point;
-    }
-  }
-
-  return dim;
-}
-
-float3** read_pc_data(const char* data_file, unsigned int* N, int* d) {
-  std::ifstream file;
-
-  file.open(data_file);
-  if( !file.good() ) {
-    std::cerr << "Could not read the frame data...\n";
-    assert(0);
-  }
-
-  char line[1024];
-  unsigned int lines = 0;
-  int dim = 0;
-
-  while (file.getline(line, 1024)) {
-    if (lines == 0) {
-      std::string str(line);
-      dim = tokenize(str, ",", nullptr, 0);
-    }
-    lines++;
-  }
-  file.clear();
-  file.seekg(0, std::ios::beg);
-
-  *N = lines;
-  *d = dim;
-
-  float3** ndpoints = new float3*[dim/3];
-  for (int i = 0; i < dim/3; i++) {
-    ndpoints[i] = new float3[lines];
-  }
-
-  lines = 0;
-  while (file.getline(line, 1024)) {
-    std::string str(line);
-    tokenize(str, ",", ndpoints, lines);
-
-    //std::cerr << ndpoints[0][lines].x << "," << ndpoints[0][lines].y << "," << ndpoints[0][lines].z << std::endl;
-    //std::cerr << ndpoints[1][lines].x << "," << ndpoints[1][lines].y << "," << ndpoints[1][lines].z << std::endl;
-    lines++;
-  }
-
-  file.close();
-
-  return ndpoints;
-}
-
-float3* read_pc_data(const char* data_file, unsigned int* N) {
-  std::ifstream file;
-
-  file.open(data_file);
-  if( !file.good() ) {
-    std::cerr << "Could not read the frame data...\n";
-    assert(0);
-  }
-
-  char line[1024];
-  unsigned int lines = 0;
-
-  while (file.getline(line, 1024)) {
-    lines++;
-  }
-  file.clear();
-  file.seekg(0, std::ios::beg);
-  *N = lines;
-
-  float3* t_points = new float3[lines];
-
-  lines = 0;
-  while (file.getline(line, 1024)) {
-    double x, y, z;
-
-    sscanf(line, "%lf,%lf,%lf\n", &x, &y, &z);
-    t_points[lines] = make_float3(x, y, z);
-    //std::cerr << t_points[lines].x << ", " << t_points[lines].y << ", " << t_points[lines].z << std::endl;
-    lines++;
-  }
-
-  file.close();
-
-  return t_points;
+// parse a comma-separated list of numbers, e.g., "1,2,4".
+static std::vector<double> parseList(const std::string& s) {
+  std::vector<double> list;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) list.push_back(std::stod(item));
+  return list;
 }
 
 void printUsageAndExit( const char* argv0 )
@@ -142,14 +36,37 @@ void printUsageAndExit( const char* argv0 )
     std::cerr << "\e[1mBasic Options:\e[0m\n";
     std::cerr << "  --pfile           | -f      File for search points. By default it's also used as queries unless -q is speficied.\n";
     std::cerr << "  --qfile           | -q      File for queries.\n";
-    std::cerr << "  --searchmode      | -sm     Search mode; can only be \"knn\" or \"radius\". Default is \"radius\". \n";
+    std::cerr << "  --rfile           | -rf     File for per-query search radii, one per line in query order. Overrides -r, whose value becomes the largest radius.\n";
+    std::cerr << "  --searchmode      | -sm     Search mode; can only be \"knn\", \"radius\" or \"count\". \"count\" returns one neighbor count per query with no K cap. Default is \"radius\". \n";
     std::cerr << "  --radius          | -r      Search radius. Default is 2.\n";
     std::cerr << "  --knn             | -k      Max K returned. Default is 50.\n";
+    std::cerr << "  --multiradius     | -mr     Comma-separated ascending radii for a multi-radius search, e.g., 1,2,4. Up to 4 radii. Overrides -r. Radius search only. Default is empty.\n";
+    std::cerr << "  --multik          | -mk     Comma-separated max K per radius of -mr. Default is -k for every radius.\n";
     std::cerr << "  --device          | -d      Specify GPU ID. Default is 0.\n";
     std::cerr << "  --interleave      | -i      Allow interleaving kernel launches? Enable it for better performance. Default is true.\n";
     std::cerr << "  --msr             | -m      Enable end-to-end measurement? If true, disable CUDA synchronizations for more accurate time measurement (and higher performance). Default is true.\n";
     std::cerr << "  --check           | -c      Enable sanity check? Default is false.\n";
     std::cerr << "  --deferFree       | -df     Defer free-ing intermediate device memory? Default is true.\n";
+    std::cerr << "  --backend         | -be     Search backend; can only be \"optix\" or \"host\". The host backend searches a uniform grid on the CPU and needs no GPU. Default is \"optix\".\n";
+    std::cerr << "  --periodic        | -pb     Periodic box; either \"lx,ly,lz\" for [0, l) along each axis or \"x0,y0,z0,x1,y1,z1\" for [x0, x1) etc. Points are wrapped into the box and distances follow the minimum image convention. The radius can't exceed half the box. Default is no periodic box.\n";
+    std::cerr << "  --recenter        | -rc     Read coordinates in double precision and search float offsets from the centre of the bounding box of points and queries? The centre is printed as \"origin\". Default is true.\n";
+    std::cerr << "  --compress        | -cp     Store points in the host grid as 16-bit fixed point within their cells? Halves the memory of the points; candidates near the radius are rechecked in full precision, so neighbors are exact, but -rd reduces over decoded positions. Host backend only; not for KNN or multi-radius search. Default is false.\n";
+    std::cerr << "  --moveBench       | -mb     Comma-separated displacements, e.g., 0.01,0.1,1. Instead of a search, move every point randomly by up to each displacement and time updating the grid incrementally against rebuilding it. Host backend only. Default is empty.\n";
+    std::cerr << "  --serve           | -sv     Instead of searching -q, serve query batches against the points on this Unix socket until a client asks it to shut down. See server.h for the protocol. Host backend only. Default is empty.\n";
+    std::cerr << "  --profile         | -pf     Write the timings as a tree of nested phases, with counts and per-batch totals, to this JSON file, and print the tree at the end. Default is empty.\n";
+    std::cerr << "  --trace           | -tr     Write every timed phase of every thread to this file in the Chrome trace_event format (chrome://tracing or Perfetto). Default is empty.\n";
+    std::cerr << "  --sweep           | -sw     Instead of one search, run every configuration of this sweep spec on the loaded data, append the timings of all phases and the memory peaks to -so, and report the Pareto-best configurations. See sweep.cpp for the spec format. Default is empty.\n";
+    std::cerr << "  --sweepOut        | -so     CSV file the sweep appends to. Default is sweep.csv.\n";
+    std::cerr << "  --plan            | -pl     Instead of searching, plan the device memory of the search without a GPU (the cell size -ac would pick, and the arrays, GASes and batches it leads to) and write it to this file as JSON. Exits with 1 if the search would not fit. Requires -mem. Default is empty.\n";
+    std::cerr << "  --memory          | -mem    Device memory in GB to plan for. Default is 0.\n";
+    std::cerr << "  --planPoints      | -pn     Plan for this many points, e.g., when -f is a sample of a larger data set with the same bounds. Default is 0 (the points read).\n";
+    std::cerr << "  --planQueries     | -pq     Plan for this many queries. Ignored if the queries are the points. Default is 0 (the queries read).\n";
+    std::cerr << "  --autotune        | -at     Pick -ps, -qs, -cr, -mc and -sg (host backend: -ps, -cr and -mc) for the data from a host-side estimate of the search cost, which samples warps of queries and counts their candidate points on the grid of each cell size. Overrides -ac. Default is false.\n";
+    std::cerr << "  --reduce          | -rd     Fused per-query reduction instead of neighbor lists; can only be \"none\", \"density\" (SPH poly6 density, smoothing length = radius) or \"mean\" (mean neighbor position). Host backend only. Default is \"none\".\n";
+    std::cerr << "  --sink            | -sk     Where the results of the OptiX backend go; can only be \"memory\" (kept in host memory until exit), \"file\" (rows of K IDs) or \"csr\" (compressed sparse rows of the neighbors found; not for counting or multi-radius search). The last two write -o on a thread of their own as chunks of queries come off the device, with the position in -q of every query; they turn off -fq, and turn on -g if queries are GAS-sorted (-s) so that their output can be chunked. See resultfile.h for the format. Default is \"memory\".\n";
+    std::cerr << "  --output          | -o      Result file of the \"file\" and \"csr\" sinks. Default is empty.\n";
+    std::cerr << "  --remap           | -rm     Write neighbor IDs as the positions of the points in -f rather than in the sorted order the search uses? Requires -sk file or csr; not for counting. Default is false.\n";
+    std::cerr << "  --halflist        | -hl     Report each unordered pair (i, j) only once, as neighbor j > i of query i? Requires queries to be the search points. Default is false.\n";
 
     std::cerr << "  --help            | -h      Print this usage message\n";
 
@@ -173,8 +90,9 @@ void printUsageAndExit( const char* argv0 )
     std::cerr << "  --autocrratio     | -ac     Automatically determining crRatio (cell/radius ratio)? cellSize = radius / crRatio. cellSize is used to create the grid for sorting queries. Default is true.\n";
     std::cerr << "  --crratio         | -cr     Specify crRatio. It's used only if \'-ac\' is false. Default is 8.\n";
     std::cerr << "  --gpumemused      | -gmu    Specify GPU memory that's occupied by other jobs. This allows a better estimation of crRatio to avoid OOM errors. Default is 0.\n";
-    std::cerr << "  --crStep          | -crs    Specify the step size in iteratively determining the best crRatio. Must be > 1. Default is 1.01.\n";
+    std::cerr << "  --crStep          | -crs    Specify the step size in determining the best crRatio, i.e., the smallest cell that fits in memory is found to within this factor. Must be > 1. Default is 1.01.\n";
     std::cerr << "  --metacellScale   | -mc     Specify the metacell scale. See comments in |genGridInfo|. Default is 4.\n";
+    std::cerr << "  --chunkMem        | -cm     Specify the device memory in MB for the search output. If the output of all queries doesn't fit, each batch is searched in chunks of queries, two of which fit, so that copying a chunk off the device overlaps with searching the next. Queries GAS-sorted without -g are searched unchunked, and their whole output is planned for. Without -sk the results of a batch are still kept whole in pinned host memory. Default is 0, which is a quarter of the device memory.\n";
     std::cerr << "  --estgassize      | -egs    Specify the estimated GAS size in MB, which will be used to help determine the crRatio if -ac is enabled. Default is -1, indicating that the GAS size will be automatically inferred. If specified the value can't be negative.\n";
 
     exit( 0 );
@@ -200,19 +118,187 @@ void parseArgs( RTNNState& state,  int argc, char* argv[] ) {
               printUsageAndExit( argv[0] );
           state.qfile = argv[++i];
       }
+      else if( arg == "--rfile" || arg == "-rf" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.rfile = argv[++i];
+      }
       else if( arg == "--knn" || arg == "-k" )
       {
           if( i >= argc - 1 )
               printUsageAndExit( argv[0] );
           state.knn = atoi(argv[++i]);
       }
+      else if( arg == "--multiradius" || arg == "-mr" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          for (auto r : parseList(argv[++i])) state.multiRadius.push_back(r);
+      }
+      else if( arg == "--multik" || arg == "-mk" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          for (auto k : parseList(argv[++i])) state.multiK.push_back((unsigned int)k);
+      }
       else if( arg == "--searchmode" || arg == "-sm" )
       {
           if( i >= argc - 1 )
               printUsageAndExit( argv[0] );
           state.searchMode = argv[++i];
-          if ((state.searchMode != "knn") && (state.searchMode != "radius"))
+          if ((state.searchMode != "knn") && (state.searchMode != "radius") && (state.searchMode != "count"))
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--backend" || arg == "-be" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.backend = argv[++i];
+          if ((state.backend != "optix") && (state.backend != "host"))
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--periodic" || arg == "-pb" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          // kept in double precision until |readData| knows the origin.
+          std::vector<double> box = parseList(argv[++i]);
+          if (box.size() == 3) {
+            state.periodicMin = make_double3(0, 0, 0);
+            state.periodicMax = make_double3(box[0], box[1], box[2]);
+          } else if (box.size() == 6) {
+            state.periodicMin = make_double3(box[0], box[1], box[2]);
+            state.periodicMax = make_double3(box[3], box[4], box[5]);
+          } else printUsageAndExit( argv[0] );
+          toLocal(&state.periodicMin, 1, state.origin, &state.boxMin);
+          toLocal(&state.periodicMax, 1, state.origin, &state.boxMax);
+          float3 boxSize = state.boxMax - state.boxMin;
+          if ((boxSize.x <= 0) || (boxSize.y <= 0) || (boxSize.z <= 0)) printUsageAndExit( argv[0] );
+          state.periodic = true;
+      }
+      else if( arg == "--reduce" || arg == "-rd" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.reduce = argv[++i];
+          if ((state.reduce != "none") && (state.reduce != "density") && (state.reduce != "mean"))
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--recenter" || arg == "-rc" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.recenter = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--compress" || arg == "-cp" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.compress = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--moveBench" || arg == "-mb" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          for (auto d : parseList(argv[++i])) state.moveBench.push_back(d);
+          if (state.moveBench.empty()) printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--serve" || arg == "-sv" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.socketPath = argv[++i];
+      }
+      else if( arg == "--profile" || arg == "-pf" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.profileFile = argv[++i];
+      }
+      else if( arg == "--trace" || arg == "-tr" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.traceFile = argv[++i];
+      }
+      else if( arg == "--sweep" || arg == "-sw" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.sweepFile = argv[++i];
+      }
+      else if( arg == "--sweepOut" || arg == "-so" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.sweepOut = argv[++i];
+      }
+      else if( arg == "--plan" || arg == "-pl" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.planFile = argv[++i];
+      }
+      else if( arg == "--memory" || arg == "-mem" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.planMemGB = std::stof(argv[++i]);
+      }
+      else if( arg == "--planPoints" || arg == "-pn" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.planPoints = std::stoul(argv[++i]);
+      }
+      else if( arg == "--planQueries" || arg == "-pq" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.planQueries = std::stoul(argv[++i]);
+      }
+      else if( arg == "--autotune" || arg == "-at" )
+      {
+          if( i >= argc - 1 )
               printUsageAndExit( argv[0] );
+          state.autoTune = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--halflist" || arg == "-hl" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.halfList = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--sink" || arg == "-sk" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.sinkType = argv[++i];
+          if ((state.sinkType != "memory") && (state.sinkType != "file") && (state.sinkType != "csr"))
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--output" || arg == "-o" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.outFile = argv[++i];
+      }
+      else if( arg == "--remap" || arg == "-rm" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.remapIds = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--chunkMem" || arg == "-cm" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.chunkMem = std::stof(argv[++i]);
+          if (state.chunkMem < 0) {
+              fprintf(stderr, "chunkMem can't be negative.\n");
+              printUsageAndExit( argv[0] );
+          }
       }
       else if( arg == "--radius" || arg == "-r" )
       {
@@ -347,7 +433,7 @@ void parseArgs( RTNNState& state,  int argc, char* argv[] ) {
               printUsageAndExit( argv[0] );
           state.mcScale = atoi(argv[++i]);
       }
-      else if( arg == "--crStep " || arg == "-crs" )
+      else if( arg == "--crStep" || arg == "-crs" )
       {
           if( i >= argc - 1 )
               printUsageAndExit( argv[0] );
@@ -368,7 +454,150 @@ void parseArgs( RTNNState& state,  int argc, char* argv[] ) {
   if (state.searchMode == "knn")
     state.knn = K; // a macro
 
+  // partitioned batches search with a radius smaller than the actual radius,
+  // which is only correct when each query stops at K neighbors. counting
+  // needs every neighbor, so all queries search with the full radius.
+  if (state.searchMode == "count")
+    state.partition = false;
+
+  if (!state.multiRadius.empty()) {
+    if (state.multiK.empty()) state.multiK.assign(state.multiRadius.size(), state.knn);
+    if ((state.multiK.size() != state.multiRadius.size()) || (state.multiRadius.size() > MAX_RADII) ||
+        !std::is_sorted(state.multiRadius.begin(), state.multiRadius.end())) {
+      fprintf(stderr, "Multi-radius search takes up to %d ascending radii and one K per radius.\n", MAX_RADII);
+      printUsageAndExit( argv[0] );
+    }
+    if ((state.searchMode != "radius") || !state.rfile.empty() || (state.reduce != "none")) {
+      fprintf(stderr, "Multi-radius search is a radius search with uniform radii and no reduction.\n");
+      printUsageAndExit( argv[0] );
+    }
+    // one traversal at the largest radius, and a query's output row holds
+    // the lists of all radii. partitioning shrinks the launch radius below
+    // the largest radius, so it's disabled.
+    state.radius = state.multiRadius.back();
+    state.knn = 0;
+    for (auto k : state.multiK) state.knn += k;
+    state.partition = false;
+  }
+
+  // filtering drops queries far from the points, which isn't meaningful when
+  // distances wrap around the box.
+  if (state.periodic) state.filterQueries = false;
+
   state.sameData = (state.qfile.empty() || (state.qfile == state.pfile));
+
+  if (state.reduce != "none") {
+    if (state.backend != "host") {
+      fprintf(stderr, "Fused reductions are only supported by the host backend.\n");
+      printUsageAndExit( argv[0] );
+    }
+    if (state.halfList) {
+      fprintf(stderr, "Fused reductions visit all neighbors; half list doesn't apply.\n");
+      printUsageAndExit( argv[0] );
+    }
+  }
+
+  if (!state.socketPath.empty() && ((state.backend != "host") || state.periodic)) {
+    fprintf(stderr, "The search server needs the host backend and no periodic box.\n");
+    printUsageAndExit( argv[0] );
+  }
+
+  if (!state.sweepFile.empty() && (!state.socketPath.empty() || !state.profileFile.empty() || !state.traceFile.empty())) {
+    fprintf(stderr, "A sweep records the timings of its runs itself; it can't be combined with -sv, -pf or -tr.\n");
+    printUsageAndExit( argv[0] );
+  }
+
+  if (!state.sweepFile.empty() && (state.sinkType != "memory")) {
+    fprintf(stderr, "A sweep discards the results of its runs; it can't be combined with -sk.\n");
+    printUsageAndExit( argv[0] );
+  }
+
+  if (!state.planFile.empty() && state.planMemGB <= 0.25) {
+    fprintf(stderr, "Planning needs the device memory, more than the 0.25 GB reserve, with -mem.\n");
+    printUsageAndExit( argv[0] );
+  }
+
+  if (!state.planFile.empty() && (state.backend != "optix" || !state.sweepFile.empty() || !state.socketPath.empty())) {
+    fprintf(stderr, "Planning only applies to one search with the OptiX backend.\n");
+    printUsageAndExit( argv[0] );
+  }
+
+  if (state.autoTune && !state.sweepFile.empty()) {
+    fprintf(stderr, "Autotuning picks one configuration and a sweep runs the given ones; they can't be combined.\n");
+    printUsageAndExit( argv[0] );
+  }
+
+  if (state.sinkType != "memory") {
+    if ((state.backend != "optix") || state.outFile.empty()) {
+      fprintf(stderr, "Result sinks need the OptiX backend and a file to write to with -o.\n");
+      printUsageAndExit( argv[0] );
+    }
+    if (state.sanCheck) {
+      fprintf(stderr, "The sanity check reads the results kept in memory; it can't be combined with -sk.\n");
+      printUsageAndExit( argv[0] );
+    }
+    if ((state.sinkType == "csr") && ((state.searchMode == "count") || !state.multiRadius.empty())) {
+      fprintf(stderr, "CSR output holds one neighbor list per query; it doesn't apply to counting or multi-radius search.\n");
+      printUsageAndExit( argv[0] );
+    }
+    // the input positions of the queries travel with them through sorting,
+    // partitioning and gathering, but not through filtering, so disable
+    // that. GAS-sorted queries are gathered so that their output can be
+    // chunked (see |calcChunkQueries|).
+    state.filterQueries = false;
+    if (state.qGasSortMode) state.toGather = true;
+  }
+
+  if (state.remapIds && ((state.sinkType == "memory") || (state.searchMode == "count"))) {
+    fprintf(stderr, "Remapping IDs applies to the neighbor IDs written by -sk file or csr.\n");
+    printUsageAndExit( argv[0] );
+  }
+
+  if (!state.moveBench.empty() && (state.backend != "host")) {
+    fprintf(stderr, "Grid update benchmark is only supported by the host backend.\n");
+    printUsageAndExit( argv[0] );
+  }
+
+  // KNN ranks, and multi-radius search bins, neighbors by distances that
+  // are only approximate for compressed points.
+  if (state.compress) {
+    if ((state.backend != "host") || (state.searchMode == "knn") || !state.multiRadius.empty()) {
+      fprintf(stderr, "Compressed points are only supported by the host backend for radius search, counting and reductions.\n");
+      printUsageAndExit( argv[0] );
+    }
+  }
+
+  if (!state.rfile.empty()) {
+    if (state.halfList || (state.reduce != "none")) {
+      fprintf(stderr, "Per-query radii can't be used with half list or fused reductions.\n");
+      printUsageAndExit( argv[0] );
+    }
+    if (state.querySortMode == 3) {
+      fprintf(stderr, "Per-query radii don't support 1D query sorting.\n");
+      printUsageAndExit( argv[0] );
+    }
+    // radii travel with the queries through grid sorting and partitioning,
+    // but not through filtering or gathering, so disable those.
+    state.filterQueries = false;
+    state.toGather = false;
+  }
+
+  if (state.halfList) {
+    if (!state.sameData) {
+      fprintf(stderr, "Half list requires queries to be the search points.\n");
+      printUsageAndExit( argv[0] );
+    }
+    // the optix backend identifies a pair by the query's position in the
+    // device query array, which only matches the point ID when queries and
+    // points share the same (identically sorted) device memory. so disable
+    // everything that copies or reorders queries independently of points.
+    if (state.backend == "optix") {
+      state.partition = false;
+      state.toGather = false;
+      state.querySortMode = state.pointSortMode;
+    }
+  }
+
   bool sameSortMode = (state.pointSortMode == state.querySortMode);
 
   // samepq indicates whether queries and points share the same host and device
@@ -377,23 +606,67 @@ void parseArgs( RTNNState& state,  int argc, char* argv[] ) {
   // share the same device memory since sorting is in-place; they can't share
   // the same host memory either since host memory layout will be mutated to be
   // in-sync with device memory layout for sanity check purpose.
-  if (sameSortMode && state.sameData) {
+  // with per-query radii queries are reordered independently of points, so
+  // they always get their own memory.
+  if (sameSortMode && state.sameData && state.rfile.empty()) {
     state.samepq = true;
   }
 }
 
-void readData(RTNNState& state) {
-  state.h_points = read_pc_data(state.pfile.c_str(), &state.numPoints);
-  state.h_queries = state.h_points;
+// read points (and queries) in double precision and keep them as float
+// offsets from |state.origin|, the centre of the bounding box of points and
+// queries together. far from the origin (e.g., UTM or ECEF coordinates) floats
+// can't resolve small radii, but offsets from the centre of the data can. the
+// search only depends on differences, so neighbor IDs are not affected.
+static void readDataRecentered(RTNNState& state) {
+  bool diffQuery = !state.qfile.empty() && (state.qfile != state.pfile);
+
+  double3* points = read_pc_data_double(state.pfile.c_str(), &state.numPoints);
+  double3* queries = points;
   state.numQueries = state.numPoints;
+  if (diffQuery) queries = read_pc_data_double(state.qfile.c_str(), &state.numQueries);
+
+  double3 lo = make_double3(DBL_MAX, DBL_MAX, DBL_MAX);
+  double3 hi = make_double3(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+  growBounds(points, state.numPoints, lo, hi);
+  if (diffQuery) growBounds(queries, state.numQueries, lo, hi);
+  if (state.numPoints && state.numQueries)
+    state.origin = make_double3((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+
+  state.h_points = new float3[state.numPoints];
+  toLocal(points, state.numPoints, state.origin, state.h_points);
+  state.h_queries = state.h_points;
+  if (!state.samepq) {
+    state.h_queries = new float3[state.numQueries];
+    toLocal(queries, state.numQueries, state.origin, state.h_queries);
+  }
+
+  if (diffQuery) delete[] queries;
+  delete[] points;
+
+  // the periodic box is given in the original coordinates.
+  if (state.periodic) {
+    toLocal(&state.periodicMin, 1, state.origin, &state.boxMin);
+    toLocal(&state.periodicMax, 1, state.origin, &state.boxMax);
+  }
+}
+
+void readData(RTNNState& state) {
+  if (state.recenter) {
+    readDataRecentered(state);
+  } else {
+    state.h_points = read_pc_data(state.pfile.c_str(), &state.numPoints);
+    state.h_queries = state.h_points;
+    state.numQueries = state.numPoints;
+  }
 
-  if (!state.samepq) { // if can't share the host memory
+  if (!state.samepq && (state.h_queries == state.h_points)) { // if can't share the host memory
     if (!state.qfile.empty() && (state.qfile != state.pfile)) {
       // if the underlying data are different, read it
       state.h_queries = read_pc_data(state.qfile.c_str(), &state.numQueries);
     } else {
       // if underlying data are the same, copy it
-      state.h_queries = (float3*)malloc(state.numQueries * sizeof(float3));
+      state.h_queries = new float3[state.numQueries];
       thrust::copy(state.h_points, state.h_points+state.numQueries, state.h_queries);
     }
   }
@@ -402,27 +675,35 @@ void readData(RTNNState& state) {
     fprintf(stdout, "empty query and/or points\n");
     exit(0);
   }
-}
 
-// this function returns the width of the inscribed cube (square) of a sphere (circle)
-float maxInscribedWidth(float radius, int dim) {
-  if (dim == 2) return radius/sqrt(2)*2;
-  else if (dim == 3) return radius/sqrt(3)*2;
-  else assert(0);
-}
+  if (!state.rfile.empty()) {
+    unsigned int numRadii;
+    state.h_qRadius = read_radius_data(state.rfile.c_str(), &numRadii);
+    if (numRadii != state.numQueries) {
+      fprintf(stderr, "%u radii are given for %u queries.\n", numRadii, state.numQueries);
+      exit(1);
+    }
+    // everything that is sized by the radius (grid cells, AABBs of the last
+    // batch) uses the largest radius.
+    state.radius = *std::max_element(state.h_qRadius, state.h_qRadius + numRadii);
+  }
 
-// this function returns the radius of the circumsphere (circumcircle) of a cube (square)
-float minCircumscribedRadius(float width, int dim) {
-  if (dim == 2) return width/2*sqrt(2);
-  else if (dim == 3) return width/2*sqrt(3);
-  else assert(0);
-}
+  if (state.periodic) {
+    // the minimum image of a point is only unique, and a point is found from
+    // at most one image of a query, if the radius is at most half the box.
+    float3 boxSize = state.boxMax - state.boxMin;
+    if (state.radius * 2 > fminf(boxSize)) {
+      fprintf(stderr, "Radius %f exceeds half of the periodic box.\n", state.radius);
+      exit(1);
+    }
 
-// this function returns the radius of a sphere (circle) with same volume of a cube (square)
-float radiusEquiVolume(float width, int dim) {
-  if (dim == 2) return width*sqrt(1/M_PI);
-  else if (dim == 3) return width*cbrt(3/(4*M_PI));
-  else assert(0);
+    for (unsigned int i = 0; i < state.numPoints; i++)
+      state.h_points[i] = wrapIntoBox(state.h_points[i], state.boxMin, boxSize);
+    if (state.h_queries != state.h_points) {
+      for (unsigned int i = 0; i < state.numQueries; i++)
+        state.h_queries[i] = wrapIntoBox(state.h_queries[i], state.boxMin, boxSize);
+    }
+  }
 }
 
 void countFromGasSort(RTNNState& state, int& qCount, int& pCount) {
@@ -530,17 +811,11 @@ float estSortLtdSize(RTNNState& state,
   float cellSize = cbrt(sceneVolume / numOfSortingCells);
 
   if (refine) {
-    float curSortingSize = numOfSortingCells * (cellArrayCount * sizeof(unsigned int));
-    while (1) {
-      GridInfo gridInfo;
-      state.crRatio = state.radius / cellSize;
-      float numOfSortingCells = genGridInfo(state, state.numPoints, gridInfo);
-      curSortingSize = numOfSortingCells * (cellArrayCount * sizeof(unsigned int));
-
-      fprintf(stdout, "%f, %f\n", curSortingSize/1024/1024, spaceAvail/1024/1024);
-      if (curSortingSize < spaceAvail) break;
-      cellSize *= state.crStep;
-    }
+    cellSize = fitCellSize(state, spaceAvail, cellSize, cellArrayCount, 0);
+    if (cellSize == 0) return 0;
+    state.crRatio = state.radius / cellSize;
+    float curSortingSize = memFootprint(state, cellSize, cellArrayCount, 0);
+    fprintf(stdout, "%f, %f\n", curSortingSize/1024/1024, spaceAvail/1024/1024);
     fprintf(stdout, "\tMemory utilization: %.3f%%\n", (1 - (spaceAvail-curSortingSize)/(state.totDRAMSize*1024*1024*1024))*100.0);
   }
   fprintf(stdout, "Sorting limited cellSize: %f\n", cellSize);
@@ -548,35 +823,85 @@ float estSortLtdSize(RTNNState& state,
   return cellSize;
 }
 
-float calcCRRatio(RTNNState& state) {
+// queries per chunk of the search output; see |search|. all of them if the
+// output of all queries fits in the result budget (-cm, or a quarter of the
+// device memory if it isn't known yet), and each batch keeps its output on the
+// device as before; otherwise as many as let two chunks fit. the kernels index
+// the output of a launch in 32 bits, which caps a chunk too. rays of
+// GAS-sorted queries that aren't gathered write the rows of queries anywhere
+// in the batch, so they can't be chunked: the whole output is planned for.
+unsigned int calcChunkQueries(RTNNState& state) {
+  if (state.qGasSortMode && !state.toGather) return state.numQueries;
+  unsigned int width = (state.searchMode == "count") ? 1 : state.knn;
+  double rowSize = (double)width * sizeof(unsigned int);
+  double budget = (state.chunkMem > 0) ? state.chunkMem * 1024.0 * 1024 : state.totDRAMSize * 1024.0 * 1024 * 1024 / 4;
+  unsigned int maxChunk = UINT_MAX / width;
+
+  if (budget <= 0 || state.numQueries * rowSize <= budget) return std::min(state.numQueries, maxChunk);
+  return (unsigned int)std::max(1.0, std::min(floor(budget / 2 / rowSize), (double)maxChunk));
+}
+
+bool estimateMemory(RTNNState& state, MemPlan& plan) {
   unsigned int N = state.numPoints;
   unsigned int Q = state.numQueries;
 
   // conservatively include both points and queries and one more copy for partitioned queries
-  int count = Q;
+  size_t count = Q;
   if (!state.samepq) count += N;
   if (state.partition) count += Q;
-  float particleDataSize = count * sizeof(float3);
-
-  // +1 to include the space for initial search which always returns 1 element
-  float returnDataSize = Q * (state.knn + 1) * sizeof(unsigned int);
-
-  int pNArrayCount, qNArrayCount;
-  int cellArrayCount;
-  if (!estimateArrayCounts(state, pNArrayCount, qNArrayCount, cellArrayCount)) return 0;
-  fprintf(stdout, "pNArrayCount: %d\nqNArrayCount: %d\ncellArrayCount: %d\n", pNArrayCount, qNArrayCount, cellArrayCount);
+  plan.particleDataSize = (size_t)count * sizeof(float3);
+  // per-query radii, plus the partitioned copy.
+  if (state.h_qRadius) plan.particleDataSize += (state.partition ? 2 : 1) * (size_t)Q * sizeof(float);
+  // the input positions of the queries for a result file.
+  if (state.sinkType != "memory") plan.particleDataSize += (size_t)Q * sizeof(unsigned int);
+
+  // the initial search always returns 1 element per query.
+  // count mode returns 1 element per query. a chunked output takes two chunks
+  // at a time (see |calcChunkQueries|).
+  unsigned int retWidth = (state.searchMode == "count") ? 1 : state.knn;
+  unsigned int chunk = calcChunkQueries(state);
+  size_t chunkedQ = (chunk < Q) ? std::min((size_t)Q, 2 * (size_t)chunk) : Q;
+  plan.returnDataSize = ((size_t)Q + chunkedQ * retWidth) * sizeof(unsigned int);
 
-  float particleArraysSize = pNArrayCount * N * sizeof(unsigned int) + qNArrayCount * Q * sizeof(unsigned int);
   // conservatively estimate the gas size as 1.5 times the point size. the
   // actual gas size depends on the search radius (i.e., aabb size), and in
   // cases where search radius is very small, the GAS size can be much larger
   // than 1.5X, in which case one would directly specify the estGasSize.
-  float gasSize = (state.estGasSize == -1) ? state.numPoints * sizeof(float3) * 1.5: state.estGasSize * 1024 * 1024;
+  plan.gasSize = (state.estGasSize == -1) ? state.numPoints * sizeof(float3) * 1.5: state.estGasSize * 1024 * 1024;
   float aabbSize = state.numPoints * sizeof(OptixAabb);
   // instGasSize is the temporary memory required when building a GAS (not
   // including the GAS itself). 8x is for |d_temp_buffer_gas| and
   // |d_buffer_temp_output_gas_and_compacted_size|, an empirical fit.
-  float instGasSize = 8 * gasSize + aabbSize;
+  plan.instGasSize = 8 * plan.gasSize + aabbSize;
+
+  // NArrays from gas sort won't be early-freed
+  int qCount = 0, pCount = 0;
+  countFromGasSort(state, qCount, pCount);
+  plan.gasSortArraysSize = ((size_t)pCount * N + (size_t)qCount * Q) * sizeof(unsigned int);
+
+  if (!estimateArrayCounts(state, plan.pNArrayCount, plan.qNArrayCount, plan.cellArrayCount)) {
+    plan.pNArrayCount = plan.qNArrayCount = plan.cellArrayCount = 0;
+    plan.particleArraysSize = plan.gasSortArraysSize;
+    return false;
+  }
+  plan.particleArraysSize = ((size_t)plan.pNArrayCount * N + (size_t)plan.qNArrayCount * Q) * sizeof(unsigned int);
+  return true;
+}
+
+// the ratio of the search radius to the smallest cell size that fits in the
+// device memory; 0 if the search doesn't need a grid, and -1 if not even the
+// data leave room for one.
+float calcCRRatio(RTNNState& state) {
+  MemPlan plan;
+  if (!estimateMemory(state, plan)) return 0;
+  int cellArrayCount = plan.cellArrayCount;
+  fprintf(stdout, "pNArrayCount: %d\nqNArrayCount: %d\ncellArrayCount: %d\n", plan.pNArrayCount, plan.qNArrayCount, cellArrayCount);
+
+  float particleArraysSize = plan.particleArraysSize;
+  float particleDataSize = plan.particleDataSize;
+  float returnDataSize = plan.returnDataSize;
+  float gasSize = plan.gasSize;
+  float instGasSize = plan.instGasSize;
 
   float cellSize, ratio;
 
@@ -600,15 +925,15 @@ float calcCRRatio(RTNNState& state) {
                      instGasSize/1024/1024);
     float spaceAvail = state.totDRAMSize * 1024 * 1024 * 1024 -
         particleArraysSize - particleDataSize - state.gpuMemUsed * 1024 * 1024;
+    if (spaceAvail <= 0) return -1;
     float cellSizeLimitedBySort = estSortLtdSize(state, spaceAvail, cellArrayCount, true);
+    if (cellSizeLimitedBySort == 0) return -1;
 
     // NArrays from gas sort won't be early-freed
-    qNArrayCount = 0;
-    pNArrayCount = 0;
-    countFromGasSort(state, qNArrayCount, pNArrayCount);
-    particleArraysSize = pNArrayCount * N * sizeof(unsigned int) + qNArrayCount * Q * sizeof(unsigned int);
+    particleArraysSize = plan.gasSortArraysSize;
     spaceAvail = state.totDRAMSize * 1024 * 1024 * 1024 -
         particleArraysSize - particleDataSize - std::max(returnDataSize, instGasSize) - state.gpuMemUsed * 1024 * 1024;
+    if (spaceAvail <= 0) return -1;
     float cellSizeLimitedByGAS = estGASLtdSize(state, spaceAvail, gasSize);
 
     cellSize = std::max(cellSizeLimitedBySort, cellSizeLimitedByGAS);
@@ -627,23 +952,20 @@ float calcCRRatio(RTNNState& state) {
                      state.gpuMemUsed,
                      gasSize/1024/1024,
                      instGasSize/1024/1024);
+    if (spaceAvail <= 0) return -1;
 
     // algorithm to estimate the cellSize
     //   total gas size + total sorting structure size <= avail mem
-    //   total gas size = (state.radius / (sqrt(3) * cellSize) + 1) * gasSize; // TODO (sqrt(2) for 2D)
-    //   total sorting structure size = sceneVolume / power(cellSize, 3) * (cellArrayCount * sizeof(unsigned int));
-    //   it's a cubic equation. don't want to solve it analytically. let's do that
-    //   iteratively. the initial size is the smallest cell size that can
-    //   accommodate the entire gas or the entire sorting structures.
+    //   (see |memFootprint|). it's a cubic equation, and the cell counts are
+    //   padded anyway, so it's solved numerically to within a factor of
+    //   crStep (see |fitCellSize|). the initial size is the smallest cell
+    //   size that can accommodate the entire gas or the entire sorting
+    //   structures.
 
     float cellSizeLimitedByGAS = estGASLtdSize(state, spaceAvail, gasSize);
     float cellSizeLimitedBySort = estSortLtdSize(state, spaceAvail, cellArrayCount);
     float cellSize = std::max(cellSizeLimitedBySort, cellSizeLimitedByGAS);
 
-    float curGASSize = 0;
-    float curSortingSize = 0;
-    float curTotalSize = 0;
-    float numOfBatches, numOfSortingCells;
     bool isOneBatch = (!state.partition || (!state.autoNB && state.numOfBatches == 1));
     // TODO: the strategy here is to find the smallest cell size, which could
     // lead to a high batch number (>100) and thus increase the
@@ -651,20 +973,14 @@ float calcCRRatio(RTNNState& state) {
     // enabled and filters the vast majority of queries, in which case there
     // will be huge memory space left to find a very small cell size. an
     // example is: -f data/buddha.txt -q data/kitti6m.txt -fq 0
-    while (1) {
-      numOfBatches = isOneBatch ? 1.0 : state.radius / (sqrt(3) * cellSize) + 1;
-      curGASSize = numOfBatches * gasSize;
-
-      GridInfo gridInfo;
-      state.crRatio = state.radius / cellSize;
-      numOfSortingCells = genGridInfo(state, N, gridInfo);
-      curSortingSize = numOfSortingCells * (cellArrayCount * sizeof(unsigned int));
-
-      curTotalSize = curGASSize + curSortingSize;
-      fprintf(stdout, "%f+%f=%f, %f\n", curGASSize/1024/1024, curSortingSize/1024/1024, curTotalSize/1024/1024, spaceAvail/1024/1024);
-      if (curTotalSize < spaceAvail) break;
-      cellSize *= state.crStep;
-    }
+    cellSize = fitCellSize(state, spaceAvail, cellSize, cellArrayCount, gasSize);
+    if (cellSize == 0) return -1;
+
+    float numOfBatches = isOneBatch ? 1.0 : state.radius / (sqrt(3) * cellSize) + 1;
+    float curGASSize = numOfBatches * gasSize;
+    float curSortingSize = memFootprint(state, cellSize, cellArrayCount, 0);
+    float curTotalSize = curGASSize + curSortingSize;
+    fprintf(stdout, "%f+%f=%f, %f\n", curGASSize/1024/1024, curSortingSize/1024/1024, curTotalSize/1024/1024, spaceAvail/1024/1024);
 
     ratio = state.radius / cellSize;
     fprintf(stdout, "\tCalculated cellRadiusRatio: %f (%f, %f)\n", ratio, curGASSize/1024/1024, curSortingSize/1024/1024);
@@ -682,7 +998,23 @@ void initBatches(RTNNState& state) {
     // increases the sort cost, but probably mean little for range search. need
     // some exhaustive testing.
     state.crRatio = calcCRRatio(state);
+    if (state.crRatio < 0) {
+      fprintf(stderr, "The data doesn't fit in device memory.\n");
+      exit(1);
+    }
+  } else if (state.autoTune) {
+    // the tuner doesn't know the device memory; don't go finer than what
+    // |calcCRRatio| finds to fit.
+    float tuned = state.crRatio;
+    float limit = calcCRRatio(state);
+    if (limit < 0) {
+      fprintf(stderr, "The data doesn't fit in device memory.\n");
+      exit(1);
+    }
+    state.crRatio = (limit > 0) ? std::min(tuned, limit) : tuned;
+    if (state.crRatio != tuned) fprintf(stdout, "\tTuned crRatio %f lowered to %f to fit the memory\n", tuned, state.crRatio);
   }
+  setPlannedMemory(state);
 
   // see |genCellMask| for the logic behind this.
   float cellSize = state.radius / state.crRatio;
@@ -704,9 +1036,21 @@ void initBatches(RTNNState& state) {
   state.d_temp_buffer_gas = new void*[maxBatchCount]();
   state.d_buffer_temp_output_gas_and_compacted_size = new void*[maxBatchCount]();
   state.pipeline = new OptixPipeline[maxBatchCount];
+  if (state.h_qRadius) {
+    state.d_actQRadius = new float*[maxBatchCount]();
+    state.h_actQRadius = new float*[maxBatchCount]();
+  }
+  if (state.sinkType != "memory") state.h_actQIds = new unsigned int*[maxBatchCount]();
 
   for (int i = 0; i < maxBatchCount; i++)
       CUDA_CHECK( cudaStreamCreate( &state.stream[i] ) );
+  thrust::device_ptr<Params> d_params_ptr;
+  state.d_params = allocThrustDevicePtr(&d_params_ptr, maxBatchCount, &state.d_pointers);
+  // the stages of different batches run concurrently (see |searchBatches|),
+  // so every batch launches with its own parameters and tracks its own
+  // allocations.
+  state.batchParams = new Params[maxBatchCount];
+  state.d_batchPointers = new std::unordered_set<void*>[maxBatchCount];
   Timing::stopTiming(true);
 }
 
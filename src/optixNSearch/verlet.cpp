@@ -0,0 +1,69 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <algorithm>
+
+#include <sutil/vec_math.h>
+
+#include "verlet.h"
+#include "hostgrid.h"
+
+namespace rtnn {
+
+VerletList::VerletList(float radius, float skin)
+  : m_radius(radius), m_skin(skin)
+{
+}
+
+void VerletList::rebuild(const float3* points, unsigned int numPoints) {
+  Index index(points, numPoints);
+  m_cached = index.queryAll(points, numPoints, m_radius + m_skin);
+  m_refPoints.assign(points, points + numPoints);
+  m_numBuilds++;
+}
+
+const NeighborList& VerletList::step(const float3* points, unsigned int numPoints) {
+  m_numSteps++;
+
+  // a pair can close in by at most twice the largest displacement, so the
+  // cached lists hold every pair within |radius| until that exceeds |skin|.
+  bool stale = (numPoints != m_refPoints.size());
+  if (!stale) {
+    float maxSqDisp = parallelReduce(numPoints, 0.0f,
+      [&](unsigned int i) {
+        float3 d = points[i] - m_refPoints[i];
+        return dot(d, d);
+      },
+      [](float a, float b) { return std::max(a, b); });
+    stale = (maxSqDisp > m_skin * m_skin / 4);
+  }
+  if (stale) rebuild(points, numPoints);
+
+  // filter the cached lists by the current distances: count, scan and fill,
+  // same as |Index::queryAll|.
+  float sqRadius = m_radius * m_radius;
+  auto isNeighbor = [&](unsigned int i, unsigned int j) {
+    float3 d = points[i] - points[j];
+    return (i != j) && (dot(d, d) < sqRadius);
+  };
+
+  m_list.offsets.assign(numPoints + 1, 0);
+  parallelFor(numPoints, [&](unsigned int i) {
+    unsigned int count = 0;
+    for (unsigned int k = m_cached.offsets[i]; k < m_cached.offsets[i + 1]; k++)
+      if (isNeighbor(i, m_cached.ids[k])) count++;
+    m_list.offsets[i + 1] = count;
+  });
+  for (unsigned int i = 0; i < numPoints; i++) m_list.offsets[i + 1] += m_list.offsets[i];
+
+  m_list.ids.resize(m_list.offsets[numPoints]);
+  parallelFor(numPoints, [&](unsigned int i) {
+    unsigned int* ids = m_list.ids.data() + m_list.offsets[i];
+    for (unsigned int k = m_cached.offsets[i]; k < m_cached.offsets[i + 1]; k++)
+      if (isNeighbor(i, m_cached.ids[k])) *ids++ = m_cached.ids[k];
+  });
+
+  return m_list;
+}
+
+} // namespace rtnn
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+
+#include <vector_types.h>
+
+#include "index.h"
+
+namespace rtnn {
+
+// Verlet neighbor lists for MD and SPH, where particles move a little each
+// timestep. The lists are searched at |radius| + |skin| and cached; as long
+// as no particle has moved more than |skin| / 2 since, every pair within
+// |radius| is still in the cached lists, so a step only filters them by the
+// current distances. Lists exclude the particle itself.
+class VerletList
+{
+public:
+  VerletList(float radius, float skin);
+
+  // neighbors within |radius| of every particle at the current |points|.
+  // the number of particles can only change through a rebuild, which is
+  // forced when it differs from the previous step.
+  const NeighborList& step(const float3* points, unsigned int numPoints);
+
+  unsigned int numBuilds() const { return m_numBuilds; }
+  unsigned int numSteps() const { return m_numSteps; }
+
+private:
+  void rebuild(const float3* points, unsigned int numPoints);
+
+  float m_radius;
+  float m_skin;
+  // positions at the last rebuild, and the lists at |radius| + |skin|.
+  std::vector<float3> m_refPoints;
+  NeighborList m_cached;
+  NeighborList m_list;
+  unsigned int m_numBuilds = 0;
+  unsigned int m_numSteps = 0;
+};
+
+} // namespace rtnn
@@ -1,4 +1,4 @@
 #include "IDFactory.h"
 
-int IDFactory::id = 0;
+std::atomic<int> IDFactory::id(0);
 
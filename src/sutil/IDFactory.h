@@ -1,12 +1,14 @@
 #pragma once
 
-/** Factory for unique ids.
+#include <atomic>
+
+/** Factory for unique ids. Thread-safe.
   */
 class IDFactory
 {
 private:
 	/** Current id */
-	static int id;
+	static std::atomic<int> id;
 
 public:
 	static int getId() { return id++; }
@@ -1,7 +1,136 @@
 #include "Timing.h"
 
+#include <cstdio>
+
 std::unordered_map<int, AverageTime> Timing::m_averageTimes;
-std::stack<TimingHelper> Timing::m_timingStack;
+thread_local std::stack<TimingHelper> Timing::m_timingStack;
 bool Timing::m_dontPrintTimes = false;
-unsigned int Timing::m_startCounter = 0;
-unsigned int Timing::m_stopCounter = 0;
+std::atomic<unsigned int> Timing::m_startCounter(0);
+std::atomic<unsigned int> Timing::m_stopCounter(0);
+std::vector<ProfileNode> Timing::m_profile;
+bool Timing::m_recordEvents = false;
+std::vector<ProfileEvent> Timing::m_events;
+std::chrono::time_point<std::chrono::high_resolution_clock> Timing::m_epoch = std::chrono::high_resolution_clock::now();
+std::mutex Timing::m_mutex;
+
+int Timing::threadIndex()
+{
+	static std::atomic<int> counter(0);
+	thread_local int index = counter++;
+	return index;
+}
+
+static std::string jsonString(const std::string& s)
+{
+	std::string out = "\"";
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if ((unsigned char)c < 0x20)
+		{
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		}
+		else
+			out += c;
+	}
+	return out + "\"";
+}
+
+static void writeStat(FILE* fp, const ProfileNode::Stat& s)
+{
+	fprintf(fp, "\"count\": %u, \"total_ms\": %.6f, \"min_ms\": %.6f, \"max_ms\": %.6f, \"mean_ms\": %.6f",
+	        s.counter, s.totalTime, s.minTime, s.maxTime, s.counter ? s.totalTime / s.counter : 0.0);
+}
+
+static void writeNode(FILE* fp, const std::vector<ProfileNode>& profile, int n, int depth)
+{
+	const ProfileNode& node = profile[n];
+	std::string indent(2 * depth, ' ');
+	fprintf(fp, "%s{\"name\": %s, ", indent.c_str(), jsonString(node.name).c_str());
+	writeStat(fp, node.total);
+
+	fprintf(fp, ",\n%s \"batches\": [", indent.c_str());
+	bool first = true;
+	for (const auto& b : node.batches)
+	{
+		fprintf(fp, "%s{\"batch\": %d, ", first ? "" : ", ", b.first);
+		writeStat(fp, b.second);
+		fprintf(fp, "}");
+		first = false;
+	}
+	fprintf(fp, "],\n%s \"children\": [", indent.c_str());
+	for (size_t i = 0; i < node.children.size(); i++)
+	{
+		fprintf(fp, "%s\n", i ? "," : "");
+		writeNode(fp, profile, node.children[i], depth + 1);
+	}
+	fprintf(fp, "]}");
+}
+
+static void printNode(const std::vector<ProfileNode>& profile, int n, int depth)
+{
+	const ProfileNode& node = profile[n];
+	if (n)
+	{
+		std::cout << std::string(2 * (depth - 1), ' ') << node.name << ": " << node.total.totalTime
+		          << " ms (" << node.total.counter << "x)";
+		for (const auto& b : node.batches)
+			std::cout << " [batch " << b.first << ": " << b.second.totalTime << " ms]";
+		std::cout << "\n";
+	}
+	for (int c : node.children)
+		printNode(profile, c, depth + 1);
+}
+
+void Timing::printProfile()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_profile.empty()) return;
+	printNode(m_profile, 0, 0);
+	std::cout << "---------------------------------------------------------------------------\n\n" << std::flush;
+}
+
+bool Timing::writeJSON(const std::string& path)
+{
+	FILE* fp = fopen(path.c_str(), "w");
+	if (!fp) return false;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	fprintf(fp, "{\"name\": \"\", \"children\": [");
+	if (!m_profile.empty())
+	{
+		for (size_t i = 0; i < m_profile[0].children.size(); i++)
+		{
+			fprintf(fp, "%s\n", i ? "," : "");
+			writeNode(fp, m_profile, m_profile[0].children[i], 1);
+		}
+	}
+	fprintf(fp, "]}\n");
+	return fclose(fp) == 0;
+}
+
+bool Timing::writeChromeTrace(const std::string& path)
+{
+	FILE* fp = fopen(path.c_str(), "w");
+	if (!fp) return false;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	for (size_t i = 0; i < m_events.size(); i++)
+	{
+		const ProfileEvent& e = m_events[i];
+		fprintf(fp, "%s\n{\"name\": %s, \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+		        i ? "," : "", jsonString(e.name).c_str(), e.thread, e.start, e.duration);
+		if (e.batch >= 0)
+			fprintf(fp, ", \"args\": {\"batch\": %d}", e.batch);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n]}\n");
+	return fclose(fp) == 0;
+}
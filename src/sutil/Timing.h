@@ -10,6 +10,11 @@
 #include <iostream>
 #include <stack>
 #include <unordered_map>
+#include <map>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
 
 #include <chrono>
 #include "IDFactory.h"
@@ -18,6 +23,10 @@ struct TimingHelper
 {
 	std::chrono::time_point<std::chrono::high_resolution_clock> start;
 	std::string name;
+	// node of this timing in the profile tree and the batch it belongs to (-1
+	// if none); see |Timing::m_profile|.
+	int node;
+	int batch;
 };
 
 struct AverageTime
@@ -27,31 +36,123 @@ struct AverageTime
 	std::string name;
 };
 
+// A node of the profile tree. The children of a node are the timings started
+// while it was the innermost open timing of the same thread, so the path from
+// the root is the nesting of the phases, e.g., "total search time" >
+// "batch search time" > "search compute". Each node aggregates all timings with
+// the same path, in total and per batch.
+struct ProfileNode
+{
+	struct Stat
+	{
+		unsigned int counter = 0;
+		double totalTime = 0;
+		double minTime = 0;
+		double maxTime = 0;
+
+		void add(double t)
+		{
+			if (counter == 0 || t < minTime) minTime = t;
+			if (counter == 0 || t > maxTime) maxTime = t;
+			totalTime += t;
+			counter++;
+		}
+	};
+
+	std::string name;
+	int parent;
+	std::vector<int> children;
+	Stat total;
+	std::map<int, Stat> batches;
+};
+
+// One timed interval for the trace export; times are in microseconds since
+// |Timing::m_epoch|.
+struct ProfileEvent
+{
+	std::string name;
+	int batch;
+	int thread;
+	double start;
+	double duration;
+};
+
+// Timings are thread-safe: every thread has its own stack of open timings,
+// and the averages and the profile shared by all threads are guarded by
+// |m_mutex|.
 class Timing
 {
 public:
 	static bool m_dontPrintTimes;
-	static unsigned int m_startCounter;
-	static unsigned int m_stopCounter;
-	static std::stack<TimingHelper> m_timingStack;
+	static std::atomic<unsigned int> m_startCounter;
+	static std::atomic<unsigned int> m_stopCounter;
+	static thread_local std::stack<TimingHelper> m_timingStack;
 	static std::unordered_map<int, AverageTime> m_averageTimes;
 
+	// the profile tree; node 0 is the root and has no timing of its own.
+	static std::vector<ProfileNode> m_profile;
+	// individual intervals, kept only if |m_recordEvents| since a long run
+	// produces many of them.
+	static bool m_recordEvents;
+	static std::vector<ProfileEvent> m_events;
+	static std::chrono::time_point<std::chrono::high_resolution_clock> m_epoch;
+	static std::mutex m_mutex;
+
+	// RAII timing of the enclosing scope; the same as calling |startTiming| at
+	// its construction and |stopTiming| at its destruction.
+	class Scope
+	{
+	public:
+		Scope(const std::string& name, bool print = true, int batch = -1) : m_print(print)
+		{
+			Timing::startTiming(name, batch);
+		}
+		~Scope()
+		{
+			Timing::stopTiming(m_print);
+		}
+
+	private:
+		Scope(const Scope&);
+		Scope& operator=(const Scope&);
+		bool m_print;
+	};
+
+	// clears the open timings of the calling thread and everything recorded by
+	// all threads.
 	static void reset()
 	{
 		while (!m_timingStack.empty())
 			m_timingStack.pop();
+		std::lock_guard<std::mutex> lock(m_mutex);
 		m_averageTimes.clear();
+		m_profile.clear();
+		m_events.clear();
+		m_epoch = std::chrono::high_resolution_clock::now();
 		m_startCounter = 0;
 		m_stopCounter = 0;
 	}
 
-	FORCE_INLINE static void startTiming(const std::string& name = std::string(""))
+	// |batch| tags the timing and, unless they are given their own, the timings
+	// nested in it, so that the profile can break a phase down by batch.
+	FORCE_INLINE static void startTiming(const std::string& name = std::string(""), int batch = -1)
 	{
 		TimingHelper h;
-		h.start = std::chrono::high_resolution_clock::now();
 		h.name = name;
-		Timing::m_timingStack.push(h);
+		int parent = 0;
+		h.batch = batch;
+		if (!Timing::m_timingStack.empty())
+		{
+			parent = Timing::m_timingStack.top().node;
+			if (batch < 0) h.batch = Timing::m_timingStack.top().batch;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			h.node = profileChild(parent, name);
+		}
 		Timing::m_startCounter++;
+		h.start = std::chrono::high_resolution_clock::now();
+		Timing::m_timingStack.push(h);
 	}
 
 	FORCE_INLINE static double stopTiming(bool print = true)
@@ -65,17 +166,22 @@ public:
 			std::chrono::duration<double> elapsed_seconds = stop - h.start;
 			double t = elapsed_seconds.count() * 1000.0;
 
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				record(h, t);
+			}
+
 			if (print)
 				std::cout << "time " << h.name.c_str() << ": " << t << " ms\n\n" << std::flush;
 			return t;
-	}
+		}
 		return 0;
-}
+	}
 
+	// |id| is -1 until the first call assigns it, under |m_mutex|, so threads
+	// may share it.
 	FORCE_INLINE static double stopTiming(bool print, int &id)
 	{
-		if (id == -1)
-			id = IDFactory::getId();
 		if (!Timing::m_timingStack.empty())
 		{
 			Timing::m_stopCounter++;
@@ -89,6 +195,10 @@ public:
 			if (print && !Timing::m_dontPrintTimes)
 				std::cout << "time " << h.name.c_str() << ": " << t << " ms\n" << std::flush;
 
+			std::lock_guard<std::mutex> lock(m_mutex);
+			record(h, t);
+			if (id == -1)
+				id = IDFactory::getId();
 			if (id >= 0)
 			{
 				std::unordered_map<int, AverageTime>::iterator iter;
@@ -114,6 +224,7 @@ public:
 
 	FORCE_INLINE static void printAverageTimes()
 	{
+		std::lock_guard<std::mutex> lock(m_mutex);
 		std::unordered_map<int, AverageTime>::iterator iter;
 		for (iter = Timing::m_averageTimes.begin(); iter != Timing::m_averageTimes.end(); iter++)
 		{
@@ -128,6 +239,7 @@ public:
 
 	FORCE_INLINE static void printTimeSums()
 	{
+		std::lock_guard<std::mutex> lock(m_mutex);
 		std::unordered_map<int, AverageTime>::iterator iter;
 		for (iter = Timing::m_averageTimes.begin(); iter != Timing::m_averageTimes.end(); iter++)
 		{
@@ -139,6 +251,70 @@ public:
 			std::cout << "Problem: " << Timing::m_startCounter << " calls of startTiming and " << Timing::m_stopCounter << " calls of stopTiming.\n " << std::flush;
 		std::cout << "---------------------------------------------------------------------------\n\n";
 	}
+
+	// prints the profile tree indented by nesting, with the total, count and
+	// per-batch totals of every phase.
+	static void printProfile();
+
+	// the profile tree as nested JSON objects:
+	//   {"name", "count", "total_ms", "min_ms", "max_ms", "mean_ms",
+	//    "batches": [{"batch", "count", "total_ms", ...}], "children": [...]}
+	// returns false if |path| cannot be written.
+	static bool writeJSON(const std::string& path);
+
+	// the recorded events in the Chrome trace_event format (complete "X"
+	// events), for chrome://tracing or Perfetto. returns false if |path| cannot
+	// be written.
+	static bool writeChromeTrace(const std::string& path);
+
+private:
+	// small sequential ID of the calling thread, for the trace.
+	static int threadIndex();
+
+	// the child of |parent| named |name|, added if missing. |m_mutex| must be held.
+	static int profileChild(int parent, const std::string& name)
+	{
+		if (m_profile.empty())
+		{
+			m_profile.push_back(ProfileNode());
+			m_profile[0].parent = -1;
+		}
+		// the tree was reset while this thread had timings open.
+		if (parent >= (int)m_profile.size())
+			parent = 0;
+		for (int c : m_profile[parent].children)
+			if (m_profile[c].name == name)
+				return c;
+		int node = (int)m_profile.size();
+		m_profile.push_back(ProfileNode());
+		m_profile[node].name = name;
+		m_profile[node].parent = parent;
+		m_profile[parent].children.push_back(node);
+		return node;
+	}
+
+	// |m_mutex| must be held.
+	static void record(const TimingHelper& h, double t)
+	{
+		// dropped if the tree was reset since the timing started.
+		if (h.node >= (int)m_profile.size() || m_profile[h.node].name != h.name)
+			return;
+		ProfileNode& node = m_profile[h.node];
+		node.total.add(t);
+		if (h.batch >= 0)
+			node.batches[h.batch].add(t);
+
+		if (m_recordEvents)
+		{
+			ProfileEvent e;
+			e.name = h.name;
+			e.batch = h.batch;
+			e.thread = threadIndex();
+			e.start = std::chrono::duration<double, std::micro>(h.start - m_epoch).count();
+			e.duration = t * 1000.0;
+			m_events.push_back(e);
+		}
+	}
 };
 
 